@@ -0,0 +1,562 @@
+// Tests and benchmarks for the BTree template in btree.h.
+// Compile with g++ -O3 -march=native btree.cpp and then just run it, or run ./a.out bench.
+// Without AVX2 the node search falls back to a plain loop. To benchmark against the
+// red-black trees too:
+//   gcc -O3 -c -Dmain=redblack_c_main ../redblack.c
+//   g++ -O3 -march=native -DBT_BENCH_C btree.cpp redblack.o -pthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include "btree.h"
+#include "../redblack.h"
+
+#ifdef BT_BENCH_C
+extern "C"
+{
+	struct rb_tree;
+	struct rb_node;
+	struct rb_tree *rb_create();
+	void rb_destroy(struct rb_tree *tree);
+	void rb_insert(struct rb_tree *tree, long key, void *data);
+	void rb_delete(struct rb_tree *tree, long key);
+	void *rb_lookup(struct rb_tree *tree, long key);
+	long rb_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(struct rb_node *node, void *context), void *context);
+}
+#endif
+
+
+///
+/// Check that the value is nonzero and message and exit if it's not nonzero.
+///
+
+void ASSERT(int value, const char *message, ...)
+{
+	if (!value)
+	{
+		va_list arglist;
+		va_start(arglist, message);
+		printf("ASSERT FAILURE\n");
+		vprintf(message, arglist);
+		printf("\n");
+		va_end(arglist);
+		exit(1);
+	}
+}
+
+
+
+//
+//
+// UNIT TESTS
+//
+//
+
+
+///
+/// TEST_BTree_check
+///
+/// Checks tree against a std::map holding what should be in it: the structure, the
+/// size, every key and value, select and rank of every key, and iteration both ways.
+///
+
+void TEST_BTree_check(const BTree<long> &tree, const std::map<long, long> &expected)
+{
+	BTree<long>::Iterator it = tree.begin();
+	size_t i = 0;
+
+	ASSERT(tree.validate() >= 0, "Tree failed to validate");
+	ASSERT(tree.size() == expected.size(), "Tree has %ld keys, expected %ld", (long)tree.size(), (long)expected.size());
+
+	for (std::map<long, long>::const_iterator e = expected.begin(); e != expected.end(); ++e, ++it, i++)
+	{
+		const long *pValue = tree.find(e->first);
+		ASSERT(pValue && *pValue == e->second, "Key %ld missing or has the wrong value", e->first);
+		ASSERT(it != tree.end() && it.key() == e->first, "Iteration is out of order at %ld", e->first);
+		ASSERT(tree.select(i) == it, "select(%ld) isn't key %ld", (long)i, e->first);
+		ASSERT(tree.rank(e->first) == i, "rank(%ld) is %ld, expected %ld", e->first, (long)tree.rank(e->first), (long)i);
+	}
+	ASSERT(it == tree.end(), "Iteration didn't end with the last key");
+	ASSERT(tree.select(expected.size()) == tree.end(), "select past the end");
+
+	if (!expected.empty())
+	{
+		it = tree.select(expected.size() - 1);
+		for (std::map<long, long>::const_reverse_iterator e = expected.rbegin(); e != expected.rend(); ++e, --it)
+		{
+			ASSERT(it != tree.end() && it.key() == e->first, "Reverse iteration is out of order at %ld", e->first);
+		}
+		ASSERT(it == tree.end(), "Reverse iteration didn't end with the first key");
+	}
+}
+
+
+
+///
+/// TEST_BTree_simple
+///
+/// Random inserts and erases checked against std::map, then runs that split and merge
+/// at every level.
+///
+
+void TEST_BTree_simple()
+{
+	BTree<long> tree;
+	std::map<long, long> expected;
+	unsigned long x = 88172645463325252UL;
+	long i, key;
+
+	TEST_BTree_check(tree, expected);
+	ASSERT(tree.find(1) == NULL, "Found a key in an empty tree");
+	ASSERT(!tree.erase(1), "Erased a key from an empty tree");
+	ASSERT(tree.lowerBound(1) == tree.end() && tree.rank(1) == 0, "lowerBound or rank on an empty tree");
+
+	for (i = 0; i < 40000; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = x % 3000;
+
+		if ((x >> 20) % 3)
+		{
+			bool inserted = tree.insert(key, key * 7);
+			ASSERT(inserted == (expected.find(key) == expected.end()), "Insert of %ld said %d", key, inserted);
+			expected.insert(std::make_pair(key, key * 7));
+		}
+		else
+		{
+			bool erased = tree.erase(key);
+			ASSERT(erased == (expected.erase(key) == 1), "Erase of %ld said %d", key, erased);
+		}
+
+		if (i % 1000 == 0)
+		{
+			TEST_BTree_check(tree, expected);
+		}
+	}
+	TEST_BTree_check(tree, expected);
+
+	// A duplicate insert leaves the old value alone.
+	key = expected.begin()->first;
+	ASSERT(!tree.insert(key, -1L), "Inserted a duplicate");
+	ASSERT(*tree.find(key) == key * 7, "Duplicate insert changed the value");
+
+	ASSERT(tree.lowerBound(-5).key() == expected.begin()->first, "lowerBound before the first key");
+	ASSERT(tree.lowerBound(100000) == tree.end(), "lowerBound after the last key");
+	for (i = 0; i < 3000; i++)
+	{
+		std::map<long, long>::iterator e = expected.lower_bound(i);
+		BTree<long>::Iterator it = tree.lowerBound(i);
+		ASSERT(e == expected.end() ? it == tree.end() : it.key() == e->first, "lowerBound(%ld) is wrong", i);
+		ASSERT(tree.rank(i) == (size_t)std::distance(expected.begin(), e), "rank(%ld) is wrong", i);
+	}
+
+	while (!expected.empty())
+	{
+		ASSERT(tree.erase(expected.begin()->first), "Couldn't erase %ld", expected.begin()->first);
+		expected.erase(expected.begin());
+		if (expected.size() % 97 == 0)
+		{
+			ASSERT(tree.validate() >= 0, "Tree failed to validate erasing from the front");
+		}
+	}
+	TEST_BTree_check(tree, expected);
+
+	// Sorted and reverse sorted runs fill nodes from one side, and erasing every other key
+	// and then the rest takes every borrow and merge case.
+	for (i = 0; i < 100000; i++)
+	{
+		tree.insert(i, i * 7);
+		tree.insert(-1 - i, (-1 - i) * 7);
+		expected[i] = i * 7;
+		expected[-1 - i] = (-1 - i) * 7;
+	}
+	ASSERT(tree.validate() >= 3, "200000 keys in a tree only %ld high", tree.validate());
+	TEST_BTree_check(tree, expected);
+	for (i = -100000; i < 100000; i += 2)
+	{
+		ASSERT(tree.erase(i), "Couldn't erase %ld", i);
+		expected.erase(i);
+	}
+	TEST_BTree_check(tree, expected);
+	for (i = 99999; i >= -99999; i -= 2)
+	{
+		ASSERT(tree.erase(i), "Couldn't erase %ld", i);
+		expected.erase(i);
+		if (i % 1001 == 0)
+		{
+			TEST_BTree_check(tree, expected);
+		}
+	}
+	TEST_BTree_check(tree, expected);
+
+	// The extremes are keys like any other, even though LONG_MAX pads the nodes.
+	for (i = 0; i < 100; i++)
+	{
+		tree.insert(LONG_MAX - i, i);
+		tree.insert(LONG_MIN + i, -i);
+		expected[LONG_MAX - i] = i;
+		expected[LONG_MIN + i] = -i;
+	}
+	TEST_BTree_check(tree, expected);
+	ASSERT(tree.lowerBound(LONG_MAX).key() == LONG_MAX, "lowerBound(LONG_MAX)");
+
+	// The slabs get reused after a clear.
+	tree.clear();
+	expected.clear();
+	TEST_BTree_check(tree, expected);
+	tree.insert(3L, 4L);
+	ASSERT(*tree.find(3) == 4, "Lost a key inserted after clear");
+
+	printf("COMPLETED TEST_BTree_simple\n");
+}
+
+
+
+///
+/// TEST_BTree_scan
+///
+/// Range scans against std::map, including ones that start between leaves, stop early
+/// or find nothing.
+///
+
+struct TEST_BTree_payload
+{
+	long m_n[4];
+};
+
+void TEST_BTree_scan()
+{
+	BTree<TEST_BTree_payload> tree;
+	std::map<long, long> expected;
+	long i, lo, hi;
+
+	// Every third key, with gaps so scans start and end on missing keys.
+	for (i = 0; i < 30000; i += 3)
+	{
+		TEST_BTree_payload payload = { { i, i + 1, i + 2, i + 3 } };
+		tree.insert(i, payload);
+		expected[i] = i;
+	}
+	for (i = 0; i < 30000; i += 9)
+	{
+		tree.erase(i);
+		expected.erase(i);
+	}
+	ASSERT(tree.validate() >= 0, "Tree failed to validate");
+
+	for (lo = -10; lo < 30010; lo += 211)
+	{
+		for (hi = lo - 1; hi < lo + 700; hi += 67)
+		{
+			std::map<long, long>::iterator e = expected.lower_bound(lo);
+			size_t nVisited = tree.rangeScan(lo, hi, [&](long key, TEST_BTree_payload &value)
+			{
+				ASSERT(e != expected.end() && key == e->first && key <= hi, "Scan of [%ld, %ld] found %ld", lo, hi, key);
+				ASSERT(value.m_n[0] == key && value.m_n[3] == key + 3, "Scan of [%ld, %ld] has the wrong value at %ld", lo, hi, key);
+				++e;
+				return false;
+			});
+			ASSERT(e == expected.end() || e->first > hi, "Scan of [%ld, %ld] stopped early", lo, hi);
+			ASSERT(nVisited == (size_t)std::distance(expected.lower_bound(lo), e), "Scan of [%ld, %ld] counted %ld", lo, hi, (long)nVisited);
+		}
+	}
+
+	// A callback returning true stops the scan.
+	i = 0;
+	ASSERT(tree.rangeScan(0, 30000, [&](long, TEST_BTree_payload &) { return ++i == 10; }) == 10 && i == 10, "Scan didn't stop");
+	ASSERT(tree.rangeScan(LONG_MIN, LONG_MAX, [](long, TEST_BTree_payload &) { return false; }) == expected.size(), "Full scan missed keys");
+	ASSERT(tree.rangeScan(100, 99, [](long, TEST_BTree_payload &) { return false; }) == 0, "Empty range visited keys");
+
+	printf("COMPLETED TEST_BTree_scan\n");
+}
+
+
+
+
+//
+//
+// BENCHMARKS
+//
+// Run with ./a.out bench (compile with -O3 -march=native).
+//
+
+
+double _bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void _bench_report(const char *name, const char *op, long n, double elapsed)
+{
+	printf("%-8s %-7s %9ld keys: %8.3fs  %6.2f Mops/s\n", name, op, n, elapsed, n / elapsed / 1e6);
+}
+
+// The same xorshift shuffle as redblack.c's benchmarks.
+void _bench_shuffle(std::vector<long> &keys)
+{
+	unsigned long x = 88172645463325252UL;
+	long i, j;
+
+	for (i = (long)keys.size() - 1; i > 0; i--)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		j = x % (i + 1);
+		std::swap(keys[i], keys[j]);
+	}
+}
+
+#ifdef BT_BENCH_C
+int _bench_scan_callback(struct rb_node *, void *context)
+{
+	(*(long *)context)++;
+	return 0;
+}
+#endif
+
+
+
+///
+/// BENCH_BTree
+///
+/// Inserts n shuffled keys, looks them all up in another shuffled order, scans them all
+/// once, does n / 100 scans of 100 keys from random starting points, and erases them,
+/// in the B+tree, RBTree and (with -DBT_BENCH_C) redblack.c. Scans report keys per
+/// second.
+///
+/// Timings when compiled -O3 -march=native (one core):
+/// BTree    insert    1000000 keys:    0.394s    2.54 Mops/s
+/// BTree    lookup    1000000 keys:    0.256s    3.90 Mops/s
+/// BTree    scan      1000000 keys:    0.018s   56.10 Mops/s
+/// BTree    scan100    999923 keys:    0.020s   50.00 Mops/s
+/// BTree    erase     1000000 keys:    0.456s    2.19 Mops/s
+/// RBTree   insert    1000000 keys:    1.070s    0.93 Mops/s
+/// RBTree   lookup    1000000 keys:    0.829s    1.21 Mops/s
+/// RBTree   scan      1000000 keys:    0.198s    5.05 Mops/s
+/// RBTree   scan100    999923 keys:    0.238s    4.19 Mops/s
+/// RBTree   erase     1000000 keys:    1.279s    0.78 Mops/s
+/// C        insert    1000000 keys:    1.180s    0.85 Mops/s
+/// C        lookup    1000000 keys:    0.494s    2.02 Mops/s
+/// C        scan      1000000 keys:    0.204s    4.89 Mops/s
+/// C        scan100    999923 keys:    0.231s    4.32 Mops/s
+/// C        erase     1000000 keys:    1.501s    0.67 Mops/s
+///
+/// BTree    insert   10000000 keys:    8.829s    1.13 Mops/s
+/// BTree    lookup   10000000 keys:    4.967s    2.01 Mops/s
+/// BTree    scan     10000000 keys:    0.253s   39.58 Mops/s
+/// BTree    scan100   9999915 keys:    0.347s   28.86 Mops/s
+/// BTree    erase    10000000 keys:   11.105s    0.90 Mops/s
+/// RBTree   insert   10000000 keys:   24.158s    0.41 Mops/s
+/// RBTree   lookup   10000000 keys:   20.329s    0.49 Mops/s
+/// RBTree   scan     10000000 keys:    2.759s    3.63 Mops/s
+/// RBTree   scan100   9999915 keys:    3.137s    3.19 Mops/s
+/// RBTree   erase    10000000 keys:   28.542s    0.35 Mops/s
+/// C        insert   10000000 keys:   29.070s    0.34 Mops/s
+/// C        lookup   10000000 keys:   11.080s    0.90 Mops/s
+/// C        scan     10000000 keys:    3.310s    3.02 Mops/s
+/// C        scan100   9999915 keys:    3.505s    2.85 Mops/s
+/// C        erase    10000000 keys:   29.550s    0.34 Mops/s
+///
+/// BTree    insert   30000000 keys:   38.512s    0.78 Mops/s
+/// BTree    lookup   30000000 keys:   24.904s    1.20 Mops/s
+/// BTree    scan     30000000 keys:    1.246s   24.09 Mops/s
+/// BTree    scan100  29999919 keys:    1.661s   18.06 Mops/s
+/// BTree    erase    30000000 keys:   53.107s    0.56 Mops/s
+/// RBTree   insert   30000000 keys:  114.271s    0.26 Mops/s
+/// RBTree   lookup   30000000 keys:   97.438s    0.31 Mops/s
+/// RBTree   scan     30000000 keys:   12.912s    2.32 Mops/s
+/// RBTree   scan100  29999919 keys:   15.389s    1.95 Mops/s
+/// RBTree   erase    30000000 keys:  136.678s    0.22 Mops/s
+/// C        insert   30000000 keys:  119.642s    0.25 Mops/s
+/// C        lookup   30000000 keys:   59.518s    0.50 Mops/s
+/// C        scan     30000000 keys:   13.605s    2.21 Mops/s
+/// C        scan100  29999919 keys:   16.139s    1.86 Mops/s
+/// C        erase    30000000 keys:  138.771s    0.22 Mops/s
+///
+/// At 10M keys the B+tree looks keys up 4x faster than RBTree and 2.2x faster than the C
+/// tree, and scans 10x faster. A lookup visits seven nodes there, each two cache lines
+/// of keys compared at once, where the red-black trees take around 25 dependent misses.
+/// Inserts and erases win by as much because most of the time they're a lookup plus a
+/// memmove inside one node. The keys
+/// here are shuffled properly, not scrambled by a multiplier like redblack.c's
+/// benchmarks, which is why the red-black numbers are lower than there.
+///
+
+void BENCH_BTree(long n)
+{
+	long i, nSum;
+	double start;
+	std::vector<long> keys(n), lookups(n);
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = lookups[i] = i;
+	}
+	_bench_shuffle(keys);
+	for (i = 0; i < n; i++)
+	{
+		lookups[i] = keys[(i * 2654435761L) % n];
+	}
+
+	{
+		BTree<long> tree;
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.insert(keys[i], keys[i]);
+		}
+		_bench_report("BTree", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			const long *pValue = tree.find(lookups[i]);
+			ASSERT(pValue && *pValue == lookups[i], "Failed on find: %ld", lookups[i]);
+		}
+		_bench_report("BTree", "lookup", n, _bench_now() - start);
+
+		nSum = 0;
+		start = _bench_now();
+		tree.rangeScan(0, n, [&](long, long &value) { nSum += value; return false; });
+		_bench_report("BTree", "scan", n, _bench_now() - start);
+		ASSERT(nSum == n * (n - 1) / 2, "Full scan summed to %ld", nSum);
+
+		nSum = 0;
+		start = _bench_now();
+		for (i = 0; i < n / 100; i++)
+		{
+			tree.rangeScan(keys[i], keys[i] + 99, [&](long, long &) { nSum++; return false; });
+		}
+		_bench_report("BTree", "scan100", nSum, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.erase(keys[i]);
+		}
+		_bench_report("BTree", "erase", n, _bench_now() - start);
+	}
+
+	{
+		RBTree<long, long> tree;
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.insert(keys[i], keys[i]);
+		}
+		_bench_report("RBTree", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			const long *pValue = tree.find(lookups[i]);
+			ASSERT(pValue && *pValue == lookups[i], "Failed on find: %ld", lookups[i]);
+		}
+		_bench_report("RBTree", "lookup", n, _bench_now() - start);
+
+		nSum = 0;
+		start = _bench_now();
+		for (RBTree<long, long>::Iterator it = tree.begin(); it != tree.end(); ++it)
+		{
+			nSum += it.value();
+		}
+		_bench_report("RBTree", "scan", n, _bench_now() - start);
+		ASSERT(nSum == n * (n - 1) / 2, "Full scan summed to %ld", nSum);
+
+		nSum = 0;
+		start = _bench_now();
+		for (i = 0; i < n / 100; i++)
+		{
+			for (RBTree<long, long>::Iterator it = tree.lowerBound(keys[i]); it != tree.end() && it.key() <= keys[i] + 99; ++it)
+			{
+				nSum++;
+			}
+		}
+		_bench_report("RBTree", "scan100", nSum, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.erase(keys[i]);
+		}
+		_bench_report("RBTree", "erase", n, _bench_now() - start);
+	}
+
+#ifdef BT_BENCH_C
+	{
+		struct rb_tree *tree = rb_create();
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			rb_insert(tree, keys[i], (void *)keys[i]);
+		}
+		_bench_report("C", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			ASSERT((long)rb_lookup(tree, lookups[i]) == lookups[i], "Failed on rb_lookup: %ld", lookups[i]);
+		}
+		_bench_report("C", "lookup", n, _bench_now() - start);
+
+		nSum = 0;
+		start = _bench_now();
+		rb_range_scan(tree, 0, n, _bench_scan_callback, &nSum);
+		_bench_report("C", "scan", nSum, _bench_now() - start);
+
+		nSum = 0;
+		start = _bench_now();
+		for (i = 0; i < n / 100; i++)
+		{
+			rb_range_scan(tree, keys[i], keys[i] + 99, _bench_scan_callback, &nSum);
+		}
+		_bench_report("C", "scan100", nSum, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			rb_delete(tree, keys[i]);
+		}
+		_bench_report("C", "erase", n, _bench_now() - start);
+
+		rb_destroy(tree);
+	}
+#endif
+}
+
+
+
+void BENCH()
+{
+	BENCH_BTree(1000000);
+	BENCH_BTree(10000000);
+	BENCH_BTree(30000000);
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		BENCH();
+		return 0;
+	}
+
+	TEST_BTree_simple();
+	TEST_BTree_scan();
+	return 0;
+}
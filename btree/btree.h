@@ -0,0 +1,959 @@
+#ifndef BTREE_H_
+#define BTREE_H_
+
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+///
+/// BTree
+///
+/// A B+tree with the operations of redblack.c: insert, erase, lookup, select/rank and
+/// range scans, for long keys. A red-black tree takes a cache miss per level, about 23
+/// of them at 10M keys; here each level is one node whose keys fill two cache lines and
+/// are compared all at once with AVX2, and there are seven levels.
+///
+/// Values live in the leaves next to the keys, and the leaves are linked both ways so a
+/// scan walks them in order without going back up. Values are moved around with memcpy
+/// as leaves split and merge, so they have to be trivially copyable, and a pointer to a
+/// value only lasts until the next insert or erase.
+///
+/// Inner nodes keep the key count of each child, which is what select and rank steer by,
+/// like num_children in redblack.c. Separator i of an inner node is an upper bound on
+/// the keys of child i; every key of child i + 1 is above it. Unused key slots hold
+/// LONG_MAX so a search can always compare a full node: nothing is less than LONG_MAX,
+/// so they're never counted.
+///
+
+template <typename Value>
+class BTree
+{
+	static_assert(std::is_trivially_copyable<Value>::value, "BTree values are moved with memcpy");
+
+	enum
+	{
+		kNodeKeys = 16,							// Two cache lines of keys.
+		kMinLeafKeys = kNodeKeys / 2,
+		kMinInnerKeys = kNodeKeys / 2 - 1,		// A full inner node splits 8 + 1 + 7.
+		kMaxHeight = 32
+	};
+
+	struct alignas(64) Leaf
+	{
+		long m_keys[kNodeKeys];
+		Value m_values[kNodeKeys];
+		Leaf *m_pPrev, *m_pNext;
+		int m_nKeys;
+	};
+
+	struct alignas(64) Inner
+	{
+		long m_keys[kNodeKeys];
+		void *m_pChildren[kNodeKeys + 1];		// Leaves on the last inner level, Inners above.
+		long m_counts[kNodeKeys + 1];			// Keys under each child.
+		int m_nKeys;
+	};
+
+public:
+	class Iterator
+	{
+	public:
+		Iterator(Leaf *pLeaf, int nPos) :
+			m_pLeaf(pLeaf),
+			m_nPos(nPos)
+		{
+		}
+
+		long key() const { return m_pLeaf->m_keys[m_nPos]; }
+		Value &value() const { return m_pLeaf->m_values[m_nPos]; }
+		bool operator==(const Iterator &o) const { return m_pLeaf == o.m_pLeaf && m_nPos == o.m_nPos; }
+		bool operator!=(const Iterator &o) const { return !(*this == o); }
+
+		Iterator &operator++()
+		{
+			if (++m_nPos == m_pLeaf->m_nKeys)
+			{
+				m_pLeaf = m_pLeaf->m_pNext;
+				m_nPos = 0;
+			}
+			return *this;
+		}
+
+		// Not from end(), which has no leaf to go back from.
+		Iterator &operator--()
+		{
+			if (m_nPos-- == 0)
+			{
+				m_pLeaf = m_pLeaf->m_pPrev;
+				m_nPos = m_pLeaf ? m_pLeaf->m_nKeys - 1 : 0;
+			}
+			return *this;
+		}
+
+	private:
+		friend class BTree;
+
+		Leaf *m_pLeaf;
+		int m_nPos;
+	};
+
+public:
+	BTree() :
+		m_pRoot(NULL),
+		m_nHeight(0),
+		m_nSize(0)
+	{
+	}
+
+	BTree(BTree &&o) :
+		BTree()
+	{
+		swap(o);
+	}
+
+	BTree &operator=(BTree &&o)
+	{
+		swap(o);
+		return *this;
+	}
+
+	BTree(const BTree &) = delete;
+	BTree &operator=(const BTree &) = delete;
+
+	virtual ~BTree()
+	{
+		clear();
+	}
+
+	void swap(BTree &o)
+	{
+		std::swap(m_pRoot, o.m_pRoot);
+		std::swap(m_nHeight, o.m_nHeight);
+		std::swap(m_nSize, o.m_nSize);
+		m_leaves.swap(o.m_leaves);
+		m_inners.swap(o.m_inners);
+	}
+
+	size_t size() const
+	{
+		return m_nSize;
+	}
+
+	bool empty() const
+	{
+		return m_nSize == 0;
+	}
+
+
+	///
+	/// insert
+	///
+	/// Adds key with value, unless key is already there. Returns whether it was added.
+	///
+
+	bool insert(long key, const Value &value)
+	{
+		Inner *path[kMaxHeight];
+		int slots[kMaxHeight];
+		Leaf *pLeaf;
+		int nPos, nLevel;
+
+		if (!m_pRoot)
+		{
+			pLeaf = newLeaf();
+			pLeaf->m_pPrev = pLeaf->m_pNext = NULL;
+			m_pRoot = pLeaf;
+		}
+
+		pLeaf = descend(key, path, slots);
+		nPos = countLess(pLeaf->m_keys, key);
+		if (nPos < pLeaf->m_nKeys && pLeaf->m_keys[nPos] == key)
+		{
+			return false;
+		}
+
+		// Count the key on the way back down, like rb_insert does on its way.
+		for (nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			path[nLevel]->m_counts[slots[nLevel]]++;
+		}
+		m_nSize++;
+
+		if (pLeaf->m_nKeys < kNodeKeys)
+		{
+			leafInsert(pLeaf, nPos, key, value);
+			return true;
+		}
+
+		// Split the full leaf in half and put the key in whichever half it belongs to.
+		Leaf *pRight = newLeaf();
+		pRight->m_nKeys = kNodeKeys / 2;
+		pLeaf->m_nKeys = kNodeKeys / 2;
+		memcpy(pRight->m_keys, pLeaf->m_keys + kNodeKeys / 2, sizeof(long) * (kNodeKeys / 2));
+		memcpy(pRight->m_values, pLeaf->m_values + kNodeKeys / 2, sizeof(Value) * (kNodeKeys / 2));
+		clearKeys(pLeaf->m_keys, kNodeKeys / 2);
+		pRight->m_pPrev = pLeaf;
+		pRight->m_pNext = pLeaf->m_pNext;
+		if (pLeaf->m_pNext)
+		{
+			pLeaf->m_pNext->m_pPrev = pRight;
+		}
+		pLeaf->m_pNext = pRight;
+
+		if (nPos <= kNodeKeys / 2)
+		{
+			leafInsert(pLeaf, nPos, key, value);
+		}
+		else
+		{
+			leafInsert(pRight, nPos - kNodeKeys / 2, key, value);
+		}
+
+		addChild(path, slots, pLeaf->m_keys[pLeaf->m_nKeys - 1], pRight, pLeaf->m_nKeys, pRight->m_nKeys);
+		return true;
+	}
+
+
+	///
+	/// find
+	///
+	/// The value stored under key, or NULL.
+	///
+
+	Value *find(long key)
+	{
+		Leaf *pLeaf;
+		int nPos;
+
+		if (!m_pRoot)
+		{
+			return NULL;
+		}
+
+		pLeaf = descend(key, NULL, NULL);
+		nPos = countLess(pLeaf->m_keys, key);
+		if (nPos < pLeaf->m_nKeys && pLeaf->m_keys[nPos] == key)
+		{
+			return &pLeaf->m_values[nPos];
+		}
+		return NULL;
+	}
+
+	const Value *find(long key) const
+	{
+		return const_cast<BTree *>(this)->find(key);
+	}
+
+
+	///
+	/// erase
+	///
+	/// Removes key. Returns false if it wasn't there. A leaf left less than half full
+	/// borrows a key from a neighbour or merges with it, and the same goes for the inner
+	/// nodes above, so every node but the root stays at least half full.
+	///
+
+	bool erase(long key)
+	{
+		Inner *path[kMaxHeight];
+		int slots[kMaxHeight];
+		Leaf *pLeaf;
+		int nPos, nLevel;
+
+		if (!m_pRoot)
+		{
+			return false;
+		}
+
+		pLeaf = descend(key, path, slots);
+		nPos = countLess(pLeaf->m_keys, key);
+		if (nPos >= pLeaf->m_nKeys || pLeaf->m_keys[nPos] != key)
+		{
+			return false;
+		}
+
+		for (nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			path[nLevel]->m_counts[slots[nLevel]]--;
+		}
+		m_nSize--;
+
+		pLeaf->m_nKeys--;
+		memmove(pLeaf->m_keys + nPos, pLeaf->m_keys + nPos + 1, sizeof(long) * (pLeaf->m_nKeys - nPos));
+		memmove(pLeaf->m_values + nPos, pLeaf->m_values + nPos + 1, sizeof(Value) * (pLeaf->m_nKeys - nPos));
+		pLeaf->m_keys[pLeaf->m_nKeys] = LONG_MAX;
+
+		if (m_nHeight == 0)
+		{
+			if (m_nSize == 0)
+			{
+				m_leaves.free(pLeaf);
+				m_pRoot = NULL;
+			}
+		}
+		else if (pLeaf->m_nKeys < kMinLeafKeys)
+		{
+			rebalanceLeaf(path[m_nHeight - 1], slots[m_nHeight - 1], pLeaf);
+			rebalanceInners(path, slots);
+		}
+		return true;
+	}
+
+
+	///
+	/// clear
+	///
+	/// Drops every key. Nodes come from pools, so this is just giving the slabs back.
+	///
+
+	void clear()
+	{
+		m_leaves.release();
+		m_inners.release();
+		m_pRoot = NULL;
+		m_nHeight = 0;
+		m_nSize = 0;
+	}
+
+
+	///
+	/// select / rank
+	///
+	/// select is the k-th smallest key (zero based), or end() if k is out of range. rank
+	/// is how many keys are less than key. Both are one descent, picking the child by
+	/// the counts on the way.
+	///
+
+	Iterator select(size_t k) const
+	{
+		void *pNode = m_pRoot;
+		long nLeft = (long)k;
+		int nLevel, nChild;
+
+		if (k >= m_nSize)
+		{
+			return end();
+		}
+
+		for (nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			Inner *pInner = (Inner *)pNode;
+			for (nChild = 0; nLeft >= pInner->m_counts[nChild]; nChild++)
+			{
+				nLeft -= pInner->m_counts[nChild];
+			}
+			pNode = pInner->m_pChildren[nChild];
+		}
+
+		return Iterator((Leaf *)pNode, (int)nLeft);
+	}
+
+	size_t rank(long key) const
+	{
+		void *pNode = m_pRoot;
+		size_t nRank = 0;
+		int nLevel, nChild, i;
+
+		if (!pNode)
+		{
+			return 0;
+		}
+
+		for (nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			Inner *pInner = (Inner *)pNode;
+			nChild = countLess(pInner->m_keys, key);
+			for (i = 0; i < nChild; i++)
+			{
+				nRank += pInner->m_counts[i];
+			}
+			pNode = pInner->m_pChildren[nChild];
+		}
+
+		return nRank + countLess(((Leaf *)pNode)->m_keys, key);
+	}
+
+
+	///
+	/// begin / end / lowerBound
+	///
+	/// In-order iteration along the leaf links. lowerBound is the first key that isn't
+	/// less than key.
+	///
+
+	Iterator begin() const
+	{
+		void *pNode = m_pRoot;
+		int nLevel;
+
+		if (!pNode)
+		{
+			return end();
+		}
+		for (nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			pNode = ((Inner *)pNode)->m_pChildren[0];
+		}
+		return Iterator((Leaf *)pNode, 0);
+	}
+
+	Iterator end() const
+	{
+		return Iterator(NULL, 0);
+	}
+
+	Iterator lowerBound(long key) const
+	{
+		Leaf *pLeaf;
+		int nPos;
+
+		if (!m_pRoot)
+		{
+			return end();
+		}
+
+		// The separators are only bounds, so the first key that big can be in the next leaf.
+		pLeaf = const_cast<BTree *>(this)->descend(key, NULL, NULL);
+		nPos = countLess(pLeaf->m_keys, key);
+		if (nPos == pLeaf->m_nKeys)
+		{
+			return Iterator(pLeaf->m_pNext, 0);
+		}
+		return Iterator(pLeaf, nPos);
+	}
+
+
+	///
+	/// rangeScan
+	///
+	/// Calls callback(key, value) on every key with lo <= key <= hi, in increasing order.
+	/// The callback can return true to stop the scan early. Returns how many keys were
+	/// visited. One descent, then straight along the leaves.
+	///
+
+	template <typename Callback>
+	size_t rangeScan(long lo, long hi, Callback callback)
+	{
+		Iterator it = lowerBound(lo);
+		Leaf *pLeaf = it.m_pLeaf;
+		int nPos = it.m_nPos;
+		size_t nVisited = 0;
+
+		for (; pLeaf; pLeaf = pLeaf->m_pNext, nPos = 0)
+		{
+			for (; nPos < pLeaf->m_nKeys; nPos++)
+			{
+				if (pLeaf->m_keys[nPos] > hi)
+				{
+					return nVisited;
+				}
+				nVisited++;
+				if (callback(pLeaf->m_keys[nPos], pLeaf->m_values[nPos]))
+				{
+					return nVisited;
+				}
+			}
+		}
+		return nVisited;
+	}
+
+
+	///
+	/// validate
+	///
+	/// Checks that keys are in order within and across nodes and within their parent's
+	/// separators, that every leaf is at the same depth, that nodes are at least half full
+	/// and padded with LONG_MAX, that the counts add up, and that the leaf links go
+	/// through every leaf in order. Returns the height, or -1 if anything is wrong.
+	///
+
+	long validate() const
+	{
+		Leaf *pLeaf = NULL;
+		Iterator it = begin();
+		size_t nCount = 0;
+		long previous = LONG_MIN;
+
+		if (!m_pRoot)
+		{
+			return (m_nSize == 0 && m_nHeight == 0) ? 0 : -1;
+		}
+		if (validateNode(m_pRoot, 0, LONG_MIN, LONG_MAX, &pLeaf) != (long)m_nSize || pLeaf->m_pNext)
+		{
+			return -1;
+		}
+
+		for (; it != end(); ++it, nCount++)
+		{
+			if (nCount > 0 && it.key() <= previous)
+			{
+				return -1;
+			}
+			previous = it.key();
+		}
+		return (nCount == m_nSize) ? m_nHeight : -1;
+	}
+
+private:
+	// Nodes are carved out of slabs like RBTree's, one pool for each kind of node.
+	template <typename Node>
+	class Pool
+	{
+	public:
+		Pool() :
+			m_pSlabs(NULL),
+			m_pFreeList(NULL)
+		{
+		}
+
+		~Pool()
+		{
+			release();
+		}
+
+		void swap(Pool &o)
+		{
+			std::swap(m_pSlabs, o.m_pSlabs);
+			std::swap(m_pFreeList, o.m_pFreeList);
+		}
+
+		Node *alloc()
+		{
+			Node *pNode;
+
+			if (m_pFreeList)
+			{
+				pNode = (Node *)m_pFreeList;
+				m_pFreeList = m_pFreeList->m_pNext;
+				return pNode;
+			}
+
+			if (!m_pSlabs || m_pSlabs->m_nUsed == kSlabNodes)
+			{
+				Slab *pSlab = new Slab;
+				pSlab->m_pNext = m_pSlabs;
+				pSlab->m_nUsed = 0;
+				m_pSlabs = pSlab;
+			}
+
+			return &m_pSlabs->m_nodes[m_pSlabs->m_nUsed++];
+		}
+
+		void free(Node *pNode)
+		{
+			FreeNode *pFree = (FreeNode *)pNode;
+			pFree->m_pNext = m_pFreeList;
+			m_pFreeList = pFree;
+		}
+
+		void release()
+		{
+			Slab *pSlab, *pNext;
+
+			for (pSlab = m_pSlabs; pSlab; pSlab = pNext)
+			{
+				pNext = pSlab->m_pNext;
+				delete pSlab;
+			}
+			m_pSlabs = NULL;
+			m_pFreeList = NULL;
+		}
+
+	private:
+		enum { kSlabNodes = 256 };
+
+		struct Slab
+		{
+			Node m_nodes[kSlabNodes];
+			Slab *m_pNext;
+			size_t m_nUsed;
+		};
+
+		struct FreeNode
+		{
+			FreeNode *m_pNext;
+		};
+
+		Slab *m_pSlabs;
+		FreeNode *m_pFreeList;
+	};
+
+	// How many of the node's 16 keys are less than key: the slot a search goes to.
+	static int countLess(const long *keys, long key)
+	{
+#ifdef __AVX2__
+		__m256i needle = _mm256_set1_epi64x(key);
+		__m256i lt0 = _mm256_cmpgt_epi64(needle, _mm256_load_si256((const __m256i *)keys));
+		__m256i lt1 = _mm256_cmpgt_epi64(needle, _mm256_load_si256((const __m256i *)(keys + 4)));
+		__m256i lt2 = _mm256_cmpgt_epi64(needle, _mm256_load_si256((const __m256i *)(keys + 8)));
+		__m256i lt3 = _mm256_cmpgt_epi64(needle, _mm256_load_si256((const __m256i *)(keys + 12)));
+		unsigned nMask = _mm256_movemask_pd(_mm256_castsi256_pd(lt0)) | (_mm256_movemask_pd(_mm256_castsi256_pd(lt1)) << 4) |
+			(_mm256_movemask_pd(_mm256_castsi256_pd(lt2)) << 8) | (_mm256_movemask_pd(_mm256_castsi256_pd(lt3)) << 12);
+		return __builtin_popcount(nMask);
+#else
+		// No early exit, so gcc vectorizes it with whatever SIMD it's allowed.
+		int nLess = 0;
+		for (int i = 0; i < kNodeKeys; i++)
+		{
+			nLess += keys[i] < key;
+		}
+		return nLess;
+#endif
+	}
+
+	static void clearKeys(long *keys, int nFrom)
+	{
+		for (int i = nFrom; i < kNodeKeys; i++)
+		{
+			keys[i] = LONG_MAX;
+		}
+	}
+
+	Leaf *newLeaf()
+	{
+		Leaf *pLeaf = m_leaves.alloc();
+		pLeaf->m_nKeys = 0;
+		clearKeys(pLeaf->m_keys, 0);
+		return pLeaf;
+	}
+
+	Inner *newInner()
+	{
+		Inner *pInner = m_inners.alloc();
+		pInner->m_nKeys = 0;
+		clearKeys(pInner->m_keys, 0);
+		return pInner;
+	}
+
+	static long sumCounts(const Inner *pInner)
+	{
+		long nSum = 0;
+		for (int i = 0; i <= pInner->m_nKeys; i++)
+		{
+			nSum += pInner->m_counts[i];
+		}
+		return nSum;
+	}
+
+	// Walks down to the leaf where key is or would go. If path is given, it gets the inner
+	// nodes from the root down and slots the child taken in each.
+	Leaf *descend(long key, Inner **path, int *slots)
+	{
+		void *pNode = m_pRoot;
+
+		for (int nLevel = 0; nLevel < m_nHeight; nLevel++)
+		{
+			Inner *pInner = (Inner *)pNode;
+			int nChild = countLess(pInner->m_keys, key);
+			if (path)
+			{
+				path[nLevel] = pInner;
+				slots[nLevel] = nChild;
+			}
+			pNode = pInner->m_pChildren[nChild];
+		}
+		return (Leaf *)pNode;
+	}
+
+	static void leafInsert(Leaf *pLeaf, int nPos, long key, const Value &value)
+	{
+		memmove(pLeaf->m_keys + nPos + 1, pLeaf->m_keys + nPos, sizeof(long) * (pLeaf->m_nKeys - nPos));
+		memmove(pLeaf->m_values + nPos + 1, pLeaf->m_values + nPos, sizeof(Value) * (pLeaf->m_nKeys - nPos));
+		pLeaf->m_keys[nPos] = key;
+		pLeaf->m_values[nPos] = value;
+		pLeaf->m_nKeys++;
+	}
+
+	// Child nSlot of pInner has just been split: it keeps the keys up to separator, with
+	// nLeftCount of them, and pRight takes the rest.
+	static void innerInsert(Inner *pInner, int nSlot, long separator, void *pRight, long nLeftCount, long nRightCount)
+	{
+		int nMove = pInner->m_nKeys - nSlot;
+
+		memmove(pInner->m_keys + nSlot + 1, pInner->m_keys + nSlot, sizeof(long) * nMove);
+		memmove(pInner->m_pChildren + nSlot + 2, pInner->m_pChildren + nSlot + 1, sizeof(void *) * nMove);
+		memmove(pInner->m_counts + nSlot + 2, pInner->m_counts + nSlot + 1, sizeof(long) * nMove);
+		pInner->m_keys[nSlot] = separator;
+		pInner->m_pChildren[nSlot + 1] = pRight;
+		pInner->m_counts[nSlot] = nLeftCount;
+		pInner->m_counts[nSlot + 1] = nRightCount;
+		pInner->m_nKeys++;
+	}
+
+	// Removes separator nSlot and the child after it, which has been merged into child nSlot.
+	static void innerRemove(Inner *pInner, int nSlot)
+	{
+		int nMove = pInner->m_nKeys - nSlot - 1;
+
+		pInner->m_counts[nSlot] += pInner->m_counts[nSlot + 1];
+		memmove(pInner->m_keys + nSlot, pInner->m_keys + nSlot + 1, sizeof(long) * nMove);
+		memmove(pInner->m_pChildren + nSlot + 1, pInner->m_pChildren + nSlot + 2, sizeof(void *) * nMove);
+		memmove(pInner->m_counts + nSlot + 1, pInner->m_counts + nSlot + 2, sizeof(long) * nMove);
+		pInner->m_nKeys--;
+		pInner->m_keys[pInner->m_nKeys] = LONG_MAX;
+	}
+
+	// Hangs pRight next to the child that was just split at the bottom of the path, splitting
+	// full inner nodes on the way up and growing a new root if the old one splits.
+	void addChild(Inner **path, int *slots, long separator, void *pRight, long nLeftCount, long nRightCount)
+	{
+		for (int nLevel = m_nHeight - 1; nLevel >= 0; nLevel--)
+		{
+			Inner *pInner = path[nLevel];
+			int nSlot = slots[nLevel];
+
+			if (pInner->m_nKeys < kNodeKeys)
+			{
+				innerInsert(pInner, nSlot, separator, pRight, nLeftCount, nRightCount);
+				return;
+			}
+
+			// Keys 0..7 stay, key 8 goes up, 9..15 move to the new node.
+			Inner *pSplit = newInner();
+			long promoted = pInner->m_keys[kNodeKeys / 2];
+			pSplit->m_nKeys = kNodeKeys - kNodeKeys / 2 - 1;
+			memcpy(pSplit->m_keys, pInner->m_keys + kNodeKeys / 2 + 1, sizeof(long) * pSplit->m_nKeys);
+			memcpy(pSplit->m_pChildren, pInner->m_pChildren + kNodeKeys / 2 + 1, sizeof(void *) * (pSplit->m_nKeys + 1));
+			memcpy(pSplit->m_counts, pInner->m_counts + kNodeKeys / 2 + 1, sizeof(long) * (pSplit->m_nKeys + 1));
+			pInner->m_nKeys = kNodeKeys / 2;
+			clearKeys(pInner->m_keys, kNodeKeys / 2);
+
+			if (nSlot <= kNodeKeys / 2)
+			{
+				innerInsert(pInner, nSlot, separator, pRight, nLeftCount, nRightCount);
+			}
+			else
+			{
+				innerInsert(pSplit, nSlot - kNodeKeys / 2 - 1, separator, pRight, nLeftCount, nRightCount);
+			}
+
+			separator = promoted;
+			pRight = pSplit;
+			nLeftCount = sumCounts(pInner);
+			nRightCount = sumCounts(pSplit);
+		}
+
+		Inner *pRoot = newInner();
+		pRoot->m_nKeys = 1;
+		pRoot->m_keys[0] = separator;
+		pRoot->m_pChildren[0] = m_pRoot;
+		pRoot->m_pChildren[1] = pRight;
+		pRoot->m_counts[0] = nLeftCount;
+		pRoot->m_counts[1] = nRightCount;
+		m_pRoot = pRoot;
+		m_nHeight++;
+	}
+
+	// pLeaf, child nSlot of pParent, is under half full: take a key from a neighbour that
+	// can spare one, or else merge with it.
+	void rebalanceLeaf(Inner *pParent, int nSlot, Leaf *pLeaf)
+	{
+		Leaf *pLeft = (nSlot > 0) ? (Leaf *)pParent->m_pChildren[nSlot - 1] : NULL;
+		Leaf *pRight = (nSlot < pParent->m_nKeys) ? (Leaf *)pParent->m_pChildren[nSlot + 1] : NULL;
+
+		if (pLeft && pLeft->m_nKeys > kMinLeafKeys)
+		{
+			pLeft->m_nKeys--;
+			leafInsert(pLeaf, 0, pLeft->m_keys[pLeft->m_nKeys], pLeft->m_values[pLeft->m_nKeys]);
+			pLeft->m_keys[pLeft->m_nKeys] = LONG_MAX;
+			pParent->m_keys[nSlot - 1] = pLeft->m_keys[pLeft->m_nKeys - 1];
+			pParent->m_counts[nSlot - 1]--;
+			pParent->m_counts[nSlot]++;
+		}
+		else if (pRight && pRight->m_nKeys > kMinLeafKeys)
+		{
+			leafInsert(pLeaf, pLeaf->m_nKeys, pRight->m_keys[0], pRight->m_values[0]);
+			pRight->m_nKeys--;
+			memmove(pRight->m_keys, pRight->m_keys + 1, sizeof(long) * pRight->m_nKeys);
+			memmove(pRight->m_values, pRight->m_values + 1, sizeof(Value) * pRight->m_nKeys);
+			pRight->m_keys[pRight->m_nKeys] = LONG_MAX;
+			pParent->m_keys[nSlot] = pLeaf->m_keys[pLeaf->m_nKeys - 1];
+			pParent->m_counts[nSlot]++;
+			pParent->m_counts[nSlot + 1]--;
+		}
+		else
+		{
+			if (!pLeft)
+			{
+				pLeft = pLeaf;
+				nSlot++;
+			}
+			else
+			{
+				pRight = pLeaf;
+			}
+
+			// pRight goes into pLeft, and its slot nSlot goes from the parent.
+			memcpy(pLeft->m_keys + pLeft->m_nKeys, pRight->m_keys, sizeof(long) * pRight->m_nKeys);
+			memcpy(pLeft->m_values + pLeft->m_nKeys, pRight->m_values, sizeof(Value) * pRight->m_nKeys);
+			pLeft->m_nKeys += pRight->m_nKeys;
+			pLeft->m_pNext = pRight->m_pNext;
+			if (pRight->m_pNext)
+			{
+				pRight->m_pNext->m_pPrev = pLeft;
+			}
+			m_leaves.free(pRight);
+			innerRemove(pParent, nSlot - 1);
+		}
+	}
+
+	// The inner node at nSlot of pParent is under half full. The same three cases as a
+	// leaf, except the separator between the two nodes comes down into the node.
+	void rebalanceInner(Inner *pParent, int nSlot, Inner *pInner)
+	{
+		Inner *pLeft = (nSlot > 0) ? (Inner *)pParent->m_pChildren[nSlot - 1] : NULL;
+		Inner *pRight = (nSlot < pParent->m_nKeys) ? (Inner *)pParent->m_pChildren[nSlot + 1] : NULL;
+
+		if (pLeft && pLeft->m_nKeys > kMinInnerKeys)
+		{
+			long nMoved = pLeft->m_counts[pLeft->m_nKeys];
+
+			memmove(pInner->m_keys + 1, pInner->m_keys, sizeof(long) * pInner->m_nKeys);
+			memmove(pInner->m_pChildren + 1, pInner->m_pChildren, sizeof(void *) * (pInner->m_nKeys + 1));
+			memmove(pInner->m_counts + 1, pInner->m_counts, sizeof(long) * (pInner->m_nKeys + 1));
+			pInner->m_keys[0] = pParent->m_keys[nSlot - 1];
+			pInner->m_pChildren[0] = pLeft->m_pChildren[pLeft->m_nKeys];
+			pInner->m_counts[0] = nMoved;
+			pInner->m_nKeys++;
+
+			pParent->m_keys[nSlot - 1] = pLeft->m_keys[pLeft->m_nKeys - 1];
+			pLeft->m_nKeys--;
+			pLeft->m_keys[pLeft->m_nKeys] = LONG_MAX;
+			pParent->m_counts[nSlot - 1] -= nMoved;
+			pParent->m_counts[nSlot] += nMoved;
+		}
+		else if (pRight && pRight->m_nKeys > kMinInnerKeys)
+		{
+			long nMoved = pRight->m_counts[0];
+
+			pInner->m_keys[pInner->m_nKeys] = pParent->m_keys[nSlot];
+			pInner->m_pChildren[pInner->m_nKeys + 1] = pRight->m_pChildren[0];
+			pInner->m_counts[pInner->m_nKeys + 1] = nMoved;
+			pInner->m_nKeys++;
+
+			pParent->m_keys[nSlot] = pRight->m_keys[0];
+			pRight->m_nKeys--;
+			memmove(pRight->m_keys, pRight->m_keys + 1, sizeof(long) * pRight->m_nKeys);
+			memmove(pRight->m_pChildren, pRight->m_pChildren + 1, sizeof(void *) * (pRight->m_nKeys + 1));
+			memmove(pRight->m_counts, pRight->m_counts + 1, sizeof(long) * (pRight->m_nKeys + 1));
+			pRight->m_keys[pRight->m_nKeys] = LONG_MAX;
+			pParent->m_counts[nSlot] += nMoved;
+			pParent->m_counts[nSlot + 1] -= nMoved;
+		}
+		else
+		{
+			if (!pLeft)
+			{
+				pLeft = pInner;
+				nSlot++;
+			}
+			else
+			{
+				pRight = pInner;
+			}
+
+			pLeft->m_keys[pLeft->m_nKeys] = pParent->m_keys[nSlot - 1];
+			memcpy(pLeft->m_keys + pLeft->m_nKeys + 1, pRight->m_keys, sizeof(long) * pRight->m_nKeys);
+			memcpy(pLeft->m_pChildren + pLeft->m_nKeys + 1, pRight->m_pChildren, sizeof(void *) * (pRight->m_nKeys + 1));
+			memcpy(pLeft->m_counts + pLeft->m_nKeys + 1, pRight->m_counts, sizeof(long) * (pRight->m_nKeys + 1));
+			pLeft->m_nKeys += pRight->m_nKeys + 1;
+			m_inners.free(pRight);
+			innerRemove(pParent, nSlot - 1);
+		}
+	}
+
+	// After a leaf rebalance the parent may have lost a key: carry on up the path, and
+	// drop the root when it's down to one child.
+	void rebalanceInners(Inner **path, int *slots)
+	{
+		for (int nLevel = m_nHeight - 1; nLevel > 0 && path[nLevel]->m_nKeys < kMinInnerKeys; nLevel--)
+		{
+			rebalanceInner(path[nLevel - 1], slots[nLevel - 1], path[nLevel]);
+		}
+
+		if (((Inner *)m_pRoot)->m_nKeys == 0)
+		{
+			Inner *pRoot = (Inner *)m_pRoot;
+			m_pRoot = pRoot->m_pChildren[0];
+			m_nHeight--;
+			m_inners.free(pRoot);
+		}
+	}
+
+	// Checks the subtree under pNode, at nLevel, whose keys must be in (lo, hi], or [lo, hi]
+	// for the first leaf. pLast is the leaf before it in key order. Returns the key count,
+	// or -1.
+	long validateNode(void *pNode, int nLevel, long lo, long hi, Leaf **pLast) const
+	{
+		int nKeys, i;
+		const long *keys;
+
+		if (nLevel == m_nHeight)
+		{
+			Leaf *pLeaf = (Leaf *)pNode;
+			nKeys = pLeaf->m_nKeys;
+			keys = pLeaf->m_keys;
+			if (pLeaf->m_pPrev != *pLast || (*pLast && (*pLast)->m_pNext != pLeaf))
+			{
+				return -1;
+			}
+			if ((nKeys < kMinLeafKeys && pNode != m_pRoot) || nKeys == 0 || nKeys > kNodeKeys)
+			{
+				return -1;
+			}
+			for (i = 0; i < kNodeKeys; i++)
+			{
+				if ((i < nKeys && (keys[i] < lo || (keys[i] == lo && *pLast) || keys[i] > hi || (i > 0 && keys[i] <= keys[i - 1]))) ||
+					(i >= nKeys && keys[i] != LONG_MAX))
+				{
+					return -1;
+				}
+			}
+			*pLast = pLeaf;
+			return nKeys;
+		}
+
+		Inner *pInner = (Inner *)pNode;
+		long nTotal = 0;
+		nKeys = pInner->m_nKeys;
+		keys = pInner->m_keys;
+		if ((nKeys < kMinInnerKeys && pNode != m_pRoot) || nKeys == 0 || nKeys > kNodeKeys)
+		{
+			return -1;
+		}
+		for (i = 0; i < kNodeKeys; i++)
+		{
+			if ((i < nKeys && (keys[i] < lo || keys[i] > hi || (i > 0 && keys[i] <= keys[i - 1]))) ||
+				(i >= nKeys && keys[i] != LONG_MAX))
+			{
+				return -1;
+			}
+		}
+		for (i = 0; i <= nKeys; i++)
+		{
+			long nCount = validateNode(pInner->m_pChildren[i], nLevel + 1, (i > 0) ? keys[i - 1] : lo, (i < nKeys) ? keys[i] : hi, pLast);
+			if (nCount < 0 || nCount != pInner->m_counts[i])
+			{
+				return -1;
+			}
+			nTotal += nCount;
+		}
+		return nTotal;
+	}
+
+private:
+	void *m_pRoot;						// A Leaf if m_nHeight is 0, an Inner otherwise.
+	int m_nHeight;						// Inner levels above the leaves.
+	size_t m_nSize;
+	Pool<Leaf> m_leaves;
+	Pool<Inner> m_inners;
+};
+
+#endif // BTREE_H_
@@ -1,8 +1,22 @@
-// Very simple: Compile with gcc redblack.c and then just run it!
+// Very simple: Compile with gcc -pthread redblack.c and then just run it!
+// Add -DRB_COMPACT for the 32 byte node layout.
+// Add -DRB_STATS for operation counters and latency histograms (see rb_stats).
+// Add -DRB_AUGMENT for subtree aggregates (see rb_set_augment).
+// String keys are further down (see rb_str_create).
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 
 ///
@@ -34,939 +48,10696 @@ enum rb_color {
 	rb_red
 };
 
+#ifndef RB_COMPACT
+
 struct rb_node 
 {
 	long key;
 	void *data;
-	struct rb_node *left, *right, *parent;
+	struct rb_node *left, *right;
+	union
+	{
+		struct rb_node *parent;
+		long refcount;				// Persistent trees count references instead; see rb_snapshot.
+	};
 	enum rb_color color;
 	long num_children;
+#ifdef RB_AUGMENT
+	long aggregate;					// The augment's combine over the subtree; see rb_set_augment.
+#endif
+};
+
+#else
+
+// The compact layout is 32 bytes instead of 56, so two nodes share a cache line.
+// Links are 32 bit offsets from the node itself, counted in nodes, with 0 meaning NULL.
+// That works because every compact node lives in one reserved region (see 
+// _rb_slab_nodes_alloc) small enough for any two nodes to be within 2^31 of each other.
+// The color takes the top bit of the subtree count.
+struct rb_node 
+{
+	long key;
+	void *data;
+	int left, right;
+	union
+	{
+		int parent;
+		int refcount;
+	};
+	unsigned int color_children;
+#ifdef RB_AUGMENT
+	long aggregate;					// Makes the node 40 bytes.
+#endif
 };
 
+#define RB_COLOR_BIT 0x80000000U
 
+#endif
 
-/// 
-/// _rb_create_node
-///
-/// Just makes a new node given a parent, key and data. Nodes default to red.
-///
 
-struct rb_node *_rb_create_node(struct rb_node *parent, long key, void *data)
+// Nodes are carved out of slabs of this many nodes. A slab is never handed back
+// until the whole tree is destroyed.
+#define RB_SLAB_NODES 1024
+
+struct rb_slab
 {
-	struct rb_node *node = (struct rb_node *)malloc(sizeof(struct rb_node));
-	
-	node->parent = parent;
-	node->left = node->right = NULL;
-	node->key = key;
-	node->data = data;
-	node->color = rb_red;
-	node->num_children = 0;
+	struct rb_slab *next;
+	long used;
+	struct rb_node *nodes;			// RB_SLAB_NODES of them.
+};
 
-	return node;
-}
+struct rb_arena
+{
+	struct rb_slab *slabs;			// Newest slab first. New nodes are bumped out of slabs->nodes.
+	struct rb_node *free_list;		// Nodes released by rb_delete, chained through their data pointer.
+	struct rb_slab *last_slab;		// The ends of both lists, so _rb_arena_merge doesn't walk them.
+	struct rb_node *last_free;
+
+	// A persistent tree and its snapshots share nodes, so they share the arena too. So
+	// do the two halves of an rb_split.
+	long trees;						// Trees using the arena. It goes away with the last one.
+	pthread_mutex_t lock;			// Held by persistent trees while changing nodes or refcounts.
+};
+
+// What a tree keeps in every node alongside num_children; see rb_set_augment.
+struct rb_augment
+{
+	long (*value)(long key, void *data);	// A node's own contribution.
+	long (*combine)(long a, long b);		// Must be associative and commutative.
+	long identity;							// combine(identity, x) == x; the aggregate of nothing.
+};
+
+// No red-black tree that fits in memory is deeper than this: the height is at most
+// twice the log of the node count.
+#define RB_MAX_DEPTH 128
+
+struct rb_tree
+{
+	struct rb_node *root;
+	struct rb_arena *arena;
+	int persistent;					// Made by rb_create_persistent or rb_snapshot.
+	int multimap;					// Made by rb_create_multimap: keys can repeat.
+
+	// Lets readers run alongside a writer without locking; see rb_write_lock.
+	unsigned long sequence;			// Odd while a write is in progress.
+	pthread_mutex_t write_lock;
+
+	struct rb_mapped *mapped;		// Set by rb_map: the saved tree under this one.
+
+	struct rb_node *finger;			// The node added last, or NULL; see rb_insert.
+	long finger_lo, finger_hi;		// Its neighbours' keys when it went in: nothing else lies between.
+
+	const struct rb_augment *augment;	// NULL unless rb_set_augment was called.
+
+	struct rb_node *leftmost, *rightmost;	// Smallest and largest nodes, or NULL; see rb_peek_min.
+};
+
+// A tree opened with rb_map keeps only its changes in nodes; these let the basic 
+// operations take the saved file into account. See the On-disk trees section.
+void _rb_mapped_log_insert(struct rb_tree *tree, long key, void *data);
+int _rb_mapped_delete(struct rb_tree *tree, long key);
+void _rb_mapped_set_data(struct rb_tree *tree, long key, void *data);
+void *_rb_mapped_lookup(struct rb_tree *tree, long key);
+long _rb_mapped_count(struct rb_tree *tree);
+long _rb_mapped_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(struct rb_node *node, void *context), void *context);
+void _rb_unmap(struct rb_tree *tree);
 
 
 
 ///
-/// _rb_find_node
+/// Instrumentation
 ///
-/// Find a node under the given node, given its key. Return NULL if it's not found.
+/// With -DRB_STATS the tree counts what its operations cost: comparisons on each descent,
+/// rotations, fixup loop iterations, subtree count updates and node allocations, plus a
+/// latency histogram for each of rb_insert, rb_delete and rb_lookup. Bucket i of a
+/// histogram counts the calls that took [2^i, 2^(i+1)) nanoseconds.
+///
+/// Only one call in RB_STATS_SAMPLE goes in the histograms. Reading the clock stops the
+/// next lookup's cache misses overlapping this one's, so timing every call made lookups
+/// 4x slower. Build with -DRB_STATS_SAMPLE=1 to time them all anyway.
+///
+/// BENCH_rb_insert_lookup(10000000) when compiled -O3:
+/// without RB_STATS             insert 2.34s   lookup 0.79s
+/// counters, no histograms      insert 2.52s   lookup 0.89s
+/// RB_STATS_SAMPLE=1            insert 3.46s   lookup 2.87s
+/// RB_STATS_SAMPLE=16           insert 2.79s   lookup 1.27s
+/// RB_STATS_SAMPLE=64           insert 2.61s   lookup 1.07s
+///
+/// Without it RB_STAT and friends are empty, so none of this is even compiled.
+///
+/// The counters are per thread so the concurrent readers don't fight over a cache line;
+/// rb_stats reports the calling thread's. Work done by the pool threads in rb_union and
+/// friends isn't counted.
 ///
 
-struct rb_node *_rb_find_node(struct rb_node *node, long key) 
+#ifdef RB_STATS
+
+#define RB_STATS_BUCKETS 32
+
+#ifndef RB_STATS_SAMPLE
+#define RB_STATS_SAMPLE 64
+#endif
+
+enum rb_stats_op {
+	rb_op_insert = 0,
+	rb_op_delete,
+	rb_op_lookup,
+	rb_op_count
+};
+
+struct rb_stats
 {
-	if (!node)
-	{
-		return NULL;
-	}
+	long descents;					// Searches from the root: lookups, inserts and deletes.
+	long hinted_inserts;			// Inserts placed next to their hint without a descent.
+	long comparisons;				// Nodes looked at by those searches.
+	long rotations;
+	long insert_fixup_loops;		// Times round the _rb_insert_fixup loop.
+	long delete_fixup_loops;		// Times round the _rb_delete_fixup loop.
+	long num_children_updates;		// Subtree counts rewritten, on the way down or in a rotation.
+	long allocations;				// Nodes handed out by the arena.
+	long slab_allocations;			// Of which needed a fresh slab.
+	long latency[rb_op_count][RB_STATS_BUCKETS];	// Sampled calls; see RB_STATS_SAMPLE.
+};
+
+__thread struct rb_stats _rb_stats;
+__thread unsigned long _rb_stats_calls;
+
+#define RB_STAT(counter) (_rb_stats.counter++)
+#define RB_STAT_ADD(counter, n) (_rb_stats.counter += (n))
+#define RB_STAT_TIMER(start) struct timespec start; _rb_stats_start(&start)
+#define RB_STAT_LATENCY(op, start) _rb_stats_latency(op, &start)
 
-	if (key < node->key) 
-	{
-		return _rb_find_node(node->left, key);
-	}
-	else if (key > node->key)
-	{
-		return _rb_find_node(node->right, key);
-	}
-	else // key == node->key
-	{
-		return node;
-	}
-}
 
 
 ///
-/// _rb_find_smallest
+/// _rb_stats_start
 ///
-/// Find the smallest node under the given one. Return NULL if it's not found.
+/// Reads the clock if this call is one of the sampled ones. Otherwise start is marked
+/// so _rb_stats_latency skips it.
 ///
 
-struct rb_node *_rb_find_smallest(struct rb_node *node)
+void _rb_stats_start(struct timespec *start)
 {
-	if (node->left == NULL) 
+	start->tv_nsec = -1;
+	if (++_rb_stats_calls % RB_STATS_SAMPLE == 0)
 	{
-		return node;
+		clock_gettime(CLOCK_MONOTONIC, start);
 	}
-	return _rb_find_smallest(node->left);
 }
 
 
 
-/// 
-/// _rb_clear
 ///
-/// Clears a tree or subtree. Note that all pointers to the passed-in node should be 
-/// discarded, since it will be freed.
+/// _rb_stats_latency
+///
+/// Adds the time since start to the op's histogram, if the call was sampled.
 ///
 
-void _rb_clear(struct rb_node *node)
+void _rb_stats_latency(enum rb_stats_op op, struct timespec *start)
 {
-	if (!node)
+	struct timespec now;
+	unsigned long ns;
+	int bucket = 0;
+
+	if (start->tv_nsec < 0)
 	{
 		return;
 	}
-
-	_rb_clear(node->left);
-	_rb_clear(node->right);
-	free(node);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+	if (ns)
+	{
+		bucket = 63 - __builtin_clzl(ns);
+	}
+	if (bucket >= RB_STATS_BUCKETS)
+	{
+		bucket = RB_STATS_BUCKETS - 1;
+	}
+	_rb_stats.latency[op][bucket]++;
 }
 
 
 
-
-
 ///
-/// _rb_sibling
+/// rb_stats
 ///
-/// Return the child of the parent node which does not route to the current node.
-/// Returns NULL if there is no parent.
+/// Copies out the calling thread's counters, then zeroes them if reset is set.
 ///
 
-struct rb_node *_rb_sibling(struct rb_node *node)
+void rb_stats(struct rb_stats *stats, int reset)
 {
-	struct rb_node *parent;
-
-	if (!node)
-	{
-		return NULL;
-	}
-
-	parent = node->parent;
-	if (!node->parent)
+	*stats = _rb_stats;
+	if (reset)
 	{
-		return NULL;
+		memset(&_rb_stats, 0, sizeof(_rb_stats));
 	}
-
-	return (node == parent->left) ? parent->right : parent->left;
 }
 
 
 
-
-
 ///
-/// _rb_parent_child_pointer
+/// rb_stats_percentile
 ///
-/// Returns a pointer to the parent of this node's pointer to this child.
-/// This assists with rotations and modifications by avoiding a bunch of "? :" syntax.
+/// The upper bound in nanoseconds of the histogram bucket holding the given fraction of
+/// an op's calls, e.g. 0.99 for the p99. Returns 0 if the op was never called.
 ///
 
-struct rb_node **_rb_parent_child_pointer(struct rb_node *node)
+long rb_stats_percentile(struct rb_stats *stats, enum rb_stats_op op, double fraction)
 {
-	if (!node || !node->parent)
-	{
-		return NULL;
-	}
+	long total = 0, seen = 0;
+	int i;
 
-	if (node->parent->left == node)
+	for (i = 0; i < RB_STATS_BUCKETS; i++)
 	{
-		return &node->parent->left;
+		total += stats->latency[op][i];
 	}
-	else
+	for (i = 0; i < RB_STATS_BUCKETS && total; i++)
 	{
-		return &node->parent->right;
+		seen += stats->latency[op][i];
+		if (seen >= fraction * total)
+		{
+			return 2L << i;
+		}
 	}
+	return 0;
 }
 
 
 
-
 ///
-/// rb_create
+/// rb_stats_print
 ///
-/// Creates a new red-black tree. The resulting pointer is what needs to be 
-/// passed into all the other functions.
+/// Dumps the counters and each op's histogram.
 ///
 
-struct rb_node **rb_create()
+void rb_stats_print(struct rb_stats *stats)
 {
-	struct rb_node **tree = (struct rb_node **)malloc(sizeof(struct rb_node *));
-	*tree = NULL;
-	return tree;
+	const char *names[rb_op_count] = { "insert", "delete", "lookup" };
+	int op, i;
+
+	printf("descents %ld, comparisons %ld (%.1f per descent), hinted inserts %ld\n", stats->descents, stats->comparisons,
+		stats->descents ? (double)stats->comparisons / stats->descents : 0.0, stats->hinted_inserts);
+	printf("rotations %ld, insert fixup loops %ld, delete fixup loops %ld\n", stats->rotations,
+		stats->insert_fixup_loops, stats->delete_fixup_loops);
+	printf("num_children updates %ld, allocations %ld (%ld slabs)\n", stats->num_children_updates,
+		stats->allocations, stats->slab_allocations);
+
+	for (op = 0; op < rb_op_count; op++)
+	{
+		printf("%-7s p50 <%ldns  p99 <%ldns  p99.9 <%ldns:", names[op], rb_stats_percentile(stats, op, 0.5),
+			rb_stats_percentile(stats, op, 0.99), rb_stats_percentile(stats, op, 0.999));
+		for (i = 0; i < RB_STATS_BUCKETS; i++)
+		{
+			if (stats->latency[op][i])
+			{
+				printf(" %ld:%ld", 1L << i, stats->latency[op][i]);
+			}
+		}
+		printf("\n");
+	}
 }
 
+#else
+
+#define RB_STAT(counter) ((void)0)
+#define RB_STAT_ADD(counter, n) ((void)(n))
+#define RB_STAT_TIMER(start) ((void)0)
+#define RB_STAT_LATENCY(op, start) ((void)0)
+
+#endif
 
 
 
 ///
-/// rb_destroy
+/// Node accessors
 ///
-/// Destroys an rb_tree. Frees all memory associated with it, but leaves
-/// the values of nodes untouched (since they're opaque).
+/// Everything goes through these to get at a node's links, color and subtree count, 
+/// so the rest of the code doesn't care which node layout is compiled in.
+/// _rb_child_for_key is the child a search for key continues into.
 ///
 
-void rb_destroy(struct rb_node **tree)
-{
-	_rb_clear(*tree);
-	free(*tree);
-}
-
+#ifndef RB_COMPACT
 
+struct rb_node *_rb_left_child(struct rb_node *node) { return node->left; }
+struct rb_node *_rb_right_child(struct rb_node *node) { return node->right; }
+struct rb_node *_rb_parent(struct rb_node *node) { return node->parent; }
+enum rb_color _rb_color(struct rb_node *node) { return node->color; }
+long _rb_num_children(struct rb_node *node) { return node->num_children; }
 
+void _rb_set_left_child(struct rb_node *node, struct rb_node *child) { node->left = child; }
+void _rb_set_right_child(struct rb_node *node, struct rb_node *child) { node->right = child; }
+void _rb_set_parent(struct rb_node *node, struct rb_node *parent) { node->parent = parent; }
+void _rb_set_color(struct rb_node *node, enum rb_color color) { node->color = color; }
+void _rb_set_num_children(struct rb_node *node, long num_children) { node->num_children = num_children; }
 
-///
-/// rb_print
-///
-/// Prints out the contents of the rb tree
-///
+long _rb_refcount(struct rb_node *node) { return node->refcount; }
+void _rb_set_refcount(struct rb_node *node, long refcount) { node->refcount = refcount; }
 
-void rb_print(struct rb_node **tree, int indent_level)
-{
-	struct rb_node *node = *tree;
+struct rb_node *_rb_child_for_key(struct rb_node *node, long key) { return (key < node->key) ? node->left : node->right; }
 
-	if (!node)
-	{
-		return;
-	}
+#else
 
-	for (int i = 0; i < indent_level; i++) {
-		printf("   ");
-	}
-	printf("Key: %ld\tLeft: %ld\tRight: %ld\tParent: %ld\tColor: %s\tChildren: %ld\n", 
-		node->key, node->left ? node->left->key : -1, 
-		node->right ? node->right->key : -1, 
-		node->parent ? node->parent->key : -1,
-		node->color == rb_red ? "red" : "black",
-		node->num_children);
-	rb_print(&node->left, indent_level + 1);
-	rb_print(&node->right, indent_level + 1);
+// _rb_link turns an offset back into a node, _rb_offset goes the other way. _rb_link is
+// branch free on purpose: with a branch, every step of a descent becomes a coin flip for
+// the branch predictor, where the pointer layout gets a cmov.
+struct rb_node *_rb_link(struct rb_node *node, int offset) 
+{
+	return (struct rb_node *)((unsigned long)(node + offset) & -(unsigned long)(offset != 0));
 }
 
+int _rb_offset(struct rb_node *node, struct rb_node *target)
+{
+	return target ? (int)(target - node) : 0;
+}
 
+struct rb_node *_rb_left_child(struct rb_node *node) { return _rb_link(node, node->left); }
+struct rb_node *_rb_right_child(struct rb_node *node) { return _rb_link(node, node->right); }
+struct rb_node *_rb_parent(struct rb_node *node) { return _rb_link(node, node->parent); }
+enum rb_color _rb_color(struct rb_node *node) { return (node->color_children & RB_COLOR_BIT) ? rb_red : rb_black; }
+long _rb_num_children(struct rb_node *node) { return node->color_children & ~RB_COLOR_BIT; }
 
+void _rb_set_left_child(struct rb_node *node, struct rb_node *child) { node->left = _rb_offset(node, child); }
+void _rb_set_right_child(struct rb_node *node, struct rb_node *child) { node->right = _rb_offset(node, child); }
+void _rb_set_parent(struct rb_node *node, struct rb_node *parent) { node->parent = _rb_offset(node, parent); }
 
-///
-/// _rb_validate_binary_tree
-///
-/// Checks that the binary tree is valid. That just means each node has a proper left and right child
-/// and parent.
-
-void _rb_validate_binary_tree(struct rb_node **tree)
+void _rb_set_color(struct rb_node *node, enum rb_color color)
 {
-	struct rb_node *node = *tree;
-	if (!node)
-	{
-		return;
-	}
+	node->color_children = (node->color_children & ~RB_COLOR_BIT) | (color == rb_red ? RB_COLOR_BIT : 0);
+}
 
-	if (node->left)
-	{
-		ASSERT(node->left->key < node->key, "Wrongly placed child node");
-		ASSERT(node->left->parent == node, "Child doesn't have me as a parent");
-	}
+void _rb_set_num_children(struct rb_node *node, long num_children)
+{
+	node->color_children = (node->color_children & RB_COLOR_BIT) | (unsigned int)num_children;
+}
 
-	if (node->right)
-	{
-		ASSERT(node->right->key > node->key, "Wrongly placed child node");
-		ASSERT(node->right->parent == node, "Child doesn't have me as a parent");
-	}
+long _rb_refcount(struct rb_node *node) { return node->refcount; }
+void _rb_set_refcount(struct rb_node *node, long refcount) { node->refcount = (int)refcount; }
 
-	_rb_validate_binary_tree(&node->left);
-	_rb_validate_binary_tree(&node->right);
+// Pick the offset first and decode once, so the choice stays a cmov.
+struct rb_node *_rb_child_for_key(struct rb_node *node, long key)
+{
+	return _rb_link(node, (key < node->key) ? node->left : node->right);
 }
 
+#endif
+
 
 
 ///
-/// _rb_validate_num_children
-///
-/// Check that the tree has the right num_children throughout.
+/// _rb_subtree_size
 ///
+/// The number of nodes in the subtree rooted at node, including node itself.
 
-void _rb_validate_num_children(struct rb_node **tree)
+long _rb_subtree_size(struct rb_node *node)
 {
-	struct rb_node *node = *tree;
-	if (!node)
-	{
-		return;
-	}
-
-	if (node->num_children > 0)
-	{
-		if (!(node->num_children == (node->left ? node->left->num_children + 1 : 0) + (node->right ? node->right->num_children + 1 : 0)))
-		{
-			rb_print(tree, 0);
-		}
-		ASSERT(node->num_children == (node->left ? node->left->num_children + 1 : 0) + (node->right ? node->right->num_children + 1 : 0), 
-			   "Child count incorrect");
-	}
-	else
-	{
-		ASSERT(node->left == NULL && node->right == NULL, "num_children == 0 must imply it has no children");
-	}
+	return node ? _rb_num_children(node) + 1 : 0;
 }
 
 
 
+#ifdef RB_AUGMENT
+
 ///
-/// rb_validate
-///
-/// Verifies that the tree follows all the rules and returns the black depth of the tree:
-/// 1. The root is black
-/// 2. If a node is red, both its children are black
-/// 3. Every path from a given node to the leaf nodes contains the same # of black nodes
+/// _rb_aggregate / _rb_augment_update
 ///
+/// Read a subtree's aggregate, where an empty subtree has the identity, and recompute 
+/// a node's from its children. A tree without an augment has nothing to recompute.
 
-long rb_validate(struct rb_node **tree, struct rb_node *node)
+long _rb_aggregate(const struct rb_augment *augment, struct rb_node *node)
 {
-	if (*tree == node)
-	{
-		ASSERT(node == NULL || node->color == rb_black, "Root node must be black");
-
-		_rb_validate_binary_tree(tree);
-		_rb_validate_num_children(tree);
-	}
+	return node ? node->aggregate : augment->identity;
+}
 
-	if (!node)
+void _rb_augment_update(const struct rb_augment *augment, struct rb_node *node)
+{
+	if (augment)
 	{
-		return 0;
+		node->aggregate = augment->combine(augment->combine(_rb_aggregate(augment, _rb_left_child(node)), 
+															  augment->value(node->key, node->data)),
+										   _rb_aggregate(augment, _rb_right_child(node)));
 	}
+}
 
-	if (node->color == rb_red)
-	{
-		ASSERT(node->left == NULL || node->left->color == rb_black, "Left child of a red node must be black");
-		ASSERT(node->right == NULL || node->right->color == rb_black, "Right child of a red node must be black");
-	}
+// A key going in somewhere under node only needs folding in; combine is commutative.
+#define RB_AUGMENT_UPDATE(augment, node) _rb_augment_update(augment, node)
+#define RB_AUGMENT_ADD(augment, node, value) \
+	do { if (augment) (node)->aggregate = (augment)->combine((node)->aggregate, value); } while (0)
 
-	{
-		long left_depth = rb_validate(tree, node->left);
-		long right_depth = rb_validate(tree, node->right);
-//		ASSERT(left_depth == right_depth, "Black depths must match for each node");
+#else
 
-		return left_depth + (node->color == rb_black ? 1 : 0);
-	}
-}
+#define RB_AUGMENT_UPDATE(augment, node) ((void)0)
+#define RB_AUGMENT_ADD(augment, node, value) ((void)0)
+
+#endif
 
 
 
 
+#ifndef RB_COMPACT
 
 ///
-/// _rb_update_num_children
+/// _rb_slab_nodes_alloc / _rb_slab_nodes_free
+///
+/// Get and give back the memory for one slab's worth of nodes.
 ///
-/// Sum the childrens' left and right children to figure out how many children this one has.
 
-void _rb_update_num_children(struct rb_node *node)
+struct rb_node *_rb_slab_nodes_alloc()
 {
-	if (node)
-	{
-		node->num_children = (node->left ? node->left->num_children + 1 : 0) + 
-						 	 (node->right ? node->right->num_children  + 1 : 0);
-	}
+	return (struct rb_node *)malloc(RB_SLAB_NODES * sizeof(struct rb_node));
+}
+
+void _rb_slab_nodes_free(struct rb_node *nodes)
+{
+	free(nodes);
 }
 
+#else
+
+// Address space reserved for compact nodes, shared by every tree. It's only reserved,
+// pages get backed by memory as slabs are first touched.
+#ifndef RB_COMPACT_REGION_NODES
+#define RB_COMPACT_REGION_NODES (1L << 31)
+#endif
+
+struct rb_region
+{
+	struct rb_node *base;
+	long used;						// Nodes handed out to slabs so far.
+	struct rb_node *free_slabs;		// Released slabs, chained through their first node's data.
+	pthread_mutex_t lock;
+};
+
+struct rb_region _rb_region = { NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
 
 
 
 ///
-/// _rb_left_rotate
+/// _rb_slab_nodes_alloc / _rb_slab_nodes_free
+///
+/// Get and give back the memory for one slab's worth of nodes. Compact nodes come out
+/// of the shared region: released slabs first, then fresh ones off the end. Released 
+/// slabs have their pages dropped, but keep their spot in the region.
 ///
-/// Perform a left rotate around node.
-/// Note that this can change what is the root of the tree. If so, that needs
-/// to be updated.
 
-void _rb_left_rotate(struct rb_node **tree, struct rb_node *node)
+struct rb_node *_rb_slab_nodes_alloc()
 {
-	struct rb_node *child;
+	struct rb_node *nodes;
+
+	pthread_mutex_lock(&_rb_region.lock);
 
-	child = node->right;
-	node->right = child->left;
-	if (child->left)
+	if (!_rb_region.base)
 	{
-		child->left->parent = node;
+		void *base = mmap(NULL, RB_COMPACT_REGION_NODES * sizeof(struct rb_node), PROT_READ | PROT_WRITE, 
+						  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		ASSERT(base != MAP_FAILED, "Couldn't reserve the compact node region.");
+		_rb_region.base = (struct rb_node *)base;
 	}
 
-	child->parent = node->parent;
-	if (node->parent)
+	if (_rb_region.free_slabs)
 	{
-		*_rb_parent_child_pointer(node) = child;
+		nodes = _rb_region.free_slabs;
+		_rb_region.free_slabs = (struct rb_node *)nodes->data;
 	}
 	else
 	{
-		*tree = child;
+		ASSERT(_rb_region.used + RB_SLAB_NODES <= RB_COMPACT_REGION_NODES, "Compact node region is full.");
+		nodes = _rb_region.base + _rb_region.used;
+		_rb_region.used += RB_SLAB_NODES;
 	}
 
-	child->left = node;
-	node->parent = child;
+	pthread_mutex_unlock(&_rb_region.lock);
 
-	_rb_update_num_children(node);
-	_rb_update_num_children(child);
-	if (child->parent)
-	{
-		_rb_update_num_children(child->parent);
-	}
+	return nodes;
 }
 
+void _rb_slab_nodes_free(struct rb_node *nodes)
+{
+	madvise(nodes, RB_SLAB_NODES * sizeof(struct rb_node), MADV_DONTNEED);
+
+	pthread_mutex_lock(&_rb_region.lock);
+	nodes->data = _rb_region.free_slabs;
+	_rb_region.free_slabs = nodes;
+	pthread_mutex_unlock(&_rb_region.lock);
+}
+
+#endif
+
 
 
 ///
-/// _rb_right_rotate
+/// _rb_arena_alloc
+///
+/// Hands out a node from the tree's arena. Recycled nodes are used first, otherwise
+/// the next unused node of the newest slab is taken, and a fresh slab is only
+/// allocated when that one is full.
 ///
-/// Perform a right rotate around node.
-/// This is just like the left rotate above, but it's flipped.
 
-void _rb_right_rotate(struct rb_node **tree, struct rb_node *node)
+struct rb_node *_rb_arena_alloc(struct rb_arena *arena)
 {
-	struct rb_node *child;
+	struct rb_node *node = arena->free_list;
+	struct rb_slab *slab;
 
-	child = node->left;
-	node->left = child->right;
-	if (child->right)
+	RB_STAT(allocations);
+	if (node)
 	{
-		child->right->parent = node;
+		arena->free_list = (struct rb_node *)node->data;
+		if (!arena->free_list)
+		{
+			arena->last_free = NULL;
+		}
+		return node;
 	}
 
-	child->parent = node->parent;
-	if (node->parent)
-	{
-		*_rb_parent_child_pointer(node) = child;
-	}
-	else
+	slab = arena->slabs;
+	if (!slab || slab->used == RB_SLAB_NODES)
 	{
-		*tree = child;
+		RB_STAT(slab_allocations);
+		slab = (struct rb_slab *)malloc(sizeof(struct rb_slab));
+		ASSERT(slab != NULL, "Out of memory allocating a slab.");
+		slab->nodes = _rb_slab_nodes_alloc();
+		ASSERT(slab->nodes != NULL, "Out of memory allocating a slab.");
+		slab->next = arena->slabs;
+		slab->used = 0;
+		if (!arena->slabs)
+		{
+			arena->last_slab = slab;
+		}
+		arena->slabs = slab;
 	}
 
-	child->right = node;
-	node->parent = child;
-
-	_rb_update_num_children(node);
-	_rb_update_num_children(child);
-	if (child->parent)
-	{
-		_rb_update_num_children(child->parent);
-	}
+	return &slab->nodes[slab->used++];
 }
 
 
 
-
 ///
-/// _rb_left_child
+/// _rb_arena_free
+///
+/// Puts a node back on the arena's free list so the next allocation can reuse it.
 ///
-/// Just gives the left child.
 
-struct rb_node *_rb_left_child(struct rb_node *node)
+void _rb_arena_free(struct rb_arena *arena, struct rb_node *node)
 {
-	return node->left;
+	if (!arena->free_list)
+	{
+		arena->last_free = node;
+	}
+	node->data = arena->free_list;
+	arena->free_list = node;
 }
 
 
 
-
 ///
-/// _rb_right_child
+/// _rb_arena_release
+///
+/// Frees every slab in the arena at once. Any nodes still in use are gone after this.
 ///
-/// Just gives the right child.
 
-struct rb_node *_rb_right_child(struct rb_node *node)
+void _rb_arena_release(struct rb_arena *arena)
 {
-	return node->right;
-}
-
+	struct rb_slab *slab, *next;
 
+	for (slab = arena->slabs; slab; slab = next)
+	{
+		next = slab->next;
+		_rb_slab_nodes_free(slab->nodes);
+		free(slab);
+	}
 
+	arena->slabs = NULL;
+	arena->free_list = NULL;
+	arena->last_slab = NULL;
+	arena->last_free = NULL;
+}
 
 
 
 /// 
-/// _rb_insert_fixup
+/// _rb_create_node
+///
+/// Just makes a new node given a parent, key and data. Nodes default to red.
+/// The memory comes from the tree's arena.
 ///
-/// After an insert, fix the colors and do rotations as necessary.
-/// NOTE: THIS IS WHERE YOU CAN TURN OFF THE RED-BLACK EASILY
 
-void _rb_insert_fixup(struct rb_node **tree, struct rb_node *node)
+struct rb_node *_rb_create_node(struct rb_tree *tree, struct rb_node *parent, long key, void *data)
 {
-	struct rb_node *parent = node->parent;
-
-	ASSERT(node->color == rb_red, "Fixup can only happen on a red node");
-
-	// Root node -> paint it black
-	if (!parent)
-	{
-		node->color = rb_black;
-		return;
-	}
-
-	// If its parent is black, no problem since no rule violations.
-	if (parent->color == rb_black)
-	{
-		return;
-	}
-	else
-	{
-		struct rb_node *sibling;
-		struct rb_node *grandparent = parent->parent;
-		ASSERT(grandparent != NULL, "Grandparent not found when it should be.");
-
-		// If the parent is red, rotations are required to preserve the red-black rules.
-		sibling = _rb_sibling(parent);
-
-		// If the sibling is not found, its color is black by definition.
-		if (sibling && sibling->color == rb_red) 
-		{
-			sibling->color = rb_black;
-			parent->color = rb_black;				
-			grandparent->color = rb_red;
-
-			_rb_insert_fixup(tree, grandparent);
-		}
-		else 
-		{
+	struct rb_node *node = _rb_arena_alloc(tree->arena);
+	
+	node->key = key;
+	node->data = data;
+	_rb_set_parent(node, parent);
+	_rb_set_left_child(node, NULL);
+	_rb_set_right_child(node, NULL);
+#ifdef RB_COMPACT
+	node->color_children = 0;
+#endif
+	_rb_set_color(node, rb_red);
+	_rb_set_num_children(node, 0);
+#ifdef RB_AUGMENT
+	node->aggregate = tree->augment ? tree->augment->value(key, data) : 0;
+#endif
 
-			// This node is red but the sibling is black (which means it is colored black or NULL). 
-			// Here we need to make sure the node is on the far left or far right of the tree from its
-			// grandparent's perspective. If not, a rotation is needed to get it there.
-			if (parent == grandparent->left && node == parent->right)
-			{
-				_rb_left_rotate(tree, parent);
-				node = node->left;				
-			}
-			else if (parent == grandparent->right && node == parent->left)
-			{
-				_rb_right_rotate(tree, parent);
-				node = node->right;
-			}			
+	return node;
+}
 
-			// Get back the parent and grandparent pointers since they may have changed in the
-			// prior rotation.
-			parent = node->parent;
-			grandparent = parent->parent;
 
-			if (grandparent)
-			{
 
-				// Finally, make the grandparent red, make the parent black and do a rotation to get everything
-				// lined up.
-				grandparent->color = rb_red;
-				parent->color = rb_black;
-				if (node == parent->left)
-				{
-					_rb_right_rotate(tree, grandparent);
-				}
-				else
-				{
-					_rb_left_rotate(tree, grandparent);
-				}
-			}
+///
+/// _rb_find_node
+///
+/// Find a node under the given node, given its key. Return NULL if it's not found.
+///
 
-		}
+struct rb_node *_rb_find_node(struct rb_node *node, long key) 
+{
+	long depth = 0;
 
+	while (node && key != node->key)
+	{
+		depth++;
+		node = _rb_child_for_key(node, key);
 	}
 
-}
-
+	// Counted once at the end: bumping a counter in memory every step halves the speed.
+	RB_STAT(descents);
+	RB_STAT_ADD(comparisons, depth);
 
+	return node;
+}
 
 
 ///
-/// rb_insert
+/// _rb_find_smallest
 ///
-/// Insert a new element into the tree. Uses recursion to traverse down the tree.
+/// Find the smallest node under the given one. Return NULL if it's not found.
 ///
 
-void rb_insert(struct rb_node **tree, struct rb_node **parent, long key, void *data) 
+struct rb_node *_rb_find_smallest(struct rb_node *node)
 {
-	struct rb_node *node = *parent;
-
-	if (!node)
+	while (node && _rb_left_child(node)) 
 	{
-		node = _rb_create_node(NULL, key, data);
-		// The root must be colored black.
-		node->color = rb_black;
-		// Use *parent here since it needs to be saved into the passed-in pointer.
-		*parent = node;
-		return;
+		node = _rb_left_child(node);
 	}
+	return node;
+}
 
-	// Keys must be unique.
-	ASSERT(key != node->key, "ERROR: Key already in tree: %ld", key);
-
-	// Grab a pointer to the correct child depending on whether the key is
-	// less than or greater than this node's key.
-	struct rb_node **child = (key < node->key) ? &(node->left) : &(node->right);
-	if (*child)
-	{
-		// Recursion on the subtree.
-		rb_insert(tree, child, key, data);
-	}
-	else
-	{
-		// Create the node and do the red-black fixup.
-		*child = _rb_create_node(node, key, data);
 
-		// Update the parent nodes with how many children are there.
-		for (node = (*child)->parent; node; node = node->parent)
-		{
-			_rb_update_num_children(node);
-		}
+///
+/// _rb_find_largest
+///
+/// Find the largest node under the given one. Return NULL if it's not found.
+///
 
-		_rb_insert_fixup(tree, *child);
+struct rb_node *_rb_find_largest(struct rb_node *node)
+{
+	while (node && _rb_right_child(node)) 
+	{
+		node = _rb_right_child(node);
 	}
+	return node;
 }
 
 
 
-
 ///
-/// _rb_delete_fixup
+/// _rb_find_ends
+///
+/// Finds the tree's leftmost and rightmost nodes again, after something that moved whole
+/// subtrees at once. Everything else keeps them as it goes.
 ///
-/// Fix the tree after deleting the given node. It is guaranteed that node will have
-/// zero or one children.
 
-void _rb_delete_fixup(struct rb_node **tree, struct rb_node *node)
+void _rb_find_ends(struct rb_tree *tree)
 {
-	struct rb_node *sibling;
-	struct rb_node *(*child)(struct rb_node *);
-	struct rb_node *(*opposite_child)(struct rb_node *);
-	void (*rotate)(struct rb_node **, struct rb_node *);
-	void (*rotate_opposite)(struct rb_node **, struct rb_node *);
+	tree->leftmost = _rb_find_smallest(tree->root);
+	tree->rightmost = _rb_find_largest(tree->root);
+}
 
-	// Keep running until the node being fixed-up is the root, or the node being fixed-up is red.
-	while (node != NULL && node->parent != NULL && node->color != rb_red)
-	{
 
-		// This just sets up the function pointers.
-		if (node == node->parent->left)
-		{
-			sibling = node->parent->right;
-			child = _rb_left_child;
-			opposite_child = _rb_right_child;
-			rotate = _rb_left_rotate;
-			rotate_opposite = _rb_right_rotate;
-		}
-		else
-		{
-			sibling = node->parent->left;
-			child = _rb_right_child;
-			opposite_child = _rb_left_child;
-			rotate = _rb_right_rotate;
-			rotate_opposite = _rb_left_rotate;
-		}
 
+/// 
+/// _rb_clear
+///
+/// Clears a tree or subtree, returning its nodes to the tree's arena. Note that all 
+/// pointers to the passed-in node should be discarded, since it will be freed.
+/// Walks down to a leaf, frees it, and climbs back up through the parent pointer,
+/// so no stack is needed however deep the tree is.
+///
 
-		// This is the actual algorithm.
-		sibling = _rb_sibling(node);
+void _rb_clear(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *top = node;
+	struct rb_node *parent;
 
-		if (sibling && sibling->color == rb_red)
+	while (node)
+	{
+		if (_rb_left_child(node))
 		{
-			sibling->color = rb_black;
-			node->parent->color = rb_red;
-			rotate(tree, node->parent);
-			sibling = _rb_sibling(node);
+			node = _rb_left_child(node);
 		}
-
-		if ((!sibling->left || sibling->left->color == rb_black) && (!sibling->right || sibling->right->color == rb_black))
+		else if (_rb_right_child(node))
 		{
-			sibling->color = rb_red;
-			node = node->parent;
+			node = _rb_right_child(node);
 		}
 		else
 		{
-			if (!opposite_child(sibling) || opposite_child(sibling)->color == rb_black)
+			// A leaf. Unhook it from its parent so the parent becomes a leaf in turn.
+			parent = (node == top) ? NULL : _rb_parent(node);
+			if (parent && _rb_left_child(parent) == node)
 			{
-				child(sibling)->color = rb_black;
-				sibling->color = rb_red;
-				rotate_opposite(tree, sibling);
-				sibling = _rb_sibling(node);
+				_rb_set_left_child(parent, NULL);
 			}
-			sibling->color = node->parent->color;
-			node->parent->color = rb_black;
-			opposite_child(sibling)->color = rb_black;
-			rotate(tree, node->parent);
-			break;
+			else if (parent)
+			{
+				_rb_set_right_child(parent, NULL);
+			}
+			_rb_arena_free(tree->arena, node);
+			node = parent;
 		}
 	}
-
-	node->color = rb_black;
 }
 
 
 
 
+
 ///
-/// rb_delete
+/// _rb_sibling
 ///
-/// Remove an element from the tree.
+/// Return the child of the parent node which does not route to the current node.
+/// Returns NULL if there is no parent.
 ///
 
-void rb_delete(struct rb_node **tree, long key)
+struct rb_node *_rb_sibling(struct rb_node *node)
 {
+	struct rb_node *parent;
 
-	struct rb_node *node = _rb_find_node(*tree, key);
-	struct rb_node *victim, *victims_child;
-
-	ASSERT(node != NULL, "rb_delete called on non-existent key.");
-
-	// Goal configuration: We are deleting an element which has zero or one children, not two.
-	// If the node to delete has two children, find its successor. Call this node the "victim" and copy its
-	// data over the node we wanted to delete. Then delete the victim instead, which is guaranteed
-	// to have zero or one children. 
-	if (node->left == NULL || node->right == NULL)
+	if (!node)
 	{
-		victim = node;
+		return NULL;
 	}
-	else
+
+	parent = _rb_parent(node);
+	if (!parent)
 	{
-		// Find the successor to node.
-		victim = _rb_find_smallest(node->right);
-		node->key = victim->key;
-		node->data = victim->data;
+		return NULL;
 	}
 
+	return (node == _rb_left_child(parent)) ? _rb_right_child(parent) : _rb_left_child(parent);
+}
 
-	if (victim->color == rb_black)
-	{
-		_rb_delete_fixup(tree, victim);
-	}
 
-	// Splice out the victim by repointing its child
-	victims_child = (victim->left == NULL) ? victim->right : victim->left;
-	if (victims_child) 
+
+
+
+///
+/// _rb_replace_child
+///
+/// Points parent at new_child wherever it used to point at old_child. A NULL parent
+/// means old_child was the root.
+/// This assists with rotations and modifications by avoiding a bunch of "? :" syntax.
+///
+
+void _rb_replace_child(struct rb_tree *tree, struct rb_node *parent, struct rb_node *old_child, struct rb_node *new_child)
+{
+	if (!parent)
 	{
-		victims_child->parent = victim->parent;
+		tree->root = new_child;
 	}
-
-	if (victim->parent == NULL)	// victim was the root?
+	else if (_rb_left_child(parent) == old_child)
 	{
-		*tree = victims_child;
-		if (victims_child)
-		{
-			// Root must be black!
-			victims_child->color = rb_black;		
-		}
+		_rb_set_left_child(parent, new_child);
 	}
 	else
 	{
-		*_rb_parent_child_pointer(victim) = victims_child;
-
-		// Update the number of children for all the parents.
-		for (node = victim->parent; node; node = node->parent)
-		{
-			_rb_update_num_children(node);
-		}		
+		_rb_set_right_child(parent, new_child);
 	}
+}
+
 
-	free(victim);
 
-}
 
 ///
-/// rb_lookup
-/// 
-/// Look up an element in the tree. If it's not found, return NULL.
+/// _rb_release
+///
+/// Drops one reference to a node of a persistent tree. When nothing refers to it any
+/// more it goes back to the arena, taking its references to its children with it.
+/// The caller holds the arena lock.
 ///
 
-void *rb_lookup(struct rb_node **tree, long key) 
+void _rb_release(struct rb_tree *tree, struct rb_node *node)
 {
-	struct rb_node *node = _rb_find_node(*tree, key);
-	return (node != NULL) ? node->data : NULL;
+	struct rb_node *left, *right;
+
+	if (!node)
+	{
+		return;
+	}
+
+	_rb_set_refcount(node, _rb_refcount(node) - 1);
+	if (_rb_refcount(node) == 0)
+	{
+		left = _rb_left_child(node);
+		right = _rb_right_child(node);
+		_rb_arena_free(tree->arena, node);
+		_rb_release(tree, left);
+		_rb_release(tree, right);
+	}
 }
 
 
 
+
 ///
-/// rb_count
-/// 
-/// Returns the number of elements in the tree.
+/// rb_create
+///
+/// Creates a new red-black tree. The resulting pointer is what needs to be 
+/// passed into all the other functions.
 ///
 
-long rb_count(struct rb_node **tree) 
+struct rb_tree *rb_create()
 {
-	struct rb_node *node = *tree;
-	if (!node) 
-	{
-		return 0;
-	}
-	return 1 + rb_count(&node->left) + rb_count(&node->right);
+	struct rb_tree *tree = (struct rb_tree *)malloc(sizeof(struct rb_tree));
+	tree->root = NULL;
+	tree->arena = (struct rb_arena *)malloc(sizeof(struct rb_arena));
+	tree->arena->slabs = NULL;
+	tree->arena->free_list = NULL;
+	tree->arena->last_slab = NULL;
+	tree->arena->last_free = NULL;
+	tree->arena->trees = 1;
+	pthread_mutex_init(&tree->arena->lock, NULL);
+	tree->persistent = 0;
+	tree->multimap = 0;
+	tree->sequence = 0;
+	pthread_mutex_init(&tree->write_lock, NULL);
+	tree->mapped = NULL;
+	tree->finger = NULL;
+	tree->augment = NULL;
+	tree->leftmost = tree->rightmost = NULL;
+	return tree;
 }
 
 
 
+
 ///
-/// rb_maximum_depth
-/// 
-/// Figures out the deepest point in the tree and returns that depth.
+/// rb_destroy
+///
+/// Destroys an rb_tree. Frees all memory associated with it, but leaves
+/// the values of nodes untouched (since they're opaque). All the nodes live in
+/// the tree's slabs, so there is no need to walk the tree to free them. The exception
+/// is a tree whose arena other trees still use, like a persistent tree with snapshots 
+/// around, or one half of an rb_split: it only gives back its own nodes.
 ///
 
-long rb_maximum_depth(struct rb_node **tree)
+void rb_destroy(struct rb_tree *tree)
 {
-	struct rb_node *node = *tree;
+	struct rb_arena *arena = tree->arena;
+	long trees;
 
-	if (node == NULL) 
+	if (tree->mapped)
 	{
-		return 0;
+		_rb_unmap(tree);
 	}
 
-	long left = rb_maximum_depth(&node->left);
-	long right = rb_maximum_depth(&node->right);
+	pthread_mutex_lock(&arena->lock);
+	trees = --arena->trees;
+	if (trees > 0 && tree->persistent)
+	{
+		_rb_release(tree, tree->root);
+	}
+	else if (trees > 0)
+	{
+		_rb_clear(tree, tree->root);
+	}
+	pthread_mutex_unlock(&arena->lock);
 
-	return (left > right) ? left + 1 : right + 1;
+	if (trees == 0)
+	{
+		_rb_arena_release(arena);
+		pthread_mutex_destroy(&arena->lock);
+		free(arena);
+	}
+	pthread_mutex_destroy(&tree->write_lock);
+	free(tree);
 }
 
 
 
-//
-//
-// UNIT TESTS
-// 
-//
 
+///
+/// rb_print
+///
+/// Prints out the contents of the rb tree. Persistent trees show each node's reference 
+/// count where the parent would be.
+///
 
-void TEST_rb_simple()
+void _rb_print_node(struct rb_tree *tree, struct rb_node *node, int indent_level)
 {
-	printf("START TEST_rb_simple\n");
-
-	long i;
-	struct rb_node **tree = rb_create();
-	
-	// Forward inserts.
-	for (i = 0; i < 1000; i++)
+	if (!node)
 	{
-		rb_insert(tree, tree, i, (void *)i);
-		rb_validate(tree, *tree);
+		return;
 	}
 
-	for (i = 0; i < 1000; i++) 
+	for (int i = 0; i < indent_level; i++) {
+		printf("   ");
+	}
+	printf("Key: %ld\tLeft: %ld\tRight: %ld\t", 
+		node->key, _rb_left_child(node) ? _rb_left_child(node)->key : -1, 
+		_rb_right_child(node) ? _rb_right_child(node)->key : -1);
+	if (tree->persistent)
 	{
-		if ((long)rb_lookup(tree, i) != i)
-		{
-			printf("Failed on rb_lookup: %ld\n", i);
-			exit(1);
-		}
+		printf("Refs: %ld\t", _rb_refcount(node));
 	}
-	
-	if (rb_count(tree) != 1000) 
+	else
 	{
-		printf("Failed on rb_count 1000\n");
-		exit(1);
+		printf("Parent: %ld\t", _rb_parent(node) ? _rb_parent(node)->key : -1);
 	}
+	printf("Color: %s\tChildren: %ld\n", _rb_color(node) == rb_red ? "red" : "black", _rb_num_children(node));
+	_rb_print_node(tree, _rb_left_child(node), indent_level + 1);
+	_rb_print_node(tree, _rb_right_child(node), indent_level + 1);
+}
 
-	printf("Maximum depth for forward: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, *tree));
+void rb_print(struct rb_tree *tree)
+{
+	_rb_print_node(tree, tree->root, 0);
+}
 
-	for (i = 0; i < 1000; i++) 
+
+
+
+///
+/// _rb_validate_binary_tree
+///
+/// Checks that the binary tree is valid. That just means each node has a proper left and right child
+/// and parent. Nodes of persistent trees have no parent, they need a positive reference count instead.
+
+void _rb_validate_binary_tree(struct rb_tree *tree, struct rb_node *node)
+{
+	if (!node)
 	{
-		rb_delete(tree, i);
-		rb_validate(tree, *tree);
+		return;
 	}
 
-	if (rb_count(tree) != 0) 
+	if (_rb_left_child(node))
 	{
-		printf("Failed on rb_count 0\n");
-		exit(1);
+		ASSERT(_rb_left_child(node)->key < node->key || (tree->multimap && _rb_left_child(node)->key == node->key), "Wrongly placed child node");
+		ASSERT(tree->persistent || _rb_parent(_rb_left_child(node)) == node, "Child doesn't have me as a parent");
+	}
+
+	if (_rb_right_child(node))
+	{
+		ASSERT(_rb_right_child(node)->key > node->key || (tree->multimap && _rb_right_child(node)->key == node->key), "Wrongly placed child node");
+		ASSERT(tree->persistent || _rb_parent(_rb_right_child(node)) == node, "Child doesn't have me as a parent");
+	}
+
+	ASSERT(!tree->persistent || _rb_refcount(node) > 0, "Node in a persistent tree has no references");
+
+	_rb_validate_binary_tree(tree, _rb_left_child(node));
+	_rb_validate_binary_tree(tree, _rb_right_child(node));
+}
+
+
+
+///
+/// _rb_validate_num_children
+///
+/// Check that the tree has the right num_children throughout.
+///
+
+void _rb_validate_num_children(struct rb_tree *tree, struct rb_node *node)
+{
+	if (!node)
+	{
+		return;
+	}
+
+	if (_rb_num_children(node) > 0)
+	{
+		if (!(_rb_num_children(node) == _rb_subtree_size(_rb_left_child(node)) + _rb_subtree_size(_rb_right_child(node))))
+		{
+			_rb_print_node(tree, node, 0);
+		}
+		ASSERT(_rb_num_children(node) == _rb_subtree_size(_rb_left_child(node)) + _rb_subtree_size(_rb_right_child(node)), 
+			   "Child count incorrect");
+	}
+	else
+	{
+		ASSERT(_rb_left_child(node) == NULL && _rb_right_child(node) == NULL, "num_children == 0 must imply it has no children");
+	}
+}
+
+
+
+///
+/// rb_validate
+///
+/// Verifies that the tree follows all the rules and returns the black depth of the tree:
+/// 1. The root is black
+/// 2. If a node is red, both its children are black
+/// 3. Every path from a given node to the leaf nodes contains the same # of black nodes
+///
+
+long rb_validate(struct rb_tree *tree, struct rb_node *node)
+{
+	if (tree->root == node)
+	{
+		ASSERT(node == NULL || _rb_color(node) == rb_black, "Root node must be black");
+		ASSERT(tree->persistent || (tree->leftmost == _rb_find_smallest(node) && tree->rightmost == _rb_find_largest(node)),
+			   "Cached leftmost or rightmost node is wrong");
+
+		_rb_validate_binary_tree(tree, node);
+		_rb_validate_num_children(tree, node);
+	}
+
+	if (!node)
+	{
+		return 0;
+	}
+
+	if (_rb_color(node) == rb_red)
+	{
+		ASSERT(_rb_left_child(node) == NULL || _rb_color(_rb_left_child(node)) == rb_black, "Left child of a red node must be black");
+		ASSERT(_rb_right_child(node) == NULL || _rb_color(_rb_right_child(node)) == rb_black, "Right child of a red node must be black");
+	}
+
+#ifdef RB_AUGMENT
+	if (tree->augment)
+	{
+		long aggregate = node->aggregate;
+
+		_rb_augment_update(tree->augment, node);
+		ASSERT(node->aggregate == aggregate, "Aggregate incorrect at key %ld", node->key);
+	}
+#endif
+
+	{
+		long left_depth = rb_validate(tree, _rb_left_child(node));
+		long right_depth = rb_validate(tree, _rb_right_child(node));
+		ASSERT(left_depth == right_depth, "Black depths must match for each node");
+
+		return left_depth + (_rb_color(node) == rb_black ? 1 : 0);
+	}
+}
+
+
+
+
+
+///
+/// _rb_update_subtree
+///
+/// Sum the childrens' left and right children to figure out how many children this one has.
+/// With an augment, recompute the node's aggregate from its children's as well.
+
+void _rb_update_subtree(const struct rb_augment *augment, struct rb_node *node)
+{
+	(void)augment;
+	if (node)
+	{
+		RB_STAT(num_children_updates);
+		_rb_set_num_children(node, _rb_subtree_size(_rb_left_child(node)) + _rb_subtree_size(_rb_right_child(node)));
+		RB_AUGMENT_UPDATE(augment, node);
+	}
+}
+
+
+
+
+///
+/// _rb_left_rotate
+///
+/// Perform a left rotate around node.
+/// Note that this can change what is the root of the tree. If so, that needs
+/// to be updated.
+
+void _rb_left_rotate(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *child;
+
+	RB_STAT(rotations);
+	child = _rb_right_child(node);
+	_rb_set_right_child(node, _rb_left_child(child));
+	if (_rb_left_child(child))
+	{
+		_rb_set_parent(_rb_left_child(child), node);
+	}
+
+	_rb_set_parent(child, _rb_parent(node));
+	_rb_replace_child(tree, _rb_parent(node), node, child);
+
+	_rb_set_left_child(child, node);
+	_rb_set_parent(node, child);
+
+	_rb_update_subtree(tree->augment, node);
+	_rb_update_subtree(tree->augment, child);
+	if (_rb_parent(child))
+	{
+		_rb_update_subtree(tree->augment, _rb_parent(child));
+	}
+}
+
+
+
+///
+/// _rb_right_rotate
+///
+/// Perform a right rotate around node.
+/// This is just like the left rotate above, but it's flipped.
+
+void _rb_right_rotate(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *child;
+
+	RB_STAT(rotations);
+	child = _rb_left_child(node);
+	_rb_set_left_child(node, _rb_right_child(child));
+	if (_rb_right_child(child))
+	{
+		_rb_set_parent(_rb_right_child(child), node);
+	}
+
+	_rb_set_parent(child, _rb_parent(node));
+	_rb_replace_child(tree, _rb_parent(node), node, child);
+
+	_rb_set_right_child(child, node);
+	_rb_set_parent(node, child);
+
+	_rb_update_subtree(tree->augment, node);
+	_rb_update_subtree(tree->augment, child);
+	if (_rb_parent(child))
+	{
+		_rb_update_subtree(tree->augment, _rb_parent(child));
+	}
+}
+
+
+
+
+/// 
+/// _rb_insert_fixup
+///
+/// After an insert, fix the colors and do rotations as necessary. Returns 1 if the
+/// tree's black height grew, which only happens when a red root gets painted black.
+/// NOTE: THIS IS WHERE YOU CAN TURN OFF THE RED-BLACK EASILY
+
+int _rb_insert_fixup(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *parent = _rb_parent(node);
+	int grew = 0;
+
+	ASSERT(_rb_color(node) == rb_red, "Fixup can only happen on a red node");
+
+	// If the parent is red, rotations are required to preserve the red-black rules.
+	// Recoloring can push the problem up to the grandparent, so loop until it settles.
+	while (parent && _rb_color(parent) == rb_red)
+	{
+		struct rb_node *sibling;
+		struct rb_node *grandparent = _rb_parent(parent);
+		ASSERT(grandparent != NULL, "Grandparent not found when it should be.");
+
+		RB_STAT(insert_fixup_loops);
+
+		sibling = _rb_sibling(parent);
+
+		// If the sibling is not found, its color is black by definition.
+		if (sibling && _rb_color(sibling) == rb_red) 
+		{
+			_rb_set_color(sibling, rb_black);
+			_rb_set_color(parent, rb_black);				
+			_rb_set_color(grandparent, rb_red);
+
+			node = grandparent;
+			parent = _rb_parent(node);
+		}
+		else 
+		{
+
+			// This node is red but the sibling is black (which means it is colored black or NULL). 
+			// Here we need to make sure the node is on the far left or far right of the tree from its
+			// grandparent's perspective. If not, a rotation is needed to get it there.
+			if (parent == _rb_left_child(grandparent) && node == _rb_right_child(parent))
+			{
+				_rb_left_rotate(tree, parent);
+				node = _rb_left_child(node);				
+			}
+			else if (parent == _rb_right_child(grandparent) && node == _rb_left_child(parent))
+			{
+				_rb_right_rotate(tree, parent);
+				node = _rb_right_child(node);
+			}			
+
+			// Get back the parent and grandparent pointers since they may have changed in the
+			// prior rotation.
+			parent = _rb_parent(node);
+			grandparent = _rb_parent(parent);
+
+			// Finally, make the grandparent red, make the parent black and do a rotation to get everything
+			// lined up.
+			_rb_set_color(grandparent, rb_red);
+			_rb_set_color(parent, rb_black);
+			if (node == _rb_left_child(parent))
+			{
+				_rb_right_rotate(tree, grandparent);
+			}
+			else
+			{
+				_rb_left_rotate(tree, grandparent);
+			}
+			break;
+		}
+	}
+
+	// Root node -> paint it black
+	if (!parent)
+	{
+		grew = (_rb_color(node) == rb_red);
+		_rb_set_color(node, rb_black);
+	}
+
+	return grew;
+}
+
+
+
+
+// The iterators come further down.
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+///
+/// _rb_hint_parent
+///
+/// Finds where key would hang next to hint without searching from the root. That works
+/// when key falls between hint and its in-order neighbour on the key's side: one of the two
+/// always has the free child slot in between. Returns that node with *left set to the side,
+/// or NULL when key lies somewhere else (or is already in the tree).
+///
+
+struct rb_node *_rb_hint_parent(struct rb_node *hint, long key, int *left)
+{
+	struct rb_node *neighbour;
+
+	if (key > hint->key)
+	{
+		neighbour = rb_next(hint);
+		if (neighbour && key >= neighbour->key)
+		{
+			return NULL;
+		}
+
+		// A right subtree means the next node is its leftmost, so its left slot is free.
+		*left = (_rb_right_child(hint) != NULL);
+		return *left ? neighbour : hint;
+	}
+	if (key < hint->key)
+	{
+		neighbour = rb_prev(hint);
+		if (neighbour && key <= neighbour->key)
+		{
+			return NULL;
+		}
+		*left = (_rb_left_child(hint) == NULL);
+		return *left ? hint : neighbour;
+	}
+	return NULL;
+}
+
+
+
+///
+/// _rb_climb
+///
+/// Climbs from hint to the lowest ancestor whose subtree spans key, for a descent to start
+/// from. Going up from a left child the parent is the subtree's upper bound, and from a
+/// right child its lower bound, so only the parents on key's side need a comparison. A key
+/// d places away is usually found about log d levels up; one across the root takes the
+/// whole climb, which is then no dearer than starting at the root.
+///
+
+struct rb_node *_rb_climb(struct rb_node *hint, long key)
+{
+	struct rb_node *node = hint;
+	struct rb_node *parent;
+
+	if (key > hint->key)
+	{
+		// A parent equal to key climbs too, so the descent finds the duplicate.
+		while ((parent = _rb_parent(node)) && (node == _rb_right_child(parent) || parent->key <= key))
+		{
+			node = parent;
+		}
+	}
+	else
+	{
+		while ((parent = _rb_parent(node)) && (node == _rb_left_child(parent) || parent->key >= key))
+		{
+			node = parent;
+		}
+	}
+	return node;
+}
+
+
+
+///
+/// _rb_insert_at
+///
+/// The body of every insert. With parent set the new node hangs straight off it, on the
+/// left if left is set. Otherwise it descends from node, which is the root or the top of a
+/// subtree spanning key, narrowing (lo, hi) down to the keys either side of the new node;
+/// those become the finger's gap for rb_insert.
+///
+/// The new node's ancestors all gain a child. A descent bumps num_children on the way down
+/// and the nodes above where it started get theirs by walking up the parents, which makes
+/// no comparisons and touches the path the last insert just did.
+///
+
+struct rb_node *_rb_insert_at(struct rb_tree *tree, struct rb_node *parent, int left, struct rb_node *node, 
+							  long lo, long hi, long key, void *data)
+{
+	struct rb_node *above = parent ? parent : (node ? _rb_parent(node) : NULL);
+	long depth = 0;
+#ifdef RB_AUGMENT
+	long value = tree->augment ? tree->augment->value(key, data) : 0;
+#endif
+	RB_STAT_TIMER(start);
+
+	ASSERT(!tree->persistent, "rb_insert called on a persistent tree, use rb_persistent_insert.");
+	if (tree->mapped)
+	{
+		_rb_mapped_log_insert(tree, key, data);
+	}
+
+	if (parent)
+	{
+		RB_STAT(hinted_inserts);
+	}
+	else
+	{
+		while (node)
+		{
+			// Keys must be unique, except in a multimap.
+			ASSERT(key != node->key || tree->multimap, "ERROR: Key already in tree: %ld", key);
+
+			_rb_set_num_children(node, _rb_num_children(node) + 1);
+			RB_AUGMENT_ADD(tree->augment, node, value);
+			parent = node;
+			left = (key < node->key);
+			if (left)
+			{
+				hi = node->key;
+			}
+			else
+			{
+				lo = node->key;
+			}
+			node = _rb_child_for_key(node, key);
+			depth++;
+		}
+		RB_STAT(descents);
+		RB_STAT_ADD(comparisons, depth);
+		RB_STAT_ADD(num_children_updates, depth);
+	}
+
+	for (; above; above = _rb_parent(above))
+	{
+		_rb_set_num_children(above, _rb_num_children(above) + 1);
+		RB_AUGMENT_ADD(tree->augment, above, value);
+		RB_STAT(num_children_updates);
+	}
+
+	// Create the node and do the red-black fixup. A new root just gets painted black.
+	node = _rb_create_node(tree, parent, key, data);
+	if (!parent)
+	{
+		tree->root = node;
+	}
+	else if (left)
+	{
+		_rb_set_left_child(parent, node);
+	}
+	else
+	{
+		_rb_set_right_child(parent, node);
+	}
+	_rb_insert_fixup(tree, node);
+
+	// A new leaf is the smallest node only if it hangs left of the old smallest one, and
+	// the largest likewise. Going by where it went rather than its key also holds for 
+	// repeated keys and string trees, whose keys don't order them.
+	if (!parent || (left && parent == tree->leftmost))
+	{
+		tree->leftmost = node;
+	}
+	if (!parent || (!left && parent == tree->rightmost))
+	{
+		tree->rightmost = node;
+	}
+	tree->finger = node;
+	tree->finger_lo = lo;
+	tree->finger_hi = hi;
+	RB_STAT_LATENCY(rb_op_insert, start);
+	return node;
+}
+
+
+
+///
+/// rb_insert_hint
+///
+/// Insert a new element near hint, a node already in the tree, and return the new node.
+/// When key belongs right beside the hint it goes in after one step to a neighbour, O(1)
+/// amortized. Otherwise the search climbs from the hint only as far as it has to (see
+/// _rb_climb) and descends from there, so keys close to the hint are cheap and far ones
+/// cost a little more than a descent from the root. A NULL hint descends from the root.
+///
+
+struct rb_node *rb_insert_hint(struct rb_tree *tree, struct rb_node *hint, long key, void *data)
+{
+	struct rb_node *parent;
+	int left = 0;
+
+	if (!hint)
+	{
+		return _rb_insert_at(tree, NULL, 0, tree->root, LONG_MIN, LONG_MAX, key, data);
+	}
+
+	parent = _rb_hint_parent(hint, key, &left);
+	if (parent)
+	{
+		// Where the gap ends isn't known, so rb_insert won't trust the finger next time.
+		return _rb_insert_at(tree, parent, left, NULL, key, key, key, data);
+	}
+
+	// Starting the bounds at key keeps them to what the descent sees.
+	return _rb_insert_at(tree, NULL, 0, _rb_climb(hint, key), key, key, key, data);
+}
+
+
+
+///
+/// rb_insert
+///
+/// Insert a new element into the tree. The node the last insert added, the finger, is
+/// remembered with the keys either side of it, so when key falls between those it belongs
+/// next to the finger and goes in without a search. Sorted and nearly sorted streams
+/// (events by timestamp, say) mostly land there. Anything else costs two comparisons more
+/// than a plain descent from the root, which walks on down, bumping each ancestor's
+/// num_children on the way so no second pass up the tree is needed.
+///
+/// rb_insert_node returns the new node, a handle for rb_erase_node and rb_set_data.
+///
+
+struct rb_node *rb_insert_node(struct rb_tree *tree, long key, void *data)
+{
+	struct rb_node *finger = tree->finger;
+	struct rb_node *parent;
+	int left = 0;
+
+	if (finger && key > tree->finger_lo && key < tree->finger_hi && (parent = _rb_hint_parent(finger, key, &left)))
+	{
+		if (key > finger->key)
+		{
+			return _rb_insert_at(tree, parent, left, NULL, finger->key, tree->finger_hi, key, data);
+		}
+		return _rb_insert_at(tree, parent, left, NULL, tree->finger_lo, finger->key, key, data);
+	}
+	return _rb_insert_at(tree, NULL, 0, tree->root, LONG_MIN, LONG_MAX, key, data);
+}
+
+void rb_insert(struct rb_tree *tree, long key, void *data)
+{
+	rb_insert_node(tree, key, data);
+}
+
+
+
+
+///
+/// _rb_build_range
+///
+/// Builds a perfectly balanced subtree out of the sorted keys[lo..hi) by making the middle
+/// key the root and recursing on each half. Nodes come out of the arena in pre-order, so a
+/// parent sits right next to its left child in memory. Every level is black except the
+/// deepest one when it's only partly filled: those nodes are colored red, which keeps the
+/// black height the same along every path.
+///
+
+struct rb_node *_rb_build_range(struct rb_tree *tree, struct rb_node *parent, long *keys, void **values, 
+								long lo, long hi, long depth, long red_depth)
+{
+	long mid;
+	struct rb_node *node;
+
+	if (lo >= hi)
+	{
+		return NULL;
+	}
+
+	mid = lo + (hi - lo) / 2;
+	node = _rb_create_node(tree, parent, keys[mid], values ? values[mid] : NULL);
+	_rb_set_color(node, (depth == red_depth) ? rb_red : rb_black);
+	_rb_set_num_children(node, hi - lo - 1);
+	_rb_set_left_child(node, _rb_build_range(tree, node, keys, values, lo, mid, depth + 1, red_depth));
+	_rb_set_right_child(node, _rb_build_range(tree, node, keys, values, mid + 1, hi, depth + 1, red_depth));
+	RB_AUGMENT_UPDATE(tree->augment, node);
+
+	return node;
+}
+
+
+
+///
+/// rb_build_from_sorted / _rb_build_into
+///
+/// Creates a new tree holding the n keys, which must be strictly increasing, in O(n). 
+/// values[i] becomes the data of keys[i]; values may be NULL to leave all the data NULL.
+/// _rb_build_into fills an empty tree the caller made instead, such as one that shares
+/// another tree's arena (see _rb_create_sharing), and returns it.
+///
+
+struct rb_tree *_rb_build_into(struct rb_tree *tree, long *keys, void **values, long n)
+{
+	long i, height = 0;
+
+	for (i = 1; i < n; i++)
+	{
+		ASSERT(keys[i - 1] < keys[i], "rb_build_from_sorted needs strictly increasing keys: %ld, %ld", keys[i - 1], keys[i]);
+	}
+
+	// The deepest level is at floor(log2(n)). If it's full (n + 1 is a power of two) the
+	// whole tree can be black, otherwise that level is colored red.
+	while ((2L << height) <= n)
+	{
+		height++;
+	}
+
+	tree->root = _rb_build_range(tree, NULL, keys, values, 0, n, 0, ((n & (n + 1)) == 0) ? -1 : height);
+	if (tree->root)
+	{
+		_rb_set_color(tree->root, rb_black);
+	}
+	_rb_find_ends(tree);
+
+	return tree;
+}
+
+struct rb_tree *rb_build_from_sorted(long *keys, void **values, long n)
+{
+	return _rb_build_into(rb_create(), keys, values, n);
+}
+
+
+
+// Sorting below this many pairs isn't worth handing to another thread.
+#define RB_PARALLEL_SORT_CUTOFF 65536
+
+struct rb_pair
+{
+	long key;
+	void *data;
+};
+
+struct rb_sort_task
+{
+	struct rb_pair *pairs;
+	struct rb_pair *scratch;
+	long n;
+	long depth;			// How many more times the work may be split across threads.
+};
+
+
+
+///
+/// _rb_radix_sort
+///
+/// LSD radix sort of pairs by key, a byte at a time, bouncing between pairs and scratch.
+/// The sign bit is flipped so negative keys sort first, and passes where every key has
+/// the same byte are skipped, which is most of them for keys in a small range.
+///
+
+void _rb_radix_sort(struct rb_pair *pairs, struct rb_pair *scratch, long n)
+{
+	long counts[256];
+	struct rb_pair *from = pairs, *to = scratch, *swap;
+	long i, shift, total;
+
+	for (shift = 0; shift < 64; shift += 8)
+	{
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < n; i++)
+		{
+			counts[((unsigned long)from[i].key ^ (1UL << 63)) >> shift & 0xff]++;
+		}
+
+		if (n == 0 || counts[((unsigned long)from[0].key ^ (1UL << 63)) >> shift & 0xff] == n)
+		{
+			continue;
+		}
+
+		for (i = 0, total = 0; i < 256; i++)
+		{
+			long count = counts[i];
+			counts[i] = total;
+			total += count;
+		}
+		for (i = 0; i < n; i++)
+		{
+			to[counts[((unsigned long)from[i].key ^ (1UL << 63)) >> shift & 0xff]++] = from[i];
+		}
+
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != pairs)
+	{
+		memcpy(pairs, from, n * sizeof(struct rb_pair));
+	}
+}
+
+
+
+///
+/// _rb_parallel_sort
+///
+/// Merge sort of task->pairs. While depth allows, the left half is sorted on a new thread
+/// while this one sorts the right half, then the halves are merged through the scratch 
+/// buffer. Small or deep enough pieces are radix sorted in place.
+///
+
+void *_rb_parallel_sort(void *arg)
+{
+	struct rb_sort_task *task = (struct rb_sort_task *)arg;
+	struct rb_sort_task left, right;
+	pthread_t thread;
+	long half = task->n / 2;
+	long i, j, k;
+
+	if (task->depth <= 0 || task->n < RB_PARALLEL_SORT_CUTOFF)
+	{
+		_rb_radix_sort(task->pairs, task->scratch, task->n);
+		return NULL;
+	}
+
+	left.pairs = task->pairs;
+	left.scratch = task->scratch;
+	left.n = half;
+	left.depth = task->depth - 1;
+
+	right.pairs = task->pairs + half;
+	right.scratch = task->scratch + half;
+	right.n = task->n - half;
+	right.depth = task->depth - 1;
+
+	if (pthread_create(&thread, NULL, _rb_parallel_sort, &left) == 0)
+	{
+		_rb_parallel_sort(&right);
+		pthread_join(thread, NULL);
+	}
+	else
+	{
+		// No more threads to be had, so do both halves here.
+		_rb_parallel_sort(&left);
+		_rb_parallel_sort(&right);
+	}
+
+	for (i = 0, j = half, k = 0; i < half && j < task->n; k++)
+	{
+		task->scratch[k] = (task->pairs[j].key < task->pairs[i].key) ? task->pairs[j++] : task->pairs[i++];
+	}
+	while (i < half)
+	{
+		task->scratch[k++] = task->pairs[i++];
+	}
+	while (j < task->n)
+	{
+		task->scratch[k++] = task->pairs[j++];
+	}
+	memcpy(task->pairs, task->scratch, task->n * sizeof(struct rb_pair));
+
+	return NULL;
+}
+
+
+
+///
+/// rb_build_from_unsorted
+///
+/// Like rb_build_from_sorted, but the keys can come in any order (they still have to be
+/// unique). The pairs are sorted across all the cores first, then built in O(n).
+///
+
+struct rb_tree *rb_build_from_unsorted(long *keys, void **values, long n)
+{
+	struct rb_pair *pairs = (struct rb_pair *)malloc(n * sizeof(struct rb_pair));
+	struct rb_pair *scratch = (struct rb_pair *)malloc(n * sizeof(struct rb_pair));
+	long *sorted_keys = (long *)malloc(n * sizeof(long));
+	void **sorted_values = (void **)malloc(n * sizeof(void *));
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct rb_sort_task task;
+	struct rb_tree *tree;
+	long i;
+
+	ASSERT(n == 0 || (pairs && scratch && sorted_keys && sorted_values), "Out of memory sorting %ld keys.", n);
+	for (i = 0; i < n; i++)
+	{
+		pairs[i].key = keys[i];
+		pairs[i].data = values ? values[i] : NULL;
+	}
+
+	// Split until there's a piece for every core.
+	task.pairs = pairs;
+	task.scratch = scratch;
+	task.n = n;
+	for (task.depth = 0; (1L << task.depth) < num_cpus; task.depth++);
+	_rb_parallel_sort(&task);
+
+	for (i = 0; i < n; i++)
+	{
+		sorted_keys[i] = pairs[i].key;
+		sorted_values[i] = pairs[i].data;
+	}
+	tree = rb_build_from_sorted(sorted_keys, sorted_values, n);
+
+	free(sorted_values);
+	free(sorted_keys);
+	free(scratch);
+	free(pairs);
+
+	return tree;
+}
+
+
+
+
+///
+/// _rb_delete_fixup
+///
+/// Fix the tree after deleting the given node. It is guaranteed that node will have
+/// zero or one children.
+
+void _rb_delete_fixup(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *sibling;
+	struct rb_node *(*child)(struct rb_node *);
+	struct rb_node *(*opposite_child)(struct rb_node *);
+	void (*rotate)(struct rb_tree *, struct rb_node *);
+	void (*rotate_opposite)(struct rb_tree *, struct rb_node *);
+
+	// Keep running until the node being fixed-up is the root, or the node being fixed-up is red.
+	while (node != NULL && _rb_parent(node) != NULL && _rb_color(node) != rb_red)
+	{
+		RB_STAT(delete_fixup_loops);
+
+		// This just sets up the function pointers.
+		if (node == _rb_left_child(_rb_parent(node)))
+		{
+			sibling = _rb_right_child(_rb_parent(node));
+			child = _rb_left_child;
+			opposite_child = _rb_right_child;
+			rotate = _rb_left_rotate;
+			rotate_opposite = _rb_right_rotate;
+		}
+		else
+		{
+			sibling = _rb_left_child(_rb_parent(node));
+			child = _rb_right_child;
+			opposite_child = _rb_left_child;
+			rotate = _rb_right_rotate;
+			rotate_opposite = _rb_left_rotate;
+		}
+
+
+		// This is the actual algorithm.
+		sibling = _rb_sibling(node);
+
+		if (sibling && _rb_color(sibling) == rb_red)
+		{
+			_rb_set_color(sibling, rb_black);
+			_rb_set_color(_rb_parent(node), rb_red);
+			rotate(tree, _rb_parent(node));
+			sibling = _rb_sibling(node);
+		}
+
+		if ((!_rb_left_child(sibling) || _rb_color(_rb_left_child(sibling)) == rb_black) && (!_rb_right_child(sibling) || _rb_color(_rb_right_child(sibling)) == rb_black))
+		{
+			_rb_set_color(sibling, rb_red);
+			node = _rb_parent(node);
+		}
+		else
+		{
+			if (!opposite_child(sibling) || _rb_color(opposite_child(sibling)) == rb_black)
+			{
+				_rb_set_color(child(sibling), rb_black);
+				_rb_set_color(sibling, rb_red);
+				rotate_opposite(tree, sibling);
+				sibling = _rb_sibling(node);
+			}
+			_rb_set_color(sibling, _rb_color(_rb_parent(node)));
+			_rb_set_color(_rb_parent(node), rb_black);
+			_rb_set_color(opposite_child(sibling), rb_black);
+			rotate(tree, _rb_parent(node));
+			break;
+		}
+	}
+
+	_rb_set_color(node, rb_black);
+}
+
+
+
+
+///
+/// _rb_swap_with_successor
+///
+/// Trades places in the tree between node, which has two children, and its successor:
+/// links, colors and subtree counts. The keys stay in their nodes, so until node is taken
+/// out of its new place the tree is out of order by that one node.
+///
+
+void _rb_swap_with_successor(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *successor = _rb_find_smallest(_rb_right_child(node));
+	struct rb_node *parent = _rb_parent(node);
+	struct rb_node *left = _rb_left_child(node);
+	struct rb_node *right = _rb_right_child(node);
+	struct rb_node *successor_parent = _rb_parent(successor);
+	struct rb_node *successor_right = _rb_right_child(successor);
+	enum rb_color color = _rb_color(node);
+	long num_children = _rb_num_children(node);
+
+	_rb_replace_child(tree, parent, node, successor);
+	_rb_set_parent(successor, parent);
+	_rb_set_left_child(successor, left);
+	_rb_set_parent(left, successor);
+	if (successor == right)
+	{
+		_rb_set_right_child(successor, node);
+		_rb_set_parent(node, successor);
+	}
+	else
+	{
+		_rb_set_right_child(successor, right);
+		_rb_set_parent(right, successor);
+		_rb_set_left_child(successor_parent, node);
+		_rb_set_parent(node, successor_parent);
+	}
+
+	_rb_set_left_child(node, NULL);
+	_rb_set_right_child(node, successor_right);
+	if (successor_right)
+	{
+		_rb_set_parent(successor_right, node);
+	}
+
+	_rb_set_color(node, _rb_color(successor));
+	_rb_set_color(successor, color);
+	_rb_set_num_children(node, _rb_num_children(successor));
+	_rb_set_num_children(successor, num_children);
+#ifdef RB_AUGMENT
+	successor->aggregate = node->aggregate;
+#endif
+}
+
+
+
+///
+/// rb_erase_node
+///
+/// Remove a node from the tree given the node itself, as rb_insert_node or rb_insert_hint
+/// returned it, so there's no search. A node with two children trades places with its
+/// successor first instead of taking over the successor's key and data, so every node
+/// keeps its key and data for as long as it's in the tree. That makes a node a handle
+/// for its key: good until the key is deleted (rb_delete works the same way after its
+/// search), through rb_split and rb_join too, which only relink nodes.
+///
+
+void _rb_erase_node(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *child, *parent;
+
+	// The finger's gap is still empty with another node gone, just not if the finger goes.
+	if (tree->finger == node)
+	{
+		tree->finger = NULL;
+	}
+	if (tree->leftmost == node)
+	{
+		tree->leftmost = rb_next(node);
+	}
+	if (tree->rightmost == node)
+	{
+		tree->rightmost = rb_prev(node);
+	}
+
+	// Goal configuration: the node being taken out has zero or one children, not two.
+	if (_rb_left_child(node) != NULL && _rb_right_child(node) != NULL)
+	{
+		_rb_swap_with_successor(tree, node);
+	}
+
+	if (_rb_color(node) == rb_black)
+	{
+		_rb_delete_fixup(tree, node);
+	}
+
+	// Splice out the node by repointing its child
+	child = (_rb_left_child(node) == NULL) ? _rb_right_child(node) : _rb_left_child(node);
+	parent = _rb_parent(node);
+	if (child) 
+	{
+		_rb_set_parent(child, parent);
+	}
+
+	_rb_replace_child(tree, parent, node, child);
+	if (parent == NULL)	// node was the root?
+	{
+		if (child)
+		{
+			// Root must be black!
+			_rb_set_color(child, rb_black);		
+		}
+	}
+	else
+	{
+		// Update the number of children for all the parents.
+		for (; parent; parent = _rb_parent(parent))
+		{
+			_rb_update_subtree(tree->augment, parent);
+		}		
+	}
+
+	_rb_arena_free(tree->arena, node);
+}
+
+void rb_erase_node(struct rb_tree *tree, struct rb_node *node)
+{
+	RB_STAT_TIMER(start);
+
+	ASSERT(!tree->persistent, "rb_erase_node called on a persistent tree, use rb_persistent_delete.");
+	if (tree->mapped)
+	{
+		_rb_mapped_delete(tree, node->key);
+	}
+	_rb_erase_node(tree, node);
+	RB_STAT_LATENCY(rb_op_delete, start);
+}
+
+
+
+///
+/// rb_delete
+///
+/// Remove an element from the tree.
+///
+
+void rb_delete(struct rb_tree *tree, long key)
+{
+	RB_STAT_TIMER(start);
+	struct rb_node *node;
+
+	if (tree->mapped && _rb_mapped_delete(tree, key))
+	{
+		RB_STAT_LATENCY(rb_op_delete, start);
+		return;
+	}
+	ASSERT(!tree->persistent, "rb_delete called on a persistent tree, use rb_persistent_delete.");
+
+	node = _rb_find_node(tree->root, key);
+	ASSERT(node != NULL, "rb_delete called on non-existent key.");
+	_rb_erase_node(tree, node);
+	RB_STAT_LATENCY(rb_op_delete, start);
+}
+
+
+
+///
+/// rb_set_data
+///
+/// Changes the data of a node in place, given the node. Aggregates above it are updated
+/// (see rb_set_augment), and a mapped tree logs the change.
+///
+
+void rb_set_data(struct rb_tree *tree, struct rb_node *node, void *data)
+{
+	ASSERT(!tree->persistent, "rb_set_data called on a persistent tree.");
+	if (tree->mapped)
+	{
+		_rb_mapped_set_data(tree, node->key, data);
+	}
+
+	node->data = data;
+#ifdef RB_AUGMENT
+	for (; tree->augment && node; node = _rb_parent(node))
+	{
+		_rb_augment_update(tree->augment, node);
+	}
+#endif
+}
+
+
+
+
+///
+/// rb_insert_or_get / rb_upsert
+///
+/// One descent for what would otherwise be rb_lookup and then rb_insert. rb_insert_or_get
+/// returns the node already holding key, untouched, or inserts one with data and returns
+/// that; *inserted (if not NULL) says which. rb_upsert inserts key or sets its data with
+/// rb_set_data, and returns the node either way.
+///
+/// The descent doesn't bump subtree counts on the way down like rb_insert's does, since
+/// the key may turn out to be there. A new key goes in below the last node visited like a
+/// hinted insert, which walks back up the same path while it's still in the cache. Before 
+/// all that, a key that's the finger's gets the finger, and one in the finger's empty gap
+/// (see rb_insert) goes straight in. Repeated keys, like a counter bumped over and over,
+/// take no descent at all. In a multimap the node is one of those with key.
+///
+
+struct rb_node *rb_insert_or_get(struct rb_tree *tree, long key, void *data, int *inserted)
+{
+	struct rb_node *node = tree->root;
+	struct rb_node *parent = NULL;
+	long lo = LONG_MIN, hi = LONG_MAX, depth = 0;
+	int left = 0, dummy;
+
+	ASSERT(!tree->persistent, "rb_insert_or_get called on a persistent tree.");
+	ASSERT(!tree->mapped, "rb_insert_or_get doesn't see the saved keys of a mapped tree.");
+	inserted = inserted ? inserted : &dummy;
+
+	if (tree->finger && key > tree->finger_lo && key < tree->finger_hi)
+	{
+		*inserted = (key != tree->finger->key);
+		return *inserted ? rb_insert_node(tree, key, data) : tree->finger;
+	}
+
+	while (node && key != node->key)
+	{
+		parent = node;
+		left = (key < node->key);
+		if (left)
+		{
+			hi = node->key;
+		}
+		else
+		{
+			lo = node->key;
+		}
+		node = _rb_child_for_key(node, key);
+		depth++;
+	}
+	RB_STAT(descents);
+	RB_STAT_ADD(comparisons, depth);
+
+	*inserted = (node == NULL);
+	return node ? node : _rb_insert_at(tree, parent, left, NULL, lo, hi, key, data);
+}
+
+struct rb_node *rb_upsert(struct rb_tree *tree, long key, void *data)
+{
+	int inserted;
+	struct rb_node *node = rb_insert_or_get(tree, key, data, &inserted);
+
+	if (!inserted)
+	{
+		rb_set_data(tree, node, data);
+	}
+	return node;
+}
+
+
+
+///
+/// rb_create_multimap
+///
+/// Creates an empty tree that takes the same key more than once. A key that's already
+/// there goes in after the others, since the descent takes the right branch on equal 
+/// keys, and rotations keep that order, so rb_lower_bound and rb_next walk a key's 
+/// entries in the order they went in. rb_lookup and rb_delete find one of them, not
+/// necessarily the first; rb_erase_node takes out a particular one. Splitting, range
+/// deletes, set operations and rb_save need unique keys and don't take multimaps.
+///
+
+struct rb_tree *rb_create_multimap()
+{
+	struct rb_tree *tree = rb_create();
+	tree->multimap = 1;
+	return tree;
+}
+
+
+
+
+///
+/// rb_peek_min / rb_peek_max
+///
+/// The node with the smallest or largest key, or NULL if the tree is empty, in O(1): the
+/// tree keeps both ends. Inserts compare against them, erasing one moves it to its 
+/// neighbour, and rotations never change which nodes they are. Persistent trees share 
+/// nodes among versions and don't keep them, so those go and look.
+///
+
+struct rb_node *rb_peek_min(struct rb_tree *tree)
+{
+	ASSERT(!tree->mapped, "rb_peek_min doesn't see the saved keys of a mapped tree.");
+	return tree->persistent ? _rb_find_smallest(tree->root) : tree->leftmost;
+}
+
+struct rb_node *rb_peek_max(struct rb_tree *tree)
+{
+	ASSERT(!tree->mapped, "rb_peek_max doesn't see the saved keys of a mapped tree.");
+	return tree->persistent ? _rb_find_largest(tree->root) : tree->rightmost;
+}
+
+
+
+///
+/// rb_pop_min / rb_pop_max
+///
+/// Takes the smallest or largest key out of the tree and returns 1 with it and its data
+/// in *key and *data, or 0 if the tree is empty. The node at the end comes out by handle,
+/// without a search, and has no child on the outside, so it never trades places with a
+/// successor. A deadline queue pops from where it last popped, so the nodes on the walk
+/// up fixing subtree counts are still in the cache.
+///
+
+int _rb_pop(struct rb_tree *tree, struct rb_node *node, long *key, void **data)
+{
+	if (!node)
+	{
+		return 0;
+	}
+	*key = node->key;
+	*data = node->data;
+	rb_erase_node(tree, node);
+	return 1;
+}
+
+int rb_pop_min(struct rb_tree *tree, long *key, void **data)
+{
+	return _rb_pop(tree, rb_peek_min(tree), key, data);
+}
+
+int rb_pop_max(struct rb_tree *tree, long *key, void **data)
+{
+	return _rb_pop(tree, rb_peek_max(tree), key, data);
+}
+
+///
+/// rb_lookup
+/// 
+/// Look up an element in the tree. If it's not found, return NULL.
+///
+
+void *rb_lookup(struct rb_tree *tree, long key) 
+{
+	RB_STAT_TIMER(start);
+	struct rb_node *node = _rb_find_node(tree->root, key);
+	void *data = (node != NULL) ? node->data : NULL;
+
+	if (!node && tree->mapped)
+	{
+		data = _rb_mapped_lookup(tree, key);
+	}
+	RB_STAT_LATENCY(rb_op_lookup, start);
+	return data;
+}
+
+
+
+// How many descents rb_lookup_batch keeps going at once.
+#define RB_BATCH_LANES 16
+
+///
+/// rb_lookup_batch
+///
+/// Looks up keys[0..n) and stores what rb_lookup would return for each in out. A single
+/// lookup in a tree bigger than the caches waits on one miss per level, and each waits for
+/// the last. Here RB_BATCH_LANES descents take turns: each moves one level, prefetches its
+/// next node and hands over to the next, so by the time it comes round again the node has
+/// usually arrived, and the misses of all the lanes overlap. A lane that finishes picks up
+/// the next key straight away rather than waiting for the others.
+///
+
+void rb_lookup_batch(struct rb_tree *tree, const long *keys, long n, void **out)
+{
+	struct rb_node *nodes[RB_BATCH_LANES];
+	long indexes[RB_BATCH_LANES];
+	long next = 0, lanes, active, depth = 0, i;
+	struct rb_node *node;
+
+	for (lanes = 0; lanes < RB_BATCH_LANES && next < n; lanes++)
+	{
+		nodes[lanes] = tree->root;
+		indexes[lanes] = next++;
+	}
+
+	for (active = lanes; active > 0; )
+	{
+		for (i = 0; i < lanes; i++)
+		{
+			if (indexes[i] < 0)
+			{
+				continue;
+			}
+
+			node = nodes[i];
+			if (node && node->key != keys[indexes[i]])
+			{
+				node = _rb_child_for_key(node, keys[indexes[i]]);
+				__builtin_prefetch(node);
+				nodes[i] = node;
+				depth++;
+				continue;
+			}
+
+			if (node)
+			{
+				out[indexes[i]] = node->data;
+			}
+			else
+			{
+				out[indexes[i]] = tree->mapped ? _rb_mapped_lookup(tree, keys[indexes[i]]) : NULL;
+			}
+
+			if (next < n)
+			{
+				nodes[i] = tree->root;
+				indexes[i] = next++;
+			}
+			else
+			{
+				indexes[i] = -1;
+				active--;
+			}
+		}
+	}
+	RB_STAT_ADD(descents, n);
+	RB_STAT_ADD(comparisons, depth);
+}
+
+
+
+///
+/// rb_count
+/// 
+/// Returns the number of elements in the tree. The root already knows how many
+/// nodes hang under it, so this is O(1).
+///
+
+long rb_count(struct rb_tree *tree) 
+{
+	return _rb_subtree_size(tree->root) + (tree->mapped ? _rb_mapped_count(tree) : 0);
+}
+
+
+
+///
+/// rb_select
+///
+/// Returns the node holding the k-th smallest key (zero based), or NULL if k is out of
+/// range. Uses the subtree sizes to steer the descent, so it's O(log n).
+///
+
+struct rb_node *rb_select(struct rb_tree *tree, long k)
+{
+	struct rb_node *node = tree->root;
+
+	ASSERT(!tree->mapped, "rb_select doesn't work on a tree opened with rb_map.");
+
+	while (node)
+	{
+		long left_size = _rb_subtree_size(_rb_left_child(node));
+
+		if (k < left_size)
+		{
+			node = _rb_left_child(node);
+		}
+		else if (k > left_size)
+		{
+			k -= left_size + 1;
+			node = _rb_right_child(node);
+		}
+		else
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+///
+/// rb_rank
+///
+/// Returns how many keys in the tree are strictly smaller than key. The key itself
+/// doesn't have to be in the tree.
+///
+
+long rb_rank(struct rb_tree *tree, long key)
+{
+	struct rb_node *node = tree->root;
+	long rank = 0;
+
+	ASSERT(!tree->mapped, "rb_rank doesn't work on a tree opened with rb_map.");
+
+	while (node)
+	{
+		if (key <= node->key)
+		{
+			node = _rb_left_child(node);
+		}
+		else
+		{
+			rank += _rb_subtree_size(_rb_left_child(node)) + 1;
+			node = _rb_right_child(node);
+		}
+	}
+
+	return rank;
+}
+
+
+
+///
+/// rb_count_range
+///
+/// Returns how many keys k in the tree satisfy lo <= k <= hi.
+///
+
+long rb_count_range(struct rb_tree *tree, long lo, long hi)
+{
+	struct rb_node *node = tree->root;
+	long at_most_hi = 0;
+
+	if (lo > hi)
+	{
+		return 0;
+	}
+
+	// Same walk as rb_rank, but counting keys <= hi so hi == LONG_MAX is fine.
+	while (node)
+	{
+		if (hi < node->key)
+		{
+			node = _rb_left_child(node);
+		}
+		else
+		{
+			at_most_hi += _rb_subtree_size(_rb_left_child(node)) + 1;
+			node = _rb_right_child(node);
+		}
+	}
+
+	return at_most_hi - rb_rank(tree, lo);
+}
+
+
+
+///
+/// rb_maximum_depth
+/// 
+/// Figures out the deepest point in the tree and returns that depth.
+/// Walks the whole tree with the parent pointers instead of recursing, tracking
+/// where it came from to know which way to go next. Persistent trees have no parent
+/// pointers, so those recurse; the depth is bounded by RB_MAX_DEPTH anyway.
+///
+
+long _rb_subtree_depth(struct rb_node *node)
+{
+	long left, right;
+
+	if (!node)
+	{
+		return 0;
+	}
+
+	left = _rb_subtree_depth(_rb_left_child(node));
+	right = _rb_subtree_depth(_rb_right_child(node));
+	return 1 + (left > right ? left : right);
+}
+
+long rb_maximum_depth(struct rb_tree *tree)
+{
+	struct rb_node *node = tree->root;
+	struct rb_node *prev = NULL;
+	struct rb_node *next;
+	long depth = 0, maximum = 0;
+
+	if (tree->persistent)
+	{
+		return _rb_subtree_depth(tree->root);
+	}
+
+	while (node)
+	{
+		if (prev == _rb_parent(node))
+		{
+			// Arrived from above.
+			depth++;
+			if (depth > maximum)
+			{
+				maximum = depth;
+			}
+			next = _rb_left_child(node) ? _rb_left_child(node) : (_rb_right_child(node) ? _rb_right_child(node) : _rb_parent(node));
+		}
+		else if (prev == _rb_left_child(node) && _rb_right_child(node))
+		{
+			// Done with the left subtree.
+			next = _rb_right_child(node);
+		}
+		else
+		{
+			// Done with both subtrees.
+			next = _rb_parent(node);
+		}
+
+		if (next == _rb_parent(node))
+		{
+			depth--;
+		}
+		prev = node;
+		node = next;
+	}
+
+	return maximum;
+}
+
+
+
+///
+/// rb_first / rb_last
+///
+/// The nodes with the smallest and largest keys, or NULL for an empty tree. Together
+/// with rb_next and rb_prev these make a cursor that needs no stack: it just follows
+/// the parent pointers. That also means the cursor doesn't work on persistent trees;
+/// use rb_range_scan on those.
+///
+
+struct rb_node *rb_first(struct rb_tree *tree)
+{
+	return _rb_find_smallest(tree->root);
+}
+
+struct rb_node *rb_last(struct rb_tree *tree)
+{
+	return _rb_find_largest(tree->root);
+}
+
+
+
+///
+/// rb_next
+///
+/// The in-order successor of node, or NULL if node is the last one. Either the leftmost
+/// node of the right subtree, or the first ancestor we reach from its left side.
+/// O(1) amortized over a full walk.
+///
+
+struct rb_node *rb_next(struct rb_node *node)
+{
+	if (_rb_right_child(node))
+	{
+		return _rb_find_smallest(_rb_right_child(node));
+	}
+
+	while (_rb_parent(node) && node == _rb_right_child(_rb_parent(node)))
+	{
+		node = _rb_parent(node);
+	}
+	return _rb_parent(node);
+}
+
+
+
+///
+/// rb_prev
+///
+/// The in-order predecessor of node, or NULL if node is the first one. Mirror of rb_next.
+///
+
+struct rb_node *rb_prev(struct rb_node *node)
+{
+	if (_rb_left_child(node))
+	{
+		return _rb_find_largest(_rb_left_child(node));
+	}
+
+	while (_rb_parent(node) && node == _rb_left_child(_rb_parent(node)))
+	{
+		node = _rb_parent(node);
+	}
+	return _rb_parent(node);
+}
+
+
+
+///
+/// rb_lower_bound
+///
+/// The first node whose key is >= key, or NULL if every key is smaller.
+///
+
+struct rb_node *rb_lower_bound(struct rb_tree *tree, long key)
+{
+	struct rb_node *node = tree->root;
+	struct rb_node *bound = NULL;
+
+	while (node)
+	{
+		if (node->key >= key)
+		{
+			bound = node;
+			node = _rb_left_child(node);
+		}
+		else
+		{
+			node = _rb_right_child(node);
+		}
+	}
+
+	return bound;
+}
+
+
+
+///
+/// _rb_stack_range_scan
+///
+/// rb_range_scan for persistent trees, which have no parent pointers to climb. The 
+/// ancestors still to be visited are kept on a stack instead, smallest on top.
+///
+
+long _rb_stack_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(struct rb_node *node, void *context), void *context)
+{
+	struct rb_node *stack[RB_MAX_DEPTH];
+	struct rb_node *node = tree->root;
+	long depth = 0, visited = 0;
+
+	// Every node >= lo on the way down to lo comes later in the scan.
+	while (node)
+	{
+		if (node->key >= lo)
+		{
+			stack[depth++] = node;
+			node = _rb_left_child(node);
+		}
+		else
+		{
+			node = _rb_right_child(node);
+		}
+	}
+
+	while (depth > 0)
+	{
+		node = stack[--depth];
+		if (node->key > hi)
+		{
+			break;
+		}
+
+		visited++;
+		if (callback(node, context))
+		{
+			break;
+		}
+
+		for (node = _rb_right_child(node); node; node = _rb_left_child(node))
+		{
+			stack[depth++] = node;
+		}
+	}
+
+	return visited;
+}
+
+
+
+///
+/// rb_range_scan
+///
+/// Calls callback on every node with lo <= key <= hi, in increasing key order. One descent
+/// to find the start, then rb_next for the rest, so it's O(log n + k) for k results.
+/// The callback can return nonzero to stop the scan early. Returns how many nodes
+/// were visited.
+///
+
+long rb_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(struct rb_node *node, void *context), void *context)
+{
+	struct rb_node *node;
+	long visited = 0;
+
+	if (tree->persistent)
+	{
+		return _rb_stack_range_scan(tree, lo, hi, callback, context);
+	}
+	if (tree->mapped)
+	{
+		return _rb_mapped_range_scan(tree, lo, hi, callback, context);
+	}
+
+	for (node = rb_lower_bound(tree, lo); node && node->key <= hi; node = rb_next(node))
+	{
+		visited++;
+		if (callback(node, context))
+		{
+			break;
+		}
+	}
+
+	return visited;
+}
+
+
+
+
+//
+// Concurrent access
+//
+// Any number of threads can read a tree with rb_concurrent_lookup and rb_concurrent_range_scan
+// while writers serialize on rb_write_lock. Readers never lock or write shared memory; they 
+// read the tree optimistically and check the tree's sequence number afterwards, retrying 
+// if a write overlapped. That's safe without any deferred freeing because deleted nodes only
+// go back to the arena's free list: their memory stays a valid node until rb_destroy. A 
+// reader that races with a write can see nonsense, but never touches freed memory, and 
+// the sequence check throws the nonsense away.
+//
+
+// How many results a concurrent range scan reads between checks of the sequence number.
+#define RB_SCAN_CHUNK 64
+
+
+
+///
+/// rb_write_lock / rb_write_unlock
+///
+/// Bracket any modification of a tree that concurrent readers may be looking at.
+/// The sequence number is odd from lock to unlock.
+///
+
+void _rb_write_begin(struct rb_tree *tree)
+{
+	__atomic_store_n(&tree->sequence, tree->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void rb_write_lock(struct rb_tree *tree)
+{
+	pthread_mutex_lock(&tree->write_lock);
+	_rb_write_begin(tree);
+}
+
+void rb_write_unlock(struct rb_tree *tree)
+{
+	__atomic_store_n(&tree->sequence, tree->sequence + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tree->write_lock);
+}
+
+
+
+///
+/// rb_concurrent_insert / rb_concurrent_delete
+///
+/// rb_insert and rb_delete under the write lock.
+///
+
+void rb_concurrent_insert(struct rb_tree *tree, long key, void *data)
+{
+	rb_write_lock(tree);
+	rb_insert(tree, key, data);
+	rb_write_unlock(tree);
+}
+
+void rb_concurrent_delete(struct rb_tree *tree, long key)
+{
+	rb_write_lock(tree);
+	rb_delete(tree, key);
+	rb_write_unlock(tree);
+}
+
+
+
+///
+/// _rb_read_begin / _rb_read_retry
+///
+/// The reader side of the sequence lock. _rb_read_begin waits out any write in progress
+/// and returns the sequence to check against; _rb_read_retry says whether a write 
+/// happened since, in which case whatever was read must be thrown away.
+///
+
+unsigned long _rb_read_begin(struct rb_tree *tree)
+{
+	unsigned long sequence;
+
+	while ((sequence = __atomic_load_n(&tree->sequence, __ATOMIC_ACQUIRE)) & 1)
+	{
+		sched_yield();
+	}
+	return sequence;
+}
+
+int _rb_read_retry(struct rb_tree *tree, unsigned long sequence)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&tree->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+
+
+///
+/// rb_concurrent_lookup
+///
+/// rb_lookup that's safe to call while another thread holds the write lock.
+///
+
+void *rb_concurrent_lookup(struct rb_tree *tree, long key)
+{
+	unsigned long sequence;
+	struct rb_node *node;
+	void *data;
+	long depth;
+
+	ASSERT(!tree->mapped, "rb_concurrent_lookup doesn't work on a tree opened with rb_map.");
+
+	do
+	{
+		sequence = _rb_read_begin(tree);
+
+		// A descent deeper than any real tree means we raced with a rotation and are going in circles.
+		node = tree->root;
+		for (depth = 0; node && key != node->key && depth < RB_MAX_DEPTH; depth++)
+		{
+			node = _rb_child_for_key(node, key);
+		}
+		data = (node && key == node->key) ? node->data : NULL;
+	}
+	while (_rb_read_retry(tree, sequence));
+
+	return data;
+}
+
+
+
+///
+/// rb_concurrent_range_scan
+///
+/// rb_range_scan that's safe to call while another thread holds the write lock. Results are
+/// copied out RB_SCAN_CHUNK at a time and only handed to the callback once the chunk is known
+/// to be consistent, so the callback gets a key and data rather than a node. Each chunk is a
+/// consistent view, but writes can land between chunks. A chunk picks up after the last
+/// key of the one before, so multimaps, whose entries for a key could straddle two chunks,
+/// are refused.
+///
+
+long rb_concurrent_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(long key, void *data, void *context), void *context)
+{
+	struct rb_pair chunk[RB_SCAN_CHUNK];
+	unsigned long sequence;
+	struct rb_node *node, *bound, *next;
+	long visited = 0;
+	long count, i, budget;
+
+	ASSERT(!tree->mapped, "rb_concurrent_range_scan doesn't work on a tree opened with rb_map.");
+	ASSERT(!tree->persistent, "rb_concurrent_range_scan doesn't work on a persistent tree.");
+	ASSERT(!tree->multimap, "rb_concurrent_range_scan needs unique keys, not a multimap.");
+
+	while (lo <= hi)
+	{
+		do
+		{
+			sequence = _rb_read_begin(tree);
+
+			// Same as rb_lower_bound followed by rb_next, but giving up if it takes far more
+			// steps than any real tree could need.
+			budget = (RB_SCAN_CHUNK + 1) * RB_MAX_DEPTH;
+			for (bound = NULL, node = tree->root; node && budget > 0; budget--)
+			{
+				if (node->key >= lo)
+				{
+					bound = node;
+					node = _rb_left_child(node);
+				}
+				else
+				{
+					node = _rb_right_child(node);
+				}
+			}
+
+			for (count = 0, node = bound; node && node->key <= hi && count < RB_SCAN_CHUNK && budget > 0; count++)
+			{
+				chunk[count].key = node->key;
+				chunk[count].data = node->data;
+
+				// Each link is read once: a writer can clear it between two reads.
+				next = _rb_right_child(node);
+				if (next)
+				{
+					for (node = next; (next = _rb_left_child(node)) && budget > 0; budget--)
+					{
+						node = next;
+					}
+				}
+				else
+				{
+					for (next = _rb_parent(node); next && node == _rb_right_child(next) && budget > 0; budget--)
+					{
+						node = next;
+						next = _rb_parent(node);
+					}
+					node = next;
+				}
+			}
+		}
+		while (_rb_read_retry(tree, sequence));
+
+		for (i = 0; i < count; i++)
+		{
+			visited++;
+			if (callback(chunk[i].key, chunk[i].data, context))
+			{
+				return visited;
+			}
+		}
+
+		// A short chunk means the end of the range or the tree was reached.
+		if (count < RB_SCAN_CHUNK || chunk[count - 1].key == hi)
+		{
+			break;
+		}
+		lo = chunk[count - 1].key + 1;
+	}
+
+	return visited;
+}
+
+
+
+
+//
+// Persistent trees
+//
+// A persistent tree never changes a node that another tree can see. rb_snapshot makes a
+// new tree sharing the whole node structure, which is O(1): it just takes another reference
+// to the root. After that, rb_persistent_insert and rb_persistent_delete copy the nodes on
+// their path that are shared, O(log n) of them, and change the copies instead. Nodes only
+// one tree refers to are changed in place, so a tree with no snapshots pays little more
+// than the usual insert. Each node counts the parents (or trees, for a root) pointing at
+// it, in place of a parent pointer, and goes back to the arena when the last one lets go.
+//
+// Snapshots are read with the normal rb_lookup, rb_range_scan, rb_select and friends; 
+// only the rb_next/rb_prev cursor needs parent pointers. A snapshot can be read from one
+// thread while another thread keeps changing the tree it was taken from, since nothing 
+// it can reach gets written. Writes, snapshots and rb_destroy all take the arena lock,
+// so those can come from any thread.
+//
+
+
+
+///
+/// rb_create_persistent
+///
+/// Creates an empty tree that supports rb_snapshot.
+///
+
+struct rb_tree *rb_create_persistent()
+{
+	struct rb_tree *tree = rb_create();
+	tree->persistent = 1;
+	return tree;
+}
+
+
+
+///
+/// rb_snapshot
+///
+/// Returns a new tree with the same contents as the persistent tree passed in. Both can
+/// be changed independently afterwards, and both need rb_destroy.
+///
+
+struct rb_tree *rb_snapshot(struct rb_tree *tree)
+{
+	struct rb_tree *snapshot = (struct rb_tree *)malloc(sizeof(struct rb_tree));
+
+	ASSERT(tree->persistent, "rb_snapshot needs a tree made by rb_create_persistent.");
+
+	pthread_mutex_lock(&tree->arena->lock);
+	snapshot->root = tree->root;
+	if (snapshot->root)
+	{
+		_rb_set_refcount(snapshot->root, _rb_refcount(snapshot->root) + 1);
+	}
+	snapshot->arena = tree->arena;
+	snapshot->arena->trees++;
+	pthread_mutex_unlock(&tree->arena->lock);
+
+	snapshot->persistent = 1;
+	snapshot->multimap = 0;
+	snapshot->sequence = 0;
+	pthread_mutex_init(&snapshot->write_lock, NULL);
+	snapshot->mapped = NULL;
+	snapshot->finger = NULL;
+	snapshot->augment = NULL;
+	snapshot->leftmost = snapshot->rightmost = NULL;
+	return snapshot;
+}
+
+
+
+///
+/// _rb_own
+///
+/// Makes child safe to change in place and returns it. If other trees can see it, parent
+/// gets a private copy instead, and the copy's children become shared in turn. That's 
+/// why paths are always owned from the top down. parent must already be owned; a NULL 
+/// parent means child is the root.
+///
+
+struct rb_node *_rb_own(struct rb_tree *tree, struct rb_node *parent, struct rb_node *child)
+{
+	struct rb_node *copy;
+
+	if (!child || _rb_refcount(child) == 1)
+	{
+		return child;
+	}
+
+	copy = _rb_create_node(tree, NULL, child->key, child->data);
+	_rb_set_left_child(copy, _rb_left_child(child));
+	_rb_set_right_child(copy, _rb_right_child(child));
+	_rb_set_color(copy, _rb_color(child));
+	_rb_set_num_children(copy, _rb_num_children(child));
+	_rb_set_refcount(copy, 1);
+
+	if (_rb_left_child(copy))
+	{
+		_rb_set_refcount(_rb_left_child(copy), _rb_refcount(_rb_left_child(copy)) + 1);
+	}
+	if (_rb_right_child(copy))
+	{
+		_rb_set_refcount(_rb_right_child(copy), _rb_refcount(_rb_right_child(copy)) + 1);
+	}
+	_rb_set_refcount(child, _rb_refcount(child) - 1);
+
+	_rb_replace_child(tree, parent, child, copy);
+	return copy;
+}
+
+
+
+///
+/// _rb_persistent_left_rotate / _rb_persistent_right_rotate
+///
+/// Rotations for persistent trees. With no parent pointers the caller passes node's 
+/// parent in. node and the child rotating up must both be owned.
+///
+
+void _rb_persistent_left_rotate(struct rb_tree *tree, struct rb_node *parent, struct rb_node *node)
+{
+	struct rb_node *child = _rb_right_child(node);
+
+	_rb_set_right_child(node, _rb_left_child(child));
+	_rb_set_left_child(child, node);
+	_rb_replace_child(tree, parent, node, child);
+
+	_rb_update_subtree(tree->augment, node);
+	_rb_update_subtree(tree->augment, child);
+}
+
+void _rb_persistent_right_rotate(struct rb_tree *tree, struct rb_node *parent, struct rb_node *node)
+{
+	struct rb_node *child = _rb_left_child(node);
+
+	_rb_set_left_child(node, _rb_right_child(child));
+	_rb_set_right_child(child, node);
+	_rb_replace_child(tree, parent, node, child);
+
+	_rb_update_subtree(tree->augment, node);
+	_rb_update_subtree(tree->augment, child);
+}
+
+
+
+///
+/// rb_persistent_insert
+///
+/// rb_insert for persistent trees. The path down to the new node is owned on the way,
+/// and kept in an array since there are no parent pointers to get back up. The fixup is 
+/// the usual one; the only extra node it touches is the uncle, which gets owned before
+/// it's recolored.
+///
+
+void rb_persistent_insert(struct rb_tree *tree, long key, void *data)
+{
+	struct rb_node *path[RB_MAX_DEPTH];
+	struct rb_node *node, *parent, *grandparent, *uncle;
+	struct rb_node *(*opposite_child)(struct rb_node *);
+	void (*rotate)(struct rb_tree *, struct rb_node *, struct rb_node *);
+	void (*rotate_opposite)(struct rb_tree *, struct rb_node *, struct rb_node *);
+	long depth = 0;
+
+	ASSERT(tree->persistent, "rb_persistent_insert needs a tree made by rb_create_persistent.");
+
+	pthread_mutex_lock(&tree->arena->lock);
+
+	for (node = _rb_own(tree, NULL, tree->root); node; node = _rb_own(tree, node, _rb_child_for_key(node, key)))
+	{
+		// Keys must be unique.
+		ASSERT(key != node->key, "ERROR: Key already in tree: %ld", key);
+
+		_rb_set_num_children(node, _rb_num_children(node) + 1);
+		path[depth++] = node;
+	}
+
+	node = _rb_create_node(tree, NULL, key, data);
+	_rb_set_refcount(node, 1);
+	if (depth == 0)
+	{
+		tree->root = node;
+	}
+	else if (key < path[depth - 1]->key)
+	{
+		_rb_set_left_child(path[depth - 1], node);
+	}
+	else
+	{
+		_rb_set_right_child(path[depth - 1], node);
+	}
+	path[depth] = node;
+
+	// path[depth] is the red node whose parent may be red too. A red parent is never 
+	// the root, so the grandparent is there.
+	while (depth > 0 && _rb_color(path[depth - 1]) == rb_red)
+	{
+		node = path[depth];
+		parent = path[depth - 1];
+		grandparent = path[depth - 2];
+
+		if (parent == _rb_left_child(grandparent))
+		{
+			opposite_child = _rb_right_child;
+			rotate = _rb_persistent_left_rotate;
+			rotate_opposite = _rb_persistent_right_rotate;
+		}
+		else
+		{
+			opposite_child = _rb_left_child;
+			rotate = _rb_persistent_right_rotate;
+			rotate_opposite = _rb_persistent_left_rotate;
+		}
+
+		uncle = opposite_child(grandparent);
+		if (uncle && _rb_color(uncle) == rb_red)
+		{
+			uncle = _rb_own(tree, grandparent, uncle);
+			_rb_set_color(uncle, rb_black);
+			_rb_set_color(parent, rb_black);
+			_rb_set_color(grandparent, rb_red);
+			depth -= 2;
+		}
+		else
+		{
+			// Get the node to the outside of the grandparent, then rotate the parent up.
+			if (node == opposite_child(parent))
+			{
+				rotate(tree, grandparent, parent);
+				parent = node;
+			}
+			_rb_set_color(parent, rb_black);
+			_rb_set_color(grandparent, rb_red);
+			rotate_opposite(tree, depth > 2 ? path[depth - 3] : NULL, grandparent);
+			break;
+		}
+	}
+
+	// Root node -> paint it black. The root is always owned by now.
+	_rb_set_color(tree->root, rb_black);
+
+	pthread_mutex_unlock(&tree->arena->lock);
+}
+
+
+
+///
+/// _rb_persistent_delete_fixup
+///
+/// _rb_delete_fixup for persistent trees. node has just taken the place of a black node
+/// under path[depth] and is short one black. The sibling and whichever of its children
+/// get recolored are owned before they're touched.
+///
+
+void _rb_persistent_delete_fixup(struct rb_tree *tree, struct rb_node **path, long depth, struct rb_node *node)
+{
+	struct rb_node *parent, *grandparent, *sibling, *nephew;
+	struct rb_node *(*child)(struct rb_node *);
+	struct rb_node *(*opposite_child)(struct rb_node *);
+	void (*rotate)(struct rb_tree *, struct rb_node *, struct rb_node *);
+	void (*rotate_opposite)(struct rb_tree *, struct rb_node *, struct rb_node *);
+
+	// Keep running until the node being fixed-up is the root, or the node being fixed-up is red.
+	while (depth >= 0 && (!node || _rb_color(node) == rb_black))
+	{
+		parent = path[depth];
+		grandparent = (depth > 0) ? path[depth - 1] : NULL;
+
+		// This just sets up the function pointers. node can be NULL, but then the sibling isn't.
+		if (node == _rb_left_child(parent))
+		{
+			child = _rb_left_child;
+			opposite_child = _rb_right_child;
+			rotate = _rb_persistent_left_rotate;
+			rotate_opposite = _rb_persistent_right_rotate;
+		}
+		else
+		{
+			child = _rb_right_child;
+			opposite_child = _rb_left_child;
+			rotate = _rb_persistent_right_rotate;
+			rotate_opposite = _rb_persistent_left_rotate;
+		}
+
+		// This is the actual algorithm.
+		sibling = _rb_own(tree, parent, opposite_child(parent));
+
+		if (_rb_color(sibling) == rb_red)
+		{
+			_rb_set_color(sibling, rb_black);
+			_rb_set_color(parent, rb_red);
+			rotate(tree, grandparent, parent);
+
+			// The sibling is now parent's parent, so it goes on the path.
+			path[depth] = sibling;
+			path[++depth] = parent;
+			grandparent = sibling;
+			sibling = _rb_own(tree, parent, opposite_child(parent));
+		}
+
+		if ((!_rb_left_child(sibling) || _rb_color(_rb_left_child(sibling)) == rb_black) && (!_rb_right_child(sibling) || _rb_color(_rb_right_child(sibling)) == rb_black))
+		{
+			_rb_set_color(sibling, rb_red);
+			node = parent;
+			depth--;
+		}
+		else
+		{
+			if (!opposite_child(sibling) || _rb_color(opposite_child(sibling)) == rb_black)
+			{
+				nephew = _rb_own(tree, sibling, child(sibling));
+				_rb_set_color(nephew, rb_black);
+				_rb_set_color(sibling, rb_red);
+				rotate_opposite(tree, parent, sibling);
+				sibling = nephew;
+			}
+			nephew = _rb_own(tree, sibling, opposite_child(sibling));
+			_rb_set_color(sibling, _rb_color(parent));
+			_rb_set_color(parent, rb_black);
+			_rb_set_color(nephew, rb_black);
+			rotate(tree, grandparent, parent);
+			return;
+		}
+	}
+
+	if (node)
+	{
+		node = _rb_own(tree, (depth >= 0) ? path[depth] : NULL, node);
+		_rb_set_color(node, rb_black);
+	}
+}
+
+
+
+///
+/// rb_persistent_delete
+///
+/// rb_delete for persistent trees. Owns the path down to the node holding key and, if
+/// that has two children, on down to its successor, which is the node that actually 
+/// gets unlinked after its key and data are copied up.
+///
+
+void rb_persistent_delete(struct rb_tree *tree, long key)
+{
+	struct rb_node *path[RB_MAX_DEPTH];
+	struct rb_node *node, *victim, *victims_child;
+	long depth = 0;
+
+	ASSERT(tree->persistent, "rb_persistent_delete needs a tree made by rb_create_persistent.");
+
+	pthread_mutex_lock(&tree->arena->lock);
+
+	ASSERT(_rb_find_node(tree->root, key) != NULL, "rb_persistent_delete called on non-existent key.");
+
+	// Every node on the way loses one descendant.
+	for (node = _rb_own(tree, NULL, tree->root); key != node->key; node = _rb_own(tree, node, _rb_child_for_key(node, key)))
+	{
+		_rb_set_num_children(node, _rb_num_children(node) - 1);
+		path[depth++] = node;
+	}
+
+	victim = node;
+	if (_rb_left_child(node) && _rb_right_child(node))
+	{
+		_rb_set_num_children(node, _rb_num_children(node) - 1);
+		path[depth++] = node;
+
+		for (victim = _rb_own(tree, node, _rb_right_child(node)); _rb_left_child(victim); victim = _rb_own(tree, victim, _rb_left_child(victim)))
+		{
+			_rb_set_num_children(victim, _rb_num_children(victim) - 1);
+			path[depth++] = victim;
+		}
+		node->key = victim->key;
+		node->data = victim->data;
+	}
+
+	// Splice out the victim. Its reference to its child moves up to its parent.
+	victims_child = _rb_left_child(victim) ? _rb_left_child(victim) : _rb_right_child(victim);
+	_rb_replace_child(tree, (depth > 0) ? path[depth - 1] : NULL, victim, victims_child);
+
+	if (_rb_color(victim) == rb_black)
+	{
+		_rb_persistent_delete_fixup(tree, path, depth - 1, victims_child);
+	}
+	_rb_arena_free(tree->arena, victim);
+
+	pthread_mutex_unlock(&tree->arena->lock);
+}
+
+
+
+
+//
+// Join and split
+//
+// rb_join glues two trees together when every key of one is below every key of the other,
+// and rb_split cuts a tree in two at a key, both in O(log n). Joining walks down the spine
+// of the taller tree to a black node as tall as the other tree, hangs both off a red node 
+// there and lets the insert fixup clean up. Splitting cuts along the search path and joins
+// the pieces back together on either side. Carrying the black heights along instead of 
+// counting them again is what keeps that O(log n): each join costs the difference in
+// height of its two pieces, and those add up to the height of the tree.
+//
+// Nodes move between trees without being copied, so the trees involved have to end up in 
+// one arena. rb_split's halves share the original's arena. Joining two trees from different
+// arenas moves the slabs of whichever arena isn't shared with a third tree over to the 
+// other one. Trees sharing an arena mustn't be changed from different threads at once.
+//
+
+
+
+///
+/// _rb_black_height
+///
+/// The number of black nodes on any path from node down to a leaf, node included.
+///
+
+long _rb_black_height(struct rb_node *node)
+{
+	long height = 0;
+
+	for (; node; node = _rb_left_child(node))
+	{
+		height += (_rb_color(node) == rb_black);
+	}
+	return height;
+}
+
+
+
+///
+/// _rb_detach
+///
+/// Cuts node loose from its parent and children, leaving it a tree of one.
+///
+
+void _rb_detach(struct rb_node *node)
+{
+	if (_rb_left_child(node))
+	{
+		_rb_set_parent(_rb_left_child(node), NULL);
+	}
+	if (_rb_right_child(node))
+	{
+		_rb_set_parent(_rb_right_child(node), NULL);
+	}
+	_rb_set_left_child(node, NULL);
+	_rb_set_right_child(node, NULL);
+	_rb_set_parent(node, NULL);
+	_rb_set_num_children(node, 0);
+}
+
+
+
+///
+/// _rb_join3
+///
+/// Returns the root of a tree holding left, pivot and right, where every key in left is 
+/// smaller than pivot's and every key in right larger. The heights are the black heights 
+/// of left and right, and *height gets the black height of the result. left and right 
+/// may have red roots, as pieces of a split tree do; the result's root is black.
+///
+
+struct rb_node *_rb_join3(const struct rb_augment *augment, struct rb_node *left, long left_height, struct rb_node *pivot, struct rb_node *right, long right_height, long *height)
+{
+	struct rb_tree scratch;
+	struct rb_node *node, *parent, *tall, *other;
+	struct rb_node *(*spine)(struct rb_node *);
+	void (*set_spine)(struct rb_node *, struct rb_node *);
+	void (*set_opposite)(struct rb_node *, struct rb_node *);
+	long node_height, other_height;
+
+	// Painting a red root black keeps the tree valid, it's just one taller.
+	if (left && _rb_color(left) == rb_red)
+	{
+		_rb_set_color(left, rb_black);
+		left_height++;
+	}
+	if (right && _rb_color(right) == rb_red)
+	{
+		_rb_set_color(right, rb_black);
+		right_height++;
+	}
+
+	_rb_detach(pivot);
+
+	if (left_height == right_height)
+	{
+		_rb_set_left_child(pivot, left);
+		_rb_set_right_child(pivot, right);
+		if (left)
+		{
+			_rb_set_parent(left, pivot);
+		}
+		if (right)
+		{
+			_rb_set_parent(right, pivot);
+		}
+		_rb_set_color(pivot, rb_black);
+		_rb_update_subtree(augment, pivot);
+		*height = left_height + 1;
+		return pivot;
+	}
+
+	// The pivot goes in on the inside edge of the taller tree: the right spine of left,
+	// or the left spine of right.
+	if (left_height > right_height)
+	{
+		tall = left;
+		other = right;
+		node_height = left_height;
+		other_height = right_height;
+		spine = _rb_right_child;
+		set_spine = _rb_set_right_child;
+		set_opposite = _rb_set_left_child;
+	}
+	else
+	{
+		tall = right;
+		other = left;
+		node_height = right_height;
+		other_height = left_height;
+		spine = _rb_left_child;
+		set_spine = _rb_set_left_child;
+		set_opposite = _rb_set_right_child;
+	}
+	*height = node_height;
+
+	// Down to the first black node (or leaf) with the same black height as the other tree.
+	parent = NULL;
+	for (node = tall; !((!node || _rb_color(node) == rb_black) && node_height == other_height); node = spine(node))
+	{
+		node_height -= (_rb_color(node) == rb_black);
+		parent = node;
+	}
+
+	// That subtree and the other tree become the red pivot's children.
+	set_spine(parent, pivot);
+	_rb_set_parent(pivot, parent);
+	set_opposite(pivot, node);
+	set_spine(pivot, other);
+	if (node)
+	{
+		_rb_set_parent(node, pivot);
+	}
+	if (other)
+	{
+		_rb_set_parent(other, pivot);
+	}
+	_rb_set_color(pivot, rb_red);
+
+	for (node = pivot; node; node = _rb_parent(node))
+	{
+		_rb_update_subtree(augment, node);
+	}
+
+	scratch.root = tall;
+	scratch.augment = augment;
+	if (_rb_insert_fixup(&scratch, pivot))
+	{
+		(*height)++;
+	}
+	return scratch.root;
+}
+
+
+
+///
+/// _rb_split_last
+///
+/// Takes the largest node out of the tree under node and returns it. *rest gets the root
+/// of what's left and *rest_height its black height.
+///
+
+struct rb_node *_rb_split_last(const struct rb_augment *augment, struct rb_node *node, long height, struct rb_node **rest, long *rest_height)
+{
+	struct rb_node *left = _rb_left_child(node);
+	struct rb_node *right = _rb_right_child(node);
+	long child_height = height - (_rb_color(node) == rb_black);
+	struct rb_node *last;
+
+	_rb_detach(node);
+
+	if (!right)
+	{
+		*rest = left;
+		*rest_height = child_height;
+		return node;
+	}
+
+	last = _rb_split_last(augment, right, child_height, &right, rest_height);
+	*rest = _rb_join3(augment, left, child_height, node, right, *rest_height, rest_height);
+	return last;
+}
+
+
+
+///
+/// _rb_join2
+///
+/// _rb_join3 without a pivot: the largest node of left is taken out to be the pivot.
+///
+
+struct rb_node *_rb_join2(const struct rb_augment *augment, struct rb_node *left, long left_height, struct rb_node *right, long right_height, long *height)
+{
+	struct rb_node *pivot;
+
+	if (!left)
+	{
+		*height = right_height;
+		return right;
+	}
+	if (!right)
+	{
+		*height = left_height;
+		return left;
+	}
+
+	pivot = _rb_split_last(augment, left, left_height, &left, &left_height);
+	return _rb_join3(augment, left, left_height, pivot, right, right_height, height);
+}
+
+
+
+///
+/// _rb_split
+///
+/// Splits the tree under node into the keys below key (*left) and above it (*right), with
+/// their black heights. If key itself is there, its node is returned on its own, otherwise
+/// NULL.
+///
+
+struct rb_node *_rb_split(const struct rb_augment *augment, struct rb_node *node, long height, long key, struct rb_node **left, long *left_height, struct rb_node **right, long *right_height)
+{
+	struct rb_node *node_left, *node_right, *middle, *found;
+	long child_height, middle_height;
+
+	if (!node)
+	{
+		*left = *right = NULL;
+		*left_height = *right_height = 0;
+		return NULL;
+	}
+
+	node_left = _rb_left_child(node);
+	node_right = _rb_right_child(node);
+	child_height = height - (_rb_color(node) == rb_black);
+	_rb_detach(node);
+
+	if (key == node->key)
+	{
+		*left = node_left;
+		*left_height = child_height;
+		*right = node_right;
+		*right_height = child_height;
+		return node;
+	}
+
+	if (key < node->key)
+	{
+		found = _rb_split(augment, node_left, child_height, key, left, left_height, &middle, &middle_height);
+		*right = _rb_join3(augment, middle, middle_height, node, node_right, child_height, right_height);
+	}
+	else
+	{
+		found = _rb_split(augment, node_right, child_height, key, &middle, &middle_height, right, right_height);
+		*left = _rb_join3(augment, node_left, child_height, node, middle, middle_height, left_height);
+	}
+
+	return found;
+}
+
+
+
+///
+/// _rb_set_root
+///
+/// Makes node the root of tree, which means black and without a parent. The finger may
+/// have gone to another tree or back to the arena, so it's dropped, and the ends are
+/// found again.
+///
+
+void _rb_set_root(struct rb_tree *tree, struct rb_node *node)
+{
+	tree->root = node;
+	tree->finger = NULL;
+	if (node)
+	{
+		_rb_set_parent(node, NULL);
+		_rb_set_color(node, rb_black);
+	}
+	_rb_find_ends(tree);
+}
+
+
+
+///
+/// _rb_arena_merge
+///
+/// Moves every slab and free node of from over to into, then frees from. into's newest
+/// slab stays first, so it keeps filling that one. Both lists are spliced at their ends,
+/// so it's O(1) however big the arenas are.
+///
+
+void _rb_arena_merge(struct rb_arena *into, struct rb_arena *from)
+{
+	if (from->slabs && into->slabs)
+	{
+		from->last_slab->next = into->slabs->next;
+		into->slabs->next = from->slabs;
+		if (into->last_slab == into->slabs)
+		{
+			into->last_slab = from->last_slab;
+		}
+	}
+	else if (from->slabs)
+	{
+		into->slabs = from->slabs;
+		into->last_slab = from->last_slab;
+	}
+
+	if (from->free_list)
+	{
+		from->last_free->data = into->free_list;
+		if (!into->free_list)
+		{
+			into->last_free = from->last_free;
+		}
+		into->free_list = from->free_list;
+	}
+
+	pthread_mutex_destroy(&from->lock);
+	free(from);
+}
+
+
+
+///
+/// _rb_absorb
+///
+/// Gets other's nodes into tree's arena, frees other and returns its root, which is
+/// now tree's to place.
+///
+
+struct rb_node *_rb_absorb(struct rb_tree *tree, struct rb_tree *other)
+{
+	struct rb_node *root = other->root;
+
+	ASSERT(!tree->persistent && !other->persistent, "Persistent trees can't be joined.");
+	ASSERT(!tree->mapped && !other->mapped, "Trees opened with rb_map can't be joined or combined.");
+	ASSERT(tree->augment == other->augment, "Trees with different augments can't be combined.");
+
+	if (other->arena == tree->arena)
+	{
+		tree->arena->trees--;
+	}
+	else if (other->arena->trees == 1)
+	{
+		_rb_arena_merge(tree->arena, other->arena);
+	}
+	else
+	{
+		ASSERT(tree->arena->trees == 1, "Can't combine two trees that both share their arenas with other trees.");
+		_rb_arena_merge(other->arena, tree->arena);
+		tree->arena = other->arena;
+	}
+
+	pthread_mutex_destroy(&other->write_lock);
+	free(other);
+	return root;
+}
+
+
+
+///
+/// rb_join
+///
+/// Moves every node of right into left and returns left. All of left's keys must be
+/// smaller than all of right's. right is gone afterwards.
+///
+
+struct rb_tree *rb_join(struct rb_tree *left, struct rb_tree *right)
+{
+	struct rb_node *left_root = left->root;
+	struct rb_node *right_root;
+	long left_height, right_height, height;
+
+	ASSERT(!left_root || !right->root || _rb_find_largest(left_root)->key < _rb_find_smallest(right->root)->key, 
+		   "rb_join needs every key on the left below every key on the right.");
+
+	right_root = _rb_absorb(left, right);
+	left_height = _rb_black_height(left_root);
+	right_height = _rb_black_height(right_root);
+
+	_rb_set_root(left, _rb_join2(left->augment, left_root, left_height, right_root, right_height, &height));
+	return left;
+}
+
+
+
+///
+/// _rb_create_sharing
+///
+/// An empty tree that takes its nodes from tree's arena. Combining the two again with
+/// _rb_absorb has no arenas to merge, and nodes either one frees get reused by both.
+///
+
+struct rb_tree *_rb_create_sharing(struct rb_tree *tree)
+{
+	struct rb_tree *other = rb_create();
+
+	pthread_mutex_destroy(&other->arena->lock);
+	free(other->arena);
+	other->arena = tree->arena;
+	tree->arena->trees++;
+	other->augment = tree->augment;
+	return other;
+}
+
+
+
+///
+/// rb_split
+///
+/// Moves every key >= key out of tree into a new tree and returns that. Both share
+/// tree's arena afterwards.
+///
+
+struct rb_tree *rb_split(struct rb_tree *tree, long key)
+{
+	struct rb_tree *right;
+	struct rb_node *left_root, *right_root, *found;
+	long left_height, right_height;
+
+	ASSERT(!tree->persistent, "Persistent trees can't be split.");
+	ASSERT(!tree->multimap, "Multimaps can't be split.");
+	ASSERT(!tree->mapped, "rb_split doesn't work on a tree opened with rb_map.");
+
+	right = _rb_create_sharing(tree);
+
+	found = _rb_split(tree->augment, tree->root, _rb_black_height(tree->root), key, &left_root, &left_height, &right_root, &right_height);
+	if (found)
+	{
+		right_root = _rb_join3(tree->augment, NULL, 0, found, right_root, right_height, &right_height);
+	}
+
+	_rb_set_root(tree, left_root);
+	_rb_set_root(right, right_root);
+	return right;
+}
+
+
+
+
+///
+/// rb_delete_range
+///
+/// Removes every key k with lo <= k <= hi and returns how many there were. Rather than a 
+/// descent per key, the range is split off the tree and the two ends joined back together,
+/// O(log n), and the nodes in the range go back to the arena in one O(k) sweep.
+///
+
+long rb_delete_range(struct rb_tree *tree, long lo, long hi)
+{
+	struct rb_node *left, *middle, *right, *found;
+	long left_height, middle_height, right_height, height, removed;
+
+	ASSERT(!tree->persistent, "rb_delete_range called on a persistent tree.");
+	ASSERT(!tree->multimap, "rb_delete_range called on a multimap.");
+	ASSERT(!tree->mapped, "rb_delete_range doesn't work on a tree opened with rb_map.");
+
+	if (lo > hi || !tree->root)
+	{
+		return 0;
+	}
+
+	// Everything below lo goes left. lo itself belongs with the range.
+	found = _rb_split(tree->augment, tree->root, _rb_black_height(tree->root), lo, &left, &left_height, &middle, &middle_height);
+	if (found)
+	{
+		middle = _rb_join3(tree->augment, NULL, 0, found, middle, middle_height, &middle_height);
+	}
+
+	// Splitting at hi rather than hi + 1 means hi can be LONG_MAX.
+	found = _rb_split(tree->augment, middle, middle_height, hi, &middle, &middle_height, &right, &right_height);
+	removed = _rb_subtree_size(middle) + (found != NULL);
+	if (found)
+	{
+		_rb_arena_free(tree->arena, found);
+	}
+	_rb_clear(tree, middle);
+
+	_rb_set_root(tree, _rb_join2(tree->augment, left, left_height, right, right_height, &height));
+	return removed;
+}
+
+
+
+
+//
+// Work-stealing pool
+//
+// The set operations split their work in two at every step. _rb_pool_fork_join runs one
+// half right away and pushes the other on the thread's own deque, where an idle worker 
+// can steal it. Owners push and pop at the tail, thieves take from the head, so a thief 
+// gets the oldest and biggest piece of work there is. A thread waiting for a stolen half
+// to finish steals work itself instead of sitting idle.
+//
+// There is one pool for the process, with a thread per core unless rb_set_threads says
+// otherwise. The thread calling into it is worker 0; the others sleep between operations.
+//
+
+// Deepest a deque can get. A full deque just runs the work itself instead.
+#define RB_POOL_DEQUE 1024
+
+struct rb_pool_task
+{
+	void (*run)(void *);
+	void *arg;
+	int done;
+};
+
+struct rb_pool_worker
+{
+	pthread_mutex_t lock;
+	struct rb_pool_task *tasks[RB_POOL_DEQUE];
+	long head, tail;				// Thieves take tasks[head], the owner pushes and pops at tail.
+};
+
+struct rb_pool
+{
+	long num_workers;
+	struct rb_pool_worker *workers;
+	pthread_t *threads;				// Worker 0 is whoever calls _rb_pool_run, so threads[0] is unused.
+
+	pthread_mutex_t run_lock;		// One operation at a time.
+	pthread_mutex_t idle_lock;
+	pthread_cond_t wake;
+	int active;						// An operation is running, so workers should look for work.
+	int stop;
+};
+
+struct rb_pool *_rb_pool = NULL;
+pthread_mutex_t _rb_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct rb_pool_worker *_rb_pool_self = NULL;
+
+
+
+///
+/// _rb_pool_push / _rb_pool_pop / _rb_pool_steal
+///
+/// The deque operations. Pushing fails if the deque is full; popping and stealing return 
+/// NULL if it's empty. head and tail only change under the lock, but thieves peek at
+/// them without it, hence the atomic stores.
+///
+
+int _rb_pool_push(struct rb_pool_worker *worker, struct rb_pool_task *task)
+{
+	int pushed = 0;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail - worker->head < RB_POOL_DEQUE)
+	{
+		worker->tasks[worker->tail % RB_POOL_DEQUE] = task;
+		__atomic_store_n(&worker->tail, worker->tail + 1, __ATOMIC_RELAXED);
+		pushed = 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return pushed;
+}
+
+struct rb_pool_task *_rb_pool_pop(struct rb_pool_worker *worker)
+{
+	struct rb_pool_task *task = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail > worker->head)
+	{
+		__atomic_store_n(&worker->tail, worker->tail - 1, __ATOMIC_RELAXED);
+		task = worker->tasks[worker->tail % RB_POOL_DEQUE];
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return task;
+}
+
+struct rb_pool_task *_rb_pool_steal(struct rb_pool *pool, struct rb_pool_worker *thief)
+{
+	struct rb_pool_task *task = NULL;
+	long start = (thief - pool->workers) + 1;
+	long i;
+
+	for (i = 0; i < pool->num_workers && !task; i++)
+	{
+		struct rb_pool_worker *victim = &pool->workers[(start + i) % pool->num_workers];
+
+		// A quick unlocked look saves taking the lock of every empty deque.
+		if (victim == thief || __atomic_load_n(&victim->tail, __ATOMIC_RELAXED) <= __atomic_load_n(&victim->head, __ATOMIC_RELAXED))
+		{
+			continue;
+		}
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->tail > victim->head)
+		{
+			task = victim->tasks[victim->head % RB_POOL_DEQUE];
+			__atomic_store_n(&victim->head, victim->head + 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return task;
+}
+
+
+
+///
+/// _rb_pool_execute
+///
+/// Runs a task and flags it done for whoever is waiting on it.
+///
+
+void _rb_pool_execute(struct rb_pool_task *task)
+{
+	task->run(task->arg);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+
+
+///
+/// _rb_pool_worker_main
+///
+/// What the pool's threads run: sleep until an operation starts, then steal work until
+/// it's over.
+///
+
+void *_rb_pool_worker_main(void *arg)
+{
+	struct rb_pool_worker *self = (struct rb_pool_worker *)arg;
+	struct rb_pool *pool = _rb_pool;
+	struct rb_pool_task *task;
+	int stop;
+
+	_rb_pool_self = self;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->idle_lock);
+		while (!__atomic_load_n(&pool->active, __ATOMIC_RELAXED) && !pool->stop)
+		{
+			pthread_cond_wait(&pool->wake, &pool->idle_lock);
+		}
+		stop = pool->stop;
+		pthread_mutex_unlock(&pool->idle_lock);
+
+		if (stop)
+		{
+			break;
+		}
+
+		while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE))
+		{
+			task = _rb_pool_steal(pool, self);
+			if (task)
+			{
+				_rb_pool_execute(task);
+			}
+			else
+			{
+				sched_yield();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+
+///
+/// rb_set_threads
+///
+/// Sets how many threads the set operations use, the calling thread included. 0 means
+/// one per core, which is also what you get without calling this.
+///
+
+void _rb_pool_destroy(struct rb_pool *pool)
+{
+	long i;
+
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	for (i = 1; i < pool->num_workers; i++)
+	{
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (i = 0; i < pool->num_workers; i++)
+	{
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+
+	pthread_mutex_destroy(&pool->run_lock);
+	pthread_mutex_destroy(&pool->idle_lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool);
+}
+
+void rb_set_threads(long threads)
+{
+	struct rb_pool *pool;
+	long i;
+
+	if (threads <= 0)
+	{
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	pthread_mutex_lock(&_rb_pool_lock);
+
+	if (_rb_pool)
+	{
+		// Let any operation that's running finish first.
+		pthread_mutex_lock(&_rb_pool->run_lock);
+		pthread_mutex_unlock(&_rb_pool->run_lock);
+		_rb_pool_destroy(_rb_pool);
+	}
+
+	pool = (struct rb_pool *)malloc(sizeof(struct rb_pool));
+	pool->num_workers = threads;
+	pool->workers = (struct rb_pool_worker *)malloc(threads * sizeof(struct rb_pool_worker));
+	pool->threads = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->idle_lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pool->active = 0;
+	pool->stop = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		pool->workers[i].head = 0;
+		pool->workers[i].tail = 0;
+	}
+
+	_rb_pool = pool;
+	for (i = 1; i < threads; i++)
+	{
+		pthread_create(&pool->threads[i], NULL, _rb_pool_worker_main, &pool->workers[i]);
+	}
+
+	pthread_mutex_unlock(&_rb_pool_lock);
+}
+
+
+
+///
+/// _rb_pool_run
+///
+/// Runs run(arg) on the calling thread as worker 0, with the rest of the pool awake to
+/// steal whatever it forks.
+///
+
+void _rb_pool_run(void (*run)(void *), void *arg)
+{
+	struct rb_pool *pool;
+
+	pthread_mutex_lock(&_rb_pool_lock);
+	if (!_rb_pool)
+	{
+		pthread_mutex_unlock(&_rb_pool_lock);
+		rb_set_threads(0);
+		pthread_mutex_lock(&_rb_pool_lock);
+	}
+	pool = _rb_pool;
+
+	pthread_mutex_lock(&pool->run_lock);
+	pthread_mutex_unlock(&_rb_pool_lock);
+
+	_rb_pool_self = &pool->workers[0];
+	pthread_mutex_lock(&pool->idle_lock);
+	__atomic_store_n(&pool->active, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	run(arg);
+
+	__atomic_store_n(&pool->active, 0, __ATOMIC_RELEASE);
+	_rb_pool_self = NULL;
+	pthread_mutex_unlock(&pool->run_lock);
+}
+
+
+
+///
+/// _rb_pool_fork_join
+///
+/// Runs first(first_arg) and second(second_arg), possibly in parallel, and returns when
+/// both are done.
+///
+
+void _rb_pool_fork_join(void (*first)(void *), void *first_arg, void (*second)(void *), void *second_arg)
+{
+	struct rb_pool_worker *self = _rb_pool_self;
+	struct rb_pool_task task = { second, second_arg, 0 };
+	struct rb_pool_task *other;
+
+	if (!self || !_rb_pool_push(self, &task))
+	{
+		first(first_arg);
+		second(second_arg);
+		return;
+	}
+
+	first(first_arg);
+
+	// Whatever first pushed it also popped, so the tail is our task unless it was stolen.
+	other = _rb_pool_pop(self);
+	if (other == &task)
+	{
+		second(second_arg);
+		return;
+	}
+	if (other)
+	{
+		// Not ours, so ours was stolen and this one must go back for its owner to find.
+		_rb_pool_push(self, other);
+	}
+
+	while (!__atomic_load_n(&task.done, __ATOMIC_ACQUIRE))
+	{
+		other = _rb_pool_steal(_rb_pool, self);
+		if (other)
+		{
+			_rb_pool_execute(other);
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+}
+
+
+
+
+//
+// Set operations
+//
+// rb_union, rb_intersection and rb_difference combine two trees by divide and conquer:
+// take the root of one tree, split the other at its key, combine the left pieces and the
+// right pieces (the two halves go to the pool), then join the results back up around the
+// root. That's O(m log(n/m + 1)) work for trees of sizes m <= n, so a small tree merged
+// into a big one costs about m lookups, and the depth of the recursion is only O(log^2 n).
+// Both trees are used up: the result is built out of their nodes, and the nodes that 
+// don't make it into the result go back to the arena.
+//
+
+// Combining trees where the smaller has fewer nodes than this isn't worth handing to
+// another thread.
+#define RB_PARALLEL_SET_CUTOFF 1024
+
+enum rb_set_op
+{
+	rb_set_union,
+	rb_set_intersection,
+	rb_set_difference
+};
+
+struct rb_set_task
+{
+	enum rb_set_op op;
+	struct rb_arena *arena;
+	const struct rb_augment *augment;
+	struct rb_node *a, *b;
+	long a_height, b_height;
+	struct rb_node *result;
+	long result_height;
+};
+
+
+
+///
+/// _rb_set_free
+///
+/// Hands the nodes under node back to the arena. Set operations can be freeing nodes on
+/// several threads at once, so nodes go on the free list with a compare and swap; nothing
+/// takes nodes off it until the operation is over.
+///
+
+void _rb_set_free(struct rb_arena *arena, struct rb_node *node)
+{
+	struct rb_node *left, *right, *head;
+
+	if (!node)
+	{
+		return;
+	}
+
+	left = _rb_left_child(node);
+	right = _rb_right_child(node);
+
+	head = __atomic_load_n(&arena->free_list, __ATOMIC_RELAXED);
+	do
+	{
+		node->data = head;
+	}
+	while (!__atomic_compare_exchange_n(&arena->free_list, &head, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Only one node can go onto an empty list, since none come off until the end.
+	if (!head)
+	{
+		arena->last_free = node;
+	}
+
+	_rb_set_free(arena, left);
+	_rb_set_free(arena, right);
+}
+
+
+
+///
+/// _rb_set_task_run
+///
+/// One step of a set operation on task->a and task->b, leaving the result in task. The
+/// root of the smaller tree is the pivot and the other tree gets split at its key, so
+/// the recursion follows the small tree and is done once that runs out. Where both trees
+/// have a key, union and intersection keep a's node, data included.
+///
+
+void _rb_set_task_run(void *arg)
+{
+	struct rb_set_task *task = (struct rb_set_task *)arg;
+	struct rb_set_task halves[2];
+	struct rb_node *pivot, *found, *pivot_left, *pivot_right, *split_left, *split_right;
+	struct rb_node *a_node, *b_node, *keep;
+	long pivot_height, split_left_height, split_right_height;
+	long a_size = _rb_subtree_size(task->a), b_size = _rb_subtree_size(task->b);
+	int pivot_from_a = (a_size <= b_size);
+	int i;
+
+	// With one side empty, union is the other side, intersection is empty and difference is a.
+	if (!task->a || !task->b)
+	{
+		if (task->op == rb_set_union)
+		{
+			task->result = task->a ? task->a : task->b;
+			task->result_height = task->a ? task->a_height : task->b_height;
+		}
+		else if (task->op == rb_set_intersection)
+		{
+			_rb_set_free(task->arena, task->a);
+			_rb_set_free(task->arena, task->b);
+			task->result = NULL;
+			task->result_height = 0;
+		}
+		else
+		{
+			_rb_set_free(task->arena, task->b);
+			task->result = task->a;
+			task->result_height = task->a_height;
+		}
+		return;
+	}
+
+	pivot = pivot_from_a ? task->a : task->b;
+	pivot_height = (pivot_from_a ? task->a_height : task->b_height) - (_rb_color(pivot) == rb_black);
+	pivot_left = _rb_left_child(pivot);
+	pivot_right = _rb_right_child(pivot);
+	_rb_detach(pivot);
+
+	found = _rb_split(task->augment, pivot_from_a ? task->b : task->a, pivot_from_a ? task->b_height : task->a_height, pivot->key, 
+					  &split_left, &split_left_height, &split_right, &split_right_height);
+
+	for (i = 0; i < 2; i++)
+	{
+		halves[i].op = task->op;
+		halves[i].arena = task->arena;
+		halves[i].augment = task->augment;
+	}
+	if (pivot_from_a)
+	{
+		halves[0].a = pivot_left;
+		halves[0].a_height = pivot_height;
+		halves[0].b = split_left;
+		halves[0].b_height = split_left_height;
+		halves[1].a = pivot_right;
+		halves[1].a_height = pivot_height;
+		halves[1].b = split_right;
+		halves[1].b_height = split_right_height;
+	}
+	else
+	{
+		halves[0].a = split_left;
+		halves[0].a_height = split_left_height;
+		halves[0].b = pivot_left;
+		halves[0].b_height = pivot_height;
+		halves[1].a = split_right;
+		halves[1].a_height = split_right_height;
+		halves[1].b = pivot_right;
+		halves[1].b_height = pivot_height;
+	}
+
+	if ((pivot_from_a ? a_size : b_size) >= RB_PARALLEL_SET_CUTOFF)
+	{
+		_rb_pool_fork_join(_rb_set_task_run, &halves[0], _rb_set_task_run, &halves[1]);
+	}
+	else
+	{
+		_rb_set_task_run(&halves[0]);
+		_rb_set_task_run(&halves[1]);
+	}
+
+	// Decide which node, if any, the pivot's key keeps in the result, and free the rest.
+	a_node = pivot_from_a ? pivot : found;
+	b_node = pivot_from_a ? found : pivot;
+	if (task->op == rb_set_union)
+	{
+		keep = a_node ? a_node : b_node;
+	}
+	else if (task->op == rb_set_intersection)
+	{
+		keep = (a_node && b_node) ? a_node : NULL;
+	}
+	else
+	{
+		keep = b_node ? NULL : a_node;
+	}
+	if (a_node != keep)
+	{
+		_rb_set_free(task->arena, a_node);
+	}
+	if (b_node != keep)
+	{
+		_rb_set_free(task->arena, b_node);
+	}
+
+	if (keep)
+	{
+		task->result = _rb_join3(task->augment, halves[0].result, halves[0].result_height, keep, halves[1].result, halves[1].result_height, &task->result_height);
+	}
+	else
+	{
+		task->result = _rb_join2(task->augment, halves[0].result, halves[0].result_height, halves[1].result, halves[1].result_height, &task->result_height);
+	}
+}
+
+
+
+///
+/// _rb_set_operation
+///
+/// Runs a set operation on the pool and puts the result in a. b is gone afterwards.
+///
+
+struct rb_tree *_rb_set_operation(struct rb_tree *a, struct rb_tree *b, enum rb_set_op op)
+{
+	struct rb_set_task task;
+
+	ASSERT(!a->multimap && !b->multimap, "Set operations need unique keys, not multimaps.");
+	task.op = op;
+	task.a = a->root;
+	task.a_height = _rb_black_height(a->root);
+	task.b = _rb_absorb(a, b);
+	task.b_height = _rb_black_height(task.b);
+	task.arena = a->arena;
+	task.augment = a->augment;
+
+	_rb_pool_run(_rb_set_task_run, &task);
+
+	_rb_set_root(a, task.result);
+	return a;
+}
+
+
+
+///
+/// rb_union / rb_intersection / rb_difference
+///
+/// Combine a and b into a and return it; b is gone afterwards. rb_difference keeps the
+/// keys of a that aren't in b. Keys in both keep a's data.
+///
+
+struct rb_tree *rb_union(struct rb_tree *a, struct rb_tree *b)
+{
+	return _rb_set_operation(a, b, rb_set_union);
+}
+
+struct rb_tree *rb_intersection(struct rb_tree *a, struct rb_tree *b)
+{
+	return _rb_set_operation(a, b, rb_set_intersection);
+}
+
+struct rb_tree *rb_difference(struct rb_tree *a, struct rb_tree *b)
+{
+	return _rb_set_operation(a, b, rb_set_difference);
+}
+
+
+
+
+//
+// On-disk trees
+//
+// rb_save writes a tree to a file that rb_map can use straight away: the file is mapped 
+// read-only and searched in place, so opening it costs the same for a thousand keys or
+// fifty million. Links in the file are byte offsets from the start of the file instead of
+// pointers, which is what makes it work wherever it gets mapped. The nodes go in key order
+// and the links make a perfectly balanced tree over them, so the file needs no colors 
+// and is never deeper than a red-black tree of the same keys.
+//
+// A mapped tree still takes rb_insert and rb_delete. The saved nodes never change; new
+// keys go into ordinary nodes in the tree, and deleted saved keys into a second tree of
+// tombstones. Each change is also appended to the end of the file, and rb_map replays 
+// those on the way in, so nothing is lost across a restart. The log only grows: saving 
+// the tree again writes a fresh file without it.
+//
+// Whatever works on the nodes directly would only see the changes, and its own changes
+// wouldn't be logged: rb_select, rb_rank, rb_split, rb_join, rb_delete_range, the set
+// operations and the rb_concurrent_ readers refuse a mapped tree. For those, copy its
+// keys into a plain tree with rb_range_scan, which merges the saved ones in.
+//
+// data is saved as its bits, so it only means something after a restart if it was a 
+// number or an offset to begin with.
+//
+
+#define RB_DISK_MAGIC "rbtree1"
+
+struct rb_disk_header
+{
+	char magic[8];
+	long count;
+	long root;						// Offset of the root node, 0 when empty.
+	long log;						// Offset of the first appended change. Nodes end here.
+};
+
+// Two to a cache line.
+struct rb_disk_node
+{
+	long key;
+	long data;
+	long left, right;				// Offsets from the start of the file, 0 for none.
+};
+
+enum rb_log_op
+{
+	rb_log_insert = 1,
+	rb_log_delete
+};
+
+struct rb_log_record
+{
+	long op;						// An rb_log_op.
+	long key;
+	long data;
+};
+
+struct rb_mapped
+{
+	const char *base;				// The mapping, as far as the nodes go.
+	long size;
+	const struct rb_disk_header *header;
+	int fd;							// Open for appending changes.
+	int replaying;					// Set while rb_map replays the log, so it isn't appended to again.
+	struct rb_tree *tombstones;		// Saved keys since deleted.
+};
+
+
+
+long _rb_disk_offset(long index)
+{
+	return (index < 0) ? 0 : (long)(sizeof(struct rb_disk_header) + index * sizeof(struct rb_disk_node));
+}
+
+
+
+///
+/// rb_save
+///
+/// Writes tree to path in the format rb_map reads. Any tree can be saved, including one
+/// that was itself mapped, and the tree is left as it was. The file is written under a
+/// temporary name and renamed over path at the end, so path is never half written. 
+/// A tree mapped from path keeps the old file and keeps appending to it, so it should be
+/// mapped again afterwards. Saving a mapped tree over its own file is refused, since its
+/// changes from then on would go to the replaced file and be lost: save it somewhere else
+/// and move that into place once it's destroyed. Returns 0, or -1 if the file couldn't 
+/// be written or is the tree's own.
+///
+
+// The nodes go out in key order, and the links are those of the tree that always splits
+// a range at its middle. Walking that tree in order alongside the scan gives each node's
+// children as it goes by: the stack holds the index ranges still to be visited.
+// Nodes are written RB_SAVE_BUFFER at a time; an fwrite per node took most of the time.
+#define RB_SAVE_BUFFER 1024
+
+struct rb_save_context
+{
+	FILE *file;
+	long index;
+	long count;
+	long depth;
+	long lo[RB_MAX_DEPTH], hi[RB_MAX_DEPTH];
+	long buffered;
+	struct rb_disk_node buffer[RB_SAVE_BUFFER];
+};
+
+int _rb_save_flush(struct rb_save_context *save)
+{
+	long buffered = save->buffered;
+
+	save->buffered = 0;
+	return fwrite(save->buffer, sizeof(struct rb_disk_node), buffered, save->file) != (size_t)buffered;
+}
+
+long _rb_save_middle(long lo, long hi)
+{
+	return (lo <= hi) ? lo + (hi - lo) / 2 : -1;
+}
+
+void _rb_save_descend(struct rb_save_context *save, long lo, long hi)
+{
+	while (lo <= hi)
+	{
+		save->lo[save->depth] = lo;
+		save->hi[save->depth] = hi;
+		save->depth++;
+		hi = _rb_save_middle(lo, hi) - 1;
+	}
+}
+
+int _rb_save_callback(struct rb_node *node, void *context)
+{
+	struct rb_save_context *save = (struct rb_save_context *)context;
+	struct rb_disk_node *disk = &save->buffer[save->buffered++];
+	long lo, hi, middle;
+
+	save->depth--;
+	lo = save->lo[save->depth];
+	hi = save->hi[save->depth];
+	middle = _rb_save_middle(lo, hi);
+	_rb_save_descend(save, middle + 1, hi);
+
+	disk->key = node->key;
+	disk->data = (long)node->data;
+	disk->left = _rb_disk_offset(_rb_save_middle(lo, middle - 1));
+	disk->right = _rb_disk_offset(_rb_save_middle(middle + 1, hi));
+	save->index++;
+
+	return save->buffered == RB_SAVE_BUFFER && _rb_save_flush(save);
+}
+
+int rb_save(struct rb_tree *tree, const char *path)
+{
+	struct rb_save_context *save;
+	struct rb_disk_header header;
+	struct stat st, mapped_st;
+	char temp[4096];
+	FILE *file;
+	int failed;
+
+	ASSERT(!tree->multimap, "rb_save needs unique keys, not a multimap.");
+	if (tree->mapped && stat(path, &st) == 0 && fstat(tree->mapped->fd, &mapped_st) == 0 &&
+		st.st_dev == mapped_st.st_dev && st.st_ino == mapped_st.st_ino)
+	{
+		return -1;
+	}
+	if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+	{
+		return -1;
+	}
+	file = fopen(temp, "wb");
+	if (!file)
+	{
+		return -1;
+	}
+
+	save = (struct rb_save_context *)malloc(sizeof(struct rb_save_context));
+	save->file = file;
+	save->index = 0;
+	save->count = rb_count(tree);
+	save->depth = 0;
+	save->buffered = 0;
+	_rb_save_descend(save, 0, save->count - 1);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RB_DISK_MAGIC, sizeof(header.magic));
+	header.count = save->count;
+	header.root = _rb_disk_offset(_rb_save_middle(0, save->count - 1));
+	header.log = _rb_disk_offset(save->count);
+
+	failed = fwrite(&header, sizeof(header), 1, file) != 1;
+	if (!failed)
+	{
+		// Over a whole tree the stack walk beats rb_next several times: rb_next climbs
+		// back through ancestors that have long since left the cache.
+		if (tree->mapped)
+		{
+			rb_range_scan(tree, LONG_MIN, LONG_MAX, _rb_save_callback, save);
+		}
+		else
+		{
+			_rb_stack_range_scan(tree, LONG_MIN, LONG_MAX, _rb_save_callback, save);
+		}
+		failed = save->index != save->count || _rb_save_flush(save);
+	}
+	free(save);
+
+	failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+	failed |= fclose(file) != 0;
+	if (failed || rename(temp, path) != 0)
+	{
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+///
+/// _rb_disk_find
+///
+/// The saved node holding key, or NULL. Same loop as _rb_find_node, on offsets.
+///
+
+const struct rb_disk_node *_rb_disk_find(struct rb_mapped *mapped, long key)
+{
+	long offset = mapped->header->root;
+	const struct rb_disk_node *node;
+
+	while (offset)
+	{
+		node = (const struct rb_disk_node *)(mapped->base + offset);
+		if (key == node->key)
+		{
+			return node;
+		}
+		offset = (key < node->key) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+int _rb_disk_live(struct rb_mapped *mapped, const struct rb_disk_node *node)
+{
+	return node && !_rb_find_node(mapped->tombstones->root, node->key);
+}
+
+
+
+///
+/// _rb_mapped_append
+///
+/// Appends a change to the file. Not synced: it survives the process going down, not
+/// the machine.
+///
+
+void _rb_mapped_append(struct rb_mapped *mapped, enum rb_log_op op, long key, void *data)
+{
+	struct rb_log_record record;
+
+	if (mapped->replaying)
+	{
+		return;
+	}
+
+	record.op = op;
+	record.key = key;
+	record.data = (long)data;
+	ASSERT(write(mapped->fd, &record, sizeof(record)) == sizeof(record), "Couldn't append to the saved tree.");
+}
+
+
+
+///
+/// _rb_mapped_log_insert
+///
+/// rb_insert on a mapped tree. Checks the key is neither saved nor in a node already and
+/// logs the insert; rb_insert then puts it in a node as usual. A key whose saved node was
+/// deleted goes into a node too, and its tombstone stays to hide the old data. The checks
+/// come first so a refused insert never reaches the log, where every rb_map after would 
+/// replay it and be refused in turn.
+///
+
+void _rb_mapped_log_insert(struct rb_tree *tree, long key, void *data)
+{
+	ASSERT(!_rb_disk_live(tree->mapped, _rb_disk_find(tree->mapped, key)), "ERROR: Key already in tree: %ld", key);
+	ASSERT(tree->multimap || !_rb_find_node(tree->root, key), "ERROR: Key already in tree: %ld", key);
+	_rb_mapped_append(tree->mapped, rb_log_insert, key, data);
+}
+
+
+
+///
+/// _rb_mapped_delete
+///
+/// rb_delete on a mapped tree. Logs the delete, and if the key is only in the file,
+/// tombstones it and returns 1 to say it's done. Returns 0 to let rb_delete take the
+/// key out of the nodes.
+///
+
+int _rb_mapped_delete(struct rb_tree *tree, long key)
+{
+	struct rb_mapped *mapped = tree->mapped;
+	int saved_only = !_rb_find_node(tree->root, key);
+
+	ASSERT(!saved_only || _rb_disk_live(mapped, _rb_disk_find(mapped, key)), "rb_delete called on non-existent key.");
+
+	_rb_mapped_append(mapped, rb_log_delete, key, NULL);
+	if (saved_only)
+	{
+		rb_insert(mapped->tombstones, key, NULL);
+	}
+	return saved_only;
+}
+
+
+
+///
+/// _rb_mapped_set_data
+///
+/// rb_set_data on a mapped tree: logs the key's delete and its insert with the new data.
+/// The key stays in its node, so this skips the checks _rb_mapped_log_insert makes.
+///
+
+void _rb_mapped_set_data(struct rb_tree *tree, long key, void *data)
+{
+	_rb_mapped_delete(tree, key);
+	_rb_mapped_append(tree->mapped, rb_log_insert, key, data);
+}
+
+
+
+///
+/// _rb_mapped_lookup
+///
+/// rb_lookup for keys that aren't in the tree's nodes.
+///
+
+void *_rb_mapped_lookup(struct rb_tree *tree, long key)
+{
+	const struct rb_disk_node *node = _rb_disk_find(tree->mapped, key);
+
+	return _rb_disk_live(tree->mapped, node) ? (void *)node->data : NULL;
+}
+
+long _rb_mapped_count(struct rb_tree *tree)
+{
+	return tree->mapped->header->count - rb_count(tree->mapped->tombstones);
+}
+
+
+
+///
+/// _rb_mapped_range_scan
+///
+/// rb_range_scan on a mapped tree: the tree's nodes merged with the live saved ones. The
+/// saved side keeps its ancestors on a stack like _rb_stack_range_scan. Saved keys reach
+/// the callback in a scratch node that only has key and data filled in, and that's only
+/// good until the callback returns.
+///
+
+long _rb_mapped_range_scan(struct rb_tree *tree, long lo, long hi, int (*callback)(struct rb_node *node, void *context), void *context)
+{
+	struct rb_mapped *mapped = tree->mapped;
+	const struct rb_disk_node *stack[RB_MAX_DEPTH];
+	const struct rb_disk_node *saved;
+	struct rb_node *node = rb_lower_bound(tree, lo);
+	struct rb_node scratch;
+	long offset = mapped->header->root;
+	long depth = 0, visited = 0;
+
+	memset(&scratch, 0, sizeof(scratch));
+
+	while (offset)
+	{
+		saved = (const struct rb_disk_node *)(mapped->base + offset);
+		if (saved->key >= lo)
+		{
+			stack[depth++] = saved;
+			offset = saved->left;
+		}
+		else
+		{
+			offset = saved->right;
+		}
+	}
+
+	for (;;)
+	{
+		struct rb_node *next = NULL;
+
+		saved = (depth > 0 && stack[depth - 1]->key <= hi) ? stack[depth - 1] : NULL;
+		if (node && node->key > hi)
+		{
+			node = NULL;
+		}
+		if (!node && !saved)
+		{
+			break;
+		}
+
+		// Take the smaller key. A key in both places is a tombstoned saved one.
+		if (saved && (!node || saved->key <= node->key))
+		{
+			depth--;
+			for (offset = saved->right; offset; offset = stack[depth - 1]->left)
+			{
+				stack[depth++] = (const struct rb_disk_node *)(mapped->base + offset);
+			}
+			if (!_rb_disk_live(mapped, saved))
+			{
+				continue;
+			}
+			scratch.key = saved->key;
+			scratch.data = (void *)saved->data;
+			next = &scratch;
+		}
+		else
+		{
+			next = node;
+			node = rb_next(node);
+		}
+
+		visited++;
+		if (callback(next, context))
+		{
+			break;
+		}
+	}
+
+	return visited;
+}
+
+
+
+///
+/// rb_map
+///
+/// Opens a file written by rb_save as a tree, without reading the nodes in. Changes 
+/// appended since the save are replayed. The tree works with rb_insert, rb_delete, 
+/// rb_lookup, rb_count, rb_range_scan and rb_save; rank, select, the cursor and the
+/// rest only see the changes, and the ones that would go wrong say so. Returns NULL if
+/// path can't be opened or isn't a saved tree.
+///
+
+struct rb_tree *rb_map(const char *path)
+{
+	struct rb_disk_header header;
+	struct rb_log_record records[256];
+	struct rb_mapped *mapped;
+	struct rb_tree *tree;
+	struct stat st;
+	long offset, i, n;
+	void *base;
+	int fd = open(path, O_RDWR | O_APPEND);
+
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(header.magic, RB_DISK_MAGIC, sizeof(header.magic)) != 0 ||
+		header.log != _rb_disk_offset(header.count) || header.log > st.st_size)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, header.log, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	mapped = (struct rb_mapped *)malloc(sizeof(struct rb_mapped));
+	mapped->base = (const char *)base;
+	mapped->size = header.log;
+	mapped->header = (const struct rb_disk_header *)base;
+	mapped->fd = fd;
+	mapped->tombstones = rb_create();
+	tree = rb_create();
+	tree->mapped = mapped;
+
+	// A record cut short by a crash is left off.
+	mapped->replaying = 1;
+	for (offset = header.log; offset + (long)sizeof(struct rb_log_record) <= st.st_size; offset += n * sizeof(struct rb_log_record))
+	{
+		n = pread(fd, records, sizeof(records), offset) / (long)sizeof(struct rb_log_record);
+		ASSERT(n > 0, "Couldn't read the changes in %s.", path);
+		for (i = 0; i < n; i++)
+		{
+			if (records[i].op == rb_log_insert)
+			{
+				rb_insert(tree, records[i].key, (void *)records[i].data);
+			}
+			else
+			{
+				rb_delete(tree, records[i].key);
+			}
+		}
+	}
+	mapped->replaying = 0;
+
+	// The next change has to start on a record boundary.
+	if (offset != st.st_size)
+	{
+		ASSERT(ftruncate(fd, offset) == 0, "Couldn't drop the partial change at the end of %s.", path);
+	}
+
+	return tree;
+}
+
+
+
+///
+/// _rb_unmap
+///
+/// rb_destroy's part for a mapped tree. The file stays as it is.
+///
+
+void _rb_unmap(struct rb_tree *tree)
+{
+	struct rb_mapped *mapped = tree->mapped;
+
+	munmap((void *)mapped->base, mapped->size);
+	close(mapped->fd);
+	rb_destroy(mapped->tombstones);
+	free(mapped);
+	tree->mapped = NULL;
+}
+
+
+
+
+//
+// Frozen trees
+//
+// rb_freeze copies a tree into two flat arrays in Eytzinger order, the layout of a binary
+// heap: slot 1 is the root and the children of slot i are 2i and 2i + 1. There are no
+// pointers, colors or counts, just the keys and the data. A search is a loop of
+// i = 2i + (keys[i] < key), which compiles to no branch but the loop's own, and the 16
+// keys four levels further down sit in two cache lines that are prefetched while this
+// level is compared. So the misses of four levels overlap instead of following each other.
+//
+// Nothing can change a frozen tree. It's meant for data that is rebuilt each epoch:
+// freeze the new tree and swap it in.
+//
+
+struct rb_frozen
+{
+	long count;
+	long *keys;						// count + 1 of them, keys[0] unused, cache line aligned.
+	void **data;					// data[i] goes with keys[i].
+};
+
+struct rb_freeze_context
+{
+	struct rb_frozen *frozen;
+	long slot;
+};
+
+
+
+///
+/// _rb_frozen_next
+///
+/// The slot after slot in key order: the leftmost slot under its right child, or else
+/// the first ancestor it's a left descendant of. Slot 0 means there is none.
+///
+
+long _rb_frozen_next(long slot, long count)
+{
+	if (2 * slot + 1 <= count)
+	{
+		for (slot = 2 * slot + 1; 2 * slot <= count; slot *= 2)
+		{
+		}
+		return slot;
+	}
+
+	while (slot & 1)
+	{
+		slot >>= 1;
+	}
+	return slot >> 1;
+}
+
+
+
+///
+/// _rb_freeze_callback
+///
+/// Puts each node of the tree, coming in key order, into the next slot in key order.
+///
+
+int _rb_freeze_callback(struct rb_node *node, void *context)
+{
+	struct rb_freeze_context *freeze = (struct rb_freeze_context *)context;
+
+	freeze->frozen->keys[freeze->slot] = node->key;
+	freeze->frozen->data[freeze->slot] = node->data;
+	freeze->slot = _rb_frozen_next(freeze->slot, freeze->frozen->count);
+	return 0;
+}
+
+
+
+///
+/// rb_freeze
+///
+/// Makes a frozen copy of the tree. The tree itself is left alone, and any kind of tree
+/// works: persistent, mapped or plain. O(n), with one pass over the tree.
+///
+
+struct rb_frozen *rb_freeze(struct rb_tree *tree)
+{
+	struct rb_frozen *frozen = (struct rb_frozen *)malloc(sizeof(struct rb_frozen));
+	struct rb_freeze_context freeze;
+	long bytes;
+
+	ASSERT(frozen != NULL, "Out of memory freezing a tree.");
+	frozen->count = rb_count(tree);
+
+	// aligned_alloc wants a whole number of cache lines.
+	bytes = ((frozen->count + 1) * sizeof(long) + 63) & ~63L;
+	frozen->keys = (long *)aligned_alloc(64, bytes);
+	frozen->data = (void **)malloc((frozen->count + 1) * sizeof(void *));
+	ASSERT(frozen->keys != NULL && frozen->data != NULL, "Out of memory freezing a tree.");
+
+	// The leftmost slot holds the smallest key.
+	freeze.frozen = frozen;
+	for (freeze.slot = 1; 2 * freeze.slot <= frozen->count; freeze.slot *= 2)
+	{
+	}
+	if (frozen->count)
+	{
+		rb_range_scan(tree, LONG_MIN, LONG_MAX, _rb_freeze_callback, &freeze);
+	}
+	ASSERT(freeze.slot == 0 || frozen->count == 0, "Tree changed while it was being frozen.");
+
+	return frozen;
+}
+
+
+
+///
+/// rb_frozen_destroy
+///
+
+void rb_frozen_destroy(struct rb_frozen *frozen)
+{
+	free(frozen->keys);
+	free(frozen->data);
+	free(frozen);
+}
+
+
+
+///
+/// rb_frozen_lower_bound
+///
+/// The slot of the smallest key >= key, or 0 if every key is smaller. keys[slot] and
+/// data[slot] are the key and its data.
+///
+/// Each step appends a bit to i: 1 for going right. The answer is the last node the
+/// search went left at, and every step after that went right, so it's i with the
+/// trailing 1s and the 0 before them shifted off. If it never went left, that's 0.
+///
+/// On the last four levels the prefetches point past the end of keys. That does no
+/// harm: a prefetch never faults.
+///
+
+long rb_frozen_lower_bound(struct rb_frozen *frozen, long key)
+{
+	const long *keys = frozen->keys;
+	long count = frozen->count;
+	long i = 1;
+
+	while (i <= count)
+	{
+		__builtin_prefetch(keys + 16 * i);
+		__builtin_prefetch(keys + 16 * i + 8);
+		i = 2 * i + (keys[i] < key);
+	}
+
+	return i >> __builtin_ffsl(~i);
+}
+
+
+
+///
+/// rb_frozen_lookup
+///
+/// Look up an element in the frozen tree. If it's not found, return NULL.
+///
+
+void *rb_frozen_lookup(struct rb_frozen *frozen, long key)
+{
+	long slot = rb_frozen_lower_bound(frozen, key);
+
+	return (slot && frozen->keys[slot] == key) ? frozen->data[slot] : NULL;
+}
+
+
+
+///
+/// rb_frozen_rank
+///
+/// How many keys are less than key, like rb_rank. Worked out from the lower bound's slot
+/// with no counts stored: in a perfect tree of all the levels, the node at depth d and
+/// offset o along its level has (2o + 1) * 2^(levels - 1 - d) - 1 nodes before it. The
+/// real tree is that minus the missing right end of the last level, whose nodes would
+/// sit at every even position from 2 * (nodes on the last level) on.
+///
+
+long rb_frozen_rank(struct rb_frozen *frozen, long key)
+{
+	long slot = rb_frozen_lower_bound(frozen, key);
+	long levels, depth, rank, last_level, missing;
+
+	if (slot == 0)
+	{
+		return frozen->count;
+	}
+
+	levels = 64 - __builtin_clzl(frozen->count);
+	depth = 63 - __builtin_clzl(slot);
+	rank = ((2 * (slot - (1L << depth)) + 1) << (levels - 1 - depth)) - 1;
+	last_level = frozen->count - (1L << (levels - 1)) + 1;
+	missing = (rank + 1) / 2 - last_level;
+
+	return (missing > 0) ? rank - missing : rank;
+}
+
+
+
+
+//
+// Sharded maps
+//
+// A tree takes one writer at a time. An rb_sharded map splits the key space into ranges,
+// each its own tree with its own arena and write lock, so writers to different ranges
+// don't wait for each other. Lookups and scans read the shards' trees the lock-free way
+// (rb_concurrent_lookup and rb_concurrent_range_scan), and rank and select add up the
+// shards' counts in front of the one that holds the answer.
+//
+// Each shard counts the writes it takes and how many of them had to wait for the lock.
+// Once one has taken RB_SHARD_WINDOW, the map looks at them all and splits a hot shard at
+// its median. Hot means writers queue up on it (more than one write in RB_SHARD_CONTENDED
+// waited), or it got more than twice its fair share of the writes, or all of them, so
+// sorted inserts keep splitting off the end. A split builds the upper half as a new tree
+// with rb_build_from_sorted and cuts it from the old one with rb_delete_range, rather
+// than using rb_split, because split trees share an arena and arenas aren't locked.
+//
+// Lookups, inserts and deletes touch nothing shared but the shard they land on. The
+// directory of shards is never changed in place: a split makes a new one and swaps the
+// map's pointer to it, and the old one is kept until the map is destroyed, so a thread
+// still holding it reads nothing freed. A writer picks its shard from the directory it
+// loaded, takes the shard's lock, and starts over if the directory was swapped meanwhile;
+// the split holds the lock of the shard it cuts from until the swap, so once a writer has
+// the lock and the same directory, the shard is the right one. A lookup can't take the
+// lock, so the map keeps a sequence number like a tree's, odd while a split is moving
+// keys, and a lookup that saw it change looks again. Splits take the map's read-write
+// lock to write, which keeps them one at a time, and scans, rank, select and count take
+// it to read so the shards hold still under them.
+//
+// Scans and rank, select and count read one shard after another, so with writers running
+// the result is made of each shard as it was at a slightly different moment.
+//
+
+// Writes to one shard between looks for a hot shard.
+#define RB_SHARD_WINDOW 65536
+
+// A shard smaller than this isn't worth splitting, and a map never gets more shards than
+// RB_SHARD_MAX.
+#define RB_SHARD_MIN_KEYS 4096
+#define RB_SHARD_MAX 256
+
+// A shard where more than one write in this many waited for the lock is hot.
+#define RB_SHARD_CONTENDED 16
+
+// Each shard gets a cache line to itself, so writers counting on different shards don't
+// bounce a line between them.
+struct rb_shard
+{
+	long lo;						// Keys from here up to the next shard's lo.
+	struct rb_tree *tree;
+	long writes;					// Since the last look, counted under the tree's write lock.
+	long waits;						// Of those, the ones that found the lock taken.
+};
+
+struct rb_shard_directory
+{
+	struct rb_shard_directory *previous;	// The one this replaced, freed with the map.
+	long count;
+	struct rb_shard *shards[];		// In key order, count of them.
+};
+
+struct rb_sharded
+{
+	struct rb_shard_directory *directory;	// Swapped whole by a split, never changed in place.
+	unsigned long sequence;			// Odd while a split is moving keys between shards.
+	pthread_rwlock_t lock;			// Written by splits; read by scans, rank, select and count.
+};
+
+struct rb_sharded_scan_context
+{
+	int (*callback)(long key, void *data, void *context);
+	void *context;
+	int stopped;
+};
+
+struct rb_sharded_split_context
+{
+	long *keys;
+	void **data;
+	long count;
+};
+
+
+
+///
+/// _rb_sharded_new_shard / _rb_sharded_new_directory
+///
+
+struct rb_shard *_rb_sharded_new_shard(long lo, struct rb_tree *tree)
+{
+	// aligned_alloc wants a whole number of cache lines.
+	struct rb_shard *shard = (struct rb_shard *)aligned_alloc(64, (sizeof(struct rb_shard) + 63) & ~63);
+
+	ASSERT(shard != NULL, "Out of memory for a shard.");
+	shard->lo = lo;
+	shard->tree = tree;
+	shard->writes = 0;
+	shard->waits = 0;
+	return shard;
+}
+
+struct rb_shard_directory *_rb_sharded_new_directory(long count)
+{
+	struct rb_shard_directory *directory = (struct rb_shard_directory *)malloc(sizeof(struct rb_shard_directory) + count * sizeof(struct rb_shard *));
+
+	ASSERT(directory != NULL, "Out of memory for a shard directory.");
+	directory->previous = NULL;
+	directory->count = count;
+	return directory;
+}
+
+
+
+///
+/// rb_sharded_create
+///
+/// Creates a map with n + 1 shards split at bounds, which must be strictly increasing.
+/// With n = 0 it starts as one shard and splits as writes come in.
+///
+
+struct rb_sharded *rb_sharded_create(const long *bounds, long n)
+{
+	struct rb_sharded *map = (struct rb_sharded *)malloc(sizeof(struct rb_sharded));
+	long i;
+
+	ASSERT(map != NULL, "Out of memory for a sharded map.");
+	ASSERT(n + 1 <= RB_SHARD_MAX, "rb_sharded_create takes at most %d shards", RB_SHARD_MAX);
+	for (i = 1; i < n; i++)
+	{
+		ASSERT(bounds[i - 1] < bounds[i], "rb_sharded_create needs increasing bounds: %ld, %ld", bounds[i - 1], bounds[i]);
+	}
+
+	pthread_rwlock_init(&map->lock, NULL);
+	map->sequence = 0;
+	map->directory = _rb_sharded_new_directory(n + 1);
+	for (i = 0; i <= n; i++)
+	{
+		map->directory->shards[i] = _rb_sharded_new_shard(i ? bounds[i - 1] : LONG_MIN, rb_create());
+	}
+	return map;
+}
+
+
+
+///
+/// rb_sharded_destroy
+///
+
+void rb_sharded_destroy(struct rb_sharded *map)
+{
+	struct rb_shard_directory *directory = map->directory, *previous;
+	long i;
+
+	// Every shard is in the newest directory; the older ones only hold pointers.
+	for (i = 0; i < directory->count; i++)
+	{
+		rb_destroy(directory->shards[i]->tree);
+		free(directory->shards[i]);
+	}
+	for (; directory; directory = previous)
+	{
+		previous = directory->previous;
+		free(directory);
+	}
+	pthread_rwlock_destroy(&map->lock);
+	free(map);
+}
+
+
+
+///
+/// _rb_sharded_find
+///
+/// The index in directory of the shard holding key: the last one whose lo is no bigger.
+///
+
+long _rb_sharded_find(struct rb_shard_directory *directory, long key)
+{
+	long lo = 0, hi = directory->count - 1, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo + 1) / 2;
+		if (directory->shards[mid]->lo <= key)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+
+
+///
+/// _rb_sharded_count_of
+///
+/// rb_count of a shard's tree, read the same lock-free way as rb_concurrent_lookup.
+///
+
+long _rb_sharded_count_of(struct rb_tree *tree)
+{
+	unsigned long sequence;
+	struct rb_node *root;
+	long count;
+
+	do
+	{
+		sequence = _rb_read_begin(tree);
+		root = tree->root;
+		count = root ? _rb_num_children(root) + 1 : 0;
+	}
+	while (_rb_read_retry(tree, sequence));
+
+	return count;
+}
+
+
+
+///
+/// _rb_sharded_split_callback / _rb_sharded_split
+///
+/// Moves the upper half of shard i into a new shard right after it and swaps in a
+/// directory with the new shard in it. The caller holds the map's lock for writing.
+///
+
+int _rb_sharded_split_callback(struct rb_node *node, void *context)
+{
+	struct rb_sharded_split_context *split = (struct rb_sharded_split_context *)context;
+
+	split->keys[split->count] = node->key;
+	split->data[split->count] = node->data;
+	split->count++;
+	return 0;
+}
+
+void _rb_sharded_split(struct rb_sharded *map, long i)
+{
+	struct rb_shard_directory *old = map->directory;
+	struct rb_shard_directory *directory = _rb_sharded_new_directory(old->count + 1);
+	struct rb_tree *tree = old->shards[i]->tree;
+	struct rb_sharded_split_context split;
+	long n, median;
+
+	// Writers that had old and land on this shard wait here and then find it swapped.
+	rb_write_lock(tree);
+	__atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	n = rb_count(tree);
+	median = rb_select(tree, n / 2)->key;
+	split.keys = (long *)malloc((n - n / 2) * sizeof(long));
+	split.data = (void **)malloc((n - n / 2) * sizeof(void *));
+	ASSERT(split.keys != NULL && split.data != NULL, "Out of memory splitting a shard.");
+	split.count = 0;
+	rb_range_scan(tree, median, LONG_MAX, _rb_sharded_split_callback, &split);
+	rb_delete_range(tree, median, LONG_MAX);
+
+	memcpy(directory->shards, old->shards, (i + 1) * sizeof(struct rb_shard *));
+	directory->shards[i + 1] = _rb_sharded_new_shard(median, rb_build_from_sorted(split.keys, split.data, split.count));
+	memcpy(&directory->shards[i + 2], &old->shards[i + 1], (old->count - i - 1) * sizeof(struct rb_shard *));
+	directory->previous = old;
+	__atomic_store_n(&map->directory, directory, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELEASE);
+	rb_write_unlock(tree);
+
+	free(split.keys);
+	free(split.data);
+}
+
+
+
+///
+/// _rb_sharded_hot
+///
+/// Picks the shard to split: of the hot ones big enough to split, the one that took the
+/// most writes. Returns -1 if there's none. The caller holds the map's lock for writing;
+/// writers keep counting while it looks, which only makes the counts a little stale.
+///
+
+long _rb_sharded_hot(struct rb_sharded *map)
+{
+	struct rb_shard_directory *directory = map->directory;
+	long i, hot = -1, total = 0, writes, waits, most = 0;
+
+	for (i = 0; i < directory->count; i++)
+	{
+		total += __atomic_load_n(&directory->shards[i]->writes, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < directory->count && directory->count < RB_SHARD_MAX; i++)
+	{
+		writes = __atomic_load_n(&directory->shards[i]->writes, __ATOMIC_RELAXED);
+		waits = __atomic_load_n(&directory->shards[i]->waits, __ATOMIC_RELAXED);
+		if ((waits * RB_SHARD_CONTENDED > writes || writes == total || writes * directory->count > 2 * total) &&
+			writes > 0 && (hot < 0 || writes > most) && _rb_sharded_count_of(directory->shards[i]->tree) >= RB_SHARD_MIN_KEYS)
+		{
+			hot = i;
+			most = writes;
+		}
+	}
+	return hot;
+}
+
+
+
+///
+/// _rb_sharded_rebalance
+///
+/// Called after a shard reaches RB_SHARD_WINDOW writes: splits the hot shard, if there
+/// is one, and starts the count again.
+///
+
+void _rb_sharded_rebalance(struct rb_sharded *map)
+{
+	struct rb_shard_directory *directory;
+	long i, hot;
+	int full = 0;
+
+	pthread_rwlock_wrlock(&map->lock);
+
+	// Another writer may have got here first and started the count again.
+	directory = map->directory;
+	for (i = 0; i < directory->count; i++)
+	{
+		full |= (__atomic_load_n(&directory->shards[i]->writes, __ATOMIC_RELAXED) >= RB_SHARD_WINDOW);
+	}
+
+	if (full)
+	{
+		hot = _rb_sharded_hot(map);
+		if (hot >= 0)
+		{
+			_rb_sharded_split(map, hot);
+		}
+		directory = map->directory;
+		for (i = 0; i < directory->count; i++)
+		{
+			__atomic_store_n(&directory->shards[i]->writes, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&directory->shards[i]->waits, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_rwlock_unlock(&map->lock);
+}
+
+
+
+///
+/// _rb_sharded_lock / _rb_sharded_unlock
+///
+/// _rb_sharded_lock finds the shard holding key and takes its tree's write lock, counting
+/// it if the lock was taken. _rb_sharded_unlock counts the write, lets the lock go, and
+/// says whether the shard has taken RB_SHARD_WINDOW writes.
+///
+
+struct rb_shard *_rb_sharded_lock(struct rb_sharded *map, long key)
+{
+	struct rb_shard_directory *directory;
+	struct rb_shard *shard;
+	int waited;
+
+	for (;;)
+	{
+		directory = __atomic_load_n(&map->directory, __ATOMIC_ACQUIRE);
+		shard = directory->shards[_rb_sharded_find(directory, key)];
+		waited = 0;
+		if (pthread_mutex_trylock(&shard->tree->write_lock) != 0)
+		{
+			pthread_mutex_lock(&shard->tree->write_lock);
+			waited = 1;
+		}
+
+		// A split swaps the directory before it lets go of the shard it cut from.
+		if (__atomic_load_n(&map->directory, __ATOMIC_ACQUIRE) == directory)
+		{
+			break;
+		}
+		pthread_mutex_unlock(&shard->tree->write_lock);
+	}
+
+	_rb_write_begin(shard->tree);
+	if (waited)
+	{
+		__atomic_store_n(&shard->waits, __atomic_load_n(&shard->waits, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	}
+	return shard;
+}
+
+int _rb_sharded_unlock(struct rb_shard *shard)
+{
+	long writes = __atomic_load_n(&shard->writes, __ATOMIC_RELAXED) + 1;
+
+	__atomic_store_n(&shard->writes, writes, __ATOMIC_RELAXED);
+	rb_write_unlock(shard->tree);
+	return writes >= RB_SHARD_WINDOW;
+}
+
+
+
+///
+/// rb_sharded_insert / rb_sharded_delete
+///
+/// rb_insert and rb_delete on the shard holding key, under that shard's write lock.
+///
+
+void rb_sharded_insert(struct rb_sharded *map, long key, void *data)
+{
+	struct rb_shard *shard = _rb_sharded_lock(map, key);
+
+	rb_insert(shard->tree, key, data);
+	if (_rb_sharded_unlock(shard))
+	{
+		_rb_sharded_rebalance(map);
+	}
+}
+
+void rb_sharded_delete(struct rb_sharded *map, long key)
+{
+	struct rb_shard *shard = _rb_sharded_lock(map, key);
+
+	rb_delete(shard->tree, key);
+	if (_rb_sharded_unlock(shard))
+	{
+		_rb_sharded_rebalance(map);
+	}
+}
+
+
+
+///
+/// rb_sharded_lookup
+///
+/// rb_concurrent_lookup in the shard holding key, looking again if a split moved keys
+/// meanwhile.
+///
+
+void *rb_sharded_lookup(struct rb_sharded *map, long key)
+{
+	struct rb_shard_directory *directory;
+	unsigned long sequence;
+	void *data;
+
+	do
+	{
+		while ((sequence = __atomic_load_n(&map->sequence, __ATOMIC_ACQUIRE)) & 1)
+		{
+			sched_yield();
+		}
+		directory = __atomic_load_n(&map->directory, __ATOMIC_ACQUIRE);
+		data = rb_concurrent_lookup(directory->shards[_rb_sharded_find(directory, key)]->tree, key);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while (__atomic_load_n(&map->sequence, __ATOMIC_RELAXED) != sequence);
+
+	return data;
+}
+
+
+
+///
+/// rb_sharded_count
+///
+
+long rb_sharded_count(struct rb_sharded *map)
+{
+	struct rb_shard_directory *directory;
+	long i, count = 0;
+
+	pthread_rwlock_rdlock(&map->lock);
+	directory = map->directory;
+	for (i = 0; i < directory->count; i++)
+	{
+		count += _rb_sharded_count_of(directory->shards[i]->tree);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	return count;
+}
+
+
+
+///
+/// rb_sharded_rank
+///
+/// How many keys in the map are strictly smaller than key: the counts of the shards in
+/// front of key's shard, plus rb_rank in that one.
+///
+
+long rb_sharded_rank(struct rb_sharded *map, long key)
+{
+	struct rb_shard_directory *directory;
+	long i, shard, rank = 0;
+	struct rb_tree *tree;
+
+	pthread_rwlock_rdlock(&map->lock);
+	directory = map->directory;
+	shard = _rb_sharded_find(directory, key);
+	for (i = 0; i < shard; i++)
+	{
+		rank += _rb_sharded_count_of(directory->shards[i]->tree);
+	}
+
+	// rb_rank has no lock-free version, so it keeps the shard's writers out instead.
+	tree = directory->shards[shard]->tree;
+	rb_write_lock(tree);
+	rank += rb_rank(tree, key);
+	rb_write_unlock(tree);
+	pthread_rwlock_unlock(&map->lock);
+	return rank;
+}
+
+
+
+///
+/// rb_sharded_select
+///
+/// Finds the key of rank k, 0 being the smallest, and returns 1 with the key and its
+/// data in *key and *data, or 0 if the map has no more than k keys.
+///
+
+int rb_sharded_select(struct rb_sharded *map, long k, long *key, void **data)
+{
+	struct rb_shard_directory *directory;
+	struct rb_tree *tree;
+	struct rb_node *node = NULL;
+	long i, count;
+
+	pthread_rwlock_rdlock(&map->lock);
+	directory = map->directory;
+	for (i = 0; i < directory->count && !node && k >= 0; i++)
+	{
+		tree = directory->shards[i]->tree;
+		rb_write_lock(tree);
+		count = rb_count(tree);
+		if (k < count)
+		{
+			node = rb_select(tree, k);
+			*key = node->key;
+			*data = node->data;
+		}
+		k -= count;
+		rb_write_unlock(tree);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	return node != NULL;
+}
+
+
+
+///
+/// rb_sharded_range_scan
+///
+/// rb_concurrent_range_scan over the shards that lo..hi covers, in key order. Returns
+/// how many keys the callback was given. The callback must not write to the map: a write
+/// that splits a shard would wait on the scan forever.
+///
+
+int _rb_sharded_scan_callback(long key, void *data, void *context)
+{
+	struct rb_sharded_scan_context *scan = (struct rb_sharded_scan_context *)context;
+
+	scan->stopped = scan->callback(key, data, scan->context);
+	return scan->stopped;
+}
+
+long rb_sharded_range_scan(struct rb_sharded *map, long lo, long hi, int (*callback)(long key, void *data, void *context), void *context)
+{
+	struct rb_shard_directory *directory;
+	struct rb_sharded_scan_context scan;
+	struct rb_shard **shards;
+	long i, visited = 0;
+
+	scan.callback = callback;
+	scan.context = context;
+	scan.stopped = 0;
+
+	pthread_rwlock_rdlock(&map->lock);
+	directory = map->directory;
+	shards = directory->shards;
+	for (i = _rb_sharded_find(directory, lo); lo <= hi && i < directory->count && shards[i]->lo <= hi && !scan.stopped; i++)
+	{
+		visited += rb_concurrent_range_scan(shards[i]->tree, (lo > shards[i]->lo) ? lo : shards[i]->lo,
+			(i + 1 < directory->count && shards[i + 1]->lo - 1 < hi) ? shards[i + 1]->lo - 1 : hi,
+			_rb_sharded_scan_callback, &scan);
+	}
+	pthread_rwlock_unlock(&map->lock);
+	return visited;
+}
+
+
+
+
+#ifdef RB_AUGMENT
+
+//
+// Augmented trees
+//
+// Every node already keeps the size of its subtree, and rotations, inserts, deletes,
+// joins and splits keep it right; that's what rank and select run on. With -DRB_AUGMENT 
+// a node keeps one more number, the aggregate of its subtree under a combine function
+// the tree is given with rb_set_augment, and it gets kept right in all the same places.
+// rb_range_aggregate then answers "sum (or min, or max, ...) of the values with keys in
+// [lo, hi]" in O(log n) by combining the aggregates of the O(log n) subtrees that make up
+// the range, instead of visiting every key in it.
+//
+// combine must be associative and commutative: an insert folds the new value into each
+// node on its way down, in whatever order the rest got there. A node's value comes from
+// its key and data, so data has to be changed with rb_set_data, which fixes the
+// aggregates above it, rather than in place. Set operations and rb_join need both trees
+// to have the same augment. Persistent and mapped trees can't have one.
+//
+
+long _rb_augment_data(long key, void *data) { (void)key; return (long)data; }
+long _rb_augment_add(long a, long b) { return a + b; }
+long _rb_augment_smaller(long a, long b) { return (a < b) ? a : b; }
+long _rb_augment_larger(long a, long b) { return (a > b) ? a : b; }
+
+// The usual ones, over data taken as a number.
+const struct rb_augment rb_augment_sum = { _rb_augment_data, _rb_augment_add, 0 };
+const struct rb_augment rb_augment_min = { _rb_augment_data, _rb_augment_smaller, LONG_MAX };
+const struct rb_augment rb_augment_max = { _rb_augment_data, _rb_augment_larger, LONG_MIN };
+
+
+
+///
+/// rb_set_augment
+///
+/// Makes the tree keep augment's aggregate in every node, or stop keeping one if augment
+/// is NULL. The aggregates of the nodes already there are worked out bottom up, O(n).
+///
+
+void _rb_augment_subtree(const struct rb_augment *augment, struct rb_node *node)
+{
+	if (node)
+	{
+		_rb_augment_subtree(augment, _rb_left_child(node));
+		_rb_augment_subtree(augment, _rb_right_child(node));
+		_rb_augment_update(augment, node);
+	}
+}
+
+void rb_set_augment(struct rb_tree *tree, const struct rb_augment *augment)
+{
+	ASSERT(!tree->persistent, "Persistent trees can't be augmented.");
+	ASSERT(!tree->mapped, "Mapped trees can't be augmented: the saved keys aren't in nodes.");
+
+	tree->augment = augment;
+	_rb_augment_subtree(augment, tree->root);
+}
+
+
+
+///
+/// rb_range_aggregate
+///
+/// Combines the values of every key k with lo <= k <= hi, or returns the identity if there
+/// are none. Below the first node in the range, the lo and hi paths go their own ways: 
+/// every node on the lo path that's in the range brings itself and its whole right 
+/// subtree, and the hi path likewise with left subtrees.
+///
+
+long rb_range_aggregate(struct rb_tree *tree, long lo, long hi)
+{
+	const struct rb_augment *augment = tree->augment;
+	struct rb_node *node = tree->root;
+	struct rb_node *child;
+	long result;
+
+	ASSERT(augment != NULL, "rb_range_aggregate needs a tree with an augment, see rb_set_augment.");
+
+	while (node && (node->key < lo || node->key > hi))
+	{
+		node = (node->key < lo) ? _rb_right_child(node) : _rb_left_child(node);
+	}
+	if (!node)
+	{
+		return augment->identity;
+	}
+
+	result = augment->value(node->key, node->data);
+	for (child = _rb_left_child(node); child; )
+	{
+		if (child->key >= lo)
+		{
+			result = augment->combine(result, augment->value(child->key, child->data));
+			result = augment->combine(result, _rb_aggregate(augment, _rb_right_child(child)));
+			child = _rb_left_child(child);
+		}
+		else
+		{
+			child = _rb_right_child(child);
+		}
+	}
+	for (child = _rb_right_child(node); child; )
+	{
+		if (child->key <= hi)
+		{
+			result = augment->combine(result, augment->value(child->key, child->data));
+			result = augment->combine(result, _rb_aggregate(augment, _rb_left_child(child)));
+			child = _rb_right_child(child);
+		}
+		else
+		{
+			child = _rb_left_child(child);
+		}
+	}
+	return result;
+}
+
+#endif
+
+
+
+
+//
+// Buffered inserts
+//
+// Each rb_insert into a big tree is a descent that misses the cache most of the way down.
+// An rb_buffered puts buffers in front of a tree, the way an LSM tree does, so that writes
+// in a burst cost a few sequential memory moves instead:
+//
+// 1. An append buffer of RB_BUFFER_APPEND writes, newest last. A write is a store at
+//    the end; a lookup checks it newest first.
+// 2. Sorted runs, where level i holds RB_BUFFER_APPEND << i keys or nothing. A full 
+//    append buffer gets sorted and carried up the levels like a binary counter: merged
+//    with each full level in one sequential pass until it reaches an empty one. A key
+//    gets moved about once per level, and lookups binary search each level.
+//
+// When the carry runs past the top level, with about capacity keys, it becomes a tree in 
+// O(m) with rb_build_from_sorted and goes into the main tree with rb_union. That costs
+// O(m log(n/m + 1)) rather than m descents, and spreads over the pool's threads (see 
+// rb_set_threads). It still touches the tree's nodes wherever they are in memory, so the
+// bigger the batch, the fewer misses per key.
+//
+// Deletes are writes too: a tombstone in the buffers that hides older data, until the
+// flush takes the key out of the tree with rb_difference. Since a write can't look at the
+// tree without giving up what the buffer is for, rb_buffered_insert on a key that's
+// already there replaces its data, and rb_buffered_delete of a key that isn't there does
+// nothing, instead of asserting like rb_insert and rb_delete.
+//
+// rb_buffered_flush empties the buffers and hands back the tree, for everything that
+// isn't a plain lookup. Like a tree, an rb_buffered takes one thread at a time.
+//
+
+#define RB_BUFFER_APPEND 256
+
+// Enough levels for any capacity that fits in memory.
+#define RB_BUFFER_LEVELS 40
+
+// Stands in for the data of a deleted key.
+char _rb_buffer_tombstone;
+#define RB_BUFFER_TOMBSTONE ((void *)&_rb_buffer_tombstone)
+
+// Unique keys in order, each with its newest data.
+struct rb_buffer_run
+{
+	long *keys;
+	void **data;
+	long count;
+};
+
+struct rb_buffered
+{
+	struct rb_tree *tree;
+	long append_keys[RB_BUFFER_APPEND];
+	void *append_data[RB_BUFFER_APPEND];
+	long appended;
+	struct rb_buffer_run levels[RB_BUFFER_LEVELS];	// Newer keys in lower levels.
+	long num_levels;
+	struct rb_buffer_run carry, spare;				// Room for every level's keys at once.
+};
+
+
+
+///
+/// rb_buffered_create / rb_buffered_destroy
+///
+/// A buffered front end over a new, empty tree, which takes the buffered keys in batches
+/// of about capacity.
+///
+
+void _rb_buffer_run_alloc(struct rb_buffer_run *run, long size)
+{
+	run->keys = (long *)malloc(size * sizeof(long));
+	run->data = (void **)malloc(size * sizeof(void *));
+	ASSERT(run->keys != NULL && run->data != NULL, "Out of memory for a run of %ld keys.", size);
+	run->count = 0;
+}
+
+struct rb_buffered *rb_buffered_create(long capacity)
+{
+	struct rb_buffered *buffered = (struct rb_buffered *)malloc(sizeof(struct rb_buffered));
+	long i;
+
+	ASSERT(buffered != NULL, "Out of memory for a buffered tree.");
+	buffered->tree = rb_create();
+	buffered->appended = 0;
+	for (buffered->num_levels = 0; (RB_BUFFER_APPEND << buffered->num_levels) < capacity; buffered->num_levels++);
+	ASSERT(buffered->num_levels < RB_BUFFER_LEVELS, "rb_buffered_create capacity %ld is too big.", capacity);
+
+	for (i = 0; i < buffered->num_levels; i++)
+	{
+		_rb_buffer_run_alloc(&buffered->levels[i], RB_BUFFER_APPEND << i);
+	}
+	_rb_buffer_run_alloc(&buffered->carry, RB_BUFFER_APPEND << buffered->num_levels);
+	_rb_buffer_run_alloc(&buffered->spare, RB_BUFFER_APPEND << buffered->num_levels);
+	return buffered;
+}
+
+void rb_buffered_destroy(struct rb_buffered *buffered)
+{
+	long i;
+
+	rb_destroy(buffered->tree);
+	for (i = 0; i < buffered->num_levels; i++)
+	{
+		free(buffered->levels[i].keys);
+		free(buffered->levels[i].data);
+	}
+	free(buffered->carry.keys);
+	free(buffered->carry.data);
+	free(buffered->spare.keys);
+	free(buffered->spare.data);
+	free(buffered);
+}
+
+
+
+///
+/// _rb_buffered_sort_append
+///
+/// Sorts the append buffer into the carry. Insertion sort is stable, so of several writes 
+/// to one key the newest ends up last, and that's the one kept.
+///
+
+void _rb_buffered_sort_append(struct rb_buffered *buffered)
+{
+	long *keys = buffered->append_keys;
+	void **data = buffered->append_data;
+	long n = buffered->appended;
+	long i, j, key;
+	void *value;
+
+	for (i = 1; i < n; i++)
+	{
+		key = keys[i];
+		value = data[i];
+		for (j = i; j > 0 && keys[j - 1] > key; j--)
+		{
+			keys[j] = keys[j - 1];
+			data[j] = data[j - 1];
+		}
+		keys[j] = key;
+		data[j] = value;
+	}
+
+	buffered->carry.count = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (i + 1 < n && keys[i + 1] == keys[i])
+		{
+			continue;
+		}
+		buffered->carry.keys[buffered->carry.count] = keys[i];
+		buffered->carry.data[buffered->carry.count++] = data[i];
+	}
+	buffered->appended = 0;
+}
+
+
+
+///
+/// _rb_buffered_carry
+///
+/// Merges the older run into the carry, which wins for keys in both, and empties older.
+///
+
+void _rb_buffered_carry(struct rb_buffered *buffered, struct rb_buffer_run *older)
+{
+	struct rb_buffer_run *newer = &buffered->carry, *out = &buffered->spare, swap;
+	long n = 0, o = 0;
+
+	for (out->count = 0; n < newer->count || o < older->count; out->count++)
+	{
+		if (o == older->count || (n < newer->count && newer->keys[n] <= older->keys[o]))
+		{
+			if (o < older->count && older->keys[o] == newer->keys[n])
+			{
+				o++;
+			}
+			out->keys[out->count] = newer->keys[n];
+			out->data[out->count] = newer->data[n++];
+		}
+		else
+		{
+			out->keys[out->count] = older->keys[o];
+			out->data[out->count] = older->data[o++];
+		}
+	}
+	older->count = 0;
+
+	swap = *newer;
+	*newer = *out;
+	*out = swap;
+}
+
+
+
+///
+/// _rb_buffered_flush_carry
+///
+/// Moves the carry into the tree. Its keys are split into the live ones, which go in the 
+/// spare run, and the tombstones, which are packed down at the front of the carry.
+///
+/// Both batches are built in the tree's own arena, so the set operations have no arenas
+/// to merge, and the nodes they free (the tombstones, and the older of each pair of equal
+/// keys) go back on the tree's free list for the next batch to reuse. The arena stays the
+/// size of the tree plus a batch, however many flushes there have been.
+///
+
+void _rb_buffered_flush_carry(struct rb_buffered *buffered)
+{
+	struct rb_buffer_run *carry = &buffered->carry, *live = &buffered->spare;
+	struct rb_tree *batch;
+	long i, dead = 0;
+
+	for (i = 0, live->count = 0; i < carry->count; i++)
+	{
+		if (carry->data[i] == RB_BUFFER_TOMBSTONE)
+		{
+			carry->keys[dead++] = carry->keys[i];
+		}
+		else
+		{
+			live->keys[live->count] = carry->keys[i];
+			live->data[live->count++] = carry->data[i];
+		}
+	}
+
+	if (dead > 0)
+	{
+		batch = _rb_build_into(_rb_create_sharing(buffered->tree), carry->keys, NULL, dead);
+		buffered->tree = rb_difference(buffered->tree, batch);
+	}
+
+	// Keys in both keep the first tree's data, and the carry's is newer, so the batch goes
+	// first. The result is the batch's tree object, but the nodes and arena are the same.
+	batch = _rb_build_into(_rb_create_sharing(buffered->tree), live->keys, live->data, live->count);
+	buffered->tree = rb_union(batch, buffered->tree);
+	carry->count = 0;
+}
+
+
+
+///
+/// rb_buffered_insert / rb_buffered_delete
+///
+/// Write to the append buffer. A full one is carried up to the first empty level, or 
+/// into the tree if there isn't one.
+///
+
+void _rb_buffered_write(struct rb_buffered *buffered, long key, void *data)
+{
+	long i;
+
+	if (buffered->appended == RB_BUFFER_APPEND)
+	{
+		_rb_buffered_sort_append(buffered);
+		for (i = 0; i < buffered->num_levels && buffered->levels[i].count > 0; i++)
+		{
+			_rb_buffered_carry(buffered, &buffered->levels[i]);
+		}
+
+		if (i < buffered->num_levels)
+		{
+			memcpy(buffered->levels[i].keys, buffered->carry.keys, buffered->carry.count * sizeof(long));
+			memcpy(buffered->levels[i].data, buffered->carry.data, buffered->carry.count * sizeof(void *));
+			buffered->levels[i].count = buffered->carry.count;
+		}
+		else
+		{
+			_rb_buffered_flush_carry(buffered);
+		}
+	}
+
+	buffered->append_keys[buffered->appended] = key;
+	buffered->append_data[buffered->appended++] = data;
+}
+
+void rb_buffered_insert(struct rb_buffered *buffered, long key, void *data)
+{
+	ASSERT(data != RB_BUFFER_TOMBSTONE, "That data is taken to mean a deleted key.");
+	_rb_buffered_write(buffered, key, data);
+}
+
+void rb_buffered_delete(struct rb_buffered *buffered, long key)
+{
+	_rb_buffered_write(buffered, key, RB_BUFFER_TOMBSTONE);
+}
+
+
+
+///
+/// rb_buffered_lookup
+///
+/// The newest data for key: the append buffer newest first, then the levels from the 
+/// bottom up, then the tree. NULL if it isn't there or was deleted.
+///
+
+void *rb_buffered_lookup(struct rb_buffered *buffered, long key)
+{
+	struct rb_buffer_run *run;
+	long i, lo, hi, mid;
+
+	for (i = buffered->appended - 1; i >= 0; i--)
+	{
+		if (buffered->append_keys[i] == key)
+		{
+			return (buffered->append_data[i] == RB_BUFFER_TOMBSTONE) ? NULL : buffered->append_data[i];
+		}
+	}
+
+	for (run = buffered->levels; run < buffered->levels + buffered->num_levels; run++)
+	{
+		for (lo = 0, hi = run->count; lo < hi; )
+		{
+			mid = lo + (hi - lo) / 2;
+			if (run->keys[mid] < key)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		if (lo < run->count && run->keys[lo] == key)
+		{
+			return (run->data[lo] == RB_BUFFER_TOMBSTONE) ? NULL : run->data[lo];
+		}
+	}
+
+	return rb_lookup(buffered->tree, key);
+}
+
+
+
+///
+/// rb_buffered_flush
+///
+/// Moves everything buffered into the tree and returns the tree, which is up to date
+/// until the next write. It stays the buffered front end's: don't destroy it, and write 
+/// through the front end rather than to it, or the buffers could hide the change.
+///
+
+struct rb_tree *rb_buffered_flush(struct rb_buffered *buffered)
+{
+	long i;
+
+	_rb_buffered_sort_append(buffered);
+	for (i = 0; i < buffered->num_levels; i++)
+	{
+		if (buffered->levels[i].count > 0)
+		{
+			_rb_buffered_carry(buffered, &buffered->levels[i]);
+		}
+	}
+	if (buffered->carry.count > 0)
+	{
+		_rb_buffered_flush_carry(buffered);
+	}
+	return buffered->tree;
+}
+
+
+
+
+//
+// String keys
+//
+// rb_str_create makes a tree keyed by byte strings, ordered like memcmp with a string 
+// before any longer one it starts. Each node's long key holds the string's first 8 bytes,
+// zero padded, loaded big-endian so comparing them as numbers is comparing the bytes. A
+// descent only reads the rest of a string, in the entry node->data points to, when the 
+// first 8 bytes are the same as the key's. Near the top of a tree the prefixes spread 
+// wide apart, so most levels are one integer compare on a node already in the cache,
+// where std::map<std::string> follows a pointer to the string's bytes at every level. 
+// Keys that mostly share their first 8 bytes ("https://www.") get nothing from it and
+// cost one more miss per level than a plain string tree; hash or trim those first.
+//
+// The rest is the ordinary tree: a string goes in below the node its descent stops at
+// like a hinted insert, and comes out through _rb_erase_node. As far as the long keys go
+// it's a multimap, since two strings can share a prefix, so rb_validate checks the 
+// prefixes loosely and the operations that need unique keys refuse it. Use only the 
+// rb_str_ functions on one, plus rb_count, rb_select, rb_next, rb_prev and rb_validate,
+// with rb_str_key and rb_str_data to read a node.
+//
+
+#define RB_STR_PREFIX 8
+
+// What node->data points to in a string tree.
+struct rb_str_entry
+{
+	void *data;
+	size_t length;
+	char bytes[];					// The whole key, for rb_str_key.
+};
+
+long _rb_str_prefix(const char *key, size_t length)
+{
+	unsigned long prefix = 0;
+	size_t i;
+
+	if (length >= RB_STR_PREFIX)
+	{
+		memcpy(&prefix, key, RB_STR_PREFIX);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		prefix = __builtin_bswap64(prefix);
+#endif
+	}
+	else
+	{
+		for (i = 0; i < RB_STR_PREFIX; i++)
+		{
+			prefix = (prefix << 8) | (i < length ? (unsigned char)key[i] : 0);
+		}
+	}
+
+	// Flipping the top bit makes signed order the same as unsigned.
+	return (long)(prefix ^ (1UL << 63));
+}
+
+// Negative, zero or positive as key is before, the same as or after node's string.
+int _rb_str_compare(struct rb_node *node, long prefix, const char *key, size_t length)
+{
+	struct rb_str_entry *entry;
+	size_t common;
+	int compare;
+
+	if (prefix != node->key)
+	{
+		return (prefix < node->key) ? -1 : 1;
+	}
+
+	// The first 8 bytes they both have are the same.
+	entry = (struct rb_str_entry *)node->data;
+	common = (length < entry->length) ? length : entry->length;
+	compare = (common > RB_STR_PREFIX) ? memcmp(key + RB_STR_PREFIX, entry->bytes + RB_STR_PREFIX, common - RB_STR_PREFIX) : 0;
+	return compare ? compare : (length > entry->length) - (length < entry->length);
+}
+
+// The node with key, or NULL and where it would go below *parent.
+struct rb_node *_rb_str_find(struct rb_tree *tree, const char *key, size_t length, struct rb_node **parent, int *left)
+{
+	struct rb_node *node = tree->root;
+	long prefix = _rb_str_prefix(key, length), depth = 0;
+	int compare;
+
+	*parent = NULL;
+	*left = 0;
+	while (node && (compare = _rb_str_compare(node, prefix, key, length)) != 0)
+	{
+		*parent = node;
+		*left = (compare < 0);
+		node = *left ? _rb_left_child(node) : _rb_right_child(node);
+		depth++;
+	}
+	RB_STAT(descents);
+	RB_STAT_ADD(comparisons, depth);
+	return node;
+}
+
+
+
+///
+/// rb_str_create / rb_str_destroy
+///
+/// An empty string-keyed tree, and freeing one along with its copies of the keys.
+///
+
+struct rb_tree *rb_str_create()
+{
+	struct rb_tree *tree = rb_create();
+	tree->multimap = 1;
+	return tree;
+}
+
+void rb_str_destroy(struct rb_tree *tree)
+{
+	struct rb_node *node;
+
+	for (node = tree->leftmost; node; node = rb_next(node))
+	{
+		free(node->data);
+	}
+	rb_destroy(tree);
+}
+
+
+
+///
+/// rb_str_insert / rb_str_lookup / rb_str_delete
+///
+/// rb_insert, rb_lookup and rb_delete for the length bytes at key, which can be anything,
+/// zeros included. The tree keeps its own copy of the key.
+///
+
+void rb_str_insert(struct rb_tree *tree, const char *key, size_t length, void *data)
+{
+	struct rb_node *parent;
+	struct rb_str_entry *entry;
+	long prefix = _rb_str_prefix(key, length);
+	int left;
+
+	ASSERT(_rb_str_find(tree, key, length, &parent, &left) == NULL, "ERROR: Key already in tree: %.*s", (int)length, key);
+
+	entry = (struct rb_str_entry *)malloc(sizeof(struct rb_str_entry) + length);
+	ASSERT(entry != NULL, "Out of memory for a string key.");
+	entry->data = data;
+	entry->length = length;
+	memcpy(entry->bytes, key, length);
+
+	// Bounds of prefix on both sides keep rb_insert from trusting the finger.
+	_rb_insert_at(tree, parent, left, NULL, prefix, prefix, prefix, entry);
+}
+
+void *rb_str_lookup(struct rb_tree *tree, const char *key, size_t length)
+{
+	struct rb_node *parent;
+	int left;
+	struct rb_node *node = _rb_str_find(tree, key, length, &parent, &left);
+
+	return node ? ((struct rb_str_entry *)node->data)->data : NULL;
+}
+
+void rb_str_delete(struct rb_tree *tree, const char *key, size_t length)
+{
+	struct rb_node *parent;
+	int left;
+	struct rb_node *node = _rb_str_find(tree, key, length, &parent, &left);
+
+	ASSERT(node != NULL, "rb_str_delete called on non-existent key.");
+	free(node->data);
+	_rb_erase_node(tree, node);
+}
+
+
+
+///
+/// rb_str_key / rb_str_data
+///
+/// A string tree node's key, with its length in *length, and its data.
+///
+
+const char *rb_str_key(struct rb_node *node, size_t *length)
+{
+	*length = ((struct rb_str_entry *)node->data)->length;
+	return ((struct rb_str_entry *)node->data)->bytes;
+}
+
+void *rb_str_data(struct rb_node *node)
+{
+	return ((struct rb_str_entry *)node->data)->data;
+}
+
+
+
+///
+/// rb_str_prefix_scan
+///
+/// Calls callback on every node whose key starts with the length bytes at prefix, in
+/// order, like rb_range_scan. The keys that start with it sit together in the tree, so
+/// it's one descent to the first and rb_next from there. The callback can return nonzero
+/// to stop. Returns how many nodes were visited.
+///
+
+long rb_str_prefix_scan(struct rb_tree *tree, const char *prefix, size_t length, 
+						int (*callback)(struct rb_node *node, void *context), void *context)
+{
+	struct rb_node *node = tree->root;
+	struct rb_node *start = NULL;
+	struct rb_str_entry *entry;
+	long key = _rb_str_prefix(prefix, length), visited = 0;
+
+	// Lower bound: the first key not before prefix.
+	while (node)
+	{
+		if (_rb_str_compare(node, key, prefix, length) <= 0)
+		{
+			start = node;
+			node = _rb_left_child(node);
+		}
+		else
+		{
+			node = _rb_right_child(node);
+		}
+	}
+
+	for (node = start; node; node = rb_next(node))
+	{
+		entry = (struct rb_str_entry *)node->data;
+		if (entry->length < length || memcmp(entry->bytes, prefix, length) != 0)
+		{
+			break;
+		}
+		visited++;
+		if (callback(node, context))
+		{
+			break;
+		}
+	}
+	return visited;
+}
+
+
+
+
+
+//
+//
+// UNIT TESTS
+// 
+//
+
+
+void TEST_rb_simple()
+{
+	printf("START TEST_rb_simple\n");
+
+	long i;
+	struct rb_tree *tree = rb_create();
+	
+	// Forward inserts.
+	for (i = 0; i < 1000; i++)
+	{
+		rb_insert(tree, i, (void *)i);
+		rb_validate(tree, tree->root);
+	}
+
+	for (i = 0; i < 1000; i++) 
+	{
+		if ((long)rb_lookup(tree, i) != i)
+		{
+			printf("Failed on rb_lookup: %ld\n", i);
+			exit(1);
+		}
+	}
+	
+	if (rb_count(tree) != 1000) 
+	{
+		printf("Failed on rb_count 1000\n");
+		exit(1);
+	}
+
+	printf("Maximum depth for forward: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, tree->root));
+
+	for (i = 0; i < 1000; i++) 
+	{
+		rb_delete(tree, i);
+		rb_validate(tree, tree->root);
+	}
+
+	if (rb_count(tree) != 0) 
+	{
+		printf("Failed on rb_count 0\n");
+		exit(1);
 	}
 
 
 	// Reverse inserts.
 	for (i = 999; i >= 0; i--)
 	{
-		rb_insert(tree, tree, i, (void *)i);
-		rb_validate(tree, *tree);
+		rb_insert(tree, i, (void *)i);
+		rb_validate(tree, tree->root);
+	}
+	
+	for (i = 999; i >= 0; i--) 
+	{
+		if ((long)rb_lookup(tree, i) != i)
+		{
+			printf("Failed on rb_lookup: %ld\n", i);
+			exit(1);
+		}
+	}
+	
+	if (rb_count(tree) != 1000) 
+	{
+		printf("Failed on rb_count 1000\n");
+		exit(1);
+	}
+	
+	printf("Maximum depth for backward: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, tree->root));
+
+	for (i = 999; i >= 0; i--) 
+	{
+		rb_delete(tree, i);
+		rb_validate(tree, tree->root);		
+	}
+
+	if (rb_count(tree) != 0) 
+	{
+		printf("Failed on rb_count 0\n");
+		exit(1);
+	}	
+
+	// Randomish inserts. Make an array and shuffle it a bit.
+	long array[1000];
+	for (i = 0; i < 1000; i++)
+	{
+		array[i] = i;
+	}
+
+	for (i = 0; i < 10000; i++)
+	{
+		long elem1 = (i * 863) % 1000;
+		long elem2 = (i * 427) % 1000;
+		long swap = array[elem1];
+		array[elem1] = array[elem2];
+		array[elem2] = swap;
+	}
+
+	for (i = 0; i < 1000; i++)
+	{
+		rb_insert(tree, array[i], (void *)array[i]);
+		rb_validate(tree, tree->root);
+	}
+	
+	for (i = 0; i < 1000; i++) 
+	{
+		if ((long)rb_lookup(tree, i) != i)
+		{
+			printf("Failed on rb_lookup: %ld\n", i);
+			exit(1);
+		}
+	}
+	
+	if (rb_count(tree) != 1000) 
+	{
+		printf("Failed on rb_count 1000\n");
+		exit(1);
+	}
+
+	printf("Maximum depth for randomish: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, tree->root));
+
+	// This time delete the root again and again.
+	for (i = 0; i < 1000; i++) 
+	{
+		rb_delete(tree, tree->root->key);
+		rb_validate(tree, tree->root);		
+	}
+
+	if (rb_count(tree) != 0) 
+	{
+		printf("Failed on rb_count 0\n");
+		exit(1);
+	}
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_simple\n");
+}
+
+
+
+void TEST_rb_arena()
+{
+	printf("START TEST_rb_arena\n");
+
+#if defined(RB_COMPACT) && defined(RB_AUGMENT)
+	ASSERT(sizeof(struct rb_node) == 40, "Augmented compact nodes should be 40 bytes, not %ld", (long)sizeof(struct rb_node));
+#elif defined(RB_COMPACT)
+	ASSERT(sizeof(struct rb_node) == 32, "Compact nodes should be 32 bytes, not %ld", (long)sizeof(struct rb_node));
+#endif
+
+	long i, num_slabs;
+	struct rb_slab *slab;
+	struct rb_tree *tree = rb_create();
+
+	// Fill up a bit more than two slabs.
+	for (i = 0; i < 2 * RB_SLAB_NODES + 10; i++)
+	{
+		rb_insert(tree, i, (void *)i);
+	}
+	rb_validate(tree, tree->root);
+
+	for (num_slabs = 0, slab = tree->arena->slabs; slab; slab = slab->next)
+	{
+		num_slabs++;
+	}
+	ASSERT(num_slabs == 3, "Expected 3 slabs, got %ld", num_slabs);
+
+	// Churn: deleted nodes must be recycled before any new slab gets allocated.
+	for (i = 0; i < RB_SLAB_NODES; i++)
+	{
+		rb_delete(tree, i * 2);
+	}
+	for (i = 0; i < RB_SLAB_NODES; i++)
+	{
+		rb_insert(tree, -1 - i, (void *)(-1 - i));
+	}
+	rb_validate(tree, tree->root);
+
+	for (num_slabs = 0, slab = tree->arena->slabs; slab; slab = slab->next)
+	{
+		num_slabs++;
+	}
+	ASSERT(num_slabs == 3, "Deleted nodes were not reused, got %ld slabs", num_slabs);
+	ASSERT(tree->arena->free_list == NULL, "Free list should be drained");
+	ASSERT(rb_count(tree) == 2 * RB_SLAB_NODES + 10, "Wrong count after churn");
+
+	for (i = 0; i < RB_SLAB_NODES; i++)
+	{
+		ASSERT((long)rb_lookup(tree, -1 - i) == -1 - i, "Lookup failed after churn: %ld", -1 - i);
+	}
+
+	// Clearing a subtree hands every one of its nodes back to the free list.
+	{
+		struct rb_node *subtree = _rb_left_child(tree->root);
+		long subtree_size = _rb_subtree_size(subtree);
+		long num_free = 0;
+		struct rb_node *node;
+
+		_rb_set_left_child(tree->root, NULL);
+		_rb_clear(tree, subtree);
+		for (node = tree->arena->free_list; node; node = (struct rb_node *)node->data)
+		{
+			num_free++;
+		}
+		ASSERT(num_free == subtree_size, "Cleared %ld nodes, expected %ld", num_free, subtree_size);
+	}
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_arena\n");
+}
+
+
+
+void TEST_rb_order_statistics()
+{
+	printf("START TEST_rb_order_statistics\n");
+
+	long i;
+	struct rb_tree *tree = rb_create();
+
+	ASSERT(rb_select(tree, 0) == NULL, "Select on an empty tree");
+	ASSERT(rb_rank(tree, 5) == 0, "Rank on an empty tree");
+	ASSERT(rb_count_range(tree, 0, 10) == 0, "Range count on an empty tree");
+
+	// Even keys 0..1998, inserted in a scrambled order.
+	for (i = 0; i < 1000; i++)
+	{
+		long key = ((i * 617) % 1000) * 2;
+		rb_insert(tree, key, (void *)key);
+	}
+	rb_validate(tree, tree->root);
+
+	ASSERT(rb_count(tree) == 1000, "Wrong count");
+
+	for (i = 0; i < 1000; i++)
+	{
+		struct rb_node *node = rb_select(tree, i);
+		ASSERT(node != NULL && node->key == i * 2, "rb_select(%ld) wrong", i);
+		ASSERT(rb_rank(tree, i * 2) == i, "rb_rank(%ld) wrong", i * 2);
+		ASSERT(rb_rank(tree, i * 2 + 1) == i + 1, "rb_rank(%ld) wrong", i * 2 + 1);
+	}
+	ASSERT(rb_select(tree, 1000) == NULL, "Select past the end");
+	ASSERT(rb_select(tree, -1) == NULL, "Select before the start");
+
+	ASSERT(rb_count_range(tree, 0, 1998) == 1000, "Full range count");
+	ASSERT(rb_count_range(tree, 1, 9) == 4, "Range count 1..9");
+	ASSERT(rb_count_range(tree, 10, 10) == 1, "Single key range count");
+	ASSERT(rb_count_range(tree, 11, 11) == 0, "Missing key range count");
+	ASSERT(rb_count_range(tree, -100, 100) == 51, "Range count across the start");
+	ASSERT(rb_count_range(tree, 20, 10) == 0, "Inverted range count");
+
+	// Counts must stay right as the tree shrinks.
+	for (i = 0; i < 500; i++)
+	{
+		rb_delete(tree, i * 4);
+	}
+	ASSERT(rb_count(tree) == 500, "Wrong count after deletes");
+	for (i = 0; i < 500; i++)
+	{
+		ASSERT(rb_select(tree, i)->key == i * 4 + 2, "rb_select(%ld) wrong after deletes", i);
+	}
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_order_statistics\n");
+}
+
+
+
+void TEST_rb_build()
+{
+	printf("START TEST_rb_build\n");
+
+	long i, n;
+	long keys[1000];
+	void *values[1000];
+	struct rb_tree *tree;
+
+	// Every size up to 1000 hits both full and partly filled bottom levels.
+	for (n = 0; n <= 1000; n++)
+	{
+		for (i = 0; i < n; i++)
+		{
+			keys[i] = i * 3;
+			values[i] = (void *)(i * 3 + 1);
+		}
+
+		tree = rb_build_from_sorted(keys, values, n);
+		rb_validate(tree, tree->root);
+		ASSERT(rb_count(tree) == n, "Built tree has the wrong count");
+		for (i = 0; i < n; i++)
+		{
+			ASSERT((long)rb_lookup(tree, i * 3) == i * 3 + 1, "Lookup failed in built tree: %ld", i * 3);
+			ASSERT(rb_select(tree, i)->key == i * 3, "rb_select failed in built tree: %ld", i);
+		}
+
+		// A built tree must behave like any other afterwards.
+		for (i = 0; i < n; i++)
+		{
+			rb_insert(tree, i * 3 + 1, NULL);
+			rb_delete(tree, i * 3);
+		}
+		rb_validate(tree, tree->root);
+		ASSERT(rb_count(tree) == n, "Built tree has the wrong count after churn");
+
+		rb_destroy(tree);
+	}
+
+	// Unsorted input, big enough to take the threaded path.
+	n = 4 * RB_PARALLEL_SORT_CUTOFF + 17;
+	{
+		long *big_keys = (long *)malloc(n * sizeof(long));
+		for (i = 0; i < n; i++)
+		{
+			big_keys[i] = ((i * 7919) % n) - 1000;
+		}
+		// Pass the keys as their own values.
+		tree = rb_build_from_unsorted(big_keys, (void **)big_keys, n);
+		rb_validate(tree, tree->root);
+		ASSERT(rb_count(tree) == n, "Unsorted build has the wrong count");
+		for (i = 0; i < n; i++)
+		{
+			struct rb_node *node = rb_select(tree, i);
+			ASSERT(node->key == i - 1000, "Unsorted build out of order at %ld", i);
+			ASSERT((long)node->data == node->key, "Unsorted build lost the value of %ld", node->key);
+		}
+		rb_destroy(tree);
+		free(big_keys);
+	}
+
+	// Force the sort to split across threads even on a single core machine.
+	{
+		struct rb_sort_task task;
+		task.pairs = (struct rb_pair *)malloc(n * sizeof(struct rb_pair));
+		task.scratch = (struct rb_pair *)malloc(n * sizeof(struct rb_pair));
+		task.n = n;
+		task.depth = 3;
+		for (i = 0; i < n; i++)
+		{
+			task.pairs[i].key = (i * 7919) % n;
+			task.pairs[i].data = (void *)(task.pairs[i].key + 5);
+		}
+		_rb_parallel_sort(&task);
+		for (i = 0; i < n; i++)
+		{
+			ASSERT(task.pairs[i].key == i, "Parallel sort out of order at %ld", i);
+			ASSERT(task.pairs[i].data == (void *)(i + 5), "Parallel sort lost the data of %ld", i);
+		}
+		free(task.scratch);
+		free(task.pairs);
+	}
+
+	printf("COMPLETED TEST_rb_build\n");
+}
+
+
+
+struct TEST_rb_scan_state
+{
+	long expected;
+	long step;
+	long stop_at;
+};
+
+int TEST_rb_scan_callback(struct rb_node *node, void *context)
+{
+	struct TEST_rb_scan_state *state = (struct TEST_rb_scan_state *)context;
+
+	ASSERT(node->key == state->expected, "Range scan visited %ld, expected %ld", node->key, state->expected);
+	state->expected += state->step;
+	return node->key == state->stop_at;
+}
+
+void TEST_rb_cursor()
+{
+	printf("START TEST_rb_cursor\n");
+
+	long i;
+	struct rb_node *node;
+	struct rb_tree *tree = rb_create();
+	struct TEST_rb_scan_state state;
+
+	ASSERT(rb_first(tree) == NULL && rb_last(tree) == NULL, "Empty tree has no ends");
+	ASSERT(rb_lower_bound(tree, 0) == NULL, "Empty tree has no lower bound");
+
+	// Multiples of 5 from 0 to 4995, scrambled.
+	for (i = 0; i < 1000; i++)
+	{
+		long key = ((i * 617) % 1000) * 5;
+		rb_insert(tree, key, (void *)key);
+	}
+
+	// Forward and backward walks see every key once, in order.
+	for (i = 0, node = rb_first(tree); node; node = rb_next(node), i++)
+	{
+		ASSERT(node->key == i * 5, "Forward walk got %ld at %ld", node->key, i);
+	}
+	ASSERT(i == 1000, "Forward walk visited %ld nodes", i);
+
+	for (i = 999, node = rb_last(tree); node; node = rb_prev(node), i--)
+	{
+		ASSERT(node->key == i * 5, "Backward walk got %ld at %ld", node->key, i);
+	}
+	ASSERT(i == -1, "Backward walk stopped early at %ld", i);
+
+	ASSERT(rb_lower_bound(tree, -10)->key == 0, "Lower bound below the start");
+	ASSERT(rb_lower_bound(tree, 10)->key == 10, "Lower bound on a key");
+	ASSERT(rb_lower_bound(tree, 11)->key == 15, "Lower bound between keys");
+	ASSERT(rb_lower_bound(tree, 4996) == NULL, "Lower bound past the end");
+
+	state.expected = 15;
+	state.step = 5;
+	state.stop_at = -1;
+	ASSERT(rb_range_scan(tree, 11, 104, TEST_rb_scan_callback, &state) == 18, "Range scan 11..104 count");
+	ASSERT(state.expected == 105, "Range scan 11..104 didn't reach the end");
+
+	state.expected = 4990;
+	state.stop_at = -1;
+	ASSERT(rb_range_scan(tree, 4990, 1L << 40, TEST_rb_scan_callback, &state) == 2, "Range scan off the end");
+
+	state.expected = 0;
+	state.stop_at = 20;
+	ASSERT(rb_range_scan(tree, -100, 4000, TEST_rb_scan_callback, &state) == 5, "Range scan stopping early");
+
+	ASSERT(rb_range_scan(tree, 11, 14, TEST_rb_scan_callback, &state) == 0, "Empty range scan");
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_cursor\n");
+}
+
+
+
+void TEST_rb_check_sorted(struct rb_tree *tree, long count)
+{
+	struct rb_node *node;
+	long i = 0;
+
+	rb_validate(tree, tree->root);
+	for (node = rb_first(tree); node; node = rb_next(node), i++)
+	{
+		ASSERT(rb_next(node) == NULL || node->key < rb_next(node)->key, "Keys out of order at %ld", node->key);
+		ASSERT(rb_rank(tree, node->key) == i, "Rank of %ld is %ld, expected %ld", node->key, rb_rank(tree, node->key), i);
+	}
+	ASSERT(i == count && rb_count(tree) == count, "Walked %ld nodes, counted %ld, expected %ld", i, rb_count(tree), count);
+}
+
+void TEST_rb_insert_hint()
+{
+	printf("START TEST_rb_insert_hint\n");
+
+	struct rb_tree *tree = rb_create();
+	struct rb_tree *right;
+	struct rb_node *node, *hint;
+	long n = 5000, i, key, below;
+	int left;
+
+	// Sorted and reversed streams: after the first of each, every key lands right next
+	// to the last one.
+	for (i = 0; i < n; i++)
+	{
+		ASSERT(i == 0 || _rb_hint_parent(tree->finger, i, &left) != NULL, "Finger missed sorted key %ld", i);
+		rb_insert(tree, i, (void *)i);
+	}
+	TEST_rb_check_sorted(tree, n);
+	for (i = -1; i >= -n; i--)
+	{
+		ASSERT(i == -1 || _rb_hint_parent(tree->finger, i, &left) != NULL, "Finger missed reversed key %ld", i);
+		rb_insert(tree, i, (void *)i);
+	}
+	TEST_rb_check_sorted(tree, 2 * n);
+	rb_destroy(tree);
+
+	// Timestamps arriving out of order within blocks of 8: some land by the finger, the
+	// rest take a descent, and the result is the same tree of keys.
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		key = (i & ~7L) + (i * 5) % 8;
+		rb_insert(tree, key, (void *)key);
+	}
+	TEST_rb_check_sorted(tree, n);
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_lookup(tree, i) == i, "Lookup failed for %ld", i);
+	}
+	rb_destroy(tree);
+
+	// Explicit hints: odd keys go in next to the even key below them, and a far-off hint
+	// climbs to somewhere the key can be found from.
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, i * 2, NULL);
+	}
+	for (i = 0; i < n; i += 2)
+	{
+		hint = _rb_find_node(tree->root, i * 2);
+		ASSERT(_rb_hint_parent(hint, i * 2 + 1, &left) != NULL, "Hint %ld missed its neighbour", i * 2);
+		node = rb_insert_hint(tree, hint, i * 2 + 1, (void *)(i * 2 + 1));
+		ASSERT(node->key == i * 2 + 1 && tree->finger == node, "rb_insert_hint returned the wrong node");
+	}
+	for (i = 1; i < n; i += 2)
+	{
+		hint = rb_first(tree);
+		ASSERT(!_rb_hint_parent(hint, i * 2 + 1, &left), "Far hint for %ld claimed a slot", i * 2 + 1);
+		rb_insert_hint(tree, hint, i * 2 + 1, (void *)(i * 2 + 1));
+	}
+	TEST_rb_check_sorted(tree, 2 * n);
+	ASSERT(!_rb_hint_parent(_rb_find_node(tree->root, 10), 11, &left), "Hint accepted a key already in the tree");
+
+	// Climbing from any hint keeps every key below it, so duplicates are still caught.
+	for (i = 0; i < n; i++)
+	{
+		hint = _rb_find_node(tree->root, (i * 617) % (2 * n));
+		key = (i * 7919) % (2 * n);
+		ASSERT(_rb_find_node(_rb_climb(hint, key), key) != NULL, "Climb from %ld lost %ld", hint->key, key);
+	}
+	rb_destroy(tree);
+
+	// Hints at random distances.
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, i * 2, NULL);
+	}
+	for (i = 0; i < n; i++)
+	{
+		hint = _rb_find_node(tree->root, ((i * 617) % n) * 2);
+		node = rb_insert_hint(tree, hint, ((i * 7919) % n) * 2 + 1, NULL);
+		ASSERT(node->key == ((i * 7919) % n) * 2 + 1, "rb_insert_hint returned the wrong node");
+	}
+	TEST_rb_check_sorted(tree, 2 * n);
+	rb_destroy(tree);
+
+	// Deleting the finger's neighbours only widens its gap, so it stays. It's dropped when
+	// its own node is deleted or a split or range delete might take it away.
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, i * 2, NULL);
+	}
+	rb_delete(tree, (n - 2) * 2);
+	ASSERT(tree->finger && tree->finger->key == (n - 1) * 2, "Deleting a neighbour dropped the finger");
+	rb_insert(tree, (n - 2) * 2 - 1, NULL);
+	ASSERT(tree->finger_lo == (n - 3) * 2 && tree->finger_hi == (n - 1) * 2, "Finger gap is %ld..%ld", tree->finger_lo, tree->finger_hi);
+	rb_delete(tree, (n - 2) * 2 - 1);
+	ASSERT(tree->finger == NULL, "Finger left on a deleted leaf");
+	rb_insert(tree, 1001, NULL);
+	rb_insert(tree, 1003, NULL);
+	rb_delete(tree, 1004);
+	rb_insert(tree, 1005, NULL);
+	rb_delete(tree, tree->root->key);
+	rb_insert(tree, 1007, NULL);
+	TEST_rb_check_sorted(tree, n + 1);
+
+	rb_delete_range(tree, 900, 1100);
+	ASSERT(tree->finger == NULL, "rb_delete_range kept the finger");
+	rb_insert(tree, 1001, NULL);
+	below = rb_rank(tree, 1000);
+	key = rb_count(tree);
+	right = rb_split(tree, 1000);
+	ASSERT(tree->finger == NULL && right->finger == NULL, "rb_split kept the finger");
+	rb_insert(tree, 999, NULL);
+	rb_insert(right, 1003, NULL);
+	TEST_rb_check_sorted(tree, below + 1);
+	TEST_rb_check_sorted(right, key - below + 1);
+	rb_destroy(right);
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_insert_hint\n");
+}
+
+
+
+///
+/// TEST_rb_node_handles
+///
+/// Nodes from rb_insert_node stay with their keys through other keys' deletes, whether
+/// by handle or by key, and erase and update without a search.
+///
+
+// Every live handle still holds its own key and data, and leads back to its tree.
+void TEST_rb_check_handles(struct rb_tree *tree, struct rb_node **handles, long *data, long n)
+{
+	long i;
+
+	rb_validate(tree, tree->root);
+	for (i = 0; i < n; i++)
+	{
+		if (handles[i])
+		{
+			ASSERT(handles[i]->key == i && (long)handles[i]->data == data[i], "Handle for %ld now has %ld", i, handles[i]->key);
+			ASSERT(_rb_find_node(tree->root, i) == handles[i], "Handle for %ld isn't the tree's node", i);
+		}
+		else
+		{
+			ASSERT(rb_lookup(tree, i) == NULL, "Erased key %ld is still there", i);
+		}
+	}
+}
+
+void TEST_rb_node_handles()
+{
+	printf("START TEST_rb_node_handles\n");
+
+	long n = 3000;
+	struct rb_tree *tree = rb_create();
+	struct rb_node **handles = (struct rb_node **)malloc(n * sizeof(struct rb_node *));
+	long *data = (long *)malloc(n * sizeof(long));
+	long i, key, count = n;
+
+	for (i = 0; i < n; i++)
+	{
+		key = (i * 7919) % n;
+		data[key] = key + 1;
+		handles[key] = rb_insert_node(tree, key, (void *)data[key]);
+	}
+	TEST_rb_check_handles(tree, handles, data, n);
+
+	// Half the keys by handle, a quarter by key. Most of them have two children when they
+	// go, so they trade places with their successors.
+	for (i = 0; i < n; i++)
+	{
+		key = (i * 4001) % n;
+		if (key % 2 == 0)
+		{
+			rb_erase_node(tree, handles[key]);
+			handles[key] = NULL;
+			count--;
+		}
+		else if (key % 4 == 1)
+		{
+			rb_delete(tree, key);
+			handles[key] = NULL;
+			count--;
+		}
+		if (i % 500 == 0)
+		{
+			TEST_rb_check_handles(tree, handles, data, n);
+		}
+	}
+	TEST_rb_check_handles(tree, handles, data, n);
+	ASSERT(rb_count(tree) == count, "%ld keys left, expected %ld", rb_count(tree), count);
+
+	// Updates through the handles.
+	for (i = 3; i < n; i += 4)
+	{
+		data[i] = -i;
+		rb_set_data(tree, handles[i], (void *)data[i]);
+	}
+	TEST_rb_check_handles(tree, handles, data, n);
+
+	// Erasing the finger, then inserting right where it was.
+	handles[0] = rb_insert_node(tree, 0, (void *)1);
+	data[0] = 1;
+	rb_erase_node(tree, handles[0]);
+	handles[0] = NULL;
+	ASSERT(tree->finger == NULL, "The finger went with its node");
+	handles[2] = rb_insert_node(tree, 2, (void *)3);
+	data[2] = 3;
+	TEST_rb_check_handles(tree, handles, data, n);
+
+	// Down to nothing, by handle.
+	for (i = 0; i < n; i++)
+	{
+		if (handles[i])
+		{
+			rb_erase_node(tree, handles[i]);
+			handles[i] = NULL;
+		}
+	}
+	ASSERT(tree->root == NULL, "Tree should be empty");
+
+	rb_destroy(tree);
+	free(data);
+	free(handles);
+
+	printf("COMPLETED TEST_rb_node_handles\n");
+}
+
+
+
+///
+/// TEST_rb_priority_queue
+///
+/// The ends the tree keeps against looking for them, through pops, inserts on either side
+/// of them, deletes, splits and joins. rb_validate checks them too.
+///
+
+void TEST_rb_priority_queue()
+{
+	printf("START TEST_rb_priority_queue\n");
+
+	struct rb_tree *tree = rb_create();
+	struct rb_tree *right;
+	unsigned long x = 88172645463325252UL;
+	long i, key, previous, count;
+	void *data;
+
+	ASSERT(rb_peek_min(tree) == NULL && rb_peek_max(tree) == NULL, "An empty tree has no ends");
+	ASSERT(!rb_pop_min(tree, &key, &data) && !rb_pop_max(tree, &key, &data), "Popped from an empty tree");
+
+	for (i = 0; i < 5000; i++)
+	{
+		key = (i * 7919) % 10007;
+		rb_insert(tree, key, (void *)(key + 1));
+	}
+	rb_validate(tree, tree->root);
+	ASSERT(rb_peek_min(tree) == rb_select(tree, 0) && rb_peek_max(tree) == rb_select(tree, 4999), "Ends after inserts");
+
+	// Popping from both ends comes out in order.
+	for (i = 0, previous = LONG_MIN; i < 1000; i++)
+	{
+		ASSERT(rb_pop_min(tree, &key, &data) && key > previous && (long)data == key + 1, "rb_pop_min gave %ld after %ld", key, previous);
+		previous = key;
+	}
+	for (i = 0, previous = LONG_MAX; i < 1000; i++)
+	{
+		ASSERT(rb_pop_max(tree, &key, &data) && key < previous && (long)data == key + 1, "rb_pop_max gave %ld after %ld", key, previous);
+		previous = key;
+	}
+	rb_validate(tree, tree->root);
+
+	// A scheduler: pop the earliest deadline, put it back a little later, sometimes insert
+	// past either end or delete from the middle.
+	for (i = 0; i < 20000; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		ASSERT(rb_pop_min(tree, &key, &data), "The queue ran dry");
+		ASSERT(rb_lookup(tree, key) == NULL && (!tree->root || _rb_find_smallest(tree->root)->key > key), "Popped %ld wasn't the smallest", key);
+		for (key += 1 + (long)(x % 5000); rb_lookup(tree, key); key++);
+		rb_insert(tree, key, (void *)(key + 1));
+
+		if (x % 7 == 0)
+		{
+			key = rb_peek_min(tree)->key - 1 - (long)((x >> 8) % 10);
+			rb_insert(tree, key, (void *)(key + 1));
+		}
+		else if (x % 7 == 1)
+		{
+			key = rb_peek_max(tree)->key + 1 + (long)((x >> 8) % 10);
+			rb_insert(tree, key, (void *)(key + 1));
+		}
+		else if (x % 7 == 2 && rb_count(tree) > 10)
+		{
+			rb_delete(tree, rb_select(tree, (long)((x >> 8) % rb_count(tree)))->key);
+		}
+		if (i % 1000 == 0)
+		{
+			rb_validate(tree, tree->root);
+		}
+	}
+	rb_validate(tree, tree->root);
+
+	// Split and join find them again.
+	count = rb_count(tree);
+	right = rb_split(tree, rb_select(tree, count / 2)->key);
+	rb_validate(tree, tree->root);
+	rb_validate(right, right->root);
+	ASSERT(rb_peek_max(tree)->key < rb_peek_min(right)->key, "Ends after a split");
+	tree = rb_join(tree, right);
+	rb_validate(tree, tree->root);
+
+	while (rb_pop_max(tree, &key, &data))
+	{
+		count--;
+	}
+	ASSERT(count == 0 && tree->root == NULL && rb_peek_min(tree) == NULL, "Popping everything left %ld", count);
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_priority_queue\n");
+}
+
+
+
+
+///
+/// TEST_rb_upsert
+///
+/// rb_insert_or_get and rb_upsert against a plain array of counters, with keys that
+/// repeat right away (the finger), soon after, and much later.
+///
+
+void TEST_rb_upsert()
+{
+	printf("START TEST_rb_upsert\n");
+
+	long n = 5000;
+	struct rb_tree *tree = rb_create();
+	struct rb_node *node;
+	long *counts = (long *)calloc(n, sizeof(long));
+	long i, key, distinct = 0;
+	int inserted;
+
+	node = rb_insert_or_get(tree, 7, (void *)1, &inserted);
+	ASSERT(inserted && node->key == 7 && tree->root == node, "First key didn't go in");
+	ASSERT(rb_insert_or_get(tree, 7, (void *)2, &inserted) == node && !inserted && (long)node->data == 1, "Existing key was changed");
+	ASSERT(rb_upsert(tree, 7, (void *)3) == node && (long)node->data == 3, "rb_upsert didn't change the data");
+	rb_delete(tree, 7);
+
+	// Word count: each key bumped by rb_upsert with the count it had.
+	for (i = 0; i < 60000; i++)
+	{
+		key = (i % 3 == 0) ? (i / 3) % n : (i * 7919) % n;
+		node = rb_insert_or_get(tree, key, (void *)0, &inserted);
+		ASSERT(inserted == (counts[key] == 0) && node->key == key, "rb_insert_or_get on %ld got it wrong", key);
+		distinct += inserted;
+		counts[key]++;
+		ASSERT(rb_upsert(tree, key, (void *)((long)node->data + 1)) == node, "rb_upsert found another node for %ld", key);
+		if (i % 5000 == 0)
+		{
+			rb_validate(tree, tree->root);
+		}
+	}
+	rb_validate(tree, tree->root);
+	ASSERT(rb_count(tree) == distinct, "%ld keys, expected %ld", rb_count(tree), distinct);
+	for (key = 0; key < n; key++)
+	{
+		ASSERT((long)rb_lookup(tree, key) == counts[key], "Key %ld counted %ld, expected %ld", key, (long)rb_lookup(tree, key), counts[key]);
+	}
+
+	// Keys in the finger's gap and past the ends.
+	rb_delete(tree, 100);
+	rb_delete(tree, 101);
+	rb_delete(tree, 102);
+	rb_insert(tree, 101, (void *)0);
+	ASSERT(rb_insert_or_get(tree, 100, (void *)1, &inserted) && inserted, "Key below the finger");
+	ASSERT(rb_insert_or_get(tree, 102, (void *)1, NULL)->key == 102, "Key above the finger");
+	rb_upsert(tree, -1, (void *)1);
+	rb_upsert(tree, n, (void *)1);
+	rb_validate(tree, tree->root);
+	ASSERT(rb_peek_min(tree)->key == -1 && rb_peek_max(tree)->key == n, "Ends after upserts");
+
+#ifdef RB_AUGMENT
+	// An upsert that finds the key changes its value in the aggregates too.
+	rb_set_augment(tree, &rb_augment_sum);
+	key = rb_range_aggregate(tree, LONG_MIN, LONG_MAX);
+	rb_upsert(tree, n / 2, (void *)((long)rb_lookup(tree, n / 2) + 10));
+	rb_upsert(tree, n + 1, (void *)5);
+	rb_validate(tree, tree->root);
+	ASSERT(rb_range_aggregate(tree, LONG_MIN, LONG_MAX) == key + 15, "Sum after upserts is off");
+#endif
+
+	rb_destroy(tree);
+	free(counts);
+
+	printf("COMPLETED TEST_rb_upsert\n");
+}
+
+
+
+// Runs operation on tree in a child process and checks it stops on an ASSERT rather
+// than carrying on. The child's output is thrown away.
+void TEST_rb_check_refused(void (*operation)(struct rb_tree *tree), struct rb_tree *tree, const char *name)
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	ASSERT(pid >= 0, "fork failed");
+	if (pid == 0)
+	{
+		ASSERT(freopen("/dev/null", "w", stdout) != NULL, "Couldn't quiet the child");
+		operation(tree);
+		exit(0);
+	}
+	ASSERT(waitpid(pid, &status, 0) == pid, "waitpid failed");
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 1, "%s wasn't refused", name);
+}
+
+// Operations some kinds of tree have to refuse.
+int TEST_rb_count_callback(long key, void *data, void *context) { (void)key; (void)data; (void)context; return 0; }
+void TEST_rb_concurrent_scan_all(struct rb_tree *tree) { rb_concurrent_range_scan(tree, LONG_MIN, LONG_MAX, TEST_rb_count_callback, NULL); }
+
+
+
+///
+/// TEST_rb_multimap
+///
+/// Repeated keys in a multimap come back out in the order they went in, through inserts
+/// by key and by hint, and deletes of some of them.
+///
+
+// Walks the entries with key, checking each one's data is bigger than the one before.
+// Returns how many there are.
+long TEST_rb_check_multimap_key(struct rb_tree *tree, long key)
+{
+	struct rb_node *node = rb_lower_bound(tree, key);
+	long count = 0, previous = -1;
+
+	for (; node && node->key == key; node = rb_next(node), count++)
+	{
+		ASSERT((long)node->data > previous, "Key %ld: %ld came after %ld", key, (long)node->data, previous);
+		previous = (long)node->data;
+	}
+	ASSERT(rb_count_range(tree, key, key) == count, "Key %ld: rb_count_range says %ld, walked %ld", key, rb_count_range(tree, key, key), count);
+	return count;
+}
+
+void TEST_rb_multimap()
+{
+	printf("START TEST_rb_multimap\n");
+
+	long n = 97;
+	struct rb_tree *tree = rb_create_multimap();
+	struct rb_node *node;
+	long *counts = (long *)calloc(n, sizeof(long));
+	long i, key, total = 0;
+
+	// The data is when each went in.
+	for (i = 0; i < 20000; i++)
+	{
+		key = (i * 31) % n;
+		if (i % 4 == 3)
+		{
+			// Hinted, off the last entry with this key, or the next key up if it's new.
+			node = rb_lower_bound(tree, key);
+			for (; node && rb_next(node) && rb_next(node)->key == key; node = rb_next(node));
+			rb_insert_hint(tree, node, key, (void *)i);
+		}
+		else
+		{
+			rb_insert(tree, key, (void *)i);
+		}
+		counts[key]++;
+		total++;
+		if (i % 2000 == 0)
+		{
+			rb_validate(tree, tree->root);
+		}
+	}
+	rb_validate(tree, tree->root);
+	ASSERT(rb_count(tree) == total, "%ld entries, expected %ld", rb_count(tree), total);
+
+	// Some of the entries, taken out by key.
+	for (i = 0; i < 5000; i++)
+	{
+		key = (i * 13) % n;
+		rb_delete(tree, key);
+		counts[key]--;
+		total--;
+	}
+	rb_validate(tree, tree->root);
+	for (key = 0; key < n; key++)
+	{
+		ASSERT(TEST_rb_check_multimap_key(tree, key) == counts[key], "Key %ld has the wrong number of entries", key);
+		ASSERT(rb_rank(tree, key + 1) - rb_rank(tree, key) == counts[key], "rb_rank is off for %ld", key);
+	}
+
+	// rb_insert_or_get still hands back one that's there.
+	node = rb_insert_or_get(tree, 5, (void *)-1, NULL);
+	ASSERT(node->key == 5 && (long)node->data >= 0, "rb_insert_or_get added to a multimap");
+	ASSERT(rb_count(tree) == total, "rb_insert_or_get changed the count");
+
+	// The lock-free scan picks up after the last key it copied, which would skip the rest
+	// of that key's entries.
+	TEST_rb_check_refused(TEST_rb_concurrent_scan_all, tree, "rb_concurrent_range_scan on a multimap");
+
+	rb_destroy(tree);
+	free(counts);
+
+	printf("COMPLETED TEST_rb_multimap\n");
+}
+
+
+
+
+///
+/// TEST_rb_strings
+///
+/// String keys of every length from empty up, many sharing their first 8 bytes or more,
+/// and some with zeros in them: in order, found, deleted and scanned by prefix.
+///
+
+// Key i: a short word, the same word padded out past the prefix, and a long key that
+// shares 13 bytes with its neighbours, in turn. Writes it to key and returns its length.
+size_t TEST_rb_str_make_key(long i, char *key)
+{
+	switch (i % 3)
+	{
+	case 0: return (size_t)sprintf(key, "%lx", i * 2654435761L % 100003);
+	case 1: return (size_t)sprintf(key, "%lx%c%c%c%c%c%c%c%c%c%ld", i * 2654435761L % 100003, 0, 0, 0, 0, 0, 0, 0, 0, 0, i);
+	default: return (size_t)sprintf(key, "user/account/%ld/%ld", i % 7, i);
+	}
+}
+
+// Walks the tree in order checking each key comes after the last, and the count.
+void TEST_rb_check_strings(struct rb_tree *tree, long count)
+{
+	struct rb_node *node = rb_peek_min(tree);
+	const char *key, *previous = NULL;
+	size_t length, previous_length = 0;
+	long seen = 0;
+
+	rb_validate(tree, tree->root);
+	for (; node; node = rb_next(node), seen++)
+	{
+		key = rb_str_key(node, &length);
+		ASSERT(node->key == _rb_str_prefix(key, length), "Node prefix doesn't match its key");
+		if (previous)
+		{
+			int compare = memcmp(previous, key, (length < previous_length) ? length : previous_length);
+			ASSERT(compare < 0 || (compare == 0 && previous_length < length), "Key %.*s out of order", (int)length, key);
+		}
+		previous = key;
+		previous_length = length;
+	}
+	ASSERT(seen == count && rb_count(tree) == count, "Walked %ld keys, expected %ld", seen, count);
+}
+
+// Prefix scan callback: checks the key starts with the prefix in context and counts it.
+struct TEST_rb_str_scan
+{
+	const char *prefix;
+	size_t length;
+	long count;
+};
+
+int TEST_rb_str_scan_callback(struct rb_node *node, void *context)
+{
+	struct TEST_rb_str_scan *scan = (struct TEST_rb_str_scan *)context;
+	size_t length;
+	const char *key = rb_str_key(node, &length);
+
+	ASSERT(length >= scan->length && memcmp(key, scan->prefix, scan->length) == 0, "%.*s doesn't start with the prefix", (int)length, key);
+	scan->count++;
+	return 0;
+}
+
+void TEST_rb_strings()
+{
+	printf("START TEST_rb_strings\n");
+
+	long n = 6000;
+	struct rb_tree *tree = rb_str_create();
+	struct TEST_rb_str_scan scan;
+	char key[64];
+	size_t length;
+	long i, count = 0;
+
+	// The empty string and ones that differ only in trailing zeros.
+	rb_str_insert(tree, "", 0, (void *)1);
+	rb_str_insert(tree, "\0", 1, (void *)2);
+	rb_str_insert(tree, "\0\0\0\0\0\0\0\0\0", 9, (void *)3);
+	rb_str_insert(tree, "\0\0\0\0\0\0\0\0", 8, (void *)4);
+	TEST_rb_check_strings(tree, 4);
+	ASSERT(rb_str_lookup(tree, "\0\0\0\0\0\0\0\0", 8) == (void *)4 && rb_str_lookup(tree, "", 0) == (void *)1, "Zero keys mixed up");
+	ASSERT(rb_str_lookup(tree, "\0\0", 2) == NULL, "Found a key never inserted");
+	rb_str_delete(tree, "", 0);
+	rb_str_delete(tree, "\0", 1);
+	rb_str_delete(tree, "\0\0\0\0\0\0\0\0\0", 9);
+	rb_str_delete(tree, "\0\0\0\0\0\0\0\0", 8);
+	ASSERT(tree->root == NULL, "Tree should be empty");
+
+	for (i = 0; i < n; i++)
+	{
+		length = TEST_rb_str_make_key(i, key);
+		rb_str_insert(tree, key, length, (void *)(i + 1));
+		count++;
+		if (i % 1000 == 0)
+		{
+			TEST_rb_check_strings(tree, count);
+		}
+	}
+	TEST_rb_check_strings(tree, count);
+	for (i = 0; i < n; i++)
+	{
+		length = TEST_rb_str_make_key(i, key);
+		ASSERT(rb_str_lookup(tree, key, length) == (void *)(i + 1), "Lookup of key %ld failed", i);
+		key[length] = 'x';
+		ASSERT(rb_str_lookup(tree, key, length + 1) == NULL, "Found key %ld with a byte added", i);
+	}
+
+	// Prefixes shorter than, as long as and longer than the inline part.
+	scan.prefix = "user/account/3/";
+	for (scan.length = 0; scan.length <= strlen(scan.prefix); scan.length++)
+	{
+		long expected = 0;
+		for (i = 0; i < n; i++)
+		{
+			length = TEST_rb_str_make_key(i, key);
+			expected += (length >= scan.length && memcmp(key, scan.prefix, scan.length) == 0);
+		}
+		scan.count = 0;
+		ASSERT(rb_str_prefix_scan(tree, scan.prefix, scan.length, TEST_rb_str_scan_callback, &scan) == expected && scan.count == expected, 
+			   "Prefix of %ld bytes found %ld keys, expected %ld", (long)scan.length, scan.count, expected);
+	}
+	scan.prefix = "zzz";
+	scan.length = 3;
+	ASSERT(rb_str_prefix_scan(tree, scan.prefix, scan.length, TEST_rb_str_scan_callback, &scan) == 0, "Found keys past the end");
+
+	// Every other key out, then the rest.
+	for (i = 0; i < n; i += 2)
+	{
+		length = TEST_rb_str_make_key(i, key);
+		rb_str_delete(tree, key, length);
+		count--;
+		ASSERT(rb_str_lookup(tree, key, length) == NULL, "Key %ld still there", i);
+	}
+	TEST_rb_check_strings(tree, count);
+	for (i = 1; i < n; i += 2)
+	{
+		length = TEST_rb_str_make_key(i, key);
+		ASSERT(rb_str_lookup(tree, key, length) == (void *)(i + 1), "Lost key %ld", i);
+		if (i % 4 == 1)
+		{
+			rb_str_delete(tree, key, length);
+			count--;
+		}
+	}
+	TEST_rb_check_strings(tree, count);
+
+	rb_str_destroy(tree);
+
+	printf("COMPLETED TEST_rb_strings\n");
+}
+
+
+
+// Checks that rb_lookup_batch over every key in lo..hi, forwards and scrambled, agrees 
+// with rb_lookup, whatever the batch length.
+void TEST_rb_check_batch(struct rb_tree *tree, long lo, long hi)
+{
+	long lengths[] = { 0, 1, RB_BATCH_LANES - 1, RB_BATCH_LANES, RB_BATCH_LANES + 1, 100 };
+	long n = hi - lo + 1, i, l, start;
+	long *keys = (long *)malloc(n * sizeof(long));
+	void **out = (void **)malloc(n * sizeof(void *));
+
+	for (l = 0; l < (long)(sizeof(lengths) / sizeof(lengths[0])); l++)
+	{
+		for (i = 0; i < n; i++)
+		{
+			keys[i] = (l % 2) ? lo + (i * 7919) % n : lo + i;
+		}
+		for (start = 0; start < n; start += lengths[l] ? lengths[l] : n)
+		{
+			rb_lookup_batch(tree, keys + start, (lengths[l] < n - start) ? lengths[l] : n - start, out + start);
+		}
+		for (i = 0; lengths[l] && i < n; i++)
+		{
+			ASSERT(out[i] == rb_lookup(tree, keys[i]), "rb_lookup_batch of %ld got %p", keys[i], out[i]);
+		}
+	}
+
+	// The same key many times over.
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = lo + n / 2;
+	}
+	rb_lookup_batch(tree, keys, n, out);
+	for (i = 0; i < n; i++)
+	{
+		ASSERT(out[i] == rb_lookup(tree, lo + n / 2), "rb_lookup_batch of a repeated key got %p", out[i]);
+	}
+
+	free(keys);
+	free(out);
+}
+
+void TEST_rb_lookup_batch()
+{
+	printf("START TEST_rb_lookup_batch\n");
+
+	long sizes[] = { 0, 1, 2, 17, 1000, 5000 };
+	long s, i;
+	struct rb_tree *tree;
+
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		// Even keys only, so half of what's looked up is missing.
+		tree = rb_create();
+		for (i = 0; i < sizes[s]; i++)
+		{
+			long key = ((i * 617) % sizes[s]) * 2;
+			rb_insert(tree, key, (void *)(key + 1));
+		}
+		TEST_rb_check_batch(tree, -5, sizes[s] * 2 + 5);
+		rb_destroy(tree);
+	}
+
+	printf("COMPLETED TEST_rb_lookup_batch\n");
+}
+
+
+
+struct TEST_rb_reader_state
+{
+	struct rb_tree *tree;
+	volatile int stop;
+	long lookups;
+	long scans;
+};
+
+int TEST_rb_concurrent_scan_callback(long key, void *data, void *context)
+{
+	long *expected = (long *)context;
+
+	// Odd keys come and go, the even ones must all be there, in order.
+	if (key % 2 == 0)
+	{
+		ASSERT(key == *expected, "Concurrent scan got %ld, expected %ld", key, *expected);
+		*expected += 2;
+	}
+	ASSERT((long)data == key, "Concurrent scan got the wrong data for %ld", key);
+	return 0;
+}
+
+void *TEST_rb_concurrent_reader(void *arg)
+{
+	struct TEST_rb_reader_state *state = (struct TEST_rb_reader_state *)arg;
+	long i = 0;
+
+	while (!state->stop)
+	{
+		long key = (i * 7) % 2000 * 2;
+		ASSERT((long)rb_concurrent_lookup(state->tree, key) == key, "Concurrent lookup lost %ld", key);
+		state->lookups++;
+
+		if (i % 100 == 0)
+		{
+			long expected = 500;
+			rb_concurrent_range_scan(state->tree, 500, 1500, TEST_rb_concurrent_scan_callback, &expected);
+			ASSERT(expected == 1502, "Concurrent scan stopped at %ld", expected);
+			state->scans++;
+		}
+		i++;
+	}
+
+	return NULL;
+}
+
+void TEST_rb_concurrent()
+{
+	printf("START TEST_rb_concurrent\n");
+
+	long i, round;
+	struct rb_tree *tree = rb_create();
+	struct TEST_rb_reader_state state[2];
+	pthread_t threads[2];
+
+	// Even keys stay put, odd keys get churned underneath the readers.
+	for (i = 0; i < 4000; i += 2)
+	{
+		rb_insert(tree, i, (void *)i);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		state[i].tree = tree;
+		state[i].stop = 0;
+		state[i].lookups = 0;
+		state[i].scans = 0;
+		pthread_create(&threads[i], NULL, TEST_rb_concurrent_reader, &state[i]);
+	}
+
+	for (round = 0; round < 20; round++)
+	{
+		for (i = 1; i < 4000; i += 2)
+		{
+			rb_concurrent_insert(tree, i, (void *)i);
+		}
+		for (i = 1; i < 4000; i += 2)
+		{
+			rb_concurrent_delete(tree, i);
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		state[i].stop = 1;
+		pthread_join(threads[i], NULL);
+		ASSERT(state[i].lookups > 0 && state[i].scans > 0, "Reader %ld never got to run", i);
+	}
+
+	rb_validate(tree, tree->root);
+	ASSERT(rb_count(tree) == 2000, "Wrong count after concurrent churn");
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_concurrent\n");
+}
+
+
+
+#define TEST_RB_PERSISTENT_KEYS 600
+#define TEST_RB_PERSISTENT_VERSIONS 30
+
+struct TEST_rb_version
+{
+	struct rb_tree *tree;
+	char present[TEST_RB_PERSISTENT_KEYS];
+};
+
+int TEST_rb_version_scan_callback(struct rb_node *node, void *context)
+{
+	long *expected = (long *)context;
+
+	ASSERT(node->key > *expected, "Scan out of order at %ld", node->key);
+	*expected = node->key;
+	return 0;
+}
+
+// Checks that tree holds exactly the keys in 0..n-1 marked present, each with key + 1 as 
+// its data, using the normal API.
+void TEST_rb_check_keys(struct rb_tree *tree, char *present, long n)
+{
+	long i, count = 0, previous = -1;
+
+	for (i = 0; i < n; i++)
+	{
+		if (present[i])
+		{
+			ASSERT((long)rb_lookup(tree, i) == i + 1, "Tree lost key %ld", i);
+			ASSERT(rb_rank(tree, i) == count, "Wrong rank for %ld", i);
+			ASSERT(rb_select(tree, count)->key == i, "Wrong select for %ld", count);
+			count++;
+		}
+		else
+		{
+			ASSERT(rb_lookup(tree, i) == NULL, "Tree has extra key %ld", i);
+		}
+	}
+	ASSERT(rb_count(tree) == count, "Tree has %ld keys, expected %ld", rb_count(tree), count);
+	ASSERT(rb_range_scan(tree, 0, n, TEST_rb_version_scan_callback, &previous) == count, "Scan missed keys");
+}
+
+void TEST_rb_check_contents(struct TEST_rb_version *version)
+{
+	TEST_rb_check_keys(version->tree, version->present, TEST_RB_PERSISTENT_KEYS);
+}
+
+// Same, plus the structure. rb_validate looks at the reference counts, which writers
+// to other versions can be changing, so this one isn't for reader threads.
+void TEST_rb_check_version(struct TEST_rb_version *version)
+{
+	rb_validate(version->tree, version->tree->root);
+	TEST_rb_check_contents(version);
+}
+
+void *TEST_rb_snapshot_reader(void *arg)
+{
+	long i;
+
+	for (i = 0; i < 20; i++)
+	{
+		TEST_rb_check_contents((struct TEST_rb_version *)arg);
+	}
+	return NULL;
+}
+
+void TEST_rb_persistent()
+{
+	printf("START TEST_rb_persistent\n");
+
+	struct TEST_rb_version versions[TEST_RB_PERSISTENT_VERSIONS];
+	struct TEST_rb_version live;
+	struct rb_node *node;
+	struct rb_slab *slab;
+	pthread_t reader;
+	long i, j, key, in_use;
+	unsigned long x = 2463534242UL;
+
+	live.tree = rb_create_persistent();
+	memset(live.present, 0, sizeof(live.present));
+
+	// Random inserts and deletes, with a snapshot taken every so often.
+	for (i = 0; i < TEST_RB_PERSISTENT_VERSIONS; i++)
+	{
+		for (j = 0; j < 100; j++)
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			key = x % TEST_RB_PERSISTENT_KEYS;
+			if (live.present[key])
+			{
+				rb_persistent_delete(live.tree, key);
+			}
+			else
+			{
+				rb_persistent_insert(live.tree, key, (void *)(key + 1));
+			}
+			live.present[key] = !live.present[key];
+		}
+
+		versions[i] = live;
+		versions[i].tree = rb_snapshot(live.tree);
+		TEST_rb_check_version(&live);
+	}
+
+	// Every snapshot still holds what it held when it was taken.
+	for (i = 0; i < TEST_RB_PERSISTENT_VERSIONS; i++)
+	{
+		TEST_rb_check_version(&versions[i]);
+	}
+
+	// Snapshots are trees in their own right: changing one leaves the others alone.
+	for (key = 0; key < TEST_RB_PERSISTENT_KEYS; key += 3)
+	{
+		if (versions[5].present[key])
+		{
+			rb_persistent_delete(versions[5].tree, key);
+		}
+		else
+		{
+			rb_persistent_insert(versions[5].tree, key, (void *)(key + 1));
+		}
+		versions[5].present[key] = !versions[5].present[key];
+	}
+	for (i = 0; i < TEST_RB_PERSISTENT_VERSIONS; i++)
+	{
+		TEST_rb_check_version(&versions[i]);
+	}
+
+	// A reader can work through a snapshot while the live tree keeps changing.
+	pthread_create(&reader, NULL, TEST_rb_snapshot_reader, &versions[TEST_RB_PERSISTENT_VERSIONS - 1]);
+	for (key = 0; key < TEST_RB_PERSISTENT_KEYS; key++)
+	{
+		if (live.present[key])
+		{
+			rb_persistent_delete(live.tree, key);
+		}
+		else
+		{
+			rb_persistent_insert(live.tree, key, (void *)(key + 1));
+		}
+		live.present[key] = !live.present[key];
+	}
+	pthread_join(reader, NULL);
+	TEST_rb_check_version(&live);
+
+	// Drop the snapshots out of order, checking the survivors each time.
+	for (i = 1; i < TEST_RB_PERSISTENT_VERSIONS; i += 2)
+	{
+		rb_destroy(versions[i].tree);
+	}
+	for (i = 0; i < TEST_RB_PERSISTENT_VERSIONS; i += 2)
+	{
+		TEST_rb_check_version(&versions[i]);
+		rb_destroy(versions[i].tree);
+	}
+	TEST_rb_check_version(&live);
+
+	// With the snapshots gone, every node not in the live tree is back on the free list.
+	for (in_use = 0, slab = live.tree->arena->slabs; slab; slab = slab->next)
+	{
+		in_use += slab->used;
+	}
+	for (node = live.tree->arena->free_list; node; node = (struct rb_node *)node->data)
+	{
+		in_use--;
+	}
+	ASSERT(in_use == rb_count(live.tree), "%ld nodes in use for %ld keys", in_use, rb_count(live.tree));
+
+	// The lock-free scan climbs parent pointers, which a persistent tree doesn't keep.
+	TEST_rb_check_refused(TEST_rb_concurrent_scan_all, live.tree, "rb_concurrent_range_scan on a persistent tree");
+
+	rb_destroy(live.tree);
+
+	printf("COMPLETED TEST_rb_persistent\n");
+}
+
+
+
+// Builds a tree out of the keys in 0..n-1 marked present, inserted in a scrambled order 
+// so the colors come out mixed.
+struct rb_tree *TEST_rb_tree_of(char *present, long n)
+{
+	struct rb_tree *tree = rb_create();
+	long i, key;
+
+	for (i = 0; i < n; i++)
+	{
+		key = (i * 7919) % n;
+		if (present[key])
+		{
+			rb_insert(tree, key, (void *)(key + 1));
+		}
+	}
+	return tree;
+}
+
+void TEST_rb_join_split()
+{
+	printf("START TEST_rb_join_split\n");
+
+	long sizes[] = { 0, 1, 2, 3, 10, 100, 1001, 5000 };
+	long n, i, s, split_at;
+	char *present = (char *)malloc(10000);
+	char *left_present = (char *)malloc(10000);
+	char *right_present = (char *)malloc(10000);
+	struct rb_tree *tree, *right;
+
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		n = sizes[s];
+		memset(present, 0, 10000);
+		for (i = 0; i < n; i++)
+		{
+			present[i] = (i % 3 != 1);
+		}
+
+		for (split_at = -1; split_at <= n + 1; split_at += (n > 20) ? n / 7 : 1)
+		{
+			tree = TEST_rb_tree_of(present, n);
+			right = rb_split(tree, split_at);
+
+			for (i = 0; i < n; i++)
+			{
+				left_present[i] = present[i] && i < split_at;
+				right_present[i] = present[i] && i >= split_at;
+			}
+			rb_validate(tree, tree->root);
+			rb_validate(right, right->root);
+			TEST_rb_check_keys(tree, left_present, n);
+			TEST_rb_check_keys(right, right_present, n);
+
+			// Alternate between gluing the halves back together and destroying them
+			// separately, since they share an arena.
+			if (split_at % 2 == 0)
+			{
+				tree = rb_join(tree, right);
+				rb_validate(tree, tree->root);
+				TEST_rb_check_keys(tree, present, n);
+			}
+			else
+			{
+				rb_destroy(right);
+				rb_validate(tree, tree->root);
+				TEST_rb_check_keys(tree, left_present, n);
+			}
+			rb_destroy(tree);
+		}
+	}
+
+	// Joining trees of very different heights, from different arenas.
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		n = sizes[s];
+		for (split_at = 0; split_at <= n; split_at += (n > 20) ? n / 5 : 1)
+		{
+			for (i = 0; i < n; i++)
+			{
+				left_present[i] = (i < split_at);
+				right_present[i] = (i >= split_at);
+				present[i] = 1;
+			}
+			tree = TEST_rb_tree_of(left_present, n);
+			right = TEST_rb_tree_of(right_present, n);
+			tree = rb_join(tree, right);
+			rb_validate(tree, tree->root);
+			TEST_rb_check_keys(tree, present, n);
+			rb_destroy(tree);
+		}
+	}
+
+	free(right_present);
+	free(left_present);
+	free(present);
+
+	printf("COMPLETED TEST_rb_join_split\n");
+}
+
+
+
+void TEST_rb_set_operations()
+{
+	printf("START TEST_rb_set_operations\n");
+
+	long sizes[] = { 0, 10, 700, 30000 };
+	long n, i, s, in_use;
+	char *a_present, *b_present, *expected;
+	enum rb_set_op op;
+	struct rb_tree *a, *b;
+	struct rb_slab *slab;
+	struct rb_node *node;
+	unsigned long x = 88172645463325252UL;
+
+	// More workers than cores, so there's stealing even on one core.
+	rb_set_threads(4);
+
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		n = sizes[s];
+		a_present = (char *)malloc(n + 1);
+		b_present = (char *)malloc(n + 1);
+		expected = (char *)malloc(n + 1);
+
+		for (op = rb_set_union; op <= rb_set_difference; op++)
+		{
+			// b gets denser as s grows, so some runs have a much smaller tree than the other.
+			for (i = 0; i < n; i++)
+			{
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				a_present[i] = (x % 2 == 0);
+				b_present[i] = ((x >> 8) % 8 < (unsigned long)(s * 2 + 1));
+			}
+
+			a = TEST_rb_tree_of(a_present, n);
+			b = TEST_rb_tree_of(b_present, n);
+
+			for (i = 0; i < n; i++)
+			{
+				if (op == rb_set_union)
+				{
+					expected[i] = a_present[i] || b_present[i];
+				}
+				else if (op == rb_set_intersection)
+				{
+					expected[i] = a_present[i] && b_present[i];
+				}
+				else
+				{
+					expected[i] = a_present[i] && !b_present[i];
+				}
+			}
+
+			if (op == rb_set_union)
+			{
+				a = rb_union(a, b);
+			}
+			else if (op == rb_set_intersection)
+			{
+				a = rb_intersection(a, b);
+			}
+			else
+			{
+				a = rb_difference(a, b);
+			}
+
+			rb_validate(a, a->root);
+			TEST_rb_check_keys(a, expected, n);
+
+			// Every node that didn't make it into the result is back on the free list.
+			for (in_use = 0, slab = a->arena->slabs; slab; slab = slab->next)
+			{
+				in_use += slab->used;
+			}
+			for (node = a->arena->free_list; node; node = (struct rb_node *)node->data)
+			{
+				in_use--;
+			}
+			ASSERT(in_use == rb_count(a), "%ld nodes in use for %ld keys", in_use, rb_count(a));
+
+			rb_destroy(a);
+		}
+
+		free(expected);
+		free(b_present);
+		free(a_present);
+	}
+
+	// Keys in both trees keep a's data.
+	a = rb_create();
+	b = rb_create();
+	rb_insert(a, 1, (void *)10);
+	rb_insert(b, 1, (void *)20);
+	rb_insert(b, 2, (void *)30);
+	a = rb_union(a, b);
+	ASSERT((long)rb_lookup(a, 1) == 10 && (long)rb_lookup(a, 2) == 30, "Union took the wrong data");
+	b = rb_create();
+	rb_insert(b, 1, (void *)40);
+	a = rb_intersection(a, b);
+	ASSERT(rb_count(a) == 1 && (long)rb_lookup(a, 1) == 10, "Intersection took the wrong data");
+	rb_destroy(a);
+
+	rb_set_threads(0);
+
+	printf("COMPLETED TEST_rb_set_operations\n");
+}
+
+
+
+void TEST_rb_delete_range()
+{
+	printf("START TEST_rb_delete_range\n");
+
+	long ranges[][2] = { { 5, 4 }, { -10, -1 }, { 3000, 4000 }, { 0, 0 }, { 10, 10 }, { 100, 199 },
+						 { 150, 450 }, { -5, 20 }, { 1990, 2100 }, { 700, 1500 }, { LONG_MIN, LONG_MAX } };
+	long n = 2000;
+	long i, r, removed, expected_removed, in_use;
+	char *present = (char *)malloc(n);
+	struct rb_tree *tree;
+	struct rb_slab *slab;
+	struct rb_node *node;
+
+	for (i = 0; i < n; i++)
+	{
+		present[i] = (i % 5 != 3);
+	}
+	tree = TEST_rb_tree_of(present, n);
+
+	for (r = 0; r < (long)(sizeof(ranges) / sizeof(ranges[0])); r++)
+	{
+		for (i = 0, expected_removed = 0; i < n; i++)
+		{
+			if (present[i] && i >= ranges[r][0] && i <= ranges[r][1])
+			{
+				present[i] = 0;
+				expected_removed++;
+			}
+		}
+
+		removed = rb_delete_range(tree, ranges[r][0], ranges[r][1]);
+		ASSERT(removed == expected_removed, "Removed %ld keys from [%ld, %ld], expected %ld", removed, ranges[r][0], ranges[r][1], expected_removed);
+		rb_validate(tree, tree->root);
+		TEST_rb_check_keys(tree, present, n);
+
+		// The removed nodes all went back to the arena.
+		for (in_use = 0, slab = tree->arena->slabs; slab; slab = slab->next)
+		{
+			in_use += slab->used;
+		}
+		for (node = tree->arena->free_list; node; node = (struct rb_node *)node->data)
+		{
+			in_use--;
+		}
+		ASSERT(in_use == rb_count(tree), "%ld nodes in use for %ld keys", in_use, rb_count(tree));
+	}
+	ASSERT(tree->root == NULL, "Tree should be empty");
+
+	rb_destroy(tree);
+	free(present);
+
+	printf("COMPLETED TEST_rb_delete_range\n");
+}
+
+
+
+// Scan callback for mapped trees: keys in order, each with key + 1 as its data.
+int TEST_rb_mapped_scan_callback(struct rb_node *node, void *context)
+{
+	long *expected = (long *)context;
+
+	ASSERT(node->key > *expected, "Scan out of order at %ld", node->key);
+	ASSERT((long)node->data == node->key + 1, "Scan has wrong data for %ld", node->key);
+	*expected = node->key;
+	return 0;
+}
+
+// TEST_rb_check_keys without rank and select, which mapped trees don't do.
+void TEST_rb_check_batch(struct rb_tree *tree, long lo, long hi);
+
+void TEST_rb_check_mapped(struct rb_tree *tree, char *present, long n)
+{
+	long i, count = 0, in_range = 0, previous = -1;
+
+	for (i = 0; i < n; i++)
+	{
+		if (present[i])
+		{
+			ASSERT((long)rb_lookup(tree, i) == i + 1, "Mapped tree lost key %ld", i);
+			count++;
+			in_range += (i >= n / 3 && i <= 2 * n / 3);
+		}
+		else
+		{
+			ASSERT(rb_lookup(tree, i) == NULL, "Mapped tree has extra key %ld", i);
+		}
+	}
+	ASSERT(rb_lookup(tree, -1) == NULL && rb_lookup(tree, n) == NULL, "Mapped tree has keys outside 0..n-1");
+	TEST_rb_check_batch(tree, -1, n + 1);
+	ASSERT(rb_count(tree) == count, "Mapped tree has %ld keys, expected %ld", rb_count(tree), count);
+	ASSERT(rb_range_scan(tree, LONG_MIN, LONG_MAX, TEST_rb_mapped_scan_callback, &previous) == count, "Scan missed keys");
+	previous = n / 3 - 1;
+	ASSERT(rb_range_scan(tree, n / 3, 2 * n / 3, TEST_rb_mapped_scan_callback, &previous) == in_range, "Partial scan missed keys");
+}
+
+// What a mapped tree has to refuse, since it would only see the logged changes.
+void TEST_rb_mapped_delete_range(struct rb_tree *tree) { rb_delete_range(tree, LONG_MIN, LONG_MAX); }
+void TEST_rb_mapped_split(struct rb_tree *tree) { rb_split(tree, 0); }
+void TEST_rb_mapped_join_left(struct rb_tree *tree) { rb_join(tree, rb_create()); }
+void TEST_rb_mapped_join_right(struct rb_tree *tree) { rb_join(rb_create(), tree); }
+void TEST_rb_mapped_union(struct rb_tree *tree) { rb_union(tree, rb_create()); }
+void TEST_rb_mapped_difference(struct rb_tree *tree) { rb_difference(rb_create(), tree); }
+void TEST_rb_mapped_lookup(struct rb_tree *tree) { rb_concurrent_lookup(tree, 0); }
+void TEST_rb_mapped_insert_twice(struct rb_tree *tree) { rb_insert(tree, -8, (void *)-7); rb_insert(tree, -8, (void *)-7); }
+
+void TEST_rb_save_map()
+{
+	printf("START TEST_rb_save_map\n");
+
+	long sizes[] = { 0, 1, 2, 3, 100, 5000 };
+	long n, i, s, key;
+	char path[64], other[64];
+	char *present = (char *)malloc(6000);
+	struct rb_tree *tree;
+	struct rb_node *node;
+	struct stat st;
+	unsigned long x = 2463534242UL;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/tmp/TEST_rb_save_map.%d", (int)getpid());
+	snprintf(other, sizeof(other), "/tmp/TEST_rb_save_map.%d.other", (int)getpid());
+
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		n = sizes[s];
+		memset(present, 0, 6000);
+		for (i = 0; i < n; i++)
+		{
+			present[i] = (i % 3 != 1);
+		}
+
+		tree = TEST_rb_tree_of(present, n);
+		ASSERT(rb_save(tree, path) == 0, "rb_save failed");
+		rb_destroy(tree);
+
+		tree = rb_map(path);
+		ASSERT(tree != NULL, "rb_map failed");
+		ASSERT(tree->root == NULL, "rb_map read nodes in");
+		TEST_rb_check_mapped(tree, present, n);
+
+		// Changes to saved keys and new ones, reopening every so often so they come 
+		// back from the log.
+		for (i = 0; i < 3000; i++)
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			key = x % (n + 10);
+
+			if (present[key])
+			{
+				rb_delete(tree, key);
+			}
+			else
+			{
+				rb_insert(tree, key, (void *)(key + 1));
+			}
+			present[key] = !present[key];
+
+			if (i % 500 == 499)
+			{
+				rb_destroy(tree);
+				tree = rb_map(path);
+				ASSERT(tree != NULL, "rb_map failed with changes in the log");
+				rb_validate(tree, tree->root);
+				TEST_rb_check_mapped(tree, present, n + 10);
+			}
+		}
+
+		// Saving again leaves the log behind. Not over the tree's own file, though, where
+		// its changes would get lost.
+		ASSERT(rb_save(tree, path) == -1, "rb_save over the tree's own file went ahead");
+		ASSERT(rb_save(tree, other) == 0, "rb_save of a mapped tree failed");
+		rb_destroy(tree);
+		ASSERT(rename(other, path) == 0, "Couldn't move the resaved tree into place");
+		tree = rb_map(path);
+		ASSERT(tree->root == NULL && tree->mapped->tombstones->root == NULL, "Resaved tree still has changes");
+		ASSERT(stat(path, &st) == 0 && st.st_size == _rb_disk_offset(rb_count(tree)), "Resaved file is %ld bytes", (long)st.st_size);
+		TEST_rb_check_mapped(tree, present, n + 10);
+		rb_destroy(tree);
+	}
+
+	// A change cut off partway is dropped.
+	file = fopen(path, "ab");
+	fwrite("torn", 4, 1, file);
+	fclose(file);
+	tree = rb_map(path);
+	ASSERT(tree != NULL, "rb_map failed on a torn change");
+	rb_insert(tree, -5, (void *)-4);
+	rb_destroy(tree);
+	tree = rb_map(path);
+	ASSERT((long)rb_lookup(tree, -5) == -4, "Change after a torn one was lost");
+	rb_delete(tree, -5);
+
+	// Erasing and updating by handle get logged too.
+	node = rb_insert_node(tree, -6, (void *)-5);
+	rb_set_data(tree, rb_insert_node(tree, -7, (void *)-6), (void *)-60);
+	rb_erase_node(tree, node);
+	rb_destroy(tree);
+	tree = rb_map(path);
+	ASSERT(rb_lookup(tree, -6) == NULL && (long)rb_lookup(tree, -7) == -60, "Changes by handle weren't logged");
+	rb_delete(tree, -7);
+	TEST_rb_check_mapped(tree, present, n + 10);
+
+	// Operations on the nodes alone refuse it, and leave it as it was.
+	TEST_rb_check_refused(TEST_rb_mapped_delete_range, tree, "rb_delete_range on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_split, tree, "rb_split on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_join_left, tree, "rb_join on the left on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_join_right, tree, "rb_join on the right on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_union, tree, "rb_union on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_difference, tree, "rb_difference on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_mapped_lookup, tree, "rb_concurrent_lookup on a mapped tree");
+	TEST_rb_check_refused(TEST_rb_concurrent_scan_all, tree, "rb_concurrent_range_scan on a mapped tree");
+	TEST_rb_check_mapped(tree, present, n + 10);
+
+	// A duplicate of a key that's only in a node is refused before it gets logged, so the
+	// file still opens.
+	TEST_rb_check_refused(TEST_rb_mapped_insert_twice, tree, "A second rb_insert");
+	rb_destroy(tree);
+	tree = rb_map(path);
+	ASSERT(tree != NULL, "rb_map failed after a refused insert");
+	ASSERT((long)rb_lookup(tree, -8) == -7, "First insert before the refused one was lost");
+	rb_delete(tree, -8);
+	TEST_rb_check_mapped(tree, present, n + 10);
+	rb_destroy(tree);
+
+	// Files that aren't saved trees.
+	file = fopen(path, "wb");
+	fwrite("not a tree, not a tree, not a tree", 34, 1, file);
+	fclose(file);
+	ASSERT(rb_map(path) == NULL, "rb_map took a file that isn't a tree");
+	unlink(path);
+	ASSERT(rb_map(path) == NULL, "rb_map took a file that isn't there");
+
+	free(present);
+
+	printf("COMPLETED TEST_rb_save_map\n");
+}
+
+
+
+///
+/// TEST_rb_freeze
+///
+/// Lookups, lower bounds and ranks of a frozen tree against the tree it came from, for
+/// every key and the gaps between them, at sizes that fill the last level to different
+/// depths. Only even keys are in the tree.
+///
+
+void TEST_rb_freeze()
+{
+	long sizes[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 31, 32, 33, 100, 1000, 4095, 4096, 5000 };
+	struct rb_tree *tree, *snapshot;
+	struct rb_frozen *frozen;
+	struct rb_node *bound;
+	long s, n, i, key, slot;
+
+	printf("START TEST_rb_freeze\n");
+
+	for (s = 0; s < (long)(sizeof(sizes) / sizeof(sizes[0])); s++)
+	{
+		n = sizes[s];
+		tree = rb_create();
+		for (i = 0; i < n; i++)
+		{
+			key = 2 * ((i * 7919) % n);
+			rb_insert(tree, key, (void *)(key + 1));
+		}
+
+		frozen = rb_freeze(tree);
+		ASSERT(frozen->count == n, "Frozen tree holds %ld keys, not %ld", frozen->count, n);
+		ASSERT(((long)frozen->keys & 63) == 0, "Frozen keys aren't cache line aligned");
+
+		for (key = -1; key <= 2 * n; key++)
+		{
+			ASSERT((long)rb_frozen_lookup(frozen, key) == (key % 2 == 0 && key < 2 * n ? key + 1 : 0), "Frozen lookup of %ld in %ld keys", key, n);
+
+			bound = rb_lower_bound(tree, key);
+			slot = rb_frozen_lower_bound(frozen, key);
+			ASSERT(bound ? (slot && frozen->keys[slot] == bound->key && frozen->data[slot] == bound->data) : slot == 0,
+				"Frozen lower bound of %ld in %ld keys", key, n);
+			ASSERT(rb_frozen_rank(frozen, key) == rb_rank(tree, key), "Frozen rank of %ld in %ld keys is %ld, not %ld",
+				key, n, rb_frozen_rank(frozen, key), rb_rank(tree, key));
+		}
+
+		// Freezing copies, so the tree carries on by itself.
+		rb_frozen_destroy(frozen);
+		if (n)
+		{
+			rb_delete(tree, 0);
+		}
+		rb_validate(tree, tree->root);
+		rb_destroy(tree);
+	}
+
+	// Persistent trees freeze the same way.
+	tree = rb_create_persistent();
+	for (i = 0; i < 1000; i++)
+	{
+		rb_persistent_insert(tree, (i * 7919) % 1000, (void *)i);
+	}
+	snapshot = rb_snapshot(tree);
+	rb_persistent_delete(tree, 500);
+	frozen = rb_freeze(snapshot);
+	ASSERT(frozen->count == 1000 && rb_frozen_lookup(frozen, 500) != NULL, "Frozen snapshot lost a key");
+	for (i = 0; i < 1000; i++)
+	{
+		ASSERT(rb_frozen_rank(frozen, i) == i, "Frozen snapshot rank of %ld", i);
+	}
+	rb_frozen_destroy(frozen);
+	rb_destroy(snapshot);
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_freeze\n");
+}
+
+
+
+// Checks that a map's shards are in order and each tree only holds keys in its range.
+void TEST_rb_check_shards(struct rb_sharded *map)
+{
+	struct rb_shard_directory *directory = map->directory;
+	long i;
+
+	for (i = 0; i < directory->count; i++)
+	{
+		struct rb_node *first = rb_first(directory->shards[i]->tree);
+		struct rb_node *last = rb_last(directory->shards[i]->tree);
+
+		rb_validate(directory->shards[i]->tree, directory->shards[i]->tree->root);
+		ASSERT(i == 0 || directory->shards[i - 1]->lo < directory->shards[i]->lo, "Shards %ld and %ld out of order", i - 1, i);
+		ASSERT(!first || first->key >= directory->shards[i]->lo, "Shard %ld holds %ld, below its range", i, first->key);
+		ASSERT(!last || i + 1 == directory->count || last->key < directory->shards[i + 1]->lo, "Shard %ld holds %ld, above its range", i, last->key);
+	}
+}
+
+struct TEST_rb_sharded_scan_state
+{
+	long expected;
+	long step;
+	long stop_at;
+};
+
+int TEST_rb_sharded_scan_callback(long key, void *data, void *context)
+{
+	struct TEST_rb_sharded_scan_state *state = (struct TEST_rb_sharded_scan_state *)context;
+
+	ASSERT(key == state->expected && (long)data == key + 1, "Sharded scan got %ld, expected %ld", key, state->expected);
+	state->expected += state->step;
+	return key == state->stop_at;
+}
+
+struct TEST_rb_sharded_writer_state
+{
+	struct rb_sharded *map;
+	long thread;
+	long threads;
+	long n;
+};
+
+void *TEST_rb_sharded_writer(void *arg)
+{
+	struct TEST_rb_sharded_writer_state *state = (struct TEST_rb_sharded_writer_state *)arg;
+	long i, key;
+
+	// Interleaved keys, scrambled, so every writer hits every shard.
+	for (i = 0; i < state->n; i++)
+	{
+		key = ((i * 7919) % state->n) * state->threads + state->thread;
+		rb_sharded_insert(state->map, key, (void *)(key + 1));
+	}
+	return NULL;
+}
+
+struct TEST_rb_sharded_reader_state
+{
+	struct rb_sharded *map;
+	long n;
+	int *done;
+	long lookups;
+};
+
+void *TEST_rb_sharded_reader(void *arg)
+{
+	struct TEST_rb_sharded_reader_state *state = (struct TEST_rb_sharded_reader_state *)arg;
+	long key;
+
+	// The even keys below 2 * n were there before the writers started, and splits move
+	// them between shards underneath us.
+	while (!__atomic_load_n(state->done, __ATOMIC_ACQUIRE))
+	{
+		key = ((state->lookups * 7919) % state->n) * 2;
+		ASSERT((long)rb_sharded_lookup(state->map, key) == key + 1, "Lookup of %ld failed during a split", key);
+		ASSERT(rb_sharded_lookup(state->map, -key - 1) == NULL, "Lookup found missing key %ld", -key - 1);
+		state->lookups++;
+	}
+	return NULL;
+}
+
+void TEST_rb_sharded()
+{
+	printf("START TEST_rb_sharded\n");
+
+	long bounds[] = { -100, 0, 100 };
+	long i, key;
+	void *data;
+	struct rb_sharded *map = rb_sharded_create(bounds, 3);
+	struct TEST_rb_sharded_scan_state state;
+	struct TEST_rb_sharded_writer_state writers[4];
+	pthread_t threads[4];
+	struct TEST_rb_sharded_reader_state reader;
+	int done = 0;
+
+	// -300..300 over four fixed shards.
+	for (i = 0; i < 601; i++)
+	{
+		key = (i * 7919) % 601 - 300;
+		rb_sharded_insert(map, key, (void *)(key + 1));
+	}
+	TEST_rb_check_shards(map);
+	ASSERT(map->directory->count == 4 && rb_sharded_count(map) == 601, "Map has %ld keys in %ld shards", rb_sharded_count(map), map->directory->count);
+	for (key = -300; key <= 300; key++)
+	{
+		ASSERT((long)rb_sharded_lookup(map, key) == key + 1, "Sharded lookup failed for %ld", key);
+		ASSERT(rb_sharded_rank(map, key) == key + 300, "Rank of %ld is %ld", key, rb_sharded_rank(map, key));
+		ASSERT(rb_sharded_select(map, key + 300, &i, &data) && i == key && (long)data == key + 1, "Select %ld got %ld", key + 300, i);
+	}
+	ASSERT(rb_sharded_lookup(map, 301) == NULL, "Sharded lookup found a missing key");
+	ASSERT(rb_sharded_rank(map, LONG_MIN) == 0 && rb_sharded_rank(map, LONG_MAX) == 601, "Rank outside the keys");
+	ASSERT(!rb_sharded_select(map, 601, &i, &data) && !rb_sharded_select(map, -1, &i, &data), "Select outside the keys");
+
+	// Scans across shard boundaries, from the bottom of the key space, and stopping early.
+	state.expected = -150;
+	state.step = 1;
+	state.stop_at = LONG_MAX;
+	ASSERT(rb_sharded_range_scan(map, -150, 150, TEST_rb_sharded_scan_callback, &state) == 301, "Scan -150..150");
+	state.expected = -300;
+	ASSERT(rb_sharded_range_scan(map, LONG_MIN, LONG_MAX, TEST_rb_sharded_scan_callback, &state) == 601, "Scan everything");
+	state.expected = -120;
+	state.stop_at = 2;
+	ASSERT(rb_sharded_range_scan(map, -120, 250, TEST_rb_sharded_scan_callback, &state) == 123, "Scan stopping in a shard");
+	ASSERT(rb_sharded_range_scan(map, 10, 5, TEST_rb_sharded_scan_callback, &state) == 0, "Empty scan");
+
+	for (key = -299; key <= 300; key += 2)
+	{
+		rb_sharded_delete(map, key);
+	}
+	ASSERT(rb_sharded_count(map) == 301 && rb_sharded_rank(map, 100) == 200, "Deletes left %ld keys", rb_sharded_count(map));
+	state.expected = -300;
+	state.step = 2;
+	state.stop_at = LONG_MAX;
+	ASSERT(rb_sharded_range_scan(map, LONG_MIN, LONG_MAX, TEST_rb_sharded_scan_callback, &state) == 301, "Scan after deletes");
+	rb_sharded_destroy(map);
+
+	// Sorted writes all go to the last shard, so every window splits it.
+	map = rb_sharded_create(NULL, 0);
+	for (key = 0; key < 4 * RB_SHARD_WINDOW; key++)
+	{
+		rb_sharded_insert(map, key, (void *)(key + 1));
+	}
+	TEST_rb_check_shards(map);
+	ASSERT(map->directory->count == 5, "Sorted writes made %ld shards", map->directory->count);
+	for (key = 0; key < 4 * RB_SHARD_WINDOW; key += 97)
+	{
+		ASSERT((long)rb_sharded_lookup(map, key) == key + 1, "Lookup after splits failed for %ld", key);
+		ASSERT(rb_sharded_rank(map, key) == key, "Rank after splits of %ld", key);
+	}
+
+	// Which shard counts as hot: none while the writes are even and uncontended, then
+	// one where writers waited, then one with more than twice its share.
+	for (i = 0; i < map->directory->count; i++)
+	{
+		map->directory->shards[i]->writes = 1000;
+		map->directory->shards[i]->waits = 10;
+	}
+	ASSERT(_rb_sharded_hot(map) == -1, "Even writes made shard %ld hot", _rb_sharded_hot(map));
+	map->directory->shards[2]->waits = 100;
+	ASSERT(_rb_sharded_hot(map) == 2, "Contended shard not hot, got %ld", _rb_sharded_hot(map));
+	map->directory->shards[2]->waits = 10;
+	map->directory->shards[3]->writes = 5000;
+	ASSERT(_rb_sharded_hot(map) == 3, "Busy shard not hot, got %ld", _rb_sharded_hot(map));
+	rb_sharded_destroy(map);
+
+	// Scrambled writes spread out after the first split, which leaves it at that.
+	map = rb_sharded_create(NULL, 0);
+	for (i = 0; i < 4 * RB_SHARD_WINDOW; i++)
+	{
+		key = (i * 7919) % (4 * RB_SHARD_WINDOW);
+		rb_sharded_insert(map, key, (void *)(key + 1));
+	}
+	TEST_rb_check_shards(map);
+	ASSERT(map->directory->count == 2, "Scrambled writes made %ld shards", map->directory->count);
+	rb_sharded_destroy(map);
+
+	// Writers running at once, splitting as they go.
+	map = rb_sharded_create(NULL, 0);
+	for (i = 0; i < 4; i++)
+	{
+		writers[i].map = map;
+		writers[i].thread = i;
+		writers[i].threads = 4;
+		writers[i].n = RB_SHARD_WINDOW;
+		pthread_create(&threads[i], NULL, TEST_rb_sharded_writer, &writers[i]);
+	}
+	for (i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	TEST_rb_check_shards(map);
+	ASSERT(rb_sharded_count(map) == 4 * RB_SHARD_WINDOW, "Writers left %ld keys", rb_sharded_count(map));
+	state.expected = 0;
+	state.step = 1;
+	ASSERT(rb_sharded_range_scan(map, LONG_MIN, LONG_MAX, TEST_rb_sharded_scan_callback, &state) == 4 * RB_SHARD_WINDOW, "Scan after writers");
+	rb_sharded_destroy(map);
+
+	// A reader while the low odd keys go in and come out again, in order, splitting the
+	// shards it reads from.
+	map = rb_sharded_create(NULL, 0);
+	for (key = 0; key < RB_SHARD_WINDOW; key++)
+	{
+		rb_sharded_insert(map, 2 * key, (void *)(2 * key + 1));
+	}
+	reader.map = map;
+	reader.n = RB_SHARD_WINDOW;
+	reader.done = &done;
+	reader.lookups = 0;
+	pthread_create(&threads[0], NULL, TEST_rb_sharded_reader, &reader);
+	for (key = 0; key < 4 * RB_SHARD_WINDOW; key++)
+	{
+		i = 2 * (key % (RB_SHARD_WINDOW / 4)) + 1;
+		if ((key / (RB_SHARD_WINDOW / 4)) % 2)
+		{
+			rb_sharded_delete(map, i);
+		}
+		else
+		{
+			rb_sharded_insert(map, i, (void *)(i + 1));
+		}
+	}
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	pthread_join(threads[0], NULL);
+	TEST_rb_check_shards(map);
+	ASSERT(map->directory->count > 2 && reader.lookups > 0, "Reader ran %ld lookups over %ld shards", reader.lookups, map->directory->count);
+	rb_sharded_destroy(map);
+
+	printf("COMPLETED TEST_rb_sharded\n");
+}
+
+
+
+#ifdef RB_AUGMENT
+
+///
+/// TEST_rb_augment
+///
+/// Aggregates through every kind of change, against adding the values up one by one.
+///
+
+// Every node's aggregate (rb_validate checks them), then rb_range_aggregate over ranges of
+// all sizes, some hanging off either end.
+void TEST_rb_check_aggregates(struct rb_tree *tree, char *present, long *values, long n)
+{
+	const struct rb_augment *augment = tree->augment;
+	unsigned long x = 2463534242UL;
+	long lo, hi, i, expected, r;
+
+	rb_validate(tree, tree->root);
+	for (r = 0; r < 300; r++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		lo = (long)(x % (unsigned long)(n + 20)) - 10;
+		hi = lo + (long)((x >> 24) % (unsigned long)((r < 150) ? 40 : n + 20));
+		if (r == 0)
+		{
+			lo = LONG_MIN;
+			hi = LONG_MAX;
+		}
+
+		for (i = (lo < 0) ? 0 : lo, expected = augment->identity; i <= hi && i < n; i++)
+		{
+			if (present[i])
+			{
+				expected = augment->combine(expected, values[i]);
+			}
+		}
+		ASSERT(rb_range_aggregate(tree, lo, hi) == expected, "Aggregate over [%ld, %ld] is %ld, expected %ld", 
+			   lo, hi, rb_range_aggregate(tree, lo, hi), expected);
+	}
+	ASSERT(rb_range_aggregate(tree, 5, 4) == augment->identity, "An empty range should have the identity");
+}
+
+void TEST_rb_augment()
+{
+	printf("START TEST_rb_augment\n");
+
+	long n = 4000;
+	long i, key;
+	char *present = (char *)calloc(n, 1);
+	long *values = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree = rb_create();
+	struct rb_tree *right, *other;
+	struct rb_node *hint = NULL;
+
+	for (i = 0; i < n; i++)
+	{
+		values[i] = (i * 7919) % 1001 - 500;
+	}
+
+	// Half the keys go in before there's an augment, half after, some beside a hint. A
+	// block is left out to go in afterwards in order, so it goes in beside the finger.
+	for (i = 0; i < n; i++)
+	{
+		key = (i * 7919) % n;
+		if (i == n / 2)
+		{
+			rb_set_augment(tree, &rb_augment_sum);
+			TEST_rb_check_aggregates(tree, present, values, n);
+		}
+		if (key % 3 != 0 && (key < n / 4 || key >= n / 4 + 300))
+		{
+			present[key] = 1;
+			if (i % 2 == 0)
+			{
+				rb_insert(tree, key, (void *)values[key]);
+			}
+			else
+			{
+				hint = rb_insert_hint(tree, hint, key, (void *)values[key]);
+			}
+		}
+	}
+	for (key = n / 4; key < n / 4 + 300; key++)
+	{
+		present[key] = 1;
+		rb_insert(tree, key, (void *)values[key]);
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// Deletes, including of nodes with two children, whose successor moves up.
+	for (i = 0; i < n; i += 7)
+	{
+		if (present[i])
+		{
+			rb_delete(tree, i);
+			present[i] = 0;
+		}
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// Data changed through rb_set_data.
+	for (i = 1; i < n; i += 5)
+	{
+		if (present[i])
+		{
+			values[i] = -values[i] + 7;
+			rb_set_data(tree, _rb_find_node(tree->root, i), (void *)values[i]);
+		}
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// A different augment over the same nodes.
+	rb_set_augment(tree, &rb_augment_min);
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// Split, check both halves, join back.
+	right = rb_split(tree, n / 3);
+	ASSERT(right->augment == &rb_augment_min, "The split off half keeps the augment");
+	for (i = n / 3; i < n; i++)
+	{
+		present[i] = 0;
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+	for (i = 0; i < n; i++)
+	{
+		present[i] = (i >= n / 3) && rb_lookup(right, i) != NULL;
+	}
+	TEST_rb_check_aggregates(right, present, values, n);
+	tree = rb_join(tree, right);
+	for (i = 0; i < n; i++)
+	{
+		present[i] = rb_lookup(tree, i) != NULL;
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	rb_set_augment(tree, &rb_augment_max);
+	rb_delete_range(tree, n / 2, n / 2 + 500);
+	for (i = n / 2; i <= n / 2 + 500; i++)
+	{
+		present[i] = 0;
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// Set operations with another tree keeping the same aggregate.
+	other = rb_create();
+	rb_set_augment(other, &rb_augment_max);
+	for (i = 0; i < n; i += 3)
+	{
+		rb_insert(other, i, (void *)values[i]);
+	}
+	tree = rb_union(tree, other);
+	for (i = 0; i < n; i += 3)
+	{
+		present[i] = 1;
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	other = rb_create();
+	rb_set_augment(other, &rb_augment_max);
+	for (i = 0; i < n; i += 2)
+	{
+		rb_insert(other, i, (void *)values[i]);
+	}
+	tree = rb_difference(tree, other);
+	for (i = 0; i < n; i += 2)
+	{
+		present[i] = 0;
+	}
+	TEST_rb_check_aggregates(tree, present, values, n);
+
+	// Dropping the augment leaves an ordinary tree.
+	rb_set_augment(tree, NULL);
+	rb_validate(tree, tree->root);
+	rb_destroy(tree);
+
+	free(values);
+	free(present);
+
+	printf("COMPLETED TEST_rb_augment\n");
+}
+
+#endif
+
+
+
+///
+/// TEST_rb_buffered
+///
+/// A mix of inserts, overwrites and deletes, checked against an array after every step
+/// and in the tree after each flush.
+///
+
+// Every key's data through the buffers, then everything in the flushed tree.
+void TEST_rb_check_buffered(struct rb_buffered *buffered, long *expected, long n)
+{
+	struct rb_tree *tree;
+	long i, count = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_buffered_lookup(buffered, i) == expected[i], "Buffered lookup of %ld gave %ld, expected %ld", 
+			   i, (long)rb_buffered_lookup(buffered, i), expected[i]);
+	}
+
+	tree = rb_buffered_flush(buffered);
+	ASSERT(buffered->appended == 0 && buffered->carry.count == 0, "Flush left keys in the buffers");
+	for (i = 0; i < buffered->num_levels; i++)
+	{
+		ASSERT(buffered->levels[i].count == 0, "Flush left keys in level %ld", i);
+	}
+	rb_validate(tree, tree->root);
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_lookup(tree, i) == expected[i], "Flushed tree has %ld for %ld, expected %ld", (long)rb_lookup(tree, i), i, expected[i]);
+		count += (expected[i] != 0);
+	}
+	ASSERT(rb_count(tree) == count, "Flushed tree has %ld keys, expected %ld", rb_count(tree), count);
+}
+
+// Checks the arena's nodes are all either in tree or on the free list, and that the ends
+// of both lists are where the arena says. Returns the number of slabs and free nodes.
+void TEST_rb_check_arena(struct rb_tree *tree, long *slabs, long *free_nodes)
+{
+	struct rb_arena *arena = tree->arena;
+	struct rb_slab *slab, *last_slab = NULL;
+	struct rb_node *node, *last_free = NULL;
+	long used = 0;
+
+	for (*slabs = 0, slab = arena->slabs; slab; last_slab = slab, slab = slab->next, (*slabs)++)
+	{
+		used += slab->used;
+	}
+	for (*free_nodes = 0, node = arena->free_list; node; last_free = node, node = (struct rb_node *)node->data, (*free_nodes)++);
+
+	ASSERT(arena->last_slab == last_slab && arena->last_free == last_free, "Arena's list ends are wrong");
+	ASSERT(used == rb_count(tree) + *free_nodes, "%ld nodes handed out, %ld in the tree and %ld free", used, rb_count(tree), *free_nodes);
+}
+
+void TEST_rb_buffered()
+{
+	printf("START TEST_rb_buffered\n");
+
+	long n = 5000;
+	long capacity[] = { 1, 1000, 100000 };
+	long *expected = (long *)malloc(n * sizeof(long));
+	struct rb_buffered *buffered;
+	unsigned long x = 88172645463325252UL;
+	long c, i, key, slabs, free_nodes;
+
+	for (c = 0; c < (long)(sizeof(capacity) / sizeof(capacity[0])); c++)
+	{
+		buffered = rb_buffered_create(capacity[c]);
+		memset(expected, 0, n * sizeof(long));
+
+		for (i = 0; i < 20 * n; i++)
+		{
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			key = (long)(x % (unsigned long)n);
+
+			// Deletes of keys that aren't there are no-ops, and inserts of keys that are
+			// there overwrite.
+			if ((x >> 32) % 3 == 0)
+			{
+				rb_buffered_delete(buffered, key);
+				expected[key] = 0;
+			}
+			else
+			{
+				rb_buffered_insert(buffered, key, (void *)(i + 1));
+				expected[key] = i + 1;
+			}
+
+			if (i % 997 == 0)
+			{
+				ASSERT((long)rb_buffered_lookup(buffered, key) == expected[key], "Lookup of %ld right after writing it", key);
+			}
+			if (i % (5 * n) == 0)
+			{
+				TEST_rb_check_buffered(buffered, expected, n);
+			}
+		}
+		TEST_rb_check_buffered(buffered, expected, n);
+
+		// Writes after a flush land on top of the tree.
+		for (i = 0; i < n; i += 2)
+		{
+			rb_buffered_insert(buffered, i, (void *)(i + 7));
+			expected[i] = i + 7;
+		}
+		for (i = 1; i < n; i += 4)
+		{
+			rb_buffered_delete(buffered, i);
+			expected[i] = 0;
+		}
+		TEST_rb_check_buffered(buffered, expected, n);
+
+		rb_buffered_destroy(buffered);
+	}
+
+	// Many flushes over a small key range. The nodes each flush frees get reused by the
+	// next, so the arena stays about the size of the tree plus a batch.
+	buffered = rb_buffered_create(1000);
+	memset(expected, 0, n * sizeof(long));
+	for (i = 0; i < 400000; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = (long)(x % 3000);
+		if ((x >> 32) % 4 == 0)
+		{
+			rb_buffered_delete(buffered, key);
+			expected[key] = 0;
+		}
+		else
+		{
+			rb_buffered_insert(buffered, key, (void *)(i + 1));
+			expected[key] = i + 1;
+		}
+	}
+	TEST_rb_check_buffered(buffered, expected, n);
+	TEST_rb_check_arena(buffered->tree, &slabs, &free_nodes);
+	ASSERT(slabs <= (3000 + 4 * 1000) / RB_SLAB_NODES + 2, "Arena grew to %ld slabs, %ld nodes free", slabs, free_nodes);
+	rb_buffered_destroy(buffered);
+
+	free(expected);
+
+	printf("COMPLETED TEST_rb_buffered\n");
+}
+
+
+
+#ifdef RB_STATS
+
+///
+/// TEST_rb_stats
+///
+/// The counters against what a known workload has to do.
+///
+
+void TEST_rb_check_histogram(struct rb_stats *stats, enum rb_stats_op op, long calls)
+{
+	long total = 0;
+	int i;
+
+	for (i = 0; i < RB_STATS_BUCKETS; i++)
+	{
+		total += stats->latency[op][i];
+	}
+
+	// Where the sampling starts depends on the calls made before.
+	ASSERT(total == calls / RB_STATS_SAMPLE || total == (calls + RB_STATS_SAMPLE - 1) / RB_STATS_SAMPLE,
+		"Histogram %d holds %ld samples of %ld calls", (int)op, total, calls);
+}
+
+void TEST_rb_stats()
+{
+	struct rb_tree *tree = rb_create();
+	struct rb_stats stats;
+	long n = 10000, i;
+
+	printf("START TEST_rb_stats\n");
+	rb_stats(&stats, 1);
+
+	// Sorted inserts keep rotating at the right edge.
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, i, (void *)i);
+	}
+	rb_stats(&stats, 1);
+	ASSERT(stats.allocations == n && stats.slab_allocations == (n + RB_SLAB_NODES - 1) / RB_SLAB_NODES,
+		"Counted %ld allocations in %ld slabs", stats.allocations, stats.slab_allocations);
+	ASSERT(stats.descents == 1 && stats.hinted_inserts == n - 1, "Counted %ld descents for %ld inserts", stats.descents, n);
+	ASSERT(stats.rotations > 0 && stats.insert_fixup_loops >= stats.rotations / 2, "Counted %ld rotations in %ld fixup loops",
+		stats.rotations, stats.insert_fixup_loops);
+	ASSERT(stats.num_children_updates >= stats.comparisons, "Counted %ld subtree count updates", stats.num_children_updates);
+	TEST_rb_check_histogram(&stats, rb_op_insert, n);
+	TEST_rb_check_histogram(&stats, rb_op_lookup, 0);
+
+	// Every lookup looks at no more nodes than the tree is deep.
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_lookup(tree, i) == i, "Lookup failed for %ld", i);
+	}
+	rb_lookup(tree, n);
+	rb_stats(&stats, 0);
+	ASSERT(stats.descents == n + 1 && stats.comparisons <= (n + 1) * rb_maximum_depth(tree), "Counted %ld comparisons in %ld lookups",
+		stats.comparisons, stats.descents);
+	ASSERT(stats.rotations == 0 && stats.allocations == 0, "Lookups rotated or allocated");
+	TEST_rb_check_histogram(&stats, rb_op_lookup, n + 1);
+	ASSERT(rb_stats_percentile(&stats, rb_op_lookup, 0.5) > 0 &&
+		rb_stats_percentile(&stats, rb_op_lookup, 0.5) <= rb_stats_percentile(&stats, rb_op_lookup, 0.999), "Lookup percentiles out of order");
+	ASSERT(rb_stats_percentile(&stats, rb_op_delete, 0.5) == 0, "Percentile of an op never called");
+
+	// Deleting black nodes takes the fixup loop.
+	rb_stats(&stats, 1);
+	for (i = 0; i < n; i += 2)
+	{
+		rb_delete(tree, i);
+	}
+	rb_validate(tree, tree->root);
+	rb_stats(&stats, 1);
+	ASSERT(stats.delete_fixup_loops > 0, "No delete fixup loops counted");
+	TEST_rb_check_histogram(&stats, rb_op_delete, n / 2);
+	ASSERT(stats.allocations == 0, "Deletes allocated");
+
+	// Freed nodes are reused without new slabs.
+	for (i = 0; i < n; i += 2)
+	{
+		rb_insert(tree, i, (void *)i);
+	}
+	rb_stats(&stats, 1);
+	ASSERT(stats.allocations == n / 2 && stats.slab_allocations == 0, "Reinserts took %ld slabs", stats.slab_allocations);
+
+	rb_destroy(tree);
+
+	printf("COMPLETED TEST_rb_stats\n");
+}
+
+#endif
+
+
+
+
+//
+//
+// BENCHMARKS
+//
+// Run with ./a.out bench (compile with -O3).
+//
+
+
+///
+/// _rb_bench_now
+///
+/// Monotonic wall clock in seconds.
+///
+
+double _rb_bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+///
+/// _rb_bench_keys
+///
+/// Fills keys with a scrambled permutation of 0..n-1, so runs are repeatable. The
+/// multiplier is a prime bigger than any n used here, so it's coprime to n.
+///
+
+void _rb_bench_keys(long *keys, long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = (i * 2654435761L) % n;
+	}
+}
+
+
+
+///
+/// _rb_bench_shuffle
+///
+/// Fisher-Yates shuffle driven by a fixed xorshift generator. Unlike _rb_bench_keys 
+/// there's no pattern left for the caches or the prefetcher to pick up.
+///
+
+void _rb_bench_shuffle(long *keys, long n)
+{
+	unsigned long x = 88172645463325252UL;
+	long i, j, swap;
+
+	for (i = n - 1; i > 0; i--)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		j = x % (i + 1);
+		swap = keys[i];
+		keys[i] = keys[j];
+		keys[j] = swap;
+	}
+}
+
+
+
+///
+/// BENCH_rb_insert_lookup
+///
+/// Inserts n scrambled keys, looks them all up and tears the tree down.
+///
+/// Timings when compiled -O3, recursive insert/lookup:
+/// insert     1000000 keys:    0.323s    3.09 Mops/s
+/// lookup     1000000 keys:    0.164s    6.11 Mops/s
+/// insert    10000000 keys:    3.928s    2.55 Mops/s
+/// lookup    10000000 keys:    1.705s    5.86 Mops/s
+///
+/// Iterative, with subtree counts bumped on the way down:
+/// insert     1000000 keys:    0.221s    4.53 Mops/s
+/// lookup     1000000 keys:    0.056s   18.02 Mops/s
+/// insert    10000000 keys:    3.039s    3.29 Mops/s
+/// lookup    10000000 keys:    0.943s   10.61 Mops/s
+///
+
+void BENCH_rb_insert_lookup(long n)
+{
+	long i;
+	double start, elapsed;
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree = rb_create();
+
+	_rb_bench_keys(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("insert   %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		if ((long)rb_lookup(tree, keys[n - 1 - i]) != keys[n - 1 - i])
+		{
+			printf("Failed on rb_lookup: %ld\n", keys[n - 1 - i]);
+			exit(1);
+		}
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("lookup   %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	printf("nodes    %9ld keys: %8.1f MB (%ld bytes/node)\n", n, n * sizeof(struct rb_node) / 1e6, (long)sizeof(struct rb_node));
+
+	start = _rb_bench_now();
+	rb_destroy(tree);
+	printf("destroy  %9ld keys: %8.3fs\n", n, _rb_bench_now() - start);
+
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_build
+///
+/// Loading n keys with rb_insert one at a time versus the bulk builders.
+///
+/// Timings when compiled -O3 (one core):
+/// rb_insert sorted      10000000 keys:    3.014s
+/// rb_build_from_sorted  10000000 keys:    0.545s
+/// rb_insert scrambled   10000000 keys:    2.974s
+/// rb_build_from_unsorted 10000000 keys:    2.147s
+///
+/// Since rb_insert puts sorted keys straight next to its finger, the first line is down
+/// to 2.1s (see BENCH_rb_insert_hint).
+///
+
+void BENCH_rb_build(long n)
+{
+	long i;
+	double start, elapsed;
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+
+	start = _rb_bench_now();
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_insert sorted     %9ld keys: %8.3fs\n", n, elapsed);
+	rb_destroy(tree);
+
+	start = _rb_bench_now();
+	tree = rb_build_from_sorted(keys, (void **)keys, n);
+	elapsed = _rb_bench_now() - start;
+	printf("rb_build_from_sorted %9ld keys: %8.3fs\n", n, elapsed);
+	rb_destroy(tree);
+
+	_rb_bench_keys(keys, n);
+
+	start = _rb_bench_now();
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_insert scrambled  %9ld keys: %8.3fs\n", n, elapsed);
+	rb_destroy(tree);
+
+	start = _rb_bench_now();
+	tree = rb_build_from_unsorted(keys, (void **)keys, n);
+	elapsed = _rb_bench_now() - start;
+	printf("rb_build_from_unsorted %7ld keys: %8.3fs\n", n, elapsed);
+	rb_destroy(tree);
+
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_insert_hint
+///
+/// Streams of n keys inserted three ways: descending from the root every time (a NULL
+/// hint), with rb_insert and its finger, and with rb_insert_hint passing the last node in.
+/// "jitter w" is sorted apart from shuffling within each block of w keys, like timestamps
+/// arriving a little late.
+///
+/// Timings when compiled -O3 (runs on this machine vary by 10-20%):
+/// insert sorted        1000000 keys:  root   0.261s  rb_insert   0.191s  hint   0.170s
+/// insert reversed      1000000 keys:  root   0.239s  rb_insert   0.182s  hint   0.172s
+/// insert jitter 16     1000000 keys:  root   0.175s  rb_insert   0.152s  hint   0.166s
+/// insert jitter 1024   1000000 keys:  root   0.238s  rb_insert   0.236s  hint   0.316s
+/// insert scrambled     1000000 keys:  root   0.207s  rb_insert   0.212s  hint   0.287s
+/// insert sorted       10000000 keys:  root   3.054s  rb_insert   2.376s  hint   2.112s
+/// insert reversed     10000000 keys:  root   2.613s  rb_insert   2.127s  hint   2.109s
+/// insert jitter 16    10000000 keys:  root   2.118s  rb_insert   1.764s  hint   1.963s
+/// insert jitter 1024  10000000 keys:  root   2.105s  rb_insert   2.107s  hint   2.680s
+/// insert scrambled    10000000 keys:  root   2.117s  rb_insert   2.186s  hint   3.556s
+///
+/// Skipping the search saves 20-30% on sorted streams; the rest is the fixup, the walk
+/// up bumping num_children and allocation, which every insert pays. Climbing from a hint
+/// only pays off when the key is really close: the walk up from where the descent starts
+/// still has to reach the root, so far keys cost a climb on top of a full path. That's
+/// why rb_insert only uses its finger when the key falls in the finger's gap.
+///
+
+void BENCH_rb_insert_hint(long n)
+{
+	const char *names[] = { "sorted", "reversed", "jitter 16", "jitter 1024", "scrambled" };
+	long i, j, stream, block;
+	double start, elapsed[3];
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+
+	for (stream = 0; stream < 5; stream++)
+	{
+		for (i = 0; i < n; i++)
+		{
+			keys[i] = (stream == 1) ? n - i : i;
+		}
+		if (stream == 2 || stream == 3)
+		{
+			block = (stream == 2) ? 16 : 1024;
+			for (i = 0; i + block <= n; i += block)
+			{
+				_rb_bench_shuffle(keys + i, block);
+			}
+		}
+		if (stream == 4)
+		{
+			_rb_bench_keys(keys, n);
+		}
+
+		for (j = 0; j < 3; j++)
+		{
+			tree = rb_create();
+			start = _rb_bench_now();
+			for (i = 0; i < n; i++)
+			{
+				if (j == 1)
+				{
+					rb_insert(tree, keys[i], (void *)keys[i]);
+				}
+				else
+				{
+					rb_insert_hint(tree, j ? tree->finger : NULL, keys[i], (void *)keys[i]);
+				}
+			}
+			elapsed[j] = _rb_bench_now() - start;
+			rb_destroy(tree);
+		}
+		printf("insert %-11s %9ld keys:  root %7.3fs  rb_insert %7.3fs  hint %7.3fs\n", names[stream], n, elapsed[0],
+			elapsed[1], elapsed[2]);
+	}
+
+	free(keys);
+}
+
+
+///
+/// BENCH_rb_erase_node
+///
+/// Deletes all of n shuffled keys in another order, by key with rb_delete and by the 
+/// handles rb_insert_node gave back with rb_erase_node.
+///
+/// Timings when compiled -O3:
+/// delete   1000000 keys  rb_delete:    1.796s  rb_erase_node:    0.998s
+/// delete  10000000 keys  rb_delete:   35.263s  rb_erase_node:   25.842s
+///
+/// The handle saves the search, which is most of the misses; the rebalancing and the walk
+/// up fixing subtree counts are the same for both. Relinking a successor instead of 
+/// copying its key over costs rb_delete a few more writes, lost in the noise here.
+///
+
+void BENCH_rb_erase_node(long n)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_node **handles = (struct rb_node **)malloc(n * sizeof(struct rb_node *));
+	struct rb_tree *tree;
+	double start, delete_time, erase_time;
+	long i;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+	_rb_bench_shuffle(keys, n);
+
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)(keys[i] + 1));
+	}
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_delete(tree, keys[(i * 7) % n]);
+	}
+	delete_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		handles[i] = rb_insert_node(tree, keys[i], (void *)(keys[i] + 1));
+	}
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_erase_node(tree, handles[(i * 7) % n]);
+	}
+	erase_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	printf("delete %9ld keys  rb_delete: %8.3fs  rb_erase_node: %8.3fs\n", n, delete_time, erase_time);
+
+	free(handles);
+	free(keys);
+}
+
+
+
+
+///
+/// BENCH_rb_upsert
+///
+/// Counts ops random keys out of range: the first time a key turns up it goes in with a
+/// count of 1, after that its count goes up. Once with rb_lower_bound to look for the key
+/// and rb_insert when it isn't there, once with rb_insert_or_get. With a small range 
+/// nearly every key is already there; with a big one most of them are new.
+///
+/// Timings when compiled -O3:
+/// count  10000000 keys out of   1000000  lookup and rb_insert:   16.296s  rb_insert_or_get:   13.400s
+/// count  10000000 keys out of 100000000  lookup and rb_insert:   40.112s  rb_insert_or_get:   30.125s
+///
+/// When the key is new, the lookup's descent was wasted and rb_insert does it over; 
+/// rb_insert_or_get's insert goes in where its search stopped, and the walk back up fixing
+/// counts finds the path still in the cache. When the key is there both are one descent,
+/// and rb_insert_or_get stops at the key where rb_lower_bound carries on to a leaf. The
+/// counts are bumped in place, which is fine with no augment; with one, use rb_upsert.
+///
+
+void BENCH_rb_upsert(long ops, long range)
+{
+	struct rb_tree *tree;
+	struct rb_node *node;
+	double start, lookup_time, upsert_time;
+	unsigned long x;
+	long i, key, count;
+
+	x = 88172645463325252UL;
+	tree = rb_create();
+	start = _rb_bench_now();
+	for (i = 0; i < ops; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = (long)(x % range);
+		node = rb_lower_bound(tree, key);
+		if (node && node->key == key)
+		{
+			node->data = (void *)((long)node->data + 1);
+		}
+		else
+		{
+			rb_insert(tree, key, (void *)1);
+		}
+	}
+	lookup_time = _rb_bench_now() - start;
+	count = rb_count(tree);
+	rb_destroy(tree);
+
+	x = 88172645463325252UL;
+	tree = rb_create();
+	start = _rb_bench_now();
+	for (i = 0; i < ops; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		node = rb_insert_or_get(tree, (long)(x % range), (void *)0, NULL);
+		node->data = (void *)((long)node->data + 1);
+	}
+	upsert_time = _rb_bench_now() - start;
+	ASSERT(rb_count(tree) == count, "rb_insert_or_get made %ld keys, not %ld", rb_count(tree), count);
+	rb_destroy(tree);
+
+	printf("count %9ld keys out of %9ld  lookup and rb_insert: %8.3fs  rb_insert_or_get: %8.3fs\n", ops, range,
+		   lookup_time, upsert_time);
+}
+
+
+
+///
+/// BENCH_rb_priority_queue
+///
+/// A deadline scheduler with n timers: pop the earliest, put it back up to a million
+/// ticks later, ops times over. Keys are a deadline in the high bits and the timer's
+/// number in the low 20, so they're unique. Once with a binary heap in an array, once
+/// with rb_pop_min, and once the way it had to be done before, finding the smallest and
+/// then deleting it by key.
+///
+/// Timings when compiled -O3:
+/// schedule      1000 timers x  10000000  heap:    1.112s  rb_pop_min:    2.609s  find and rb_delete:    3.096s
+/// schedule   1000000 timers x  10000000  heap:    3.992s  rb_pop_min:   23.761s  find and rb_delete:   21.888s
+///
+/// rb_pop_min saves the descent down the left spine, which is only worth much when the
+/// whole queue is in the cache: with a million timers the time goes to putting each one
+/// back, a descent to a random place. A heap does both in an array with no pointers to 
+/// chase, and mostly near the end of it, so if all a queue needs is the earliest deadline,
+/// a heap is the better choice. The tree is for when timers also get cancelled or moved
+/// by handle (rb_erase_node), looked up, or scanned by deadline.
+///
+
+struct _rb_bench_heap_entry
+{
+	long key;
+	void *data;
+};
+
+void _rb_bench_heap_push(struct _rb_bench_heap_entry *heap, long *size, long key, void *data)
+{
+	long i = (*size)++;
+
+	for (; i > 0 && heap[(i - 1) / 2].key > key; i = (i - 1) / 2)
+	{
+		heap[i] = heap[(i - 1) / 2];
+	}
+	heap[i].key = key;
+	heap[i].data = data;
+}
+
+struct _rb_bench_heap_entry _rb_bench_heap_pop(struct _rb_bench_heap_entry *heap, long *size)
+{
+	struct _rb_bench_heap_entry top = heap[0], last = heap[--(*size)];
+	long i = 0, child;
+
+	for (; (child = 2 * i + 1) < *size; i = child)
+	{
+		if (child + 1 < *size && heap[child + 1].key < heap[child].key)
+		{
+			child++;
+		}
+		if (heap[child].key >= last.key)
+		{
+			break;
+		}
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+	return top;
+}
+
+void BENCH_rb_priority_queue(long n, long ops)
+{
+	struct _rb_bench_heap_entry *heap = (struct _rb_bench_heap_entry *)malloc(n * sizeof(struct _rb_bench_heap_entry));
+	struct _rb_bench_heap_entry top;
+	struct rb_tree *tree;
+	struct rb_node *node;
+	double start, heap_time, pop_time, delete_time;
+	unsigned long x;
+	long i, size = 0, key = 0, check = 0;
+	void *data = NULL;
+
+	x = 88172645463325252UL;
+	for (i = 0; i < n; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		_rb_bench_heap_push(heap, &size, (long)((x % 1000000) << 20) | i, (void *)i);
+	}
+	start = _rb_bench_now();
+	for (i = 0; i < ops; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		top = _rb_bench_heap_pop(heap, &size);
+		check += top.key;
+		_rb_bench_heap_push(heap, &size, top.key + (long)((1 + x % 1000000) << 20), top.data);
+	}
+	heap_time = _rb_bench_now() - start;
+
+	x = 88172645463325252UL;
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		rb_insert(tree, (long)((x % 1000000) << 20) | i, (void *)i);
+	}
+	start = _rb_bench_now();
+	for (i = 0; i < ops; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		rb_pop_min(tree, &key, &data);
+		check -= key;
+		rb_insert(tree, key + (long)((1 + x % 1000000) << 20), data);
+	}
+	pop_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+	ASSERT(check == 0, "rb_pop_min and the heap disagree");
+
+	x = 88172645463325252UL;
+	tree = rb_create();
+	for (i = 0; i < n; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		rb_insert(tree, (long)((x % 1000000) << 20) | i, (void *)i);
+	}
+	start = _rb_bench_now();
+	for (i = 0; i < ops; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		node = _rb_find_smallest(tree->root);
+		key = node->key;
+		data = node->data;
+		rb_delete(tree, key);
+		rb_insert(tree, key + (long)((1 + x % 1000000) << 20), data);
+	}
+	delete_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	printf("schedule %9ld timers x %9ld  heap: %8.3fs  rb_pop_min: %8.3fs  find and rb_delete: %8.3fs\n", 
+		   n, ops, heap_time, pop_time, delete_time);
+
+	free(heap);
+}
+
+
+
+
+///
+/// BENCH_rb_random_lookup
+///
+/// Lookups in a truly random order, so nearly every level below the top few is a cache 
+/// miss. This is where the node layout shows.
+///
+/// Timings when compiled -O3, 56 byte nodes:
+/// random lookup   1000000 keys:    0.458s    2.18 Mops/s  (56 bytes/node)
+/// random lookup  10000000 keys:    9.024s    1.11 Mops/s  (56 bytes/node)
+///
+/// -DRB_COMPACT, 32 byte nodes:
+/// random lookup   1000000 keys:    0.362s    2.76 Mops/s  (32 bytes/node)
+/// random lookup  10000000 keys:    7.942s    1.26 Mops/s  (32 bytes/node)
+///
+/// The compact layout takes 43% less memory and wins once the tree is far bigger than
+/// the caches. When the working set stays cached (BENCH_rb_insert_lookup, sorted inserts)
+/// decoding the offsets is on the critical path and it's slower: sorted inserts of 10M
+/// keys take 5.1s against 2.2s, and those lookups run at 8.8 Mops/s against 7-12.
+///
+
+void BENCH_rb_random_lookup(long n)
+{
+	long i;
+	double start, elapsed;
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+	tree = rb_build_from_sorted(keys, (void **)keys, n);
+	_rb_bench_shuffle(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		if ((long)rb_lookup(tree, keys[i]) != keys[i])
+		{
+			printf("Failed on rb_lookup: %ld\n", keys[i]);
+			exit(1);
+		}
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("random lookup %9ld keys: %8.3fs  %6.2f Mops/s  (%ld bytes/node)\n", n, elapsed, n / elapsed / 1e6, (long)sizeof(struct rb_node));
+
+	rb_destroy(tree);
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_lookup_batch
+///
+/// n lookups in a random order, like BENCH_rb_random_lookup, one rb_lookup at a time and 
+/// then handed to rb_lookup_batch in batches of various lengths. At 10M keys the tree
+/// takes 560MB, far more than the last level cache.
+///
+/// Timings when compiled -O3, 16 lanes:
+/// rb_lookup             1000000 keys:    0.496s    2.02 Mops/s
+/// rb_lookup_batch    4   1000000 keys:    0.292s    3.42 Mops/s
+/// rb_lookup_batch   16   1000000 keys:    0.143s    6.97 Mops/s
+/// rb_lookup_batch   64   1000000 keys:    0.160s    6.26 Mops/s
+/// rb_lookup_batch 1024    999424 keys:    0.178s    5.62 Mops/s
+/// rb_lookup            10000000 keys:    9.637s    1.04 Mops/s
+/// rb_lookup_batch    4  10000000 keys:    5.627s    1.78 Mops/s
+/// rb_lookup_batch   16  10000000 keys:    2.325s    4.30 Mops/s
+/// rb_lookup_batch   64  10000000 keys:    2.542s    3.93 Mops/s
+/// rb_lookup_batch 1024   9999360 keys:    2.785s    3.59 Mops/s
+///
+/// 8 lanes only got to 2.5 Mops/s at 10M keys, and 32 did no better than 16. A batch of 
+/// 4 keys can only overlap 4 misses, which still makes it 1.7x faster.
+///
+
+void BENCH_rb_lookup_batch(long n)
+{
+	long lengths[] = { 4, 16, 64, 1024 };
+	long i, l, start_index;
+	double start, elapsed;
+	long *keys = (long *)malloc(n * sizeof(long));
+	void **out = (void **)malloc(n * sizeof(void *));
+	struct rb_tree *tree;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+	tree = rb_build_from_sorted(keys, (void **)keys, n);
+	_rb_bench_shuffle(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		out[i] = rb_lookup(tree, keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_lookup           %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	for (l = 0; l < (long)(sizeof(lengths) / sizeof(lengths[0])); l++)
+	{
+		memset(out, 0, n * sizeof(void *));
+		start = _rb_bench_now();
+		for (start_index = 0; start_index + lengths[l] <= n; start_index += lengths[l])
+		{
+			rb_lookup_batch(tree, keys + start_index, lengths[l], out + start_index);
+		}
+		elapsed = _rb_bench_now() - start;
+
+		for (i = 0; i < start_index; i++)
+		{
+			if ((long)out[i] != keys[i])
+			{
+				printf("Failed on rb_lookup_batch: %ld\n", keys[i]);
+				exit(1);
+			}
+		}
+		printf("rb_lookup_batch %4ld %9ld keys: %8.3fs  %6.2f Mops/s\n", lengths[l], start_index, elapsed, start_index / elapsed / 1e6);
+	}
+
+	rb_destroy(tree);
+	free(keys);
+	free(out);
+}
+
+
+
+///
+/// BENCH_rb_freeze
+///
+/// Random lookups and ranks in a tree built by rb_insert against its frozen copy. Every 
+/// other lookup misses, so the frozen search can't get lucky and stop early.
+///
+/// Timings when compiled -O3:
+/// rb_freeze            1000000 keys:    0.256s  (16 bytes/key against 56)
+/// rb_lookup            1000000 keys:    0.909s    1.10 Mops/s
+/// rb_frozen_lookup     1000000 keys:    0.166s    6.02 Mops/s
+/// rb_rank              1000000 keys:    1.440s    0.69 Mops/s
+/// rb_frozen_rank       1000000 keys:    0.097s   10.34 Mops/s
+/// rb_freeze           10000000 keys:    3.668s  (16 bytes/key against 56)
+/// rb_lookup           10000000 keys:   18.199s    0.55 Mops/s
+/// rb_frozen_lookup    10000000 keys:    3.193s    3.13 Mops/s
+/// rb_rank             10000000 keys:   28.590s    0.35 Mops/s
+/// rb_frozen_rank      10000000 keys:    2.965s    3.37 Mops/s
+///
+/// Without the prefetches the frozen lookups take 0.284s and 7.247s: the layout alone is
+/// worth 2.5x at 10M keys, and overlapping the misses another 2.3x.
+///
+
+void BENCH_rb_freeze(long n)
+{
+	long i, sum;
+	double start, elapsed;
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree = rb_create();
+	struct rb_frozen *frozen;
+
+	_rb_bench_keys(keys, n);
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, 2 * keys[i], (void *)(2 * keys[i] + 1));
+	}
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+	_rb_bench_shuffle(keys, n);
+
+	start = _rb_bench_now();
+	frozen = rb_freeze(tree);
+	printf("rb_freeze          %9ld keys: %8.3fs  (%ld bytes/key against %ld)\n", n, _rb_bench_now() - start,
+		(long)(sizeof(long) + sizeof(void *)), (long)sizeof(struct rb_node));
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_lookup(tree, keys[i]) == (keys[i] % 2 ? 0 : keys[i] + 1), "Failed on rb_lookup: %ld", keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_lookup          %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		ASSERT((long)rb_frozen_lookup(frozen, keys[i]) == (keys[i] % 2 ? 0 : keys[i] + 1), "Failed on rb_frozen_lookup: %ld", keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_frozen_lookup   %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	sum = 0;
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		sum += rb_rank(tree, keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_rank            %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		sum -= rb_frozen_rank(frozen, keys[i]);
+	}
+	elapsed = _rb_bench_now() - start;
+	printf("rb_frozen_rank     %9ld keys: %8.3fs  %6.2f Mops/s\n", n, elapsed, n / elapsed / 1e6);
+	ASSERT(sum == 0, "rb_frozen_rank disagrees with rb_rank");
+
+	rb_frozen_destroy(frozen);
+	rb_destroy(tree);
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_concurrent
+///
+/// Reader threads do random lookups in an n key tree for a second while one writer keeps
+/// inserting and deleting keys, once with rb_concurrent_lookup and once with every reader
+/// taking the tree's mutex, which is what you'd have without the sequence lock. Prints 
+/// the readers' total throughput and how many writes got in alongside them.
+///
+/// Timings when compiled -O3, 1M keys, on a single core machine so the threads only
+/// take turns rather than run side by side:
+/// readers 1   seqlock:   1.59 Mops/s  mutex:   1.41 Mops/s  (writes 17442 / 15002)
+/// readers 2   seqlock:   1.43 Mops/s  mutex:   1.60 Mops/s  (writes 14400 / 13384)
+/// readers 4   seqlock:   1.75 Mops/s  mutex:   1.81 Mops/s  (writes 13842 / 332)
+/// readers 8   seqlock:   1.84 Mops/s  mutex:   1.93 Mops/s  (writes 2196 / 114)
+///
+/// With one core the readers' total can't scale, and an uncontended mutex is cheap, so
+/// read throughput is a wash. The difference is the writer: behind a mutex it gets
+/// starved once there are a few readers, while with the sequence lock it still gets its
+/// writes in. On a multicore machine the seqlock readers share nothing but the sequence
+/// number's cache line, which they only read, where the mutex bounces between all of them.
+///
+
+struct BENCH_rb_concurrent_state
+{
+	struct rb_tree *tree;
+	long n;
+	int use_mutex;
+	int seed;
+	volatile int stop;
+	long ops;
+};
+
+void *BENCH_rb_concurrent_reader(void *arg)
+{
+	struct BENCH_rb_concurrent_state *state = (struct BENCH_rb_concurrent_state *)arg;
+	unsigned long x = 88172645463325252UL + state->seed;
+	long ops = 0;
+	long key;
+
+	while (!state->stop)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = (x % state->n) * 2;
+
+		if (state->use_mutex)
+		{
+			pthread_mutex_lock(&state->tree->write_lock);
+			if ((long)rb_lookup(state->tree, key) != key)
+			{
+				printf("Failed on rb_lookup: %ld\n", key);
+				exit(1);
+			}
+			pthread_mutex_unlock(&state->tree->write_lock);
+		}
+		else if ((long)rb_concurrent_lookup(state->tree, key) != key)
+		{
+			printf("Failed on rb_concurrent_lookup: %ld\n", key);
+			exit(1);
+		}
+		ops++;
+	}
+
+	state->ops = ops;
+	return NULL;
+}
+
+void *BENCH_rb_concurrent_writer(void *arg)
+{
+	struct BENCH_rb_concurrent_state *state = (struct BENCH_rb_concurrent_state *)arg;
+	struct timespec pause = { 0, 50000 };
+	long key = 1;
+	long ops = 0;
+
+	// Odd keys only, so readers looking for even ones always find them. The pause keeps
+	// it a steady trickle of writes rather than a second thread hammering the tree.
+	while (!state->stop)
+	{
+		rb_concurrent_insert(state->tree, key, (void *)key);
+		rb_concurrent_delete(state->tree, key);
+		key = (key + 2 * 7919) % (2 * state->n);
+		ops += 2;
+		nanosleep(&pause, NULL);
+	}
+
+	state->ops = ops;
+	return NULL;
+}
+
+double _rb_bench_concurrent_run(struct rb_tree *tree, long n, int readers, int use_mutex, long *writes)
+{
+	struct BENCH_rb_concurrent_state states[readers + 1];
+	pthread_t threads[readers + 1];
+	double start, elapsed;
+	long ops = 0;
+	int i;
+
+	for (i = 0; i <= readers; i++)
+	{
+		states[i].tree = tree;
+		states[i].n = n;
+		states[i].use_mutex = use_mutex;
+		states[i].seed = i;
+		states[i].stop = 0;
+		states[i].ops = 0;
+	}
+
+	start = _rb_bench_now();
+	pthread_create(&threads[readers], NULL, BENCH_rb_concurrent_writer, &states[readers]);
+	for (i = 0; i < readers; i++)
+	{
+		pthread_create(&threads[i], NULL, BENCH_rb_concurrent_reader, &states[i]);
+	}
+
+	sleep(1);
+
+	for (i = 0; i <= readers; i++)
+	{
+		states[i].stop = 1;
+	}
+	for (i = 0; i <= readers; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = _rb_bench_now() - start;
+
+	for (i = 0; i < readers; i++)
+	{
+		ops += states[i].ops;
+	}
+	*writes = states[readers].ops;
+	return ops / elapsed / 1e6;
+}
+
+void BENCH_rb_concurrent(long n)
+{
+	long i, seqlock_writes, mutex_writes;
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+	int readers;
+	double seqlock, mutex;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i * 2;
+	}
+	tree = rb_build_from_sorted(keys, (void **)keys, n);
+
+	for (readers = 1; readers <= 8; readers *= 2)
+	{
+		seqlock = _rb_bench_concurrent_run(tree, n, readers, 0, &seqlock_writes);
+		mutex = _rb_bench_concurrent_run(tree, n, readers, 1, &mutex_writes);
+		printf("readers %d   seqlock: %6.2f Mops/s  mutex: %6.2f Mops/s  (writes %ld / %ld)\n", readers, seqlock, mutex, seqlock_writes, mutex_writes);
+	}
+
+	rb_validate(tree, tree->root);
+	rb_destroy(tree);
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_persistent
+///
+/// Inserts n scrambled keys into a plain tree, a persistent tree, and a persistent tree
+/// that has a snapshot taken every 1000 inserts (each one dropped when the next is 
+/// taken, like a report query that's finished), then deletes them all again.
+///
+/// Timings when compiled -O3, 56 byte nodes:
+/// insert+delete   1000000 keys  plain:         0.411s
+/// insert+delete   1000000 keys  persistent:    0.322s
+/// insert+delete   1000000 keys  snapshots:     4.899s
+///
+/// -DRB_COMPACT, 32 byte nodes:
+/// insert+delete   1000000 keys  plain:         0.524s
+/// insert+delete   1000000 keys  persistent:    0.453s
+/// insert+delete   1000000 keys  snapshots:     4.161s
+///
+/// Without snapshots the persistent tree is no slower than the plain one. Once there are
+/// snapshots, every write copies the part of its path not already copied since the last
+/// one, and each copy touches both its children to bump their counts, so writes get
+/// an order of magnitude more expensive. Taking a snapshot every 100000 inserts instead
+/// still costs 3.6s: between snapshots the writes end up copying most of the tree.
+///
+
+double _rb_bench_persistent_run(long *keys, long n, int persistent, long snapshot_every)
+{
+	struct rb_tree *tree = persistent ? rb_create_persistent() : rb_create();
+	struct rb_tree *snapshot = NULL;
+	double start = _rb_bench_now();
+	long i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (snapshot_every && i % snapshot_every == 0)
+		{
+			if (snapshot)
+			{
+				rb_destroy(snapshot);
+			}
+			snapshot = rb_snapshot(tree);
+		}
+
+		if (persistent)
+		{
+			rb_persistent_insert(tree, keys[i], (void *)keys[i]);
+		}
+		else
+		{
+			rb_insert(tree, keys[i], (void *)keys[i]);
+		}
 	}
-	
-	for (i = 999; i >= 0; i--) 
+	for (i = 0; i < n; i++)
 	{
-		if ((long)rb_lookup(tree, i) != i)
+		if (snapshot_every && i % snapshot_every == 0)
 		{
-			printf("Failed on rb_lookup: %ld\n", i);
-			exit(1);
+			if (snapshot)
+			{
+				rb_destroy(snapshot);
+			}
+			snapshot = rb_snapshot(tree);
+		}
+
+		if (persistent)
+		{
+			rb_persistent_delete(tree, keys[i]);
+		}
+		else
+		{
+			rb_delete(tree, keys[i]);
 		}
 	}
-	
-	if (rb_count(tree) != 1000) 
+
+	if (snapshot)
 	{
-		printf("Failed on rb_count 1000\n");
-		exit(1);
+		rb_destroy(snapshot);
 	}
-	
-	printf("Maximum depth for backward: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, *tree));
+	rb_destroy(tree);
+	return _rb_bench_now() - start;
+}
 
-	for (i = 999; i >= 0; i--) 
+void BENCH_rb_persistent(long n)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+
+	_rb_bench_keys(keys, n);
+
+	printf("insert+delete %9ld keys  plain:      %8.3fs\n", n, _rb_bench_persistent_run(keys, n, 0, 0));
+	printf("insert+delete %9ld keys  persistent: %8.3fs\n", n, _rb_bench_persistent_run(keys, n, 1, 0));
+	printf("insert+delete %9ld keys  snapshots:  %8.3fs\n", n, _rb_bench_persistent_run(keys, n, 1, 1000));
+
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_set_operations
+///
+/// Merges a tree of m keys into one of n keys (every other key, so they interleave),
+/// once with rb_union and once the old way, rb_insert'ing the m keys one at a time. Then
+/// times a split down the middle of the result and the join putting it back.
+///
+/// Timings when compiled -O3, on one core, so with no help from the pool:
+/// merge  10000000 into  10000000 keys  rb_union:    1.305s  rb_insert:    2.745s  split: 6.7us  join: 11.8us
+/// merge     10000 into  10000000 keys  rb_union:    0.033s  rb_insert:    0.019s  split: 6.9us  join: 17.1us
+///
+/// For trees of similar size rb_union is twice as fast even on one thread, and that part
+/// of the work spreads across cores. A small tree into a big one is about m lookups either
+/// way; rb_insert comes out ahead there because the keys arrive in order, so consecutive 
+/// inserts find most of their path still in the cache.
+///
+
+struct rb_tree *_rb_bench_strided_tree(long n, long stride, long offset)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+	long i;
+
+	for (i = 0; i < n; i++)
 	{
-		rb_delete(tree, i);
-		rb_validate(tree, *tree);		
+		keys[i] = i * stride + offset;
 	}
+	tree = rb_build_from_sorted(keys, (void **)keys, n);
+	free(keys);
+	return tree;
+}
 
-	if (rb_count(tree) != 0) 
+void BENCH_rb_set_operations(long n, long m)
+{
+	struct rb_tree *a, *b;
+	struct rb_node *node;
+	double start, union_time, insert_time, split_time, join_time;
+	long stride = n / m;
+
+	// b's keys land between a's, spread evenly across the whole range.
+	a = _rb_bench_strided_tree(n, 2, 0);
+	b = _rb_bench_strided_tree(m, 2 * stride, 1);
+	start = _rb_bench_now();
+	a = rb_union(a, b);
+	union_time = _rb_bench_now() - start;
+	rb_destroy(a);
+
+	a = _rb_bench_strided_tree(n, 2, 0);
+	b = _rb_bench_strided_tree(m, 2 * stride, 1);
+	start = _rb_bench_now();
+	for (node = rb_first(b); node; node = rb_next(node))
 	{
-		printf("Failed on rb_count 0\n");
-		exit(1);
-	}	
+		rb_insert(a, node->key, node->data);
+	}
+	insert_time = _rb_bench_now() - start;
+	rb_destroy(b);
+
+	start = _rb_bench_now();
+	b = rb_split(a, n);
+	split_time = _rb_bench_now() - start;
+	start = _rb_bench_now();
+	a = rb_join(a, b);
+	join_time = _rb_bench_now() - start;
+	rb_destroy(a);
+
+	printf("merge %9ld into %9ld keys  rb_union: %8.3fs  rb_insert: %8.3fs  split: %.1fus  join: %.1fus\n", 
+		   m, n, union_time, insert_time, split_time * 1e6, join_time * 1e6);
+}
 
-	// Randomish inserts. Make an array and shuffle it a bit.
-	long array[1000];
-	for (i = 0; i < 1000; i++)
+
+
+///
+/// BENCH_rb_delete_range
+///
+/// Expires 1000 evenly spaced runs of k consecutive keys from an n key tree, once with
+/// rb_delete_range and once with an rb_delete per key.
+///
+/// Timings when compiled -O3:
+/// expire 1000 x    100 of  10000000 keys  rb_delete_range:    0.012s  rb_delete:    0.020s
+/// expire 1000 x   5000 of  10000000 keys  rb_delete_range:    0.147s  rb_delete:    0.749s
+///
+/// What's left for rb_delete_range is mostly the sweep handing nodes back to the arena.
+///
+
+void BENCH_rb_delete_range(long n, long k)
+{
+	struct rb_tree *tree;
+	double start, range_time, delete_time;
+	long i, j, step = n / 1000;
+
+	tree = _rb_bench_strided_tree(n, 1, 0);
+	start = _rb_bench_now();
+	for (i = 0; i < n; i += step)
 	{
-		array[i] = i;
+		rb_delete_range(tree, i, i + k - 1);
+	}
+	range_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	tree = _rb_bench_strided_tree(n, 1, 0);
+	start = _rb_bench_now();
+	for (i = 0; i < n; i += step)
+	{
+		for (j = i; j < i + k; j++)
+		{
+			rb_delete(tree, j);
+		}
+	}
+	delete_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	printf("expire 1000 x %6ld of %9ld keys  rb_delete_range: %8.3fs  rb_delete: %8.3fs\n", k, n, range_time, delete_time);
+}
+
+
+#ifdef RB_AUGMENT
+
+///
+/// BENCH_rb_range_aggregate
+///
+/// Sums of the data over 10000 random ranges of width keys out of n, with
+/// rb_range_aggregate and by adding up an rb_range_scan. Also what keeping the sums costs
+/// rb_insert, against a tree without an augment.
+///
+/// Timings when compiled -O3 -DRB_AUGMENT:
+/// sum 10000 x     100 of   1000000 keys  rb_range_aggregate:    0.017s  rb_range_scan:    0.201s  insert    1.676s (   1.809s without)
+/// sum 10000 x   10000 of   1000000 keys  rb_range_aggregate:    0.031s  rb_range_scan:   22.758s  insert    1.278s (   1.345s without)
+///
+/// The aggregate costs the same for any width, about two descents. The extra combine per 
+/// level on insert is lost in the cache misses the descent takes anyway; the two insert
+/// columns are within run to run noise of each other.
+///
+
+int _rb_bench_sum_callback(struct rb_node *node, void *context)
+{
+	*(long *)context += (long)node->data;
+	return 0;
+}
+
+void BENCH_rb_range_aggregate(long n, long width)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *plain = rb_create();
+	struct rb_tree *tree = rb_create();
+	double start, plain_time, insert_time, aggregate_time, scan_time;
+	unsigned long x = 88172645463325252UL;
+	long i, lo, sum, check = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = i;
+	}
+	_rb_bench_shuffle(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(plain, keys[i], (void *)(keys[i] & 0xff));
 	}
+	plain_time = _rb_bench_now() - start;
 
+	rb_set_augment(tree, &rb_augment_sum);
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)(keys[i] & 0xff));
+	}
+	insert_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
 	for (i = 0; i < 10000; i++)
 	{
-		long elem1 = (i * 863) % 1000;
-		long elem2 = (i * 427) % 1000;
-		long swap = array[elem1];
-		array[elem1] = array[elem2];
-		array[elem2] = swap;
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		lo = (long)(x % (unsigned long)(n - width));
+		check += rb_range_aggregate(tree, lo, lo + width - 1);
 	}
+	aggregate_time = _rb_bench_now() - start;
 
-	for (i = 0; i < 1000; i++)
+	x = 88172645463325252UL;
+	start = _rb_bench_now();
+	for (i = 0; i < 10000; i++)
 	{
-		rb_insert(tree, tree, array[i], (void *)array[i]);
-		rb_validate(tree, *tree);
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		lo = (long)(x % (unsigned long)(n - width));
+		sum = 0;
+		rb_range_scan(tree, lo, lo + width - 1, _rb_bench_sum_callback, &sum);
+		check -= sum;
 	}
-	
-	for (i = 0; i < 1000; i++) 
+	scan_time = _rb_bench_now() - start;
+	ASSERT(check == 0, "rb_range_aggregate and rb_range_scan disagree");
+
+	printf("sum 10000 x %7ld of %9ld keys  rb_range_aggregate: %8.3fs  rb_range_scan: %8.3fs  insert %8.3fs (%8.3fs without)\n", 
+		   width, n, aggregate_time, scan_time, insert_time, plain_time);
+
+	rb_destroy(plain);
+	rb_destroy(tree);
+	free(keys);
+}
+
+#endif
+
+
+
+///
+/// BENCH_rb_buffered
+///
+/// n shuffled keys with rb_insert, and through an rb_buffered of the given capacity, 
+/// counting the final flush. Then n / 10 lookups of each, before the buffered one's flush,
+/// so some of them go through the levels.
+///
+/// Timings when compiled -O3:
+/// insert   1000000 keys  rb_insert:    1.285s  buffered   65536:    0.700s + flush  0.024s  lookups:  0.054s vs  0.182s
+/// insert   1000000 keys  rb_insert:    1.330s  buffered 1000000:    0.243s + flush  0.082s  lookups:  0.055s vs  0.186s
+/// insert  10000000 keys  rb_insert:   27.989s  buffered 1000000:    6.071s + flush  0.462s  lookups:  1.153s vs  4.131s
+///
+/// Batches of a million make inserts 4-5x faster. Smaller batches spend more of their
+/// time in rb_union, which still takes a few misses per key. Lookups pay for a binary 
+/// search per level on top of the tree's descent, so a burst is the time to buffer, and
+/// a flush the time to go back to lookups.
+///
+
+void BENCH_rb_buffered(long n, long capacity)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree = rb_create();
+	struct rb_buffered *buffered = rb_buffered_create(capacity);
+	double start, insert_time, buffered_time, lookup_time, buffered_lookup_time, flush_time;
+	long i, check = 0;
+
+	for (i = 0; i < n; i++)
 	{
-		if ((long)rb_lookup(tree, i) != i)
+		keys[i] = i;
+	}
+	_rb_bench_shuffle(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)(keys[i] + 1));
+	}
+	insert_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_buffered_insert(buffered, keys[i], (void *)(keys[i] + 1));
+	}
+	buffered_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
+	for (i = 0; i < n / 10; i++)
+	{
+		check += (long)rb_lookup(tree, keys[i * 7 % n]);
+	}
+	lookup_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
+	for (i = 0; i < n / 10; i++)
+	{
+		check -= (long)rb_buffered_lookup(buffered, keys[i * 7 % n]);
+	}
+	buffered_lookup_time = _rb_bench_now() - start;
+	ASSERT(check == 0, "Buffered lookups disagree with the tree");
+
+	start = _rb_bench_now();
+	rb_buffered_flush(buffered);
+	flush_time = _rb_bench_now() - start;
+
+	printf("insert %9ld keys  rb_insert: %8.3fs  buffered %7ld: %8.3fs + flush %6.3fs  lookups: %6.3fs vs %6.3fs\n", 
+		   n, insert_time, capacity, buffered_time, flush_time, lookup_time, buffered_lookup_time);
+
+	rb_buffered_destroy(buffered);
+	rb_destroy(tree);
+	free(keys);
+}
+
+
+
+
+///
+/// BENCH_rb_save_map
+///
+/// What a restart costs: inserting n keys into a fresh tree, against rb_map on a file
+/// saved by rb_save. The file is dropped from the page cache before mapping, so the
+/// first lookups go to disk.
+///
+/// Timings when compiled -O3:
+/// startup    10000000 keys  rb_insert:    2.801s  rb_save:    2.140s (305 MB)  lookup 1000000:    1.014s
+///            10000000 keys  rb_map and one lookup:   58.926ms  next 999 cold:  263.590ms  lookup 1000000 warm:    0.982s
+/// startup    50000000 keys  rb_insert:   18.648s  rb_save:   19.887s (1525 MB)  lookup 1000000:    1.825s
+///            50000000 keys  rb_map and one lookup:   68.224ms  next 999 cold: 1382.547ms  lookup 1000000 warm:    1.861s
+///
+/// Startup at 50M keys goes from 18.6s to under 0.1s. Cold lookups each read a handful
+/// of pages until the top of the tree is cached. Warm, the file searches as fast as the
+/// nodes: 32 byte nodes without parents or colors, laid out by key, make up for the
+/// offsets. rb_save costs about what the inserts did, and most of that is the walk
+/// over nodes scattered around the heap.
+///
+
+int _rb_bench_count_callback(struct rb_node *node, void *context)
+{
+	(void)node;
+	(void)context;
+	return 0;
+}
+
+void BENCH_rb_save_map(long n)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree = rb_create();
+	double start, insert_time, lookup_time, save_time, map_time;
+	char path[64];
+	long i, lookups = 1000000;
+	int fd;
+
+	snprintf(path, sizeof(path), "/tmp/BENCH_rb_save_map.%d", (int)getpid());
+	_rb_bench_keys(keys, n);
+
+	start = _rb_bench_now();
+	for (i = 0; i < n; i++)
+	{
+		rb_insert(tree, keys[i], (void *)keys[i]);
+	}
+	insert_time = _rb_bench_now() - start;
+
+	_rb_bench_shuffle(keys, n);
+	start = _rb_bench_now();
+	for (i = 0; i < lookups; i++)
+	{
+		ASSERT((long)rb_lookup(tree, keys[i]) == keys[i], "Failed on rb_lookup: %ld", keys[i]);
+	}
+	lookup_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
+	ASSERT(rb_save(tree, path) == 0, "rb_save failed");
+	save_time = _rb_bench_now() - start;
+	rb_destroy(tree);
+
+	printf("startup   %9ld keys  rb_insert: %8.3fs  rb_save: %8.3fs (%ld MB)  lookup %ld: %8.3fs\n", 
+		   n, insert_time, save_time, _rb_disk_offset(n) >> 20, lookups, lookup_time);
+
+	// Out of the page cache. rb_save synced the file, so the pages are clean and go.
+	fd = open(path, O_RDONLY);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	start = _rb_bench_now();
+	tree = rb_map(path);
+	ASSERT((long)rb_lookup(tree, keys[0]) == keys[0], "Failed on rb_lookup: %ld", keys[0]);
+	map_time = _rb_bench_now() - start;
+
+	start = _rb_bench_now();
+	for (i = 1; i < 1000; i++)
+	{
+		ASSERT((long)rb_lookup(tree, keys[i]) == keys[i], "Failed on rb_lookup: %ld", keys[i]);
+	}
+	printf("          %9ld keys  rb_map and one lookup: %8.3fms  next 999 cold: %8.3fms", n, map_time * 1e3, (_rb_bench_now() - start) * 1e3);
+
+	// Warm the whole file up, then look the same keys up as the tree did.
+	ASSERT(rb_range_scan(tree, LONG_MIN, LONG_MAX, _rb_bench_count_callback, NULL) == n, "Scan of the mapped tree missed keys");
+	start = _rb_bench_now();
+	for (i = 0; i < lookups; i++)
+	{
+		ASSERT((long)rb_lookup(tree, keys[i]) == keys[i], "Failed on rb_lookup: %ld", keys[i]);
+	}
+	printf("  lookup %ld warm: %8.3fs\n", lookups, _rb_bench_now() - start);
+
+	rb_destroy(tree);
+	unlink(path);
+	free(keys);
+}
+
+
+
+///
+/// BENCH_rb_sharded
+///
+/// Threads share n scrambled keys between them, each its own interleaved share, and run
+/// them against one tree (rb_concurrent_insert and rb_concurrent_lookup) and against an
+/// rb_sharded map that starts as one shard. First every op is an insert; then the keys
+/// are all there and seven ops in eight are lookups, the eighth deleting a key and
+/// putting it back. Prints the total throughput for 1 to 8 threads and how many shards
+/// the map ended up with.
+///
+/// Timings when compiled -O3, 1M keys, on a single core machine:
+/// threads 1   writes  one tree:   0.73  sharded:   0.73   7:1 lookups  one tree:   0.96  sharded:   0.84 Mops/s  (2 shards)
+/// threads 2   writes  one tree:   0.70  sharded:   0.73   7:1 lookups  one tree:   0.96  sharded:   0.81 Mops/s  (2 shards)
+/// threads 4   writes  one tree:   0.74  sharded:   0.87   7:1 lookups  one tree:   1.18  sharded:   0.99 Mops/s  (2 shards)
+/// threads 8   writes  one tree:   0.73  sharded:   0.81   7:1 lookups  one tree:   1.02  sharded:   0.91 Mops/s  (2 shards)
+///
+/// With one core the threads only take turns, so neither side can scale, and runs vary
+/// by 20%. A writer is hardly ever descheduled holding a lock, so no shard looks
+/// contended and the map stops at the split the first window always makes. What this
+/// does show is what the layer costs: nothing to see on writes, and around 10% on
+/// lookups, which check the map's sequence as well as the tree's. Where threads really
+/// run side by side, a lookup or a write touches only its own shard's lock and sequence
+/// number and no line that every thread writes, so throughput should go up with the
+/// threads until the shards run out. That hasn't been measured here.
+///
+
+struct BENCH_rb_sharded_state
+{
+	struct rb_tree *tree;
+	struct rb_sharded *map;
+	long *keys;
+	long n;
+	int lookups;					// Lookups per write.
+	long found;
+};
+
+void *BENCH_rb_sharded_worker(void *arg)
+{
+	struct BENCH_rb_sharded_state *state = (struct BENCH_rb_sharded_state *)arg;
+	long i;
+
+	for (i = 0; i < state->n; i++)
+	{
+		if (i % (state->lookups + 1) == 0)
 		{
-			printf("Failed on rb_lookup: %ld\n", i);
-			exit(1);
+			// Once the keys are in, a write takes one out and puts it back.
+			if (state->map)
+			{
+				if (state->lookups)
+				{
+					rb_sharded_delete(state->map, state->keys[i]);
+				}
+				rb_sharded_insert(state->map, state->keys[i], (void *)state->keys[i]);
+			}
+			else
+			{
+				if (state->lookups)
+				{
+					rb_concurrent_delete(state->tree, state->keys[i]);
+				}
+				rb_concurrent_insert(state->tree, state->keys[i], (void *)state->keys[i]);
+			}
+		}
+		else if (state->map)
+		{
+			state->found += (rb_sharded_lookup(state->map, state->keys[i]) != NULL);
+		}
+		else
+		{
+			state->found += (rb_concurrent_lookup(state->tree, state->keys[i]) != NULL);
 		}
 	}
-	
-	if (rb_count(tree) != 1000) 
+	return NULL;
+}
+
+double _rb_bench_sharded_run(struct rb_tree *tree, struct rb_sharded *map, long *keys, long n, int threads, int lookups)
+{
+	struct BENCH_rb_sharded_state states[threads];
+	pthread_t workers[threads];
+	double start = _rb_bench_now();
+	int i;
+
+	for (i = 0; i < threads; i++)
 	{
-		printf("Failed on rb_count 1000\n");
-		exit(1);
+		states[i].tree = tree;
+		states[i].map = map;
+		states[i].keys = keys + i * (n / threads);
+		states[i].n = n / threads;
+		states[i].lookups = lookups;
+		states[i].found = 0;
+		pthread_create(&workers[i], NULL, BENCH_rb_sharded_worker, &states[i]);
 	}
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	return n / (_rb_bench_now() - start) / 1e6;
+}
 
-	printf("Maximum depth for randomish: %ld, Black depth: %ld\n", rb_maximum_depth(tree), rb_validate(tree, *tree));
+void BENCH_rb_sharded(long n)
+{
+	long *keys = (long *)malloc(n * sizeof(long));
+	struct rb_tree *tree;
+	struct rb_sharded *map;
+	double single_writes, sharded_writes, single_mixed, sharded_mixed;
+	int threads;
+	long i;
 
-	// This time delete the root again and again.
-	for (i = 0; i < 1000; i++) 
+	for (i = 0; i < n; i++)
 	{
-		rb_delete(tree, (*tree)->key);
-		rb_validate(tree, *tree);		
+		keys[i] = i;
 	}
+	_rb_bench_shuffle(keys, n);
 
-	if (rb_count(tree) != 0) 
+	for (threads = 1; threads <= 8; threads *= 2)
 	{
-		printf("Failed on rb_count 0\n");
-		exit(1);
+		tree = rb_create();
+		single_writes = _rb_bench_sharded_run(tree, NULL, keys, n, threads, 0);
+		single_mixed = _rb_bench_sharded_run(tree, NULL, keys, n, threads, 7);
+		rb_destroy(tree);
+
+		map = rb_sharded_create(NULL, 0);
+		sharded_writes = _rb_bench_sharded_run(NULL, map, keys, n, threads, 0);
+		sharded_mixed = _rb_bench_sharded_run(NULL, map, keys, n, threads, 7);
+		printf("threads %d   writes  one tree: %6.2f  sharded: %6.2f   7:1 lookups  one tree: %6.2f  sharded: %6.2f Mops/s  (%ld shards)\n",
+			threads, single_writes, sharded_writes, single_mixed, sharded_mixed, map->directory->count);
+		rb_sharded_destroy(map);
 	}
 
-	rb_destroy(tree);
+	free(keys);
+}
 
-	printf("COMPLETED TEST_rb_simple\n");
+
+
+void BENCH()
+{
+	BENCH_rb_insert_lookup(1000000);
+	BENCH_rb_insert_lookup(10000000);
+	BENCH_rb_build(10000000);
+	BENCH_rb_insert_hint(1000000);
+	BENCH_rb_insert_hint(10000000);
+	BENCH_rb_erase_node(1000000);
+	BENCH_rb_erase_node(10000000);
+	BENCH_rb_upsert(10000000, 1000000);
+	BENCH_rb_upsert(10000000, 100000000);
+	BENCH_rb_priority_queue(1000, 10000000);
+	BENCH_rb_priority_queue(1000000, 10000000);
+	BENCH_rb_random_lookup(1000000);
+	BENCH_rb_random_lookup(10000000);
+	BENCH_rb_lookup_batch(1000000);
+	BENCH_rb_lookup_batch(10000000);
+	BENCH_rb_freeze(1000000);
+	BENCH_rb_freeze(10000000);
+	BENCH_rb_concurrent(1000000);
+	BENCH_rb_sharded(1000000);
+	BENCH_rb_persistent(1000000);
+	BENCH_rb_set_operations(10000000, 10000000);
+	BENCH_rb_set_operations(10000000, 10000);
+	BENCH_rb_delete_range(10000000, 100);
+	BENCH_rb_delete_range(10000000, 5000);
+	BENCH_rb_buffered(1000000, 65536);
+	BENCH_rb_buffered(1000000, 1000000);
+	BENCH_rb_buffered(10000000, 1000000);
+#ifdef RB_AUGMENT
+	BENCH_rb_range_aggregate(1000000, 100);
+	BENCH_rb_range_aggregate(1000000, 10000);
+#endif
+	BENCH_rb_save_map(10000000);
+	BENCH_rb_save_map(50000000);
 }
 
 
@@ -974,7 +10745,39 @@ void TEST_rb_simple()
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		BENCH();
+		return 0;
+	}
+
 	TEST_rb_simple();
+	TEST_rb_arena();
+	TEST_rb_order_statistics();
+	TEST_rb_build();
+	TEST_rb_cursor();
+	TEST_rb_insert_hint();
+	TEST_rb_node_handles();
+	TEST_rb_priority_queue();
+	TEST_rb_upsert();
+	TEST_rb_multimap();
+	TEST_rb_strings();
+	TEST_rb_lookup_batch();
+	TEST_rb_concurrent();
+	TEST_rb_persistent();
+	TEST_rb_join_split();
+	TEST_rb_set_operations();
+	TEST_rb_delete_range();
+	TEST_rb_save_map();
+	TEST_rb_freeze();
+	TEST_rb_sharded();
+#ifdef RB_AUGMENT
+	TEST_rb_augment();
+#endif
+	TEST_rb_buffered();
+#ifdef RB_STATS
+	TEST_rb_stats();
+#endif
 	return 0;
 }
 
@@ -0,0 +1,524 @@
+// Tests and benchmarks for the RBTree template in redblack.h.
+// Compile with g++ -O3 redblack.cpp and then just run it, or run ./a.out bench.
+// To benchmark against the C version too:
+//   gcc -O3 -c -Dmain=redblack_c_main redblack.c
+//   g++ -O3 -DRB_BENCH_C redblack.cpp redblack.o -pthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "redblack.h"
+
+#ifdef RB_BENCH_C
+extern "C"
+{
+	struct rb_tree;
+	struct rb_tree *rb_create();
+	void rb_destroy(struct rb_tree *tree);
+	void rb_insert(struct rb_tree *tree, long key, void *data);
+	void rb_delete(struct rb_tree *tree, long key);
+	void *rb_lookup(struct rb_tree *tree, long key);
+}
+#endif
+
+
+///
+/// Check that the value is nonzero and message and exit if it's not nonzero.
+///
+
+void ASSERT(int value, const char *message, ...)
+{
+	if (!value)
+	{
+		va_list arglist;
+		va_start(arglist, message);
+		printf("ASSERT FAILURE\n");
+		vprintf(message, arglist);
+		printf("\n");
+		va_end(arglist);
+		exit(1);
+	}
+}
+
+
+
+//
+//
+// UNIT TESTS
+//
+//
+
+
+///
+/// TEST_RBTree_check
+///
+/// Checks tree against a std::map holding what should be in it: the rules, the size,
+/// every key and value, and the iteration order both ways.
+///
+
+void TEST_RBTree_check(const RBTree<long, long> &tree, const std::map<long, long> &expected)
+{
+	RBTree<long, long>::Iterator it = tree.begin();
+	RBTree<long, long>::Iterator last = tree.end();
+
+	ASSERT(tree.validate() >= 0, "Tree broke the red-black rules");
+	ASSERT(tree.size() == expected.size(), "Size %ld, expected %ld", (long)tree.size(), (long)expected.size());
+
+	for (std::map<long, long>::const_iterator e = expected.begin(); e != expected.end(); ++e)
+	{
+		ASSERT(it != tree.end(), "Iteration ended early before %ld", e->first);
+		ASSERT(it.key() == e->first, "Iterated to %ld, expected %ld", it.key(), e->first);
+		ASSERT(*tree.find(e->first) == e->second, "Wrong value under %ld", e->first);
+		last = it;
+		++it;
+	}
+	ASSERT(it == tree.end(), "Iteration went past the last key");
+
+	for (std::map<long, long>::const_reverse_iterator e = expected.rbegin(); e != expected.rend(); ++e)
+	{
+		ASSERT(last.key() == e->first, "Iterated back to %ld, expected %ld", last.key(), e->first);
+		--last;
+	}
+	ASSERT(last == tree.end(), "Iteration back went past the first key");
+}
+
+
+
+///
+/// TEST_RBTree_simple
+///
+/// Random inserts and erases checked against std::map.
+///
+
+void TEST_RBTree_simple()
+{
+	RBTree<long, long> tree;
+	std::map<long, long> expected;
+	unsigned long x = 88172645463325252UL;
+	long i, key;
+
+	TEST_RBTree_check(tree, expected);
+	ASSERT(tree.find(1) == NULL, "Found a key in an empty tree");
+	ASSERT(!tree.erase(1), "Erased a key from an empty tree");
+
+	for (i = 0; i < 20000; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = x % 1000;
+
+		if ((x >> 20) % 3)
+		{
+			bool inserted = tree.insert(key, key * 7);
+			ASSERT(inserted == (expected.find(key) == expected.end()), "Insert of %ld said %d", key, inserted);
+			expected.insert(std::make_pair(key, key * 7));
+		}
+		else
+		{
+			bool erased = tree.erase(key);
+			ASSERT(erased == (expected.erase(key) == 1), "Erase of %ld said %d", key, erased);
+		}
+
+		if (i % 500 == 0)
+		{
+			TEST_RBTree_check(tree, expected);
+		}
+	}
+	TEST_RBTree_check(tree, expected);
+
+	// A duplicate insert leaves the old value alone.
+	key = expected.begin()->first;
+	ASSERT(!tree.insert(key, -1L), "Inserted a duplicate");
+	ASSERT(*tree.find(key) == key * 7, "Duplicate insert changed the value");
+
+	ASSERT(tree.lowerBound(-5).key() == expected.begin()->first, "lowerBound before the first key");
+	ASSERT(tree.lowerBound(100000) == tree.end(), "lowerBound after the last key");
+	for (i = 0; i < 1000; i++)
+	{
+		std::map<long, long>::iterator e = expected.lower_bound(i);
+		RBTree<long, long>::Iterator it = tree.lowerBound(i);
+		ASSERT(e == expected.end() ? it == tree.end() : it.key() == e->first, "lowerBound(%ld) is wrong", i);
+	}
+
+	while (!expected.empty())
+	{
+		ASSERT(tree.erase(expected.begin()->first), "Couldn't erase %ld", expected.begin()->first);
+		expected.erase(expected.begin());
+	}
+	TEST_RBTree_check(tree, expected);
+
+	// The slabs get reused after a clear.
+	for (i = 0; i < 5000; i++)
+	{
+		tree.insert(i, i);
+		expected[i] = i;
+	}
+	tree.clear();
+	expected.clear();
+	TEST_RBTree_check(tree, expected);
+	tree.insert(3L, 4L);
+	ASSERT(*tree.find(3) == 4, "Lost a key inserted after clear");
+
+	printf("COMPLETED TEST_RBTree_simple\n");
+}
+
+
+
+///
+/// TEST_RBTree_values
+///
+/// Move-only values, destructors run exactly once, and values that don't move when
+/// other keys are erased around them.
+///
+
+struct TEST_RBTree_counted
+{
+	static long s_nLive;
+
+	TEST_RBTree_counted(long n) : m_n(n) { s_nLive++; }
+	TEST_RBTree_counted(TEST_RBTree_counted &&o) : m_n(o.m_n) { s_nLive++; }
+	TEST_RBTree_counted(const TEST_RBTree_counted &) = delete;
+	~TEST_RBTree_counted() { s_nLive--; }
+
+	long m_n;
+};
+
+long TEST_RBTree_counted::s_nLive = 0;
+
+void TEST_RBTree_values()
+{
+	long i;
+	std::vector<long *> values;
+
+	{
+		RBTree<long, std::unique_ptr<long> > tree;
+
+		for (i = 0; i < 1000; i++)
+		{
+			std::unique_ptr<long> value(new long(i));
+			values.push_back(value.get());
+			ASSERT(tree.insert(i, std::move(value)), "Couldn't insert %ld", i);
+			ASSERT(value == NULL, "Value wasn't moved into the tree");
+		}
+
+		// Every erase of a node with two children relinks its successor node.
+		std::unique_ptr<long> *pKept = tree.find(500);
+		for (i = 0; i < 1000; i++)
+		{
+			if (i != 500 && i % 3)
+			{
+				ASSERT(tree.erase(i), "Couldn't erase %ld", i);
+			}
+		}
+		ASSERT(tree.validate() >= 0, "Tree broke the red-black rules");
+		ASSERT(tree.find(500) == pKept, "Value for 500 moved");
+		for (i = 0; i < 1000; i++)
+		{
+			std::unique_ptr<long> *pValue = tree.find(i);
+			ASSERT((pValue != NULL) == (i == 500 || i % 3 == 0), "Wrong presence for %ld", i);
+			ASSERT(!pValue || pValue->get() == values[i], "Wrong value for %ld", i);
+		}
+
+		std::pair<std::unique_ptr<long> *, bool> result = tree.emplace(2000L, new long(5));
+		ASSERT(result.second && **result.first == 5, "emplace didn't build the value in place");
+
+		RBTree<long, std::unique_ptr<long> > moved(std::move(tree));
+		ASSERT(tree.empty() && moved.size() == 336, "Move left %ld behind, took %ld", (long)tree.size(), (long)moved.size());
+		ASSERT(moved.find(500) == pKept, "Moving the tree moved the values");
+	}
+
+	{
+		RBTree<long, TEST_RBTree_counted> tree;
+
+		for (i = 0; i < 3000; i++)
+		{
+			tree.emplace(i, i * 2);
+		}
+		ASSERT(TEST_RBTree_counted::s_nLive == 3000, "%ld values alive", TEST_RBTree_counted::s_nLive);
+		ASSERT(!tree.emplace(7L, 0L).second, "Inserted a duplicate");
+		ASSERT(TEST_RBTree_counted::s_nLive == 3000, "Duplicate emplace left %ld values alive", TEST_RBTree_counted::s_nLive);
+		for (i = 0; i < 3000; i += 2)
+		{
+			tree.erase(i);
+		}
+		ASSERT(TEST_RBTree_counted::s_nLive == 1500, "%ld values alive after erase", TEST_RBTree_counted::s_nLive);
+		ASSERT(tree.find(9)->m_n == 18, "Wrong value under 9");
+	}
+	ASSERT(TEST_RBTree_counted::s_nLive == 0, "%ld values leaked", TEST_RBTree_counted::s_nLive);
+
+	printf("COMPLETED TEST_RBTree_values\n");
+}
+
+
+
+///
+/// TEST_RBTree_compare
+///
+/// Comparators other than std::less, and keys that aren't numbers.
+///
+
+void TEST_RBTree_compare()
+{
+	long i, prev;
+	RBTree<long, long, std::greater<long> > reversed;
+	RBTree<std::string, long> names;
+	const char *list[] = { "pear", "apple", "fig", "banana", "cherry", "apple" };
+	const char *sorted[] = { "apple", "banana", "cherry", "fig", "pear" };
+
+	for (i = 0; i < 1000; i++)
+	{
+		reversed.insert((i * 7919) % 1000, i);
+	}
+	ASSERT(reversed.validate() >= 0, "Tree broke the red-black rules");
+	prev = 1000;
+	for (RBTree<long, long, std::greater<long> >::Iterator it = reversed.begin(); it != reversed.end(); ++it)
+	{
+		ASSERT(it.key() == prev - 1, "Iterated to %ld after %ld", it.key(), prev);
+		prev = it.key();
+	}
+	ASSERT(prev == 0, "Iteration stopped at %ld", prev);
+
+	for (i = 0; i < 6; i++)
+	{
+		names.insert(std::string(list[i]), i);
+	}
+	ASSERT(names.size() == 5, "%ld names", (long)names.size());
+	ASSERT(*names.find("apple") == 1, "Duplicate replaced apple");
+	i = 0;
+	for (RBTree<std::string, long>::Iterator it = names.begin(); it != names.end(); ++it)
+	{
+		ASSERT(it.key() == sorted[i], "Iterated to %s, expected %s", it.key().c_str(), sorted[i]);
+		i++;
+	}
+	ASSERT(names.lowerBound("c").key() == "cherry", "lowerBound(c) is %s", names.lowerBound("c").key().c_str());
+	names.erase("cherry");
+	ASSERT(names.find("cherry") == NULL && names.validate() >= 0, "Erase of cherry");
+
+	printf("COMPLETED TEST_RBTree_compare\n");
+}
+
+
+
+
+//
+//
+// BENCHMARKS
+//
+// Run with ./a.out bench (compile with -O3).
+//
+
+
+double _bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void _bench_report(const char *name, const char *op, long n, double elapsed)
+{
+	printf("%-8s %-7s %9ld keys: %8.3fs  %6.2f Mops/s\n", name, op, n, elapsed, n / elapsed / 1e6);
+}
+
+// A value too big to be worth a pointer in the C tree's data field.
+struct BenchPayload
+{
+	long m_n[4];
+};
+
+
+
+///
+/// BENCH_RBTree
+///
+/// Inserts n scrambled keys, looks them all up and erases them all, in the template,
+/// std::map and (with -DRB_BENCH_C) redblack.c. The payload runs store a 32 byte value:
+/// inline in the template and std::map, and malloced behind the data pointer in C.
+///
+/// Timings when compiled -O3 (redblack.c with -O3 too):
+///                                   long value            32 byte value
+/// RBTree   insert    1000000 keys:  0.167s  5.99 Mops/s   0.179s  5.57 Mops/s
+/// RBTree   lookup    1000000 keys:  0.103s  9.69 Mops/s   0.103s  9.75 Mops/s
+/// RBTree   erase     1000000 keys:  0.124s  8.06 Mops/s   0.149s  6.71 Mops/s
+/// std::map insert    1000000 keys:  0.197s  5.09 Mops/s   0.233s  4.29 Mops/s
+/// std::map lookup    1000000 keys:  0.218s  4.59 Mops/s   0.248s  4.03 Mops/s
+/// std::map erase     1000000 keys:  0.208s  4.80 Mops/s   0.245s  4.09 Mops/s
+/// C        insert    1000000 keys:  0.173s  5.78 Mops/s   0.280s  3.57 Mops/s
+/// C        lookup    1000000 keys:  0.060s 16.69 Mops/s   0.079s 12.62 Mops/s
+/// C        erase     1000000 keys:  0.151s  6.62 Mops/s   0.231s  4.34 Mops/s
+///
+/// RBTree   insert   10000000 keys:  2.115s  4.73 Mops/s   2.759s  3.62 Mops/s
+/// RBTree   lookup   10000000 keys:  1.381s  7.24 Mops/s   1.610s  6.21 Mops/s
+/// RBTree   erase    10000000 keys:  1.774s  5.64 Mops/s   1.996s  5.01 Mops/s
+/// std::map insert   10000000 keys:  3.209s  3.12 Mops/s   2.894s  3.46 Mops/s
+/// std::map lookup   10000000 keys:  1.970s  5.08 Mops/s   1.671s  5.99 Mops/s
+/// std::map erase    10000000 keys:  2.150s  4.65 Mops/s   2.297s  4.35 Mops/s
+/// C        insert   10000000 keys:  2.526s  3.96 Mops/s   3.045s  3.28 Mops/s
+/// C        lookup   10000000 keys:  1.138s  8.79 Mops/s   1.067s  9.37 Mops/s
+/// C        erase    10000000 keys:  2.850s  3.51 Mops/s   2.917s  3.43 Mops/s
+///
+/// Inserts and erases beat both: the C tree bumps a subtree count in every node on the
+/// way down for rank and select, and erase there is a second descent to free the
+/// payload. Lookups lose to C. gcc won't emit a cmov for a generic comparator, so the
+/// template masks pointers instead (see RBTree::select), and the mask is a few more
+/// cycles per level than redblack.c's cmov. Written as a plain branch it was 2.5x
+/// slower than C. The C payload lookups stay fast because the benchmark only touches
+/// the payload of the key it finds.
+///
+
+template <typename Value>
+Value _bench_value(long key)
+{
+	return Value(key);
+}
+
+template <>
+BenchPayload _bench_value<BenchPayload>(long key)
+{
+	BenchPayload payload = { { key, key, key, key } };
+	return payload;
+}
+
+long _bench_value_key(long value) { return value; }
+long _bench_value_key(const BenchPayload &value) { return value.m_n[3]; }
+
+template <typename Value>
+void BENCH_RBTree(long n)
+{
+	long i;
+	double start;
+	std::vector<long> keys(n);
+
+	for (i = 0; i < n; i++)
+	{
+		keys[i] = (i * 2654435761L) % n;
+	}
+
+	{
+		RBTree<long, Value> tree;
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.insert(keys[i], _bench_value<Value>(keys[i]));
+		}
+		_bench_report("RBTree", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			const Value *pValue = tree.find(keys[n - 1 - i]);
+			ASSERT(pValue && _bench_value_key(*pValue) == keys[n - 1 - i], "Failed on find: %ld", keys[n - 1 - i]);
+		}
+		_bench_report("RBTree", "lookup", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.erase(keys[i]);
+		}
+		_bench_report("RBTree", "erase", n, _bench_now() - start);
+	}
+
+	{
+		std::map<long, Value> tree;
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.insert(std::make_pair(keys[i], _bench_value<Value>(keys[i])));
+		}
+		_bench_report("std::map", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			typename std::map<long, Value>::const_iterator it = tree.find(keys[n - 1 - i]);
+			ASSERT(it != tree.end() && _bench_value_key(it->second) == keys[n - 1 - i], "Failed on find: %ld", keys[n - 1 - i]);
+		}
+		_bench_report("std::map", "lookup", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			tree.erase(keys[i]);
+		}
+		_bench_report("std::map", "erase", n, _bench_now() - start);
+	}
+
+#ifdef RB_BENCH_C
+	{
+		struct rb_tree *tree = rb_create();
+		bool bBoxed = sizeof(Value) > sizeof(void *);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			void *data = (void *)keys[i];
+			if (bBoxed)
+			{
+				data = malloc(sizeof(Value));
+				*(Value *)data = _bench_value<Value>(keys[i]);
+			}
+			rb_insert(tree, keys[i], data);
+		}
+		_bench_report("C", "insert", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			void *data = rb_lookup(tree, keys[n - 1 - i]);
+			long value = bBoxed ? _bench_value_key(*(Value *)data) : (long)data;
+			ASSERT(value == keys[n - 1 - i], "Failed on rb_lookup: %ld", keys[n - 1 - i]);
+		}
+		_bench_report("C", "lookup", n, _bench_now() - start);
+
+		start = _bench_now();
+		for (i = 0; i < n; i++)
+		{
+			if (bBoxed)
+			{
+				free(rb_lookup(tree, keys[i]));
+			}
+			rb_delete(tree, keys[i]);
+		}
+		_bench_report("C", "erase", n, _bench_now() - start);
+
+		rb_destroy(tree);
+	}
+#endif
+}
+
+
+
+void BENCH()
+{
+	BENCH_RBTree<long>(1000000);
+	BENCH_RBTree<BenchPayload>(1000000);
+	BENCH_RBTree<long>(10000000);
+	BENCH_RBTree<BenchPayload>(10000000);
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		BENCH();
+		return 0;
+	}
+
+	TEST_RBTree_simple();
+	TEST_RBTree_values();
+	TEST_RBTree_compare();
+	return 0;
+}
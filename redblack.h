@@ -0,0 +1,660 @@
+#ifndef REDBLACK_H_
+#define REDBLACK_H_
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <functional>
+#include <type_traits>
+
+
+///
+/// RBTree
+///
+/// The red-black tree from redblack.c as a header-only template. Keys and values live
+/// in the node itself, so a lookup ends at the value instead of at a pointer to it, and
+/// values only have to be movable. The comparator is part of the type, so it inlines.
+/// The left and right cases of the fixups are one template instantiated for each side,
+/// where redblack.c picks between function pointers on every pass of the loop.
+///
+/// Nodes are carved out of slabs like in redblack.c. Erasing relinks the successor node
+/// into the erased node's place instead of moving its key and value over, so a pointer
+/// to a value stays good until that value itself is erased.
+///
+
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class RBTree
+{
+public:
+	struct Node
+	{
+		template <typename K, typename... Args>
+		Node(K &&key, Args &&... args) :
+			m_key(std::forward<K>(key)),
+			m_value(std::forward<Args>(args)...)
+		{
+		}
+
+		Node *m_pChild[2];			// Left and right.
+		Node *m_pParent;
+		bool m_bRed;
+		Key m_key;
+		Value m_value;
+	};
+
+	class Iterator
+	{
+	public:
+		Iterator(Node *pNode) :
+			m_pNode(pNode)
+		{
+		}
+
+		const Key &key() const { return m_pNode->m_key; }
+		Value &value() const { return m_pNode->m_value; }
+		Node &operator*() const { return *m_pNode; }
+		Node *operator->() const { return m_pNode; }
+		bool operator==(const Iterator &o) const { return m_pNode == o.m_pNode; }
+		bool operator!=(const Iterator &o) const { return m_pNode != o.m_pNode; }
+
+		Iterator &operator++()
+		{
+			m_pNode = RBTree::next<1>(m_pNode);
+			return *this;
+		}
+
+		Iterator &operator--()
+		{
+			m_pNode = RBTree::next<0>(m_pNode);
+			return *this;
+		}
+
+	private:
+		Node *m_pNode;
+	};
+
+public:
+	RBTree(const Compare &compare = Compare()) :
+		m_pRoot(NULL),
+		m_nSize(0),
+		m_pSlabs(NULL),
+		m_pFreeList(NULL),
+		m_compare(compare)
+	{
+	}
+
+	RBTree(RBTree &&o) :
+		RBTree(o.m_compare)
+	{
+		swap(o);
+	}
+
+	RBTree &operator=(RBTree &&o)
+	{
+		swap(o);
+		return *this;
+	}
+
+	RBTree(const RBTree &) = delete;
+	RBTree &operator=(const RBTree &) = delete;
+
+	virtual ~RBTree()
+	{
+		clear();
+	}
+
+	void swap(RBTree &o)
+	{
+		std::swap(m_pRoot, o.m_pRoot);
+		std::swap(m_nSize, o.m_nSize);
+		std::swap(m_pSlabs, o.m_pSlabs);
+		std::swap(m_pFreeList, o.m_pFreeList);
+		std::swap(m_compare, o.m_compare);
+	}
+
+	size_t size() const
+	{
+		return m_nSize;
+	}
+
+	bool empty() const
+	{
+		return m_nSize == 0;
+	}
+
+
+	///
+	/// emplace
+	///
+	/// Inserts key with a value built from args, unless key is already there. Returns the
+	/// value in the tree either way, and whether it was inserted.
+	///
+
+	template <typename K, typename... Args>
+	std::pair<Value *, bool> emplace(K &&key, Args &&... args)
+	{
+		Node *pNode = m_pRoot;
+		Node *pParent = NULL;
+		Node *pBound = NULL;
+		int nDir = 0;
+
+		// One comparison per level: remember the last node we went left at, which is the
+		// only one that can be equal to key.
+		while (pNode)
+		{
+			pParent = pNode;
+			nDir = m_compare(pNode->m_key, key);
+			pBound = select(nDir, pBound, pNode);
+			pNode = select(nDir, pNode->m_pChild[1], pNode->m_pChild[0]);
+		}
+
+		if (pBound && !m_compare(key, pBound->m_key))
+		{
+			return std::make_pair(&pBound->m_value, false);
+		}
+
+		pNode = new (allocNode()) Node(std::forward<K>(key), std::forward<Args>(args)...);
+		pNode->m_pChild[0] = pNode->m_pChild[1] = NULL;
+		pNode->m_pParent = pParent;
+		pNode->m_bRed = true;
+		if (pParent)
+		{
+			pParent->m_pChild[nDir] = pNode;
+		}
+		else
+		{
+			m_pRoot = pNode;
+		}
+		m_nSize++;
+
+		insertFixup(pNode);
+		return std::make_pair(&pNode->m_value, true);
+	}
+
+	template <typename K, typename V>
+	bool insert(K &&key, V &&value)
+	{
+		return emplace(std::forward<K>(key), std::forward<V>(value)).second;
+	}
+
+
+	///
+	/// find
+	///
+	/// The value stored under key, or NULL.
+	///
+
+	Value *find(const Key &key)
+	{
+		Node *pNode = m_pRoot;
+
+		// Stopping at an equal key skips the bottom levels, which are the ones that miss.
+		while (pNode)
+		{
+			bool bLess = m_compare(key, pNode->m_key);
+			if (!bLess && !m_compare(pNode->m_key, key))
+			{
+				return &pNode->m_value;
+			}
+			pNode = select(bLess, pNode->m_pChild[0], pNode->m_pChild[1]);
+		}
+		return NULL;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return const_cast<RBTree *>(this)->find(key);
+	}
+
+
+	///
+	/// erase
+	///
+	/// Removes key and destroys its value. Returns false if it wasn't there.
+	///
+
+	bool erase(const Key &key)
+	{
+		Node *pNode = lowerBoundNode(key);
+
+		if (!pNode || m_compare(key, pNode->m_key))
+		{
+			return false;
+		}
+
+		eraseNode(pNode);
+		return true;
+	}
+
+
+	///
+	/// clear
+	///
+	/// Destroys every key and value and gives all the memory back. Like rb_destroy, it
+	/// doesn't need to walk the tree unless there are destructors to run.
+	///
+
+	void clear()
+	{
+		Slab *pSlab, *pNext;
+
+		if (!std::is_trivially_destructible<Key>::value || !std::is_trivially_destructible<Value>::value)
+		{
+			destroySubtree(m_pRoot);
+		}
+
+		for (pSlab = m_pSlabs; pSlab; pSlab = pNext)
+		{
+			pNext = pSlab->m_pNext;
+			delete pSlab;
+		}
+
+		m_pRoot = NULL;
+		m_nSize = 0;
+		m_pSlabs = NULL;
+		m_pFreeList = NULL;
+	}
+
+
+	///
+	/// begin / end / lowerBound
+	///
+	/// In-order iteration. lowerBound is the first key that isn't less than key.
+	///
+
+	Iterator begin() const
+	{
+		return Iterator(extreme<0>(m_pRoot));
+	}
+
+	Iterator end() const
+	{
+		return Iterator(NULL);
+	}
+
+	Iterator lowerBound(const Key &key) const
+	{
+		return Iterator(lowerBoundNode(key));
+	}
+
+
+	///
+	/// validate
+	///
+	/// Checks the same rules as rb_validate. Returns the black height, or -1 if any rule
+	/// is broken.
+	///
+
+	long validate() const
+	{
+		if (m_pRoot && (m_pRoot->m_bRed || m_pRoot->m_pParent))
+		{
+			return -1;
+		}
+		return validateSubtree(m_pRoot);
+	}
+
+private:
+	enum { kSlabNodes = 1024 };
+
+	struct Slab
+	{
+		Slab *m_pNext;
+		size_t m_nUsed;
+		typename std::aligned_storage<sizeof(Node), alignof(Node)>::type m_nodes[kSlabNodes];
+	};
+
+	// Free nodes are chained through their first bytes.
+	struct FreeNode
+	{
+		FreeNode *m_pNext;
+	};
+
+	void *allocNode()
+	{
+		void *p;
+
+		if (m_pFreeList)
+		{
+			p = m_pFreeList;
+			m_pFreeList = m_pFreeList->m_pNext;
+			return p;
+		}
+
+		if (!m_pSlabs || m_pSlabs->m_nUsed == kSlabNodes)
+		{
+			Slab *pSlab = new Slab;
+			pSlab->m_pNext = m_pSlabs;
+			pSlab->m_nUsed = 0;
+			m_pSlabs = pSlab;
+		}
+
+		return &m_pSlabs->m_nodes[m_pSlabs->m_nUsed++];
+	}
+
+	void freeNode(Node *pNode)
+	{
+		pNode->~Node();
+		FreeNode *pFree = new (pNode) FreeNode;
+		pFree->m_pNext = m_pFreeList;
+		m_pFreeList = pFree;
+	}
+
+	void destroySubtree(Node *pNode)
+	{
+		// Post-order through the parent pointers, like _rb_clear, so no stack is needed.
+		Node *pParent;
+
+		while (pNode)
+		{
+			if (pNode->m_pChild[0])
+			{
+				pNode = pNode->m_pChild[0];
+			}
+			else if (pNode->m_pChild[1])
+			{
+				pNode = pNode->m_pChild[1];
+			}
+			else
+			{
+				pParent = pNode->m_pParent;
+				if (pParent)
+				{
+					pParent->m_pChild[pParent->m_pChild[1] == pNode] = NULL;
+				}
+				pNode->~Node();
+				pNode = pParent;
+			}
+		}
+	}
+
+	Node *lowerBoundNode(const Key &key) const
+	{
+		Node *pNode = m_pRoot;
+		Node *pBound = NULL;
+
+		while (pNode)
+		{
+			int nDir = m_compare(pNode->m_key, key);
+			pBound = select(nDir, pBound, pNode);
+			pNode = select(nDir, pNode->m_pChild[1], pNode->m_pChild[0]);
+		}
+
+		return pBound;
+	}
+
+	// Picks pIfSet or pIfClear without a branch. Left to itself gcc turns the select in a
+	// descent back into a jump, and then every level is a coin flip for the predictor;
+	// _rb_link in redblack.c masks for the same reason.
+	static Node *select(bool bSet, Node *pIfSet, Node *pIfClear)
+	{
+		size_t nMask = -(size_t)bSet;
+		return (Node *)(((size_t)pIfSet & nMask) | ((size_t)pIfClear & ~nMask));
+	}
+
+	// The leftmost (kDir 0) or rightmost (kDir 1) node under pNode.
+	template <int kDir>
+	static Node *extreme(Node *pNode)
+	{
+		while (pNode && pNode->m_pChild[kDir])
+		{
+			pNode = pNode->m_pChild[kDir];
+		}
+		return pNode;
+	}
+
+	// The in-order successor (kDir 1) or predecessor (kDir 0) of pNode.
+	template <int kDir>
+	static Node *next(Node *pNode)
+	{
+		if (pNode->m_pChild[kDir])
+		{
+			return extreme<1 - kDir>(pNode->m_pChild[kDir]);
+		}
+
+		while (pNode->m_pParent && pNode == pNode->m_pParent->m_pChild[kDir])
+		{
+			pNode = pNode->m_pParent;
+		}
+		return pNode->m_pParent;
+	}
+
+	static bool isRed(Node *pNode)
+	{
+		return pNode && pNode->m_bRed;
+	}
+
+	void replaceChild(Node *pParent, Node *pOld, Node *pNew)
+	{
+		if (!pParent)
+		{
+			m_pRoot = pNew;
+		}
+		else
+		{
+			pParent->m_pChild[pParent->m_pChild[1] == pOld] = pNew;
+		}
+	}
+
+	// Puts pNew where pOld hangs in the tree. pOld's own children are left alone.
+	void transplant(Node *pOld, Node *pNew)
+	{
+		replaceChild(pOld->m_pParent, pOld, pNew);
+		if (pNew)
+		{
+			pNew->m_pParent = pOld->m_pParent;
+		}
+	}
+
+	// Rotates pNode down to its kDir side, bringing up its child on the other side.
+	// rotate<0> is _rb_left_rotate.
+	template <int kDir>
+	void rotate(Node *pNode)
+	{
+		Node *pChild = pNode->m_pChild[1 - kDir];
+
+		pNode->m_pChild[1 - kDir] = pChild->m_pChild[kDir];
+		if (pChild->m_pChild[kDir])
+		{
+			pChild->m_pChild[kDir]->m_pParent = pNode;
+		}
+
+		transplant(pNode, pChild);
+		pChild->m_pChild[kDir] = pNode;
+		pNode->m_pParent = pChild;
+	}
+
+	// One pass of the insert fixup for a parent on the kDir side of the grandparent.
+	// Returns the node to carry on from, or NULL when the tree is fixed.
+	template <int kDir>
+	Node *insertFixupSide(Node *pNode, Node *pParent, Node *pGrandparent)
+	{
+		Node *pUncle = pGrandparent->m_pChild[1 - kDir];
+
+		if (isRed(pUncle))
+		{
+			pUncle->m_bRed = false;
+			pParent->m_bRed = false;
+			pGrandparent->m_bRed = true;
+			return pGrandparent;
+		}
+
+		// Get the node to the outside of the grandparent first.
+		if (pNode == pParent->m_pChild[1 - kDir])
+		{
+			rotate<kDir>(pParent);
+			pParent = pNode;
+		}
+
+		pParent->m_bRed = false;
+		pGrandparent->m_bRed = true;
+		rotate<1 - kDir>(pGrandparent);
+		return NULL;
+	}
+
+	void insertFixup(Node *pNode)
+	{
+		Node *pParent;
+
+		while (pNode && (pParent = pNode->m_pParent) && pParent->m_bRed)
+		{
+			Node *pGrandparent = pParent->m_pParent;
+
+			if (pParent == pGrandparent->m_pChild[0])
+			{
+				pNode = insertFixupSide<0>(pNode, pParent, pGrandparent);
+			}
+			else
+			{
+				pNode = insertFixupSide<1>(pNode, pParent, pGrandparent);
+			}
+		}
+
+		m_pRoot->m_bRed = false;
+	}
+
+	// One pass of the erase fixup for a node (maybe NULL) on the kDir side of pParent that
+	// is a black short. Returns the node to carry on from; the root means done.
+	template <int kDir>
+	Node *eraseFixupSide(Node *pParent)
+	{
+		Node *pSibling = pParent->m_pChild[1 - kDir];
+
+		if (pSibling->m_bRed)
+		{
+			pSibling->m_bRed = false;
+			pParent->m_bRed = true;
+			rotate<kDir>(pParent);
+			pSibling = pParent->m_pChild[1 - kDir];
+		}
+
+		if (!isRed(pSibling->m_pChild[0]) && !isRed(pSibling->m_pChild[1]))
+		{
+			pSibling->m_bRed = true;
+			return pParent;
+		}
+
+		if (!isRed(pSibling->m_pChild[1 - kDir]))
+		{
+			pSibling->m_pChild[kDir]->m_bRed = false;
+			pSibling->m_bRed = true;
+			rotate<1 - kDir>(pSibling);
+			pSibling = pParent->m_pChild[1 - kDir];
+		}
+
+		pSibling->m_bRed = pParent->m_bRed;
+		pParent->m_bRed = false;
+		pSibling->m_pChild[1 - kDir]->m_bRed = false;
+		rotate<kDir>(pParent);
+		return m_pRoot;
+	}
+
+	void eraseFixup(Node *pNode, Node *pParent)
+	{
+		while (pNode != m_pRoot && !isRed(pNode))
+		{
+			if (pNode == pParent->m_pChild[0])
+			{
+				pNode = eraseFixupSide<0>(pParent);
+			}
+			else
+			{
+				pNode = eraseFixupSide<1>(pParent);
+			}
+			pParent = pNode->m_pParent;
+		}
+
+		if (pNode)
+		{
+			pNode->m_bRed = false;
+		}
+	}
+
+	void eraseNode(Node *pNode)
+	{
+		Node *pSuccessor, *pChild, *pChildParent;
+		bool bRemovedRed = pNode->m_bRed;
+
+		if (!pNode->m_pChild[0] || !pNode->m_pChild[1])
+		{
+			pChild = pNode->m_pChild[0] ? pNode->m_pChild[0] : pNode->m_pChild[1];
+			pChildParent = pNode->m_pParent;
+			transplant(pNode, pChild);
+		}
+		else
+		{
+			// The successor node itself moves into pNode's place, taking pNode's color,
+			// so the node that really leaves its position is the successor.
+			pSuccessor = extreme<0>(pNode->m_pChild[1]);
+			bRemovedRed = pSuccessor->m_bRed;
+			pChild = pSuccessor->m_pChild[1];
+
+			if (pSuccessor->m_pParent == pNode)
+			{
+				pChildParent = pSuccessor;
+			}
+			else
+			{
+				pChildParent = pSuccessor->m_pParent;
+				transplant(pSuccessor, pChild);
+				pSuccessor->m_pChild[1] = pNode->m_pChild[1];
+				pSuccessor->m_pChild[1]->m_pParent = pSuccessor;
+			}
+
+			transplant(pNode, pSuccessor);
+			pSuccessor->m_pChild[0] = pNode->m_pChild[0];
+			pSuccessor->m_pChild[0]->m_pParent = pSuccessor;
+			pSuccessor->m_bRed = pNode->m_bRed;
+		}
+
+		if (!bRemovedRed)
+		{
+			eraseFixup(pChild, pChildParent);
+		}
+
+		freeNode(pNode);
+		m_nSize--;
+	}
+
+	long validateSubtree(Node *pNode) const
+	{
+		long nLeft, nRight;
+
+		if (!pNode)
+		{
+			return 0;
+		}
+
+		for (int nDir = 0; nDir < 2; nDir++)
+		{
+			Node *pChild = pNode->m_pChild[nDir];
+			if (pChild && (pChild->m_pParent != pNode || (pNode->m_bRed && pChild->m_bRed)))
+			{
+				return -1;
+			}
+		}
+		if ((pNode->m_pChild[0] && !m_compare(pNode->m_pChild[0]->m_key, pNode->m_key)) ||
+			(pNode->m_pChild[1] && !m_compare(pNode->m_key, pNode->m_pChild[1]->m_key)))
+		{
+			return -1;
+		}
+
+		nLeft = validateSubtree(pNode->m_pChild[0]);
+		nRight = validateSubtree(pNode->m_pChild[1]);
+		if (nLeft < 0 || nLeft != nRight)
+		{
+			return -1;
+		}
+		return nLeft + (pNode->m_bRed ? 0 : 1);
+	}
+
+private:
+	Node *m_pRoot;
+	size_t m_nSize;
+	Slab *m_pSlabs;
+	FreeNode *m_pFreeList;
+	Compare m_compare;
+};
+
+
+#endif // REDBLACK_H_
@@ -0,0 +1,865 @@
+// Benchmark suite: redblack.c, the RBTree template and the BTree in btree/ against
+// std::map and absl's B-tree.
+// Compile with
+//   gcc -O3 -c -Dmain=redblack_c_main redblack.c
+//   g++ -O3 -std=c++17 redblack_bench.cpp redblack.o -pthread
+// and run ./a.out [max keys] [c] [rbtree] [btree] [map] [absl] [strings]. Add -march=native
+// for BTree's AVX2 node search, and -DRB_BENCH_ABSL to compile in absl::btree_map. Sizes 
+// go up 10x at a time from 1000 to max keys, 100M if not given. A size that wouldn't fit 
+// in memory for a structure is skipped. strings runs the string key benchmark instead, on
+// the structures that take strings, up to BENCH_MAX_STRINGS keys.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "redblack.h"
+#include "btree/btree.h"
+#ifdef RB_BENCH_ABSL
+#include "absl/container/btree_map.h"
+#endif
+
+extern "C"
+{
+	struct rb_tree;
+	struct rb_node;
+	struct rb_tree *rb_create();
+	void rb_destroy(struct rb_tree *tree);
+	void rb_insert(struct rb_tree *tree, long key, void *data);
+	void rb_delete(struct rb_tree *tree, long key);
+	void *rb_lookup(struct rb_tree *tree, long key);
+
+	struct rb_tree *rb_str_create();
+	void rb_str_destroy(struct rb_tree *tree);
+	void rb_str_insert(struct rb_tree *tree, const char *key, size_t length, void *data);
+	void rb_str_delete(struct rb_tree *tree, const char *key, size_t length);
+	void *rb_str_lookup(struct rb_tree *tree, const char *key, size_t length);
+	long rb_str_prefix_scan(struct rb_tree *tree, const char *prefix, size_t length, 
+							int (*callback)(struct rb_node *node, void *context), void *context);
+}
+
+
+
+//
+// Structures under test. They all store key + 1 as the value, so no value is NULL.
+//
+
+struct BenchC
+{
+	static const char *name() { return "c"; }
+
+	BenchC() : m_pTree(rb_create()) {}
+	~BenchC() { rb_destroy(m_pTree); }
+
+	void insert(long key) { rb_insert(m_pTree, key, (void *)(key + 1)); }
+	bool find(long key) { return rb_lookup(m_pTree, key) != NULL; }
+	void erase(long key) { rb_delete(m_pTree, key); }
+
+	struct rb_tree *m_pTree;
+};
+
+struct BenchRBTree
+{
+	static const char *name() { return "rbtree"; }
+
+	void insert(long key) { m_tree.insert(key, key + 1); }
+	bool find(long key) { return m_tree.find(key) != NULL; }
+	void erase(long key) { m_tree.erase(key); }
+
+	RBTree<long, long> m_tree;
+};
+
+struct BenchBTree
+{
+	static const char *name() { return "btree"; }
+
+	void insert(long key) { m_tree.insert(key, key + 1); }
+	bool find(long key) { return m_tree.find(key) != NULL; }
+	void erase(long key) { m_tree.erase(key); }
+
+	BTree<long> m_tree;
+};
+
+struct BenchStdMap
+{
+	static const char *name() { return "map"; }
+
+	void insert(long key) { m_map.insert(std::make_pair(key, key + 1)); }
+	bool find(long key) { return m_map.find(key) != m_map.end(); }
+	void erase(long key) { m_map.erase(key); }
+
+	std::map<long, long> m_map;
+};
+
+#ifdef RB_BENCH_ABSL
+struct BenchAbsl
+{
+	static const char *name() { return "absl"; }
+
+	void insert(long key) { m_map.insert(std::make_pair(key, key + 1)); }
+	bool find(long key) { return m_map.find(key) != m_map.end(); }
+	void erase(long key) { m_map.erase(key); }
+
+	absl::btree_map<long, long> m_map;
+};
+#endif
+
+
+
+//
+// Key distributions
+//
+
+enum BenchDist
+{
+	kSequential,
+	kReverse,
+	kUniform,
+	kZipfian,
+	kNumDists
+};
+
+const char *s_distNames[kNumDists] = { "seq", "reverse", "uniform", "zipf" };
+
+// xorshift, as in redblack.c's benchmarks, so runs repeat exactly.
+struct BenchRandom
+{
+	BenchRandom(unsigned long seed) : m_x(seed) {}
+
+	unsigned long next()
+	{
+		m_x ^= m_x << 13;
+		m_x ^= m_x >> 7;
+		m_x ^= m_x << 17;
+		return m_x;
+	}
+
+	double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+	unsigned long m_x;
+};
+
+
+
+///
+/// BenchZipf
+///
+/// Zipfian ranks in 0..n-1 with theta 0.99, rank 0 the most popular: the generator from
+/// YCSB (Gray et al., "Quickly generating billion-record synthetic databases"). Setting
+/// up sums n powers, so one is made per size and shared.
+///
+
+struct BenchZipf
+{
+	BenchZipf(long n, double theta = 0.99) :
+		m_n(n),
+		m_theta(theta)
+	{
+		double zeta2 = 1.0 + pow(0.5, theta);
+
+		m_zetan = 0;
+		for (long i = 1; i <= n; i++)
+		{
+			m_zetan += pow((double)i, -theta);
+		}
+		m_alpha = 1.0 / (1.0 - theta);
+		m_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / m_zetan);
+	}
+
+	long next(BenchRandom &random)
+	{
+		double u = random.unit();
+		double uz = u * m_zetan;
+		long rank;
+
+		if (uz < 1.0)
+		{
+			return 0;
+		}
+		if (uz < 1.0 + pow(0.5, m_theta))
+		{
+			return 1;
+		}
+		rank = (long)(m_n * pow(m_eta * u - m_eta + 1.0, m_alpha));
+		return (rank < m_n) ? rank : m_n - 1;
+	}
+
+	long m_n;
+	double m_theta, m_zetan, m_alpha, m_eta;
+};
+
+// Spreads the popular ranks over the key space, so the hot keys aren't all neighbors
+// in the tree. The multiplier is a prime bigger than any n here, so this is a
+// permutation of 0..n-1.
+long _bench_scramble(long rank, long n)
+{
+	return (long)(((unsigned long)rank * 2654435761UL) % n);
+}
+
+
+
+///
+/// _bench_order
+///
+/// The order keys 0..n-1 get inserted or deleted in. Zipfian goes from the most popular
+/// key down, which is where the hot keys of a real index tend to come from.
+///
+
+void _bench_order(BenchDist dist, long n, unsigned long seed, std::vector<long> &keys)
+{
+	BenchRandom random(seed);
+	long i;
+
+	keys.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		switch (dist)
+		{
+		case kSequential: keys[i] = i; break;
+		case kReverse: keys[i] = n - 1 - i; break;
+		case kUniform: keys[i] = i; break;
+		default: keys[i] = _bench_scramble(i, n); break;
+		}
+	}
+
+	if (dist == kUniform)
+	{
+		for (i = n - 1; i > 0; i--)
+		{
+			std::swap(keys[i], keys[random.next() % (i + 1)]);
+		}
+	}
+}
+
+
+
+///
+/// _bench_draws
+///
+/// count keys in 0..n-1 for lookups and mixed operations, repeats allowed. Sequential
+/// and reverse sweep the keys over and over.
+///
+
+void _bench_draws(BenchDist dist, long n, long count, BenchZipf *zipf, unsigned long seed, std::vector<long> &keys)
+{
+	BenchRandom random(seed);
+	long i;
+
+	keys.resize(count);
+	for (i = 0; i < count; i++)
+	{
+		switch (dist)
+		{
+		case kSequential: keys[i] = i % n; break;
+		case kReverse: keys[i] = n - 1 - i % n; break;
+		case kUniform: keys[i] = random.next() % n; break;
+		default: keys[i] = _bench_scramble(zipf->next(random), n); break;
+		}
+	}
+}
+
+
+
+
+//
+// Measuring
+//
+
+// One operation in this many is timed on its own for the percentiles. Timing all of them
+// would double the cost of the fast ones.
+#define BENCH_SAMPLE_EVERY 16
+
+// Small trees are rebuilt until each workload has done at least this many operations.
+#define BENCH_MIN_OPS 1000000
+
+// Lookups and mixed operations per round stop here for big trees.
+#define BENCH_MAX_DRAWS 10000000
+
+double _bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long _bench_heap_bytes()
+{
+	struct mallinfo2 info = mallinfo2();
+	return (long)(info.uordblks + info.hblkhd);
+}
+
+struct BenchStats
+{
+	BenchStats() : m_nOps(0), m_seconds(0) {}
+
+	long m_nOps;
+	double m_seconds;
+	std::vector<float> m_samples;	// Nanoseconds.
+};
+
+template <typename Op>
+void _bench_time(BenchStats &stats, long count, Op op)
+{
+	double start = _bench_now();
+	double t;
+	long i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (i % BENCH_SAMPLE_EVERY == 0)
+		{
+			t = _bench_now();
+			op(i);
+			stats.m_samples.push_back((float)((_bench_now() - t) * 1e9));
+		}
+		else
+		{
+			op(i);
+		}
+	}
+
+	stats.m_seconds += _bench_now() - start;
+	stats.m_nOps += count;
+}
+
+double _bench_percentile(std::vector<float> &samples, double fraction)
+{
+	size_t k = (size_t)(fraction * (samples.size() - 1));
+
+	std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+	return samples[k];
+}
+
+void _bench_report(const char *name, const char *workload, const char *keys, long n, BenchStats &stats, double bytesPerKey)
+{
+	printf("%-7s %-7s %-8s %10ld keys  %7.2f Mops/s  p50 %6.0f  p99 %6.0f  p99.9 %7.0f ns  %6.1f B/key\n",
+		   name, workload, keys, n, stats.m_nOps / stats.m_seconds / 1e6,
+		   _bench_percentile(stats.m_samples, 0.5), _bench_percentile(stats.m_samples, 0.99),
+		   _bench_percentile(stats.m_samples, 0.999), bytesPerKey);
+	fflush(stdout);
+}
+
+
+
+///
+/// BENCH_structure
+///
+/// All four workloads on one structure for one size and distribution:
+/// insert   n keys into an empty tree, in _bench_order.
+/// lookup   keys drawn from the distribution, all of them present.
+/// mixed    drawn keys again: half are lookups, the other half insert the key if it's
+///          missing and delete it if it's there, so the size stays around n.
+/// delete   every key left, in _bench_order with a different shuffle.
+/// Bytes per key is the heap growth from building the tree, keys included.
+///
+
+template <typename Tree>
+double BENCH_structure(BenchDist dist, long n, BenchZipf *zipf)
+{
+	BenchStats insert, lookup, mixed, erase;
+	std::vector<long> order, draws;
+	std::vector<char> present;
+	long rounds = std::max(1L, BENCH_MIN_OPS / n);
+	long numDraws = std::max(std::min(n, (long)BENCH_MAX_DRAWS), BENCH_MIN_OPS / rounds);
+	long round, heap = 0, found = 0, sink = 0;
+	double bytesPerKey = 0;
+
+	_bench_order(dist, n, 88172645463325252UL, order);
+	_bench_draws(dist, n, numDraws, zipf, 2463534242UL, draws);
+	insert.m_samples.reserve(rounds * n / BENCH_SAMPLE_EVERY + rounds);
+	lookup.m_samples.reserve(rounds * numDraws / BENCH_SAMPLE_EVERY + rounds);
+	mixed.m_samples.reserve(rounds * numDraws / BENCH_SAMPLE_EVERY + rounds);
+	erase.m_samples.reserve(rounds * n / BENCH_SAMPLE_EVERY + rounds);
+
+	for (round = 0; round < rounds; round++)
+	{
+		Tree *pTree;
+
+		heap = _bench_heap_bytes();
+		pTree = new Tree;
+		_bench_time(insert, n, [&](long i) { pTree->insert(order[i]); });
+		if (round == 0)
+		{
+			bytesPerKey = (double)(_bench_heap_bytes() - heap) / n;
+		}
+
+		_bench_time(lookup, numDraws, [&](long i) { found += pTree->find(draws[i]); });
+
+		present.assign(n, 1);
+		_bench_time(mixed, numDraws, [&](long i)
+		{
+			long key = draws[i];
+			if (i & 1)
+			{
+				sink += pTree->find(key);
+			}
+			else if (present[key])
+			{
+				pTree->erase(key);
+				present[key] = 0;
+			}
+			else
+			{
+				pTree->insert(key);
+				present[key] = 1;
+			}
+		});
+
+		// The same keys again, in a different order where there's a choice.
+		_bench_order(dist, n, 0x9E3779B97F4A7C15UL + round, order);
+		_bench_time(erase, n, [&](long i)
+		{
+			if (present[order[i]])
+			{
+				pTree->erase(order[i]);
+			}
+		});
+		_bench_order(dist, n, 88172645463325252UL, order);
+
+		delete pTree;
+	}
+
+	if (found != rounds * numDraws || sink < 0)
+	{
+		printf("Lookups missed keys: %ld of %ld\n", found, rounds * numDraws);
+		exit(1);
+	}
+
+	_bench_report(Tree::name(), "insert", s_distNames[dist], n, insert, bytesPerKey);
+	_bench_report(Tree::name(), "lookup", s_distNames[dist], n, lookup, bytesPerKey);
+	_bench_report(Tree::name(), "mixed", s_distNames[dist], n, mixed, bytesPerKey);
+	_bench_report(Tree::name(), "delete", s_distNames[dist], n, erase, bytesPerKey);
+	return bytesPerKey;
+}
+
+
+
+///
+/// BENCH_size
+///
+/// Every selected structure and distribution at one size. Each structure remembers its
+/// bytes per key from the last size, to guess whether the next one fits.
+///
+
+template <typename Tree>
+void BENCH_maybe(bool bSelected, double &bytesPerKey, BenchDist dist, long n, BenchZipf *zipf)
+{
+	// The tree, plus the order, draws and present arrays.
+	double needed = n * (bytesPerKey + sizeof(long) + 1) + std::min(n, (long)BENCH_MAX_DRAWS) * sizeof(long);
+	double memory = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+	if (!bSelected)
+	{
+		return;
+	}
+	if (needed > 0.8 * memory)
+	{
+		printf("%-7s skipped  %-8s %10ld keys  needs about %.1f GB\n", Tree::name(), s_distNames[dist], n, needed / 1e9);
+		return;
+	}
+	bytesPerKey = BENCH_structure<Tree>(dist, n, zipf);
+}
+
+struct BenchSelection
+{
+	bool m_bC, m_bRBTree, m_bBTree, m_bMap, m_bAbsl, m_bStrings;
+	double m_cBytes, m_rbtreeBytes, m_btreeBytes, m_mapBytes, m_abslBytes;
+};
+
+void BENCH_size(BenchSelection &selection, long n)
+{
+	BenchZipf zipf(n);
+
+	for (int dist = 0; dist < kNumDists; dist++)
+	{
+		BENCH_maybe<BenchC>(selection.m_bC, selection.m_cBytes, (BenchDist)dist, n, &zipf);
+		BENCH_maybe<BenchRBTree>(selection.m_bRBTree, selection.m_rbtreeBytes, (BenchDist)dist, n, &zipf);
+		BENCH_maybe<BenchBTree>(selection.m_bBTree, selection.m_btreeBytes, (BenchDist)dist, n, &zipf);
+		BENCH_maybe<BenchStdMap>(selection.m_bMap, selection.m_mapBytes, (BenchDist)dist, n, &zipf);
+#ifdef RB_BENCH_ABSL
+		BENCH_maybe<BenchAbsl>(selection.m_bAbsl, selection.m_abslBytes, (BenchDist)dist, n, &zipf);
+#endif
+	}
+}
+
+
+
+
+
+//
+// String keys: rb_str_ trees, which compare 8 bytes inline, against trees of std::string.
+// Values are the key's index + 1 again.
+//
+
+// Sizes for the string benchmark stop here: the keys are kept twice, in the tree and in
+// the array they're drawn from.
+#define BENCH_MAX_STRINGS 10000000
+
+// Prefix scans per size. Each one visits about a thousandth of the keys.
+#define BENCH_PREFIX_SCANS 1000
+
+int _bench_count_node(struct rb_node *node, void *context)
+{
+	(void)node;
+	(void)context;
+	return 0;
+}
+
+struct BenchStrC
+{
+	static const char *name() { return "c"; }
+
+	BenchStrC() : m_pTree(rb_str_create()) {}
+	~BenchStrC() { rb_str_destroy(m_pTree); }
+
+	void insert(const std::string &key, long value) { rb_str_insert(m_pTree, key.data(), key.size(), (void *)value); }
+	bool find(const std::string &key) { return rb_str_lookup(m_pTree, key.data(), key.size()) != NULL; }
+	void erase(const std::string &key) { rb_str_delete(m_pTree, key.data(), key.size()); }
+	long prefixCount(const std::string &prefix)
+	{
+		return rb_str_prefix_scan(m_pTree, prefix.data(), prefix.size(), _bench_count_node, NULL);
+	}
+
+	struct rb_tree *m_pTree;
+};
+
+struct BenchStrRBTree
+{
+	static const char *name() { return "rbtree"; }
+
+	void insert(const std::string &key, long value) { m_tree.insert(key, value); }
+	bool find(const std::string &key) { return m_tree.find(key) != NULL; }
+	void erase(const std::string &key) { m_tree.erase(key); }
+	long prefixCount(const std::string &prefix)
+	{
+		long count = 0;
+		for (RBTree<std::string, long>::Iterator it = m_tree.lowerBound(prefix);
+			 it != m_tree.end() && it.key().compare(0, prefix.size(), prefix) == 0; ++it)
+		{
+			count++;
+		}
+		return count;
+	}
+
+	RBTree<std::string, long> m_tree;
+};
+
+template <typename Map>
+long _bench_map_prefix_count(Map &map, const std::string &prefix)
+{
+	long count = 0;
+	for (typename Map::iterator it = map.lower_bound(prefix);
+		 it != map.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+	{
+		count++;
+	}
+	return count;
+}
+
+struct BenchStrMap
+{
+	static const char *name() { return "map"; }
+
+	void insert(const std::string &key, long value) { m_map.insert(std::make_pair(key, value)); }
+	bool find(const std::string &key) { return m_map.find(key) != m_map.end(); }
+	void erase(const std::string &key) { m_map.erase(key); }
+	long prefixCount(const std::string &prefix) { return _bench_map_prefix_count(m_map, prefix); }
+
+	std::map<std::string, long> m_map;
+};
+
+#ifdef RB_BENCH_ABSL
+struct BenchStrAbsl
+{
+	static const char *name() { return "absl"; }
+
+	void insert(const std::string &key, long value) { m_map.insert(std::make_pair(key, value)); }
+	bool find(const std::string &key) { return m_map.find(key) != m_map.end(); }
+	void erase(const std::string &key) { m_map.erase(key); }
+	long prefixCount(const std::string &prefix) { return _bench_map_prefix_count(m_map, prefix); }
+
+	absl::btree_map<std::string, long> m_map;
+};
+#endif
+
+enum BenchStrKeys
+{
+	kWords,
+	kPaths,
+	kNumStrKeys
+};
+
+const char *s_strKeyNames[kNumStrKeys] = { "words", "paths" };
+
+
+
+///
+/// _bench_strings
+///
+/// n unique keys in a random order, and prefixes that each start about n / 1000 of them.
+/// words are 3 to 12 random letters and a number, so their first 8 bytes nearly always
+/// tell them apart. paths are "tenant/0042/order/17": all of them share their first 8 
+/// bytes, which is the worst case for an inline prefix.
+///
+
+void _bench_strings(BenchStrKeys kind, long n, std::vector<std::string> &keys, std::vector<std::string> &prefixes)
+{
+	BenchRandom random(88172645463325252UL);
+	char buffer[64];
+	long i, j, length;
+
+	keys.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		if (kind == kWords)
+		{
+			length = 3 + random.next() % 10;
+			for (j = 0; j < length; j++)
+			{
+				buffer[j] = 'a' + random.next() % 26;
+			}
+			sprintf(buffer + length, "%ld", i);
+		}
+		else
+		{
+			sprintf(buffer, "tenant/%04ld/order/%ld", i % 1000, i);
+		}
+		keys[i] = buffer;
+	}
+	for (i = n - 1; i > 0; i--)
+	{
+		std::swap(keys[i], keys[random.next() % (i + 1)]);
+	}
+
+	// Two letters start 1 word in 676; a tenant, 1 path in 1000.
+	prefixes.resize(BENCH_PREFIX_SCANS);
+	for (i = 0; i < BENCH_PREFIX_SCANS; i++)
+	{
+		if (kind == kWords)
+		{
+			buffer[0] = 'a' + random.next() % 26;
+			buffer[1] = 'a' + random.next() % 26;
+			buffer[2] = 0;
+		}
+		else
+		{
+			sprintf(buffer, "tenant/%04ld/", (long)(random.next() % 1000));
+		}
+		prefixes[i] = buffer;
+	}
+}
+
+
+
+///
+/// BENCH_strings
+///
+/// insert   the n keys into an empty tree.
+/// lookup   n keys drawn uniformly, all present.
+/// prefix   BENCH_PREFIX_SCANS scans counting the keys that start with a prefix; the
+///          rate is keys visited per second.
+/// delete   every key, in another order.
+/// Bytes per key is the heap growth from building the tree, key copies included.
+///
+/// Timings when compiled -O3 on a one core box, c and map only (./a.out 10000000 strings):
+///
+/// c       insert  words       1000000 keys     0.60 Mops/s  p50   1709  p99   5562  p99.9   15604 ns   103.9 B/key
+/// c       lookup  words       1000000 keys     0.56 Mops/s  p50   1996  p99   3137  p99.9    7369 ns   103.9 B/key
+/// c       prefix  words       1000000 keys     4.18 Mops/s  p50 320817  p99 793549  p99.9 4454396 ns   103.9 B/key
+/// c       delete  words       1000000 keys     0.47 Mops/s  p50   2200  p99   3265  p99.9   18249 ns   103.9 B/key
+/// map     insert  words       1000000 keys     0.51 Mops/s  p50   2000  p99   3587  p99.9    9159 ns    89.2 B/key
+/// map     lookup  words       1000000 keys     0.44 Mops/s  p50   2400  p99   3523  p99.9   14457 ns    89.2 B/key
+/// map     prefix  words       1000000 keys     4.81 Mops/s  p50 290660  p99 477530  p99.9 1757400 ns    89.2 B/key
+/// map     delete  words       1000000 keys     0.45 Mops/s  p50   2312  p99   3734  p99.9   13994 ns    89.2 B/key
+/// c       insert  paths       1000000 keys     0.40 Mops/s  p50   2640  p99   6226  p99.9   17956 ns   104.1 B/key
+/// c       lookup  paths       1000000 keys     0.34 Mops/s  p50   3039  p99   4872  p99.9   18138 ns   104.1 B/key
+/// map     insert  paths       1000000 keys     0.42 Mops/s  p50   2403  p99   4090  p99.9    8380 ns   126.4 B/key
+/// map     lookup  paths       1000000 keys     0.38 Mops/s  p50   2884  p99   4163  p99.9   16032 ns   126.4 B/key
+/// c       insert  words      10000000 keys     0.26 Mops/s  p50   3772  p99  12490  p99.9   34643 ns   104.0 B/key
+/// c       lookup  words      10000000 keys     0.25 Mops/s  p50   4333  p99   6638  p99.9   24920 ns   104.0 B/key
+/// map     insert  words      10000000 keys     0.27 Mops/s  p50   3650  p99   6069  p99.9   22868 ns    92.4 B/key
+/// map     lookup  words      10000000 keys     0.22 Mops/s  p50   4593  p99   7053  p99.9   24519 ns    92.4 B/key
+/// c       lookup  paths      10000000 keys     0.17 Mops/s  p50   5849  p99   8872  p99.9   31438 ns   118.4 B/key
+/// map     lookup  paths      10000000 keys     0.18 Mops/s  p50   5773  p99   8369  p99.9   32018 ns   127.8 B/key
+///
+/// With words, c's lookups and inserts are 15-25% faster than map's at 1M keys, where the
+/// upper levels' nodes stay cached and the inline prefix saves the trip to each one's 
+/// string. At 10M nearly every level misses whatever it reads, and c's node and its entry
+/// are two misses where map's short strings sit in the node, so it comes out about even.
+/// paths defeat the prefix, as expected, and cost c a little. Prefix scans are rb_next
+/// walks in every structure and run the same.
+///
+
+template <typename Tree>
+void BENCH_strings(BenchStrKeys kind, long n)
+{
+	BenchStats insert, lookup, prefix, erase;
+	std::vector<std::string> keys, prefixes;
+	std::vector<long> draws;
+	BenchRandom random(2463534242UL);
+	Tree *pTree;
+	long i, heap, count, found = 0, visited = 0;
+	double bytesPerKey, start, elapsed;
+
+	_bench_strings(kind, n, keys, prefixes);
+	draws.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		draws[i] = random.next() % n;
+	}
+	insert.m_samples.reserve(n / BENCH_SAMPLE_EVERY + 1);
+	lookup.m_samples.reserve(n / BENCH_SAMPLE_EVERY + 1);
+	erase.m_samples.reserve(n / BENCH_SAMPLE_EVERY + 1);
+
+	heap = _bench_heap_bytes();
+	pTree = new Tree;
+	_bench_time(insert, n, [&](long i) { pTree->insert(keys[i], i + 1); });
+	bytesPerKey = (double)(_bench_heap_bytes() - heap) / n;
+
+	_bench_time(lookup, n, [&](long i) { found += pTree->find(keys[draws[i]]); });
+
+	// Each scan is one sample, and counts as the keys it visits.
+	for (i = 0; i < BENCH_PREFIX_SCANS; i++)
+	{
+		start = _bench_now();
+		count = pTree->prefixCount(prefixes[i]);
+		elapsed = _bench_now() - start;
+		prefix.m_samples.push_back((float)(elapsed * 1e9));
+		prefix.m_seconds += elapsed;
+		prefix.m_nOps += count;
+		visited += count;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		std::swap(keys[i], keys[draws[i]]);
+	}
+	_bench_time(erase, n, [&](long i) { pTree->erase(keys[i]); });
+	delete pTree;
+
+	if (found != n || visited < BENCH_PREFIX_SCANS * (n / 2000))
+	{
+		printf("String lookups or scans came up short: %ld of %ld, %ld scanned\n", found, n, visited);
+		exit(1);
+	}
+
+	_bench_report(Tree::name(), "insert", s_strKeyNames[kind], n, insert, bytesPerKey);
+	_bench_report(Tree::name(), "lookup", s_strKeyNames[kind], n, lookup, bytesPerKey);
+	_bench_report(Tree::name(), "prefix", s_strKeyNames[kind], n, prefix, bytesPerKey);
+	_bench_report(Tree::name(), "delete", s_strKeyNames[kind], n, erase, bytesPerKey);
+}
+
+void BENCH_strings_size(BenchSelection &selection, long n)
+{
+	for (int kind = 0; kind < kNumStrKeys; kind++)
+	{
+		if (selection.m_bC)
+		{
+			BENCH_strings<BenchStrC>((BenchStrKeys)kind, n);
+		}
+		if (selection.m_bRBTree)
+		{
+			BENCH_strings<BenchStrRBTree>((BenchStrKeys)kind, n);
+		}
+		if (selection.m_bMap)
+		{
+			BENCH_strings<BenchStrMap>((BenchStrKeys)kind, n);
+		}
+#ifdef RB_BENCH_ABSL
+		if (selection.m_bAbsl)
+		{
+			BENCH_strings<BenchStrAbsl>((BenchStrKeys)kind, n);
+		}
+#endif
+	}
+}
+
+
+
+///
+/// Timings when compiled -O3, with -DRB_BENCH_ABSL, on a one core box (uniform keys and
+/// sequential lookups at 10M; run it for the rest). Run up to 10M keys only.
+///
+/// c       insert  uniform     1000000 keys     0.72 Mops/s  p50   1468  p99   5448  p99.9   15156 ns    56.1 B/key
+/// c       lookup  uniform     1000000 keys     1.55 Mops/s  p50   1167  p99   2189  p99.9    5068 ns    56.1 B/key
+/// c       mixed   uniform     1000000 keys     0.90 Mops/s  p50   1767  p99   2906  p99.9    8665 ns    56.1 B/key
+/// c       delete  uniform     1000000 keys     0.94 Mops/s  p50   1254  p99   2513  p99.9    4480 ns    56.1 B/key
+/// rbtree  insert  uniform     1000000 keys     0.87 Mops/s  p50   1266  p99   4301  p99.9   12231 ns    48.1 B/key
+/// rbtree  lookup  uniform     1000000 keys     1.26 Mops/s  p50   1208  p99   2243  p99.9    3561 ns    48.1 B/key
+/// rbtree  mixed   uniform     1000000 keys     0.80 Mops/s  p50   1628  p99   2935  p99.9   13423 ns    48.1 B/key
+/// rbtree  delete  uniform     1000000 keys     1.02 Mops/s  p50   1285  p99   2602  p99.9    4100 ns    48.1 B/key
+/// map     insert  uniform     1000000 keys     0.75 Mops/s  p50   1370  p99   2548  p99.9    6226 ns    64.0 B/key
+/// map     lookup  uniform     1000000 keys     0.65 Mops/s  p50   1583  p99   2306  p99.9    5420 ns    64.0 B/key
+/// map     mixed   uniform     1000000 keys     0.56 Mops/s  p50   1923  p99   3019  p99.9    7595 ns    64.0 B/key
+/// map     delete  uniform     1000000 keys     0.88 Mops/s  p50   1462  p99   2838  p99.9    5372 ns    64.0 B/key
+/// absl    insert  uniform     1000000 keys     2.08 Mops/s  p50    494  p99   1519  p99.9    2367 ns    22.7 B/key
+/// absl    lookup  uniform     1000000 keys     2.16 Mops/s  p50    507  p99    932  p99.9    1565 ns    22.7 B/key
+/// absl    mixed   uniform     1000000 keys     1.84 Mops/s  p50    652  p99   1489  p99.9    2918 ns    22.7 B/key
+/// absl    delete  uniform     1000000 keys     2.65 Mops/s  p50    443  p99   1499  p99.9    2340 ns    22.7 B/key
+/// c       lookup  seq        10000000 keys    15.39 Mops/s  p50    152  p99   1180  p99.9    2786 ns    56.0 B/key
+/// rbtree  lookup  seq        10000000 keys    10.15 Mops/s  p50    258  p99   1304  p99.9    2954 ns    48.0 B/key
+/// map     lookup  seq        10000000 keys     2.78 Mops/s  p50    419  p99   1657  p99.9    3833 ns    64.0 B/key
+/// absl    lookup  seq        10000000 keys    10.83 Mops/s  p50    114  p99    257  p99.9     540 ns    18.7 B/key
+/// c       insert  uniform    10000000 keys     0.38 Mops/s  p50   2659  p99   7084  p99.9   24132 ns    56.0 B/key
+/// c       lookup  uniform    10000000 keys     0.72 Mops/s  p50   2510  p99   4242  p99.9   17726 ns    56.0 B/key
+/// c       mixed   uniform    10000000 keys     0.42 Mops/s  p50   3544  p99   5346  p99.9   22716 ns    56.0 B/key
+/// c       delete  uniform    10000000 keys     0.47 Mops/s  p50   2707  p99   4767  p99.9   11245 ns    56.0 B/key
+/// rbtree  insert  uniform    10000000 keys     0.41 Mops/s  p50   2524  p99   6770  p99.9   24653 ns    48.0 B/key
+/// rbtree  lookup  uniform    10000000 keys     0.49 Mops/s  p50   2748  p99   4722  p99.9   19804 ns    48.0 B/key
+/// rbtree  mixed   uniform    10000000 keys     0.38 Mops/s  p50   3286  p99   5762  p99.9   20735 ns    48.0 B/key
+/// rbtree  delete  uniform    10000000 keys     0.42 Mops/s  p50   3202  p99   5917  p99.9   19094 ns    48.0 B/key
+/// map     insert  uniform    10000000 keys     0.34 Mops/s  p50   2981  p99   5186  p99.9   19567 ns    64.0 B/key
+/// map     lookup  uniform    10000000 keys     0.30 Mops/s  p50   3369  p99   5096  p99.9   22986 ns    64.0 B/key
+/// map     mixed   uniform    10000000 keys     0.28 Mops/s  p50   3807  p99   5891  p99.9   26900 ns    64.0 B/key
+/// map     delete  uniform    10000000 keys     0.42 Mops/s  p50   3094  p99   5410  p99.9   17934 ns    64.0 B/key
+/// absl    insert  uniform    10000000 keys     1.09 Mops/s  p50    918  p99   2530  p99.9    3821 ns    22.7 B/key
+/// absl    lookup  uniform    10000000 keys     1.08 Mops/s  p50    927  p99   1511  p99.9    2877 ns    22.7 B/key
+/// absl    mixed   uniform    10000000 keys     0.90 Mops/s  p50   1193  p99   2329  p99.9    4307 ns    22.7 B/key
+/// absl    delete  uniform    10000000 keys     1.23 Mops/s  p50    926  p99   2634  p99.9    4162 ns    22.7 B/key
+///
+
+int main(int argc, char **argv)
+{
+	BenchSelection selection;
+	long maxKeys = (argc > 1) ? atol(argv[1]) : 100000000L;
+	long n;
+	int i;
+
+	memset(&selection, 0, sizeof(selection));
+	for (i = 2; i < argc; i++)
+	{
+		selection.m_bC |= strcmp(argv[i], BenchC::name()) == 0;
+		selection.m_bRBTree |= strcmp(argv[i], BenchRBTree::name()) == 0;
+		selection.m_bBTree |= strcmp(argv[i], BenchBTree::name()) == 0;
+		selection.m_bMap |= strcmp(argv[i], BenchStdMap::name()) == 0;
+		selection.m_bAbsl |= strcmp(argv[i], "absl") == 0;
+		selection.m_bStrings |= strcmp(argv[i], "strings") == 0;
+	}
+	if (!selection.m_bC && !selection.m_bRBTree && !selection.m_bBTree && !selection.m_bMap && !selection.m_bAbsl)
+	{
+		selection.m_bC = selection.m_bRBTree = selection.m_bBTree = selection.m_bMap = selection.m_bAbsl = true;
+	}
+
+	for (n = 1000; n <= maxKeys; n *= 10)
+	{
+		if (selection.m_bStrings)
+		{
+			if (n <= BENCH_MAX_STRINGS)
+			{
+				BENCH_strings_size(selection, n);
+			}
+		}
+		else
+		{
+			BENCH_size(selection, n);
+		}
+	}
+	return 0;
+}